@@ -1,18 +1,61 @@
 #include "json.hpp"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#ifdef _WIN32
+#define NOMINMAX
 #include <windows.h>
+#include <io.h>
+#include <aclapi.h>
+#include <sddl.h>
 #include <shellapi.h>
 #include <wingdi.h>
 #include <wininet.h>
 #include <winreg.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#include <arm_acle.h>
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
 
 using json = nlohmann::json;
 
@@ -22,370 +65,7774 @@ class FontInstaller;
 class WTAFileManager;
 class WTACommandManager;
 
-int CALLBACK EnumFontFamExProc(ENUMLOGFONTEX *lpelfe, NEWTEXTMETRICEX *lpntme,
-                               DWORD FontType, LPARAM lParam) {
-  std::string *targetFont = reinterpret_cast<std::string *>(lParam);
-  std::string fontName =
-      reinterpret_cast<char *>(lpelfe->elfLogFont.lfFaceName);
+std::string formatSize(uint64_t bytes) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0) << " MB";
+  return out.str();
+}
+
+std::filesystem::path tempDirectory() {
+  std::error_code ec;
+  std::filesystem::path path = std::filesystem::temp_directory_path(ec);
+  return ec ? std::filesystem::path(".") : path;
+}
 
-  std::transform(fontName.begin(), fontName.end(), fontName.begin(), ::tolower);
-  std::string targetLower = *targetFont;
-  std::transform(targetLower.begin(), targetLower.end(), targetLower.begin(),
-                 ::tolower);
+inline uint16_t readLE16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+inline uint32_t readLE32(const uint8_t *p) { return (uint32_t)readLE16(p) | ((uint32_t)readLE16(p + 2) << 16); }
+inline uint64_t readLE64(const uint8_t *p) { return (uint64_t)readLE32(p) | ((uint64_t)readLE32(p + 4) << 32); }
 
-  if (fontName == targetLower) {
-    return 0;
+// CRC-32 (ISO-HDLC, as used by ZIP and gzip). update() takes and returns the
+// finished checksum, so it chains like zlib's crc32(): update(0, ...) starts a run.
+class Crc32 {
+private:
+  using Kernel = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+  static const uint32_t (&tables())[8][256] {
+    static uint32_t table[8][256];
+    static bool built = [] {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t value = i;
+        for (int bit = 0; bit < 8; ++bit) {
+          value = (value >> 1) ^ (0xEDB88320u & (0u - (value & 1)));
+        }
+        table[0][i] = value;
+      }
+      for (uint32_t i = 0; i < 256; ++i) {
+        for (int k = 1; k < 8; ++k) {
+          table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+        }
+      }
+      return true;
+    }();
+    (void)built;
+    return table;
   }
-  return 1;
-}
 
-class FileDownloader {
-public:
-  bool downloadFile(const std::string &url, const std::string &filePath) {
-    HINTERNET hInternet =
-        InternetOpenA("FontDownloader", INTERNET_OPEN_TYPE_DIRECT, NULL, NULL, 0);
-    if (!hInternet)
-      return false;
+  static uint32_t slicingBy8(uint32_t state, const uint8_t *data, size_t size) {
+    const uint32_t (&table)[8][256] = tables();
+    while (size >= 8) {
+      uint32_t one = readLE32(data) ^ state;
+      uint32_t two = readLE32(data + 4);
+      state = table[7][one & 0xff] ^ table[6][(one >> 8) & 0xff] ^ table[5][(one >> 16) & 0xff] ^
+              table[4][one >> 24] ^ table[3][two & 0xff] ^ table[2][(two >> 8) & 0xff] ^
+              table[1][(two >> 16) & 0xff] ^ table[0][two >> 24];
+      data += 8;
+      size -= 8;
+    }
+    while (size-- > 0) {
+      state = table[0][(state ^ *data++) & 0xff] ^ (state >> 8);
+    }
+    return state;
+  }
 
-    HINTERNET hFile = InternetOpenUrlA(hInternet, url.c_str(), NULL, 0,
-                                       INTERNET_FLAG_RELOAD, 0);
-    if (!hFile) {
-      InternetCloseHandle(hInternet);
-      return false;
-    }
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  // Folds 64 bytes per iteration with carry-less multiplies and finishes with a
+  // Barrett reduction (Gopal et al., "Fast CRC Computation Using PCLMULQDQ").
+  // Handles whole 16-byte blocks of at least 64 bytes; slicingBy8 does the rest.
+  __attribute__((target("pclmul,sse4.1"))) static uint32_t foldPclmul(uint32_t state, const uint8_t *data,
+                                                                     size_t size) {
+    alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x00));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x10));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x20));
+    __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)state));
+    __m128i x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+    data += 64;
+    size -= 64;
+
+    while (size >= 64) {
+      __m128i x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      __m128i x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+      __m128i x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+      __m128i x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+      x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+      x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x00)));
+      x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x10)));
+      x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x20)));
+      x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 0x30)));
+      data += 64;
+      size -= 64;
+    }
+
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+    __m128i next[3] = {x2, x3, x4};
+    for (const __m128i &block : next) {
+      __m128i x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, block), x5);
+    }
+
+    while (size >= 16) {
+      __m128i x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+      x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+      x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i *>(data))), x5);
+      data += 16;
+      size -= 16;
+    }
+
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+  }
 
-    std::ofstream outFile(filePath, std::ios::binary);
-    if (!outFile) {
-      InternetCloseHandle(hFile);
-      InternetCloseHandle(hInternet);
-      return false;
+  static uint32_t accelerated(uint32_t state, const uint8_t *data, size_t size) {
+    if (size >= 64) {
+      size_t blocks = size & ~(size_t)15;
+      state = foldPclmul(state, data, blocks);
+      data += blocks;
+      size -= blocks;
     }
+    return slicingBy8(state, data, size);
+  }
 
-    char buffer[4096];
-    DWORD bytesRead;
-    while (InternetReadFile(hFile, buffer, sizeof(buffer), &bytesRead) &&
-           bytesRead > 0) {
-      outFile.write(buffer, bytesRead);
+  static bool hasAcceleration() {
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+  }
+#elif defined(__GNUC__) && defined(__aarch64__)
+  __attribute__((target("+crc"))) static uint32_t accelerated(uint32_t state, const uint8_t *data, size_t size) {
+    while (size >= 8) {
+      state = __crc32d(state, readLE64(data));
+      data += 8;
+      size -= 8;
     }
+    while (size-- > 0) {
+      state = __crc32b(state, *data++);
+    }
+    return state;
+  }
 
-    outFile.close();
-    InternetCloseHandle(hFile);
-    InternetCloseHandle(hInternet);
+  static bool hasAcceleration() {
+#if defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(__APPLE__)
     return true;
+#else
+    return false;
+#endif
+  }
+#else
+  static uint32_t accelerated(uint32_t state, const uint8_t *data, size_t size) {
+    return slicingBy8(state, data, size);
   }
-};
-
-class FontInstaller {
-public:
-  bool extractAndInstallFonts(const std::string &zipPath, const std::string &fontName) {
-    std::string tempDir = std::getenv("TEMP");
-    tempDir += "\\" + fontName + "_fonts";
 
-    if (!createTempDirectory(tempDir)) {
-      return false;
-    }
+  static bool hasAcceleration() { return false; }
+#endif
 
-    if (!extractArchive(zipPath, tempDir)) {
-      std::filesystem::remove_all(tempDir);
-      return false;
-    }
+  static Kernel kernel() {
+    static const Kernel selected = hasAcceleration() ? &accelerated : &slicingBy8;
+    return selected;
+  }
 
-    std::cout << "Note: Font installation may require administrator privileges." << std::endl;
+public:
+  static uint32_t update(uint32_t crc, const uint8_t *data, size_t size) {
+    return ~kernel()(~crc, data, size);
+  }
 
-    bool fontsInstalled = installFontsFromDirectory(tempDir);
+  static uint32_t updatePortable(uint32_t crc, const uint8_t *data, size_t size) {
+    return ~slicingBy8(~crc, data, size);
+  }
 
-    std::filesystem::remove_all(tempDir);
-    std::filesystem::remove(zipPath);
+  static bool accelerationAvailable() { return hasAcceleration(); }
+};
 
-    return fontsInstalled;
-  }
+class ByteSource {
+public:
+  virtual ~ByteSource() = default;
+  // Returns the number of bytes read; 0 means end of data or a failed read.
+  virtual size_t read(uint8_t *buffer, size_t size) = 0;
+};
 
+class InputStream {
 private:
-  bool createTempDirectory(const std::string &tempDir) {
-    try {
-      std::filesystem::create_directories(tempDir);
-      return true;
-    } catch (...) {
-      std::cerr << "Error: Failed to create temporary directory." << std::endl;
-      return false;
-    }
+  ByteSource &source;
+  std::vector<uint8_t> buffer;
+  size_t pos = 0;
+  size_t end = 0;
+
+  bool fill() {
+    pos = 0;
+    end = source.read(buffer.data(), buffer.size());
+    return end > 0;
   }
 
-  bool extractArchive(const std::string &zipPath, const std::string &tempDir) {
-    std::string command = "powershell -Command \"Expand-Archive -Path '" +
-                          zipPath + "' -DestinationPath '" + tempDir +
-                          "' -Force\"";
-    if (system(command.c_str()) != 0) {
-      std::cerr << "Error: Failed to extract font archive." << std::endl;
+public:
+  explicit InputStream(ByteSource &source, size_t bufferSize = 1 << 16)
+      : source(source), buffer(bufferSize) {}
+
+  bool readByte(uint8_t &value) {
+    if (pos == end && !fill()) {
       return false;
     }
+    value = buffer[pos++];
     return true;
   }
 
-  bool installFontsFromDirectory(const std::string &tempDir) {
-    bool fontsInstalled = false;
-    
-    for (const auto &entry : std::filesystem::recursive_directory_iterator(tempDir)) {
-      if (entry.is_regular_file()) {
-        std::string ext = entry.path().extension().string();
-        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-
-        if (ext == ".ttf" || ext == ".otf") {
-          if (installSingleFont(entry.path().string())) {
-            fontsInstalled = true;
-          }
-        }
+  size_t read(uint8_t *out, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+      if (pos == end && !fill()) {
+        break;
       }
+      size_t chunk = std::min(size - total, end - pos);
+      std::memcpy(out + total, buffer.data() + pos, chunk);
+      pos += chunk;
+      total += chunk;
     }
-    
-    return fontsInstalled;
+    return total;
   }
 
-  bool installSingleFont(const std::string &fontFile) {
-    std::string fontsDir = getWindowsFontsDirectory();
-    if (fontsDir.empty()) {
-      return false;
-    }
+  bool readExact(uint8_t *out, size_t size) { return read(out, size) == size; }
 
-    std::string destPath = fontsDir + "\\" + std::filesystem::path(fontFile).filename().string();
-    
-    if (CopyFileA(fontFile.c_str(), destPath.c_str(), FALSE)) {
-      registerFontInRegistry(fontFile);
-      return true;
-    } else {
-      std::cerr << "Error: Could not copy font file to " << destPath << std::endl;
-      return false;
+  void skipToEnd() {
+    while (fill()) {
     }
+    pos = end;
   }
 
-  std::string getWindowsFontsDirectory() {
-    char fontsPath[MAX_PATH];
-    if (GetWindowsDirectoryA(fontsPath, MAX_PATH) == 0) {
-      std::cerr << "Error: Could not get Windows directory." << std::endl;
-      return "";
+  bool skip(uint64_t size) {
+    while (size > 0) {
+      if (pos == end && !fill()) {
+        return false;
+      }
+      size_t chunk = (size_t)std::min<uint64_t>(size, end - pos);
+      pos += chunk;
+      size -= chunk;
     }
-    return std::string(fontsPath) + "\\Fonts";
+    return true;
   }
 
-  void registerFontInRegistry(const std::string &fontFile) {
-    std::string fontName = std::filesystem::path(fontFile).stem().string();
-    std::string fileName = std::filesystem::path(fontFile).filename().string();
-    
-    HKEY hKey;
-    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, 
-                     "SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Fonts",
-                     0, KEY_WRITE, &hKey) == ERROR_SUCCESS) {
-      RegSetValueExA(hKey, fontName.c_str(), 0, REG_SZ,
-                    (const BYTE*)fileName.c_str(), fileName.length() + 1);
-      RegCloseKey(hKey);
-      std::cout << "Installed font: " << fontName << std::endl;
+  // Hands back bytes a decoder read ahead so the next reader sees them again.
+  void unread(const uint8_t *data, size_t size) {
+    if (pos >= size) {
+      pos -= size;
+      std::memcpy(buffer.data() + pos, data, size);
     } else {
-      std::cout << "Warning: Could not register font in registry (requires admin rights)" << std::endl;
+      buffer.insert(buffer.begin() + pos, data, data + size);
+      end += size;
     }
   }
 };
 
-class FontManager {
+class Inflater {
+public:
+  using Sink = std::function<bool(const uint8_t *, size_t)>;
+
 private:
-  const std::string FONT_DATA_URL = "https://raw.githubusercontent.com/k0src/Windows-Terminal-CLI-Actions/992ac7b89305645fe6c972cbffde7592c8f32b73/font_data.json";
-  FileDownloader downloader;
+  static const size_t WINDOW_SIZE = 1 << 15;
+  static const size_t BUFFER_SIZE = WINDOW_SIZE * 4;
+  static const size_t MAX_MATCH = 258;
+  static const int FAST_BITS = 10;
+
+  struct Huffman {
+    uint16_t counts[16];
+    uint16_t symbols[288];
+    uint16_t fast[1 << FAST_BITS];  // (symbol << 4) | length, 0 when the code is longer
+  };
+
+  InputStream *input = nullptr;
+  const Sink *output = nullptr;
+  uint64_t bitBuffer = 0;
+  int bitCount = 0;
+  std::vector<uint8_t> window;
+  size_t pos = 0;
+  size_t flushed = 0;
+  uint64_t totalOut = 0;
+  uint32_t crc = 0;
+  std::string errorMessage;
+  Huffman literalCodes;
+  Huffman distanceCodes;
 
 public:
-  bool fontExists(const std::string &fontName) {
-    HDC hdc = GetDC(NULL);
-    if (!hdc)
-      return false;
+  bool inflate(InputStream &in, const Sink &sink) {
+    input = &in;
+    output = &sink;
+    bitBuffer = 0;
+    bitCount = 0;
+    pos = 0;
+    flushed = 0;
+    totalOut = 0;
+    crc = 0;
+    errorMessage.clear();
+    window.resize(BUFFER_SIZE);
+
+    bool last = false;
+    while (!last) {
+      uint32_t header;
+      if (!getBits(3, header)) {
+        return fail("unexpected end of compressed data");
+      }
+      last = header & 1;
 
-    LOGFONT lf = {0};
-    lf.lfCharSet = DEFAULT_CHARSET;
+      bool ok;
+      switch (header >> 1) {
+      case 0:
+        ok = storedBlock();
+        break;
+      case 1:
+        ok = compressedBlock(fixedLiteralCodes(), fixedDistanceCodes());
+        break;
+      case 2:
+        ok = dynamicBlock() && compressedBlock(literalCodes, distanceCodes);
+        break;
+      default:
+        ok = fail("invalid block type");
+      }
+      if (!ok) {
+        return false;
+      }
+    }
 
-    std::string targetFont = fontName;
-    int result = EnumFontFamiliesEx(hdc, &lf, (FONTENUMPROC)EnumFontFamExProc,
-                                    reinterpret_cast<LPARAM>(&targetFont), 0);
+    if (!flush()) {
+      return false;
+    }
 
-    ReleaseDC(NULL, hdc);
-    return (result == 0);
+    consumeBits(bitCount & 7);
+    uint8_t unused[8];
+    size_t unusedCount = 0;
+    while (bitCount > 0) {
+      unused[unusedCount++] = (uint8_t)bitBuffer;
+      consumeBits(8);
+    }
+    input->unread(unused, unusedCount);
+    return true;
   }
 
-  json readFontData() {
-    std::string tempPath = std::getenv("TEMP");
-    std::string fontDataPath = tempPath + "\\font_data.json";
-    
-    if (downloader.downloadFile(FONT_DATA_URL, fontDataPath)) {
-      std::ifstream file(fontDataPath);
-      if (file) {
-        try {
-          json data;
-          file >> data;
-          file.close();
-          std::filesystem::remove(fontDataPath);
-          return data;
-        } catch (...) {
-          std::cerr << "Error: Failed to parse font data." << std::endl;
-          file.close();
-          std::filesystem::remove(fontDataPath);
-        }
-      }
-    }
+  uint64_t bytesWritten() const { return totalOut; }
+  uint32_t checksum() const { return crc; }
+  const std::string &error() const { return errorMessage; }
+
+private:
+  bool fail(const std::string &message) {
+    errorMessage = message;
+    return false;
   }
 
-  bool findFontInData(const json &fontData, const std::string &fontName, std::string &fontUrl) {
-    for (const auto &font : fontData) {
-      if (font["Name"].get<std::string>() == fontName) {
-        fontUrl = font["URL"].get<std::string>();
-        return true;
-      }
+  void refill() {
+    uint8_t byte;
+    while (bitCount <= 56 && input->readByte(byte)) {
+      bitBuffer |= (uint64_t)byte << bitCount;
+      bitCount += 8;
     }
-    return false;
   }
-};
 
-class WTAFileManager {
-private:
-  json settings;
-  std::string settingsPath;
+  void consumeBits(int count) {
+    bitBuffer >>= count;
+    bitCount -= count;
+  }
 
-public:
-  WTAFileManager() {
-    settingsPath = getSettingsPath();
-    settings = readSettings(settingsPath);
+  bool getBits(int count, uint32_t &value) {
+    if (bitCount < count) {
+      refill();
+      if (bitCount < count) {
+        return false;
+      }
+    }
+    value = (uint32_t)(bitBuffer & ((1ull << count) - 1));
+    consumeBits(count);
+    return true;
   }
 
-  std::string getSettingsPath() {
-    const char *localAppData = std::getenv("LOCALAPPDATA");
-    if (!localAppData) {
-      std::cerr << "Could not get LOCALAPPDATA environment variable." << std::endl;
-      std::exit(1);
+  static bool buildHuffman(Huffman &table, const uint8_t *lengths, int count) {
+    std::memset(table.counts, 0, sizeof(table.counts));
+    std::memset(table.fast, 0, sizeof(table.fast));
+    for (int i = 0; i < count; ++i) {
+      table.counts[lengths[i]]++;
     }
+    table.counts[0] = 0;
 
-    std::filesystem::path path =
-        std::filesystem::path(localAppData) /
-        "Packages/Microsoft.WindowsTerminal_8wekyb3d8bbwe/LocalState/settings.json";
+    int left = 1;
+    for (int len = 1; len < 16; ++len) {
+      left = (left << 1) - table.counts[len];
+      if (left < 0) {
+        return false;
+      }
+    }
 
-    if (!std::filesystem::exists(path)) {
-      std::cerr << "settings.json does not exist. Make sure Windows Terminal is installed."
-                << std::endl;
-      std::exit(1);
+    uint16_t offsets[16];
+    uint16_t nextCode[16];
+    offsets[1] = 0;
+    nextCode[1] = 0;
+    for (int len = 1; len < 15; ++len) {
+      offsets[len + 1] = offsets[len] + table.counts[len];
+      nextCode[len + 1] = (nextCode[len] + table.counts[len]) << 1;
     }
 
-    return path.string();
-  }
+    for (int symbol = 0; symbol < count; ++symbol) {
+      int len = lengths[symbol];
+      if (len == 0) {
+        continue;
+      }
+      table.symbols[offsets[len]++] = (uint16_t)symbol;
 
-  json readSettings(const std::string &path) {
-    std::ifstream file(path);
-    if (!file) {
-      std::cerr << "Failed to open settings.json." << std::endl;
-      std::exit(1);
+      uint32_t code = nextCode[len]++;
+      if (len <= FAST_BITS) {
+        uint32_t reversed = 0;
+        for (int i = 0; i < len; ++i) {
+          reversed |= ((code >> i) & 1) << (len - 1 - i);
+        }
+        for (uint32_t j = reversed; j < (1u << FAST_BITS); j += 1u << len) {
+          table.fast[j] = (uint16_t)((symbol << 4) | len);
+        }
+      }
     }
+    return true;
+  }
 
-    try {
-      json data;
-      file >> data;
-      return data;
-    } catch (...) {
-      std::cerr << "Failed to parse settings.json." << std::endl;
-      std::exit(1);
+  bool decode(const Huffman &table, int &symbol) {
+    if (bitCount < 15) {
+      refill();
     }
-  }
 
-  void writeSettings() {
-    std::ofstream file(settingsPath);
-    if (!file) {
-      std::cerr << "Failed to write to settings.json." << std::endl;
-      std::exit(1);
+    uint16_t entry = table.fast[bitBuffer & ((1u << FAST_BITS) - 1)];
+    if (entry != 0 && (entry & 15) <= bitCount) {
+      consumeBits(entry & 15);
+      symbol = entry >> 4;
+      return true;
     }
 
-    try {
-      file << std::setw(4) << settings << std::endl;
-    } catch (...) {
-      std::cerr << "Failed to write settings to settings.json." << std::endl;
-      std::exit(1);
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len < 16 && len <= bitCount; ++len) {
+      code |= (int)((bitBuffer >> (len - 1)) & 1);
+      int count = table.counts[len];
+      if (code - first < count) {
+        consumeBits(len);
+        symbol = table.symbols[index + code - first];
+        return true;
+      }
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
     }
+    return false;
   }
 
-  json &getSettings() { return settings; }
+  static const Huffman &fixedLiteralCodes() {
+    static const Huffman table = [] {
+      uint8_t lengths[288];
+      std::fill(lengths, lengths + 144, 8);
+      std::fill(lengths + 144, lengths + 256, 9);
+      std::fill(lengths + 256, lengths + 280, 7);
+      std::fill(lengths + 280, lengths + 288, 8);
+      Huffman built;
+      buildHuffman(built, lengths, 288);
+      return built;
+    }();
+    return table;
+  }
 
-  bool profileExists(const std::string &profileName) {
-    return settings["profiles"].contains(profileName);
+  static const Huffman &fixedDistanceCodes() {
+    static const Huffman table = [] {
+      uint8_t lengths[30];
+      std::fill(lengths, lengths + 30, 5);
+      Huffman built;
+      buildHuffman(built, lengths, 30);
+      return built;
+    }();
+    return table;
   }
 
-  bool colorSchemeExists(const std::string &schemeName) {
-    for (const auto &scheme : settings["schemes"]) {
-      if (scheme["name"] == schemeName) {
-        return true;
+  // The CRC is taken here, while the freshly decoded bytes are still in cache,
+  // instead of as a second pass over the written file.
+  bool flush() {
+    if (pos > flushed) {
+      crc = Crc32::update(crc, window.data() + flushed, pos - flushed);
+      if (!(*output)(window.data() + flushed, pos - flushed)) {
+        return fail("failed to write decompressed data");
       }
+      totalOut += pos - flushed;
     }
-    return false;
+    if (pos > WINDOW_SIZE) {
+      std::memmove(window.data(), window.data() + pos - WINDOW_SIZE, WINDOW_SIZE);
+      pos = WINDOW_SIZE;
+    }
+    flushed = pos;
+    return true;
   }
 
-  bool themeExists(const std::string &themeName) {
-    if (!settings.contains("themes")) {
-      return false;
+  bool storedBlock() {
+    consumeBits(bitCount & 7);
+    uint32_t length, complement;
+    if (!getBits(16, length) || !getBits(16, complement)) {
+      return fail("unexpected end of compressed data");
     }
-    for (const auto &theme : settings["themes"]) {
-      if (theme["name"] == themeName) {
-        return true;
-      }
+    if (length != (~complement & 0xffff)) {
+      return fail("stored block length mismatch");
     }
-    return false;
-  }
 
-  bool profileNameExists(const std::string &profileName) {
-    for (const auto &profile : settings["profiles"]["list"]) {
-      if (profile["name"] == profileName) {
-        return true;
+    while (length > 0) {
+      if (pos + MAX_MATCH > BUFFER_SIZE && !flush()) {
+        return false;
+      }
+      size_t chunk = std::min<size_t>(length, BUFFER_SIZE - pos);
+      size_t copied = 0;
+      while (copied < chunk && bitCount >= 8) {
+        window[pos + copied++] = (uint8_t)bitBuffer;
+        consumeBits(8);
+      }
+      if (copied < chunk && !input->readExact(window.data() + pos + copied, chunk - copied)) {
+        return fail("unexpected end of compressed data");
       }
+      pos += chunk;
+      length -= (uint32_t)chunk;
     }
-    return false;
+    return true;
   }
 
-  bool actionIdExists(const std::string &actionId) {
-    if (!settings.contains("actions")) {
-      return false;
+  bool dynamicBlock() {
+    static const uint8_t ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    uint32_t literalCount, distanceCount, codeLengthCount;
+    if (!getBits(5, literalCount) || !getBits(5, distanceCount) || !getBits(4, codeLengthCount)) {
+      return fail("unexpected end of compressed data");
     }
-    
-    for (const auto &action : settings["actions"]) {
-      if (action.contains("id") && action["id"] == actionId) {
-        return true;
+    literalCount += 257;
+    distanceCount += 1;
+    codeLengthCount += 4;
+    if (literalCount > 286 || distanceCount > 30) {
+      return fail("invalid code counts");
+    }
+
+    uint8_t lengths[320] = {0};
+    for (uint32_t i = 0; i < codeLengthCount; ++i) {
+      uint32_t value;
+      if (!getBits(3, value)) {
+        return fail("unexpected end of compressed data");
       }
+      lengths[ORDER[i]] = (uint8_t)value;
     }
-    return false;
-  }
 
-  void addAction(const json &newAction) {
-    if (!settings.contains("actions")) {
-      settings["actions"] = json::array();
+    Huffman lengthCodes;
+    if (!buildHuffman(lengthCodes, lengths, 19)) {
+      return fail("invalid code length codes");
     }
-    settings["actions"].push_back(newAction);
-  }
 
-  void addKeybinding(const json &newKeybinding) {
-    if (!settings.contains("keybindings")) {
-      settings["keybindings"] = json::array();
+    uint32_t index = 0;
+    while (index < literalCount + distanceCount) {
+      int symbol;
+      if (!decode(lengthCodes, symbol)) {
+        return fail("invalid code length code");
+      }
+      if (symbol < 16) {
+        lengths[index++] = (uint8_t)symbol;
+        continue;
+      }
+
+      uint8_t value = 0;
+      uint32_t repeat;
+      bool ok;
+      if (symbol == 16) {
+        if (index == 0) {
+          return fail("repeat with no previous length");
+        }
+        value = lengths[index - 1];
+        ok = getBits(2, repeat);
+        repeat += 3;
+      } else if (symbol == 17) {
+        ok = getBits(3, repeat);
+        repeat += 3;
+      } else {
+        ok = getBits(7, repeat);
+        repeat += 11;
+      }
+      if (!ok || index + repeat > literalCount + distanceCount) {
+        return fail("invalid code length repeat");
+      }
+      std::fill(lengths + index, lengths + index + repeat, value);
+      index += repeat;
     }
-    settings["keybindings"].push_back(newKeybinding);
-  }
 
-  bool removeAction(const std::string &actionId) {
-    if (!settings.contains("actions")) {
-      return false;
+    if (lengths[256] == 0) {
+      return fail("missing end-of-block code");
     }
-    
-    auto &actions = settings["actions"];
-    bool removed = false;
-    
-    for (auto it = actions.begin(); it != actions.end(); ++it) {
-      if (it->contains("id") && (*it)["id"] == actionId) {
-        actions.erase(it);
-        removed = true;
-        break;
-      }
+    if (!buildHuffman(literalCodes, lengths, literalCount) ||
+        !buildHuffman(distanceCodes, lengths + literalCount, distanceCount)) {
+      return fail("invalid literal/length or distance codes");
     }
-    
-    return removed;
+    return true;
   }
 
-  int removeKeybindingsForAction(const std::string &actionId) {
+  bool compressedBlock(const Huffman &literals, const Huffman &distances) {
+    static const uint16_t LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                             31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                             2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                               193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                               6145, 8193, 12289, 16385, 24577};
+    static const uint8_t DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                               6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+    while (true) {
+      if (pos + MAX_MATCH > BUFFER_SIZE && !flush()) {
+        return false;
+      }
+
+      int symbol;
+      if (!decode(literals, symbol)) {
+        return fail("invalid literal/length code");
+      }
+      if (symbol < 256) {
+        window[pos++] = (uint8_t)symbol;
+        continue;
+      }
+      if (symbol == 256) {
+        return true;
+      }
+
+      symbol -= 257;
+      if (symbol >= 29) {
+        return fail("invalid length symbol");
+      }
+      uint32_t extra;
+      if (!getBits(LENGTH_EXTRA[symbol], extra)) {
+        return fail("unexpected end of compressed data");
+      }
+      size_t length = LENGTH_BASE[symbol] + extra;
+
+      if (!decode(distances, symbol) || symbol >= 30) {
+        return fail("invalid distance code");
+      }
+      if (!getBits(DISTANCE_EXTRA[symbol], extra)) {
+        return fail("unexpected end of compressed data");
+      }
+      size_t distance = DISTANCE_BASE[symbol] + extra;
+      if (distance > pos) {
+        return fail("distance too far back");
+      }
+
+      uint8_t *target = window.data() + pos;
+      const uint8_t *from = target - distance;
+      if (distance >= length) {
+        std::memcpy(target, from, length);
+      } else {
+        for (size_t i = 0; i < length; ++i) {
+          target[i] = from[i];
+        }
+      }
+      pos += length;
+    }
+  }
+};
+
+struct ZipEntry {
+  std::string name;
+  uint16_t flags = 0;
+  uint16_t method = 0;
+  uint32_t crc32 = 0;
+  uint64_t compressedSize = 0;
+  uint64_t uncompressedSize = 0;
+  uint64_t localHeaderOffset = 0;
+  bool zip64 = false;
+};
+
+// Walks the local file headers of an archive front to back, so entries can be
+// extracted while the archive is still arriving.
+class ZipStreamReader {
+private:
+  InputStream &in;
+  Inflater inflater;
+  std::string errorMessage;
+
+  bool fail(const std::string &message) {
+    errorMessage = message;
+    return false;
+  }
+
+public:
+  explicit ZipStreamReader(InputStream &in) : in(in) {}
+
+  const std::string &error() const { return errorMessage; }
+
+  bool nextEntry(ZipEntry &entry) {
+    uint8_t header[30];
+    if (!in.readExact(header, 4)) {
+      return fail("archive is truncated");
+    }
+
+    uint32_t signature = readLE32(header);
+    if (signature == 0x02014b50 || signature == 0x06054b50) {
+      return false;
+    }
+    if (signature != 0x04034b50) {
+      return fail("invalid local file header");
+    }
+    if (!in.readExact(header + 4, 26)) {
+      return fail("archive is truncated");
+    }
+
+    entry = ZipEntry();
+    entry.flags = readLE16(header + 6);
+    entry.method = readLE16(header + 8);
+    entry.crc32 = readLE32(header + 14);
+    entry.compressedSize = readLE32(header + 18);
+    entry.uncompressedSize = readLE32(header + 22);
+
+    std::vector<uint8_t> name(readLE16(header + 26));
+    std::vector<uint8_t> extra(readLE16(header + 28));
+    if (!in.readExact(name.data(), name.size()) || !in.readExact(extra.data(), extra.size())) {
+      return fail("archive is truncated");
+    }
+    entry.name.assign(name.begin(), name.end());
+
+    for (size_t offset = 0; offset + 4 <= extra.size();) {
+      uint16_t id = readLE16(extra.data() + offset);
+      uint16_t size = readLE16(extra.data() + offset + 2);
+      if (id == 0x0001 && offset + 4 + size <= extra.size()) {
+        const uint8_t *field = extra.data() + offset + 4;
+        const uint8_t *fieldEnd = field + size;
+        entry.zip64 = true;
+        if (entry.uncompressedSize == 0xFFFFFFFF && field + 8 <= fieldEnd) {
+          entry.uncompressedSize = readLE64(field);
+          field += 8;
+        }
+        if (entry.compressedSize == 0xFFFFFFFF && field + 8 <= fieldEnd) {
+          entry.compressedSize = readLE64(field);
+        }
+      }
+      offset += 4 + size;
+    }
+    return true;
+  }
+
+  bool readEntry(const ZipEntry &entry, const Inflater::Sink &sink) {
+    uint32_t crc = 0;
+    uint64_t size = 0;
+    if (entry.method == 8) {
+      if (!inflater.inflate(in, sink)) {
+        return fail(entry.name + ": " + inflater.error());
+      }
+      crc = inflater.checksum();
+      size = inflater.bytesWritten();
+    } else if (entry.method == 0) {
+      if (entry.flags & 8) {
+        return fail(entry.name + ": stored entries with data descriptors cannot be streamed");
+      }
+      uint8_t buffer[1 << 14];
+      for (uint64_t left = entry.compressedSize; left > 0;) {
+        size_t chunk = (size_t)std::min<uint64_t>(left, sizeof(buffer));
+        if (!in.readExact(buffer, chunk)) {
+          return fail("archive is truncated");
+        }
+        crc = Crc32::update(crc, buffer, chunk);
+        if (!sink(buffer, chunk)) {
+          return fail(entry.name + ": failed to write data");
+        }
+        left -= chunk;
+      }
+      size = entry.compressedSize;
+    } else {
+      return fail(entry.name + ": unsupported compression method " + std::to_string(entry.method));
+    }
+
+    uint32_t expectedCrc = entry.crc32;
+    uint64_t expectedSize = entry.uncompressedSize;
+    if (entry.flags & 8) {
+      uint8_t descriptor[24];
+      if (!in.readExact(descriptor, 4)) {
+        return fail("archive is truncated");
+      }
+      size_t fields = 0;
+      size_t remaining = entry.zip64 ? 16 : 8;
+      if (readLE32(descriptor) == 0x08074b50) {
+        fields = 4;
+        remaining += 4;
+      }
+      if (!in.readExact(descriptor + 4, remaining)) {
+        return fail("archive is truncated");
+      }
+      expectedCrc = readLE32(descriptor + fields);
+      expectedSize = entry.zip64 ? readLE64(descriptor + fields + 12) : readLE32(descriptor + fields + 8);
+    }
+
+    if (crc != expectedCrc || size != expectedSize) {
+      return fail(entry.name + ": CRC-32 or size mismatch, the archive is corrupt");
+    }
+    return true;
+  }
+
+  bool skipEntry(const ZipEntry &entry) {
+    if (!(entry.flags & 8)) {
+      return in.skip(entry.compressedSize) || fail("archive is truncated");
+    }
+    return readEntry(entry, [](const uint8_t *, size_t) { return true; });
+  }
+};
+
+// Decodes gzip data (RFC 1952) as it arrives: each member's header is
+// skipped, its deflate stream goes through the same Inflater as zip entries,
+// and the CRC-32 and size in its trailer are checked.
+class GzipReader {
+private:
+  InputStream &in;
+  Inflater inflater;
+  std::string errorMessage;
+
+  bool fail(const std::string &message) {
+    errorMessage = message;
+    return false;
+  }
+
+  bool skipString() {
+    uint8_t byte;
+    do {
+      if (!in.readByte(byte)) {
+        return false;
+      }
+    } while (byte != 0);
+    return true;
+  }
+
+  bool readMember(const Inflater::Sink &sink) {
+    uint8_t header[10];
+    if (!in.readExact(header, sizeof(header)) || !hasMagic(header, sizeof(header))) {
+      return fail("not gzip data");
+    }
+    uint8_t flags = header[3];
+    if (header[2] != 8 || (flags & 0xE0)) {
+      return fail("unsupported gzip header");
+    }
+    uint8_t field[8];
+    if ((flags & 0x04) && !(in.readExact(field, 2) && in.skip(readLE16(field)))) {
+      return fail("gzip header is truncated");
+    }
+    if (((flags & 0x08) && !skipString()) || ((flags & 0x10) && !skipString()) ||
+        ((flags & 0x02) && !in.skip(2))) {
+      return fail("gzip header is truncated");
+    }
+    if (!inflater.inflate(in, sink)) {
+      return fail(inflater.error());
+    }
+    if (!in.readExact(field, 8)) {
+      return fail("gzip data is truncated");
+    }
+    if (readLE32(field) != inflater.checksum() || readLE32(field + 4) != (uint32_t)inflater.bytesWritten()) {
+      return fail("CRC-32 or size mismatch, the gzip data is corrupt");
+    }
+    return true;
+  }
+
+public:
+  explicit GzipReader(InputStream &in) : in(in) {}
+
+  static bool hasMagic(const uint8_t *data, size_t size) { return size >= 2 && data[0] == 0x1F && data[1] == 0x8B; }
+
+  static bool isGzip(InputStream &in) {
+    uint8_t header[2];
+    size_t got = in.read(header, sizeof(header));
+    in.unread(header, got);
+    return hasMagic(header, got);
+  }
+
+  const std::string &error() const { return errorMessage; }
+
+  // Members written back to back decode as one stream, like gzip -d does.
+  bool read(const Inflater::Sink &sink) {
+    do {
+      if (!readMember(sink)) {
+        return false;
+      }
+    } while (isGzip(in));
+    return true;
+  }
+};
+
+class MemorySource : public ByteSource {
+private:
+  const uint8_t *data;
+  size_t remaining;
+
+public:
+  MemorySource(const uint8_t *data, size_t size) : data(data), remaining(size) {}
+
+  size_t read(uint8_t *buffer, size_t size) override {
+    size_t chunk = std::min(size, remaining);
+    std::memcpy(buffer, data, chunk);
+    data += chunk;
+    remaining -= chunk;
+    return chunk;
+  }
+};
+
+class MappedFile {
+private:
+  const uint8_t *view = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  HANDLE hFile = INVALID_HANDLE_VALUE;
+  HANDLE hMapping = NULL;
+#else
+  int fd = -1;
+#endif
+
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { close(); }
+
+  bool open(const std::string &path) {
+    close();
+#ifdef _WIN32
+    hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+      return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size)) {
+      close();
+      return false;
+    }
+    length = (size_t)size.QuadPart;
+    if (length == 0) {
+      return true;
+    }
+    hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!hMapping) {
+      close();
+      return false;
+    }
+    view = static_cast<const uint8_t *>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close();
+      return false;
+    }
+    length = (size_t)info.st_size;
+    if (length == 0) {
+      return true;
+    }
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    view = mapped == MAP_FAILED ? nullptr : static_cast<const uint8_t *>(mapped);
+#endif
+    if (!view) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+#ifdef _WIN32
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+    if (hMapping) {
+      CloseHandle(hMapping);
+      hMapping = NULL;
+    }
+    if (hFile != INVALID_HANDLE_VALUE) {
+      CloseHandle(hFile);
+      hFile = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (view) {
+      munmap(const_cast<uint8_t *>(view), length);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+#endif
+    view = nullptr;
+    length = 0;
+  }
+
+  const uint8_t *data() const { return view; }
+  size_t size() const { return length; }
+};
+
+class MappedFileSource : public ByteSource {
+private:
+  MappedFile file;
+  size_t offset = 0;
+
+public:
+  bool open(const std::string &path) {
+    offset = 0;
+    return file.open(path);
+  }
+
+  size_t read(uint8_t *buffer, size_t size) override {
+    size_t chunk = std::min(size, file.size() - offset);
+    if (chunk > 0) {
+      std::memcpy(buffer, file.data() + offset, chunk);
+      offset += chunk;
+    }
+    return chunk;
+  }
+};
+
+// Random-access reader for archives on disk: the central directory is parsed
+// from the mapped file and each entry is inflated straight out of the mapping.
+class ZipArchive {
+private:
+  MappedFile file;
+  std::vector<ZipEntry> entryList;
+  // Byte ranges of an archive read over the network, keyed by offset. A
+  // mapped archive is a single segment at offset zero.
+  std::map<uint64_t, std::vector<uint8_t>> segments;
+  std::string errorMessage;
+
+  bool fail(const std::string &message) {
+    errorMessage = message;
+    return false;
+  }
+
+public:
+  // Where the central directory lives, read from the end of the archive.
+  struct DirectoryLocation {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t entryCount = 0;
+  };
+
+  const std::vector<ZipEntry> &entries() const { return entryList; }
+  const std::string &error() const { return errorMessage; }
+
+  bool open(const std::string &path) {
+    close();
+    errorMessage.clear();
+    if (!file.open(path)) {
+      return fail("could not open " + path);
+    }
+
+    DirectoryLocation location;
+    if (!locateDirectory(file.data(), file.size(), file.size(), location, errorMessage)) {
+      return false;
+    }
+    if (location.offset + location.size > file.size()) {
+      return fail("central directory is out of bounds");
+    }
+    return readDirectory(file.data() + location.offset, (size_t)location.size, location.entryCount);
+  }
+
+  // Finds the end of central directory record in the last tailSize bytes of
+  // an archive of archiveSize bytes. A zip64 record must also be in the tail.
+  static bool locateDirectory(const uint8_t *tail, size_t tailSize, uint64_t archiveSize,
+                              DirectoryLocation &location, std::string &error) {
+    if (tailSize < 22 || tailSize > archiveSize) {
+      error = "archive is too small";
+      return false;
+    }
+    size_t eocd = std::string::npos;
+    size_t searchStart = tailSize > 22 + 0xFFFF ? tailSize - 22 - 0xFFFF : 0;
+    for (size_t pos = tailSize - 22; pos + 1 > searchStart; --pos) {
+      if (readLE32(tail + pos) == 0x06054b50) {
+        eocd = pos;
+        break;
+      }
+      if (pos == 0) {
+        break;
+      }
+    }
+    if (eocd == std::string::npos) {
+      error = "end of central directory not found";
+      return false;
+    }
+
+    location.entryCount = readLE16(tail + eocd + 10);
+    location.size = readLE32(tail + eocd + 12);
+    location.offset = readLE32(tail + eocd + 16);
+
+    uint64_t tailOffset = archiveSize - tailSize;
+    if (eocd >= 20 && readLE32(tail + eocd - 20) == 0x07064b50) {
+      uint64_t zip64Offset = readLE64(tail + eocd - 20 + 8);
+      if (zip64Offset < tailOffset || zip64Offset - tailOffset + 56 > tailSize ||
+          readLE32(tail + (zip64Offset - tailOffset)) != 0x06064b50) {
+        error = "invalid zip64 end of central directory";
+        return false;
+      }
+      const uint8_t *record = tail + (zip64Offset - tailOffset);
+      location.entryCount = readLE64(record + 32);
+      location.size = readLE64(record + 40);
+      location.offset = readLE64(record + 48);
+    }
+
+    if (location.offset > archiveSize || location.size > archiveSize - location.offset) {
+      error = "central directory is out of bounds";
+      return false;
+    }
+    return true;
+  }
+
+  // Parses a central directory on its own; entry data is then supplied with
+  // addSegment before extracting.
+  bool readDirectory(const uint8_t *directory, size_t directorySize, uint64_t entryCount) {
+    entryList.clear();
+    const uint8_t *cursor = directory;
+    const uint8_t *end = cursor + directorySize;
+    entryList.reserve((size_t)std::min<uint64_t>(entryCount, directorySize / 46));
+    for (uint64_t i = 0; i < entryCount; ++i) {
+      if (end - cursor < 46 || readLE32(cursor) != 0x02014b50) {
+        return fail("invalid central directory entry");
+      }
+      uint16_t nameLength = readLE16(cursor + 28);
+      uint16_t extraLength = readLE16(cursor + 30);
+      uint16_t commentLength = readLE16(cursor + 32);
+      if (end - cursor - 46 < nameLength + extraLength + commentLength) {
+        return fail("invalid central directory entry");
+      }
+
+      ZipEntry entry;
+      entry.flags = readLE16(cursor + 8);
+      entry.method = readLE16(cursor + 10);
+      entry.crc32 = readLE32(cursor + 16);
+      entry.compressedSize = readLE32(cursor + 20);
+      entry.uncompressedSize = readLE32(cursor + 24);
+      entry.localHeaderOffset = readLE32(cursor + 42);
+      entry.name.assign(reinterpret_cast<const char *>(cursor + 46), nameLength);
+
+      const uint8_t *extra = cursor + 46 + nameLength;
+      for (size_t offset = 0; offset + 4 <= extraLength;) {
+        uint16_t id = readLE16(extra + offset);
+        uint16_t fieldSize = readLE16(extra + offset + 2);
+        if (id == 0x0001 && offset + 4 + fieldSize <= extraLength) {
+          const uint8_t *field = extra + offset + 4;
+          const uint8_t *fieldEnd = field + fieldSize;
+          entry.zip64 = true;
+          if (entry.uncompressedSize == 0xFFFFFFFF && field + 8 <= fieldEnd) {
+            entry.uncompressedSize = readLE64(field);
+            field += 8;
+          }
+          if (entry.compressedSize == 0xFFFFFFFF && field + 8 <= fieldEnd) {
+            entry.compressedSize = readLE64(field);
+            field += 8;
+          }
+          if (entry.localHeaderOffset == 0xFFFFFFFF && field + 8 <= fieldEnd) {
+            entry.localHeaderOffset = readLE64(field);
+          }
+        }
+        offset += 4 + fieldSize;
+      }
+
+      entryList.push_back(std::move(entry));
+      cursor += 46 + nameLength + extraLength + commentLength;
+    }
+    return true;
+  }
+
+  void addSegment(uint64_t offset, std::vector<uint8_t> data) { segments[offset] = std::move(data); }
+
+  void close() {
+    file.close();
+    entryList.clear();
+    segments.clear();
+  }
+
+  // Safe to call from several threads at once; each call uses its own inflater.
+  bool extract(const ZipEntry &entry, const Inflater::Sink &sink, std::string &error) const {
+    auto fail = [&error](const std::string &message) {
+      error = message;
+      return false;
+    };
+    // Offsets below are relative to the mapped file or to the segment that
+    // holds the entry's local header.
+    const uint8_t *data = file.data();
+    size_t size = file.size();
+    uint64_t headerOffset = entry.localHeaderOffset;
+    if (!segments.empty()) {
+      auto segment = segments.upper_bound(entry.localHeaderOffset);
+      if (segment == segments.begin()) {
+        return fail(entry.name + ": entry data was not fetched");
+      }
+      --segment;
+      data = segment->second.data();
+      size = segment->second.size();
+      headerOffset -= segment->first;
+    }
+    if (headerOffset > size || size - headerOffset < 30 || readLE32(data + headerOffset) != 0x04034b50) {
+      return fail(entry.name + ": invalid local file header");
+    }
+    uint64_t dataOffset = headerOffset + 30 + readLE16(data + headerOffset + 26) + readLE16(data + headerOffset + 28);
+    if (dataOffset > size || entry.compressedSize > size - dataOffset) {
+      return fail(entry.name + ": entry data is out of bounds");
+    }
+
+    const uint8_t *compressed = data + dataOffset;
+    uint32_t crc;
+    uint64_t written;
+    if (entry.method == 0) {
+      crc = Crc32::update(0, compressed, (size_t)entry.compressedSize);
+      written = entry.compressedSize;
+      if (entry.compressedSize > 0 && !sink(compressed, (size_t)entry.compressedSize)) {
+        return fail(entry.name + ": failed to write data");
+      }
+    } else if (entry.method == 8) {
+      MemorySource source(compressed, (size_t)entry.compressedSize);
+      InputStream in(source);
+      Inflater inflater;
+      if (!inflater.inflate(in, sink)) {
+        return fail(entry.name + ": " + inflater.error());
+      }
+      crc = inflater.checksum();
+      written = inflater.bytesWritten();
+    } else {
+      return fail(entry.name + ": unsupported compression method " + std::to_string(entry.method));
+    }
+
+    if (crc != entry.crc32 || written != entry.uncompressedSize) {
+      return fail(entry.name + ": CRC-32 or size mismatch, the archive is corrupt");
+    }
+    return true;
+  }
+};
+
+class Sha256 {
+private:
+  uint32_t state[8];
+  uint64_t length = 0;
+  uint8_t pending[64];
+  size_t pendingSize = 0;
+
+  static const uint32_t *roundConstants() {
+    alignas(16) static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    return K;
+  }
+
+  static uint32_t rotr(uint32_t value, int count) { return (value >> count) | (value << (32 - count)); }
+
+  static void compressPortable(uint32_t *digest, const uint8_t *data, size_t blocks) {
+    const uint32_t *K = roundConstants();
+    for (; blocks > 0; --blocks, data += 64) {
+      uint32_t w[64];
+      for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) |
+               ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+      }
+      for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+
+      uint32_t a = digest[0], b = digest[1], c = digest[2], d = digest[3];
+      uint32_t e = digest[4], f = digest[5], g = digest[6], h = digest[7];
+      for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+      }
+      digest[0] += a;
+      digest[1] += b;
+      digest[2] += c;
+      digest[3] += d;
+      digest[4] += e;
+      digest[5] += f;
+      digest[6] += g;
+      digest[7] += h;
+    }
+  }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  // SHA-NI: each sha256rnds2 performs two rounds; the message schedule for the
+  // next group is computed with msg1/msg2 while the current group is hashed.
+  __attribute__((target("sha,sse4.1"))) static void compressShaNi(uint32_t *digest, const uint8_t *data,
+                                                                  size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    const uint32_t *K = roundConstants();
+
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(digest)), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(digest + 4)), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+      __m128i savedAbef = state0;
+      __m128i savedCdgh = state1;
+      __m128i w[4];
+
+      for (int group = 0; group < 16; ++group) {
+        if (group < 4) {
+          w[group] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + group * 16)), byteSwap);
+        }
+        __m128i current = w[group & 3];
+        __m128i message = _mm_add_epi32(current, _mm_load_si128(reinterpret_cast<const __m128i *>(K + group * 4)));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+        if (group >= 3 && group <= 14) {
+          __m128i &next = w[(group + 1) & 3];
+          next = _mm_add_epi32(next, _mm_alignr_epi8(current, w[(group - 1) & 3], 4));
+          next = _mm_sha256msg2_epu32(next, current);
+        }
+        message = _mm_shuffle_epi32(message, 0x0E);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, message);
+        if (group >= 1 && group <= 12) {
+          w[(group - 1) & 3] = _mm_sha256msg1_epu32(w[(group - 1) & 3], current);
+        }
+      }
+
+      state0 = _mm_add_epi32(state0, savedAbef);
+      state1 = _mm_add_epi32(state1, savedCdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(digest), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(digest + 4), state1);
+  }
+
+  static bool hasShaExtensions() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (ebx & (1u << 29)) != 0 && __builtin_cpu_supports("sse4.1");
+  }
+
+  static void compress(uint32_t *digest, const uint8_t *data, size_t blocks) {
+    static const bool accelerated = hasShaExtensions();
+    if (accelerated) {
+      compressShaNi(digest, data, blocks);
+    } else {
+      compressPortable(digest, data, blocks);
+    }
+  }
+#else
+  static void compress(uint32_t *digest, const uint8_t *data, size_t blocks) {
+    compressPortable(digest, data, blocks);
+  }
+#endif
+
+public:
+  Sha256() { reset(); }
+
+  void reset() {
+    static const uint32_t INITIAL[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    std::memcpy(state, INITIAL, sizeof(state));
+    length = 0;
+    pendingSize = 0;
+  }
+
+  void update(const uint8_t *data, size_t size) {
+    length += size;
+    if (pendingSize > 0) {
+      size_t chunk = std::min(size, 64 - pendingSize);
+      std::memcpy(pending + pendingSize, data, chunk);
+      pendingSize += chunk;
+      data += chunk;
+      size -= chunk;
+      if (pendingSize < 64) {
+        return;
+      }
+      compress(state, pending, 1);
+      pendingSize = 0;
+    }
+    if (size >= 64) {
+      compress(state, data, size / 64);
+      data += size & ~(size_t)63;
+      size &= 63;
+    }
+    std::memcpy(pending, data, size);
+    pendingSize = size;
+  }
+
+  uint64_t bytesHashed() const { return length; }
+
+  std::string hexDigest() const {
+    Sha256 copy = *this;
+    uint8_t padding[72] = {0x80};
+    size_t padLength = (copy.pendingSize < 56 ? 56 : 120) - copy.pendingSize;
+    uint64_t bits = length * 8;
+    for (int i = 0; i < 8; ++i) {
+      padding[padLength + i] = (uint8_t)(bits >> (56 - 8 * i));
+    }
+    copy.update(padding, padLength + 8);
+
+    static const char HEX[] = "0123456789abcdef";
+    std::string digest;
+    for (uint32_t word : copy.state) {
+      for (int shift = 28; shift >= 0; shift -= 4) {
+        digest += HEX[(word >> shift) & 0xf];
+      }
+    }
+    return digest;
+  }
+
+  // Lets a resumed download continue hashing without re-reading the bytes it
+  // already has on disk.
+  json exportState() const {
+    return {{"state", std::vector<uint32_t>(state, state + 8)},
+            {"length", length},
+            {"pending", std::vector<uint8_t>(pending, pending + pendingSize)}};
+  }
+
+  bool importState(const json &saved) {
+    try {
+      std::vector<uint32_t> words = saved.at("state").get<std::vector<uint32_t>>();
+      std::vector<uint8_t> tail = saved.at("pending").get<std::vector<uint8_t>>();
+      uint64_t savedLength = saved.at("length").get<uint64_t>();
+      if (words.size() != 8 || tail.size() != savedLength % 64) {
+        return false;
+      }
+      std::copy(words.begin(), words.end(), state);
+      std::copy(tail.begin(), tail.end(), pending);
+      pendingSize = tail.size();
+      length = savedLength;
+      return true;
+    } catch (...) {
+      return false;
+    }
+  }
+};
+
+struct ExpectedContent {
+  std::string sha256;
+  int64_t size = -1;
+};
+
+class HashingSource : public ByteSource {
+private:
+  ByteSource &inner;
+  Sha256 hasher;
+  std::ostream *copy = nullptr;
+
+public:
+  explicit HashingSource(ByteSource &inner) : inner(inner) {}
+
+  // Also writes everything read to `out`, to keep a streamed archive.
+  void copyTo(std::ostream *out) { copy = out; }
+
+  size_t read(uint8_t *buffer, size_t size) override {
+    size_t bytesRead = inner.read(buffer, size);
+    hasher.update(buffer, bytesRead);
+    if (copy && bytesRead > 0) {
+      copy->write(reinterpret_cast<const char *>(buffer), bytesRead);
+    }
+    return bytesRead;
+  }
+
+  const Sha256 &digest() const { return hasher; }
+};
+
+bool verifyContent(const ExpectedContent &expected, const Sha256 &actual) {
+  if (expected.size >= 0 && actual.bytesHashed() != (uint64_t)expected.size) {
+    std::cerr << "Error: Integrity check failed: expected " << expected.size << " bytes, received "
+              << actual.bytesHashed() << "." << std::endl;
+    return false;
+  }
+  if (!expected.sha256.empty()) {
+    std::string expectedDigest = expected.sha256;
+    std::transform(expectedDigest.begin(), expectedDigest.end(), expectedDigest.begin(), ::tolower);
+    std::string actualDigest = actual.hexDigest();
+    if (expectedDigest != actualDigest) {
+      std::cerr << "Error: Integrity check failed: expected SHA-256 " << expectedDigest << ", got "
+                << actualDigest << "." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// CRC-64/XZ (ECMA-182, reflected), the default integrity check of .xz files.
+class Crc64 {
+private:
+  static const uint64_t (&table())[256] {
+    static uint64_t values[256];
+    static bool built = [] {
+      for (uint64_t i = 0; i < 256; ++i) {
+        uint64_t value = i;
+        for (int bit = 0; bit < 8; ++bit) {
+          value = (value >> 1) ^ (0xC96C5795D7870F42ull & (0ull - (value & 1)));
+        }
+        values[i] = value;
+      }
+      return true;
+    }();
+    (void)built;
+    return values;
+  }
+
+public:
+  static uint64_t update(uint64_t crc, const uint8_t *data, size_t size) {
+    const uint64_t(&values)[256] = table();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+      crc = values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+};
+
+// Decodes the LZMA2 data of one .xz block. Output is produced into a ring
+// buffer holding the last dictionary-size bytes, which later matches copy
+// from, and handed to the caller as it is decoded. A whole compressed chunk
+// (at most 64 KiB) is read before decoding it, so the range decoder never
+// waits for input in the middle of a symbol.
+class Lzma2Decoder {
+private:
+  static const int STATES = 12;
+  static const int LITERAL_STATES = 7;
+  static const int POS_STATES_MAX = 1 << 4;
+  static const int DIST_STATES = 4;
+  static const int DIST_SLOTS = 64;
+  static const int DIST_MODEL_START = 4;
+  static const int DIST_MODEL_END = 14;
+  static const int FULL_DISTANCES = 1 << (DIST_MODEL_END / 2);
+  static const int ALIGN_BITS = 4;
+  static const int MATCH_LEN_MIN = 2;
+  static const int LITERAL_CODER_SIZE = 0x300;
+
+  struct LengthCoder {
+    uint16_t choice;
+    uint16_t choice2;
+    uint16_t low[POS_STATES_MAX][8];
+    uint16_t mid[POS_STATES_MAX][8];
+    uint16_t high[256];
+  };
+
+  struct Probabilities {
+    uint16_t isMatch[STATES][POS_STATES_MAX];
+    uint16_t isRep[STATES];
+    uint16_t isRep0[STATES];
+    uint16_t isRep1[STATES];
+    uint16_t isRep2[STATES];
+    uint16_t isRep0Long[STATES][POS_STATES_MAX];
+    uint16_t distSlot[DIST_STATES][DIST_SLOTS];
+    uint16_t distSpecial[FULL_DISTANCES - DIST_MODEL_END];
+    uint16_t distAlign[1 << ALIGN_BITS];
+    LengthCoder matchLength;
+    LengthCoder repLength;
+    uint16_t literal[LITERAL_CODER_SIZE << 4];
+  };
+
+  InputStream *input = nullptr;
+  std::string errorMessage;
+
+  // The last dictionary-size bytes of output, which matches copy from.
+  struct Window {
+    uint8_t *buffer;
+    size_t size;
+    size_t pos;
+    size_t full;
+    // Bytes since the last dictionary reset.
+    uint64_t position;
+
+    void put(uint8_t byte) {
+      buffer[pos] = byte;
+      if (++pos == size) {
+        pos = 0;
+      }
+      if (full < size) {
+        full++;
+      }
+      position++;
+    }
+
+    uint8_t get(uint32_t distance) const {
+      return buffer[distance < pos ? pos - distance - 1 : pos + size - distance - 1];
+    }
+  };
+
+  std::unique_ptr<uint8_t[]> dict;
+  size_t allocated = 0;
+  Window window = {};
+
+  // Each LZMA chunk starts a new range coder. The chunk buffer is padded
+  // with zeros so the coder can read past the end of corrupt input without
+  // a bounds check per bit; running past the end is caught per symbol.
+  struct RangeDecoder {
+    const uint8_t *next;
+    const uint8_t *end;
+    uint32_t range;
+    uint32_t code;
+
+    bool overrun() const { return next > end; }
+
+    void normalize() {
+      if (range < (1u << 24)) {
+        range <<= 8;
+        code = (code << 8) | *next++;
+      }
+    }
+
+    int bit(uint16_t &prob) {
+      normalize();
+      uint32_t bound = (range >> 11) * prob;
+      if (code < bound) {
+        range = bound;
+        prob += (2048 - prob) >> 5;
+        return 0;
+      }
+      range -= bound;
+      code -= bound;
+      prob -= prob >> 5;
+      return 1;
+    }
+
+    uint32_t bitTree(uint16_t *tree, uint32_t limit) {
+      uint32_t symbol = 1;
+      do {
+        symbol = (symbol << 1) | bit(tree[symbol]);
+      } while (symbol < limit);
+      return symbol - limit;
+    }
+
+    void reverseBitTree(uint16_t *tree, uint32_t &value, int bits) {
+      uint32_t symbol = 1;
+      for (int i = 0; i < bits; ++i) {
+        int b = bit(tree[symbol]);
+        symbol = (symbol << 1) | b;
+        value += (uint32_t)b << i;
+      }
+    }
+
+    void directBits(uint32_t &value, int bits) {
+      while (bits-- > 0) {
+        normalize();
+        range >>= 1;
+        code -= range;
+        uint32_t mask = 0u - (code >> 31);
+        code += range & mask;
+        value = (value << 1) + (mask + 1);
+      }
+    }
+  };
+
+  static const size_t CHUNK_PADDING = 64;
+  std::vector<uint8_t> chunk;
+  RangeDecoder rc = {};
+
+  Probabilities probs;
+  int lc = 0;
+  int lpMask = 0;
+  int pbMask = 0;
+  int state = 0;
+  uint32_t rep[4] = {};
+  uint32_t pendingLength = 0;
+
+  uint64_t chunkLeft = 0;
+  bool chunkIsLzma = false;
+  bool needDictReset = true;
+  bool needProps = true;
+  bool finished = false;
+  uint64_t compressedRead = 0;
+
+public:
+  // dictSize comes from the block's filter properties; sizeHint, when the
+  // block header records its uncompressed size, caps the allocation.
+  void startBlock(InputStream &in, uint64_t dictionarySize, uint64_t sizeHint) {
+    input = &in;
+    errorMessage.clear();
+    size_t dictSize = (size_t)std::max<uint64_t>(1, std::min(dictionarySize, sizeHint));
+    if (dictSize > allocated) {
+      dict.reset(new uint8_t[dictSize]);
+      allocated = dictSize;
+    }
+    window = {dict.get(), dictSize, 0, 0, 0};
+    chunkLeft = 0;
+    pendingLength = 0;
+    needDictReset = true;
+    needProps = true;
+    finished = false;
+    compressedRead = 0;
+  }
+
+  // Decodes up to `size` bytes into `out`. Returns 0 at the end of the LZMA2
+  // data or on error; error() tells the two apart.
+  size_t decode(uint8_t *out, size_t size) {
+    size_t produced = 0;
+    while (produced < size && !finished && errorMessage.empty()) {
+      if (chunkLeft == 0 && !startChunk()) {
+        break;
+      }
+      size_t room = (size_t)std::min<uint64_t>(size - produced, chunkLeft);
+      size_t count = chunkIsLzma ? decodeLzma(out + produced, room) : copyStored(out + produced, room);
+      produced += count;
+      chunkLeft -= count;
+      if (chunkLeft == 0 && chunkIsLzma && errorMessage.empty()) {
+        rc.normalize();
+        if (pendingLength != 0 || rc.code != 0 || rc.next != rc.end) {
+          fail("corrupt LZMA2 chunk");
+        }
+      }
+    }
+    return produced;
+  }
+
+  bool atEnd() const { return finished; }
+  uint64_t compressedSize() const { return compressedRead; }
+  const std::string &error() const { return errorMessage; }
+
+private:
+  bool fail(const std::string &message) {
+    if (errorMessage.empty()) {
+      errorMessage = message;
+    }
+    return false;
+  }
+
+  bool readInput(uint8_t *out, size_t size) {
+    if (!input->readExact(out, size)) {
+      return fail("archive is truncated");
+    }
+    compressedRead += size;
+    return true;
+  }
+
+  bool startChunk() {
+    uint8_t control;
+    if (!readInput(&control, 1)) {
+      return false;
+    }
+    if (control == 0x00) {
+      finished = true;
+      return false;
+    }
+    if (control == 0x01 || control == 0x02) {
+      uint8_t header[2];
+      if (!readInput(header, 2)) {
+        return false;
+      }
+      if (control == 0x01) {
+        resetDict();
+      } else if (needDictReset) {
+        return fail("corrupt LZMA2 data: missing dictionary reset");
+      }
+      chunkIsLzma = false;
+      chunkLeft = ((uint32_t)header[0] << 8 | header[1]) + 1u;
+      return true;
+    }
+    if (control < 0x80) {
+      return fail("corrupt LZMA2 data: invalid control byte");
+    }
+
+    uint8_t header[5];
+    int reset = (control >> 5) & 3;
+    if (!readInput(header, reset >= 2 ? 5 : 4)) {
+      return false;
+    }
+    if (reset == 3) {
+      resetDict();
+    } else if (needDictReset) {
+      return fail("corrupt LZMA2 data: missing dictionary reset");
+    }
+    if (reset >= 2) {
+      if (!setProperties(header[4])) {
+        return false;
+      }
+    } else if (needProps) {
+      return fail("corrupt LZMA2 data: missing properties");
+    }
+    if (reset >= 1) {
+      resetState();
+    }
+
+    chunkIsLzma = true;
+    chunkLeft = (((uint32_t)(control & 0x1F) << 16) | ((uint32_t)header[0] << 8) | header[1]) + 1u;
+    size_t compressed = ((size_t)header[2] << 8 | header[3]) + 1u;
+    chunk.assign(compressed + CHUNK_PADDING, 0);
+    if (compressed < 5 || !readInput(chunk.data(), compressed) || chunk[0] != 0) {
+      return fail("corrupt LZMA2 chunk");
+    }
+    rc.next = chunk.data() + 5;
+    rc.end = chunk.data() + compressed;
+    rc.range = 0xFFFFFFFF;
+    rc.code = (uint32_t)chunk[1] << 24 | (uint32_t)chunk[2] << 16 | (uint32_t)chunk[3] << 8 | chunk[4];
+    return true;
+  }
+
+  void resetDict() {
+    window.pos = 0;
+    window.full = 0;
+    window.position = 0;
+    needDictReset = false;
+  }
+
+  bool setProperties(uint8_t props) {
+    if (props >= 9 * 5 * 5) {
+      return fail("corrupt LZMA2 data: invalid properties");
+    }
+    lc = props % 9;
+    int lp = (props / 9) % 5;
+    int pb = props / 45;
+    if (lc + lp > 4) {
+      return fail("corrupt LZMA2 data: invalid properties");
+    }
+    lpMask = (1 << lp) - 1;
+    pbMask = (1 << pb) - 1;
+    needProps = false;
+    return true;
+  }
+
+  void resetState() {
+    uint16_t *all = reinterpret_cast<uint16_t *>(&probs);
+    std::fill(all, all + sizeof(probs) / sizeof(uint16_t), (uint16_t)1024);
+    state = 0;
+    rep[0] = rep[1] = rep[2] = rep[3] = 0;
+    pendingLength = 0;
+  }
+
+  size_t copyStored(uint8_t *out, size_t size) {
+    if (!readInput(out, size)) {
+      return 0;
+    }
+    for (size_t i = 0; i < size; ++i) {
+      window.put(out[i]);
+    }
+    return size;
+  }
+
+  // Copies up to `size` bytes of the pending match.
+  size_t copyMatch(Window &w, uint8_t *out, size_t size) {
+    size_t count = std::min<size_t>(pendingLength, size);
+    size_t from = rep[0] < w.pos ? w.pos - rep[0] - 1 : w.pos + w.size - rep[0] - 1;
+    for (size_t i = 0; i < count; ++i) {
+      uint8_t byte = w.buffer[from];
+      if (++from == w.size) {
+        from = 0;
+      }
+      out[i] = byte;
+      w.buffer[w.pos] = byte;
+      if (++w.pos == w.size) {
+        w.pos = 0;
+      }
+    }
+    w.full = std::min(w.size, w.full + count);
+    w.position += count;
+    pendingLength -= (uint32_t)count;
+    return count;
+  }
+
+  static uint32_t decodeLength(RangeDecoder &rc, LengthCoder &coder, uint32_t posState) {
+    if (!rc.bit(coder.choice)) {
+      return MATCH_LEN_MIN + rc.bitTree(coder.low[posState], 8);
+    }
+    if (!rc.bit(coder.choice2)) {
+      return MATCH_LEN_MIN + 8 + rc.bitTree(coder.mid[posState], 8);
+    }
+    return MATCH_LEN_MIN + 16 + rc.bitTree(coder.high, 256);
+  }
+
+  uint8_t decodeLiteral(RangeDecoder &rc, const Window &w) {
+    uint8_t previous = w.full > 0 ? w.get(0) : 0;
+    uint32_t literalState = (((uint32_t)w.position & lpMask) << lc) + (previous >> (8 - lc));
+    uint16_t *coder = probs.literal + LITERAL_CODER_SIZE * literalState;
+    uint32_t symbol = 1;
+    if (state < LITERAL_STATES) {
+      do {
+        symbol = (symbol << 1) | rc.bit(coder[symbol]);
+      } while (symbol < 0x100);
+    } else {
+      uint32_t matchByte = (uint32_t)w.get(rep[0]) << 1;
+      uint32_t offset = 0x100;
+      do {
+        uint32_t matchBit = matchByte & offset;
+        matchByte <<= 1;
+        if (rc.bit(coder[offset + matchBit + symbol])) {
+          symbol = (symbol << 1) | 1;
+          offset = matchBit;
+        } else {
+          symbol <<= 1;
+          offset &= ~matchBit;
+        }
+      } while (symbol < 0x100);
+    }
+    state = state < 4 ? 0 : state < 10 ? state - 3 : state - 6;
+    return (uint8_t)symbol;
+  }
+
+  uint32_t decodeDistance(RangeDecoder &rc, uint32_t length) {
+    uint32_t distState = std::min<uint32_t>(length - MATCH_LEN_MIN, DIST_STATES - 1);
+    uint32_t slot = rc.bitTree(probs.distSlot[distState], DIST_SLOTS);
+    if (slot < DIST_MODEL_START) {
+      return slot;
+    }
+    int bits = (int)(slot >> 1) - 1;
+    uint32_t distance = (2 | (slot & 1)) << bits;
+    if (slot < DIST_MODEL_END) {
+      rc.reverseBitTree(probs.distSpecial + distance - slot - 1, distance, bits);
+    } else {
+      uint32_t high = 0;
+      rc.directBits(high, bits - ALIGN_BITS);
+      distance += high << ALIGN_BITS;
+      rc.reverseBitTree(probs.distAlign, distance, ALIGN_BITS);
+    }
+    return distance;
+  }
+
+  // The range coder and window are copied into locals for the loop so their
+  // state stays in registers rather than being reloaded after every output
+  // byte.
+  size_t decodeLzma(uint8_t *out, size_t size) {
+    RangeDecoder rc = this->rc;
+    Window w = window;
+    size_t produced = 0;
+    while (produced < size) {
+      if (pendingLength > 0) {
+        produced += copyMatch(w, out + produced, size - produced);
+        continue;
+      }
+      if (rc.overrun()) {
+        fail("corrupt LZMA2 chunk");
+        break;
+      }
+
+      uint32_t posState = (uint32_t)w.position & pbMask;
+      if (!rc.bit(probs.isMatch[state][posState])) {
+        uint8_t byte = decodeLiteral(rc, w);
+        w.put(byte);
+        out[produced++] = byte;
+        continue;
+      }
+
+      uint32_t length;
+      if (!rc.bit(probs.isRep[state])) {
+        state = state < LITERAL_STATES ? 7 : 10;
+        length = decodeLength(rc, probs.matchLength, posState);
+        rep[3] = rep[2];
+        rep[2] = rep[1];
+        rep[1] = rep[0];
+        rep[0] = decodeDistance(rc, length);
+      } else {
+        bool shortRep = false;
+        if (!rc.bit(probs.isRep0[state])) {
+          shortRep = !rc.bit(probs.isRep0Long[state][posState]);
+        } else {
+          uint32_t distance;
+          if (!rc.bit(probs.isRep1[state])) {
+            distance = rep[1];
+          } else {
+            if (!rc.bit(probs.isRep2[state])) {
+              distance = rep[2];
+            } else {
+              distance = rep[3];
+              rep[3] = rep[2];
+            }
+            rep[2] = rep[1];
+          }
+          rep[1] = rep[0];
+          rep[0] = distance;
+        }
+        if (shortRep) {
+          state = state < LITERAL_STATES ? 9 : 11;
+          length = 1;
+        } else {
+          state = state < LITERAL_STATES ? 8 : 11;
+          length = decodeLength(rc, probs.repLength, posState);
+        }
+      }
+
+      if (rep[0] >= w.full) {
+        fail("corrupt LZMA2 chunk: match distance out of range");
+        break;
+      }
+      pendingLength = length;
+    }
+    this->rc = rc;
+    window = w;
+    return produced;
+  }
+};
+
+// Decompresses an .xz file as it is read: stream and block headers, LZMA2
+// block data, block checks, the index and stream footer, and any further
+// concatenated streams. Only the LZMA2 filter is supported, which is what
+// xz and tar -J produce by default.
+class XzSource : public ByteSource {
+private:
+  InputStream &in;
+  Lzma2Decoder lzma;
+  std::string errorMessage;
+  bool inBlock = false;
+  bool done = false;
+  bool firstStream = true;
+  uint8_t streamFlags[2] = {};
+  uint8_t checkType = 0;
+
+  uint64_t headerSize = 0;
+  uint64_t expectedCompressed = UINT64_MAX;
+  uint64_t expectedUncompressed = UINT64_MAX;
+  uint64_t blockOut = 0;
+  uint32_t crc32 = 0;
+  uint64_t crc64 = 0;
+  Sha256 sha256;
+  // Unpadded and uncompressed size of each block, checked against the index.
+  std::vector<std::pair<uint64_t, uint64_t>> blocks;
+
+  bool fail(const std::string &message) {
+    if (errorMessage.empty()) {
+      errorMessage = message;
+    }
+    return false;
+  }
+
+  static size_t checkSize(uint8_t type) { return type == 0 ? 0 : (size_t)4 << ((type - 1) / 3); }
+
+  static bool parseVarint(const uint8_t *data, size_t size, size_t &pos, uint64_t &value) {
+    value = 0;
+    for (int i = 0; i < 9 && pos < size; ++i) {
+      uint8_t byte = data[pos++];
+      value |= (uint64_t)(byte & 0x7F) << (7 * i);
+      if (!(byte & 0x80)) {
+        return i == 0 || byte != 0;
+      }
+    }
+    return false;
+  }
+
+  bool readVarint(std::vector<uint8_t> &bytes, uint64_t &value) {
+    for (int i = 0; i < 9; ++i) {
+      uint8_t byte;
+      if (!in.readByte(byte)) {
+        return fail("archive is truncated");
+      }
+      bytes.push_back(byte);
+      if (!(byte & 0x80)) {
+        size_t pos = bytes.size() - i - 1;
+        return parseVarint(bytes.data(), bytes.size(), pos, value) || fail("corrupt xz index");
+      }
+    }
+    return fail("corrupt xz index");
+  }
+
+  bool readStreamHeader() {
+    uint8_t header[12];
+    size_t got = in.read(header, 4);
+    if (!firstStream) {
+      // Stream padding comes in zero-filled groups of four bytes.
+      while (got == 4 && readLE32(header) == 0) {
+        got = in.read(header, 4);
+      }
+      if (got == 0) {
+        done = true;
+        return true;
+      }
+    }
+    if (got != 4 || !in.readExact(header + 4, 8)) {
+      return fail(firstStream ? "not an xz archive" : "archive is truncated");
+    }
+    if (!hasMagic(header, sizeof(header))) {
+      return fail("not an xz archive");
+    }
+    if (Crc32::update(0, header + 6, 2) != readLE32(header + 8) || header[6] != 0 || header[7] > 0x0F) {
+      return fail("corrupt xz stream header");
+    }
+    streamFlags[0] = header[6];
+    streamFlags[1] = header[7];
+    checkType = header[7];
+    firstStream = false;
+    blocks.clear();
+    return true;
+  }
+
+  bool startBlock(uint8_t sizeByte) {
+    headerSize = ((uint64_t)sizeByte + 1) * 4;
+    std::vector<uint8_t> header(headerSize);
+    header[0] = sizeByte;
+    if (!in.readExact(header.data() + 1, header.size() - 1)) {
+      return fail("archive is truncated");
+    }
+    size_t end = header.size() - 4;
+    if (Crc32::update(0, header.data(), end) != readLE32(header.data() + end)) {
+      return fail("corrupt xz block header");
+    }
+    uint8_t flags = header[1];
+    if (flags & 0x3C) {
+      return fail("unsupported xz block header");
+    }
+    size_t pos = 2;
+    expectedCompressed = UINT64_MAX;
+    expectedUncompressed = UINT64_MAX;
+    if ((flags & 0x40) && !parseVarint(header.data(), end, pos, expectedCompressed)) {
+      return fail("corrupt xz block header");
+    }
+    if ((flags & 0x80) && !parseVarint(header.data(), end, pos, expectedUncompressed)) {
+      return fail("corrupt xz block header");
+    }
+    uint64_t filterId, propsSize;
+    if ((flags & 3) != 0 || !parseVarint(header.data(), end, pos, filterId) ||
+        !parseVarint(header.data(), end, pos, propsSize)) {
+      return fail("unsupported xz filter chain; only LZMA2 is supported");
+    }
+    if (filterId != 0x21 || propsSize != 1 || pos >= end || header[pos] > 40) {
+      return fail("unsupported xz filter chain; only LZMA2 is supported");
+    }
+    uint8_t dictBits = header[pos++];
+    for (; pos < end; ++pos) {
+      if (header[pos] != 0) {
+        return fail("corrupt xz block header");
+      }
+    }
+    uint64_t dictSize = dictBits == 40 ? 0xFFFFFFFFull : (uint64_t)(2 | (dictBits & 1)) << (dictBits / 2 + 11);
+    if (std::min(dictSize, expectedUncompressed) > ((uint64_t)1 << 30)) {
+      return fail("xz dictionary is too large");
+    }
+
+    lzma.startBlock(in, dictSize, expectedUncompressed);
+    blockOut = 0;
+    crc32 = 0;
+    crc64 = 0;
+    sha256 = Sha256();
+    inBlock = true;
+    return true;
+  }
+
+  bool finishBlock() {
+    inBlock = false;
+    uint64_t compressed = lzma.compressedSize();
+    if ((expectedCompressed != UINT64_MAX && compressed != expectedCompressed) ||
+        (expectedUncompressed != UINT64_MAX && blockOut != expectedUncompressed)) {
+      return fail("xz block size does not match its header");
+    }
+    uint64_t unpadded = headerSize + compressed;
+    uint8_t check[64];
+    size_t padding = (size_t)((4 - unpadded % 4) % 4);
+    if (!in.readExact(check, padding)) {
+      return fail("archive is truncated");
+    }
+    if (std::any_of(check, check + padding, [](uint8_t byte) { return byte != 0; })) {
+      return fail("corrupt xz block padding");
+    }
+    size_t size = checkSize(checkType);
+    if (!in.readExact(check, size)) {
+      return fail("archive is truncated");
+    }
+    bool ok = true;
+    if (checkType == 0x01) {
+      ok = readLE32(check) == crc32;
+    } else if (checkType == 0x04) {
+      ok = readLE64(check) == crc64;
+    } else if (checkType == 0x0A) {
+      ok = sha256.hexDigest() == toHex(check, 32);
+    }
+    if (!ok) {
+      return fail("xz integrity check failed, the archive is corrupt");
+    }
+    blocks.emplace_back(unpadded + size, blockOut);
+    return true;
+  }
+
+  static std::string toHex(const uint8_t *data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string text;
+    for (size_t i = 0; i < size; ++i) {
+      text += digits[data[i] >> 4];
+      text += digits[data[i] & 15];
+    }
+    return text;
+  }
+
+  // Reads the index (its indicator byte already consumed) and the footer.
+  bool readIndex() {
+    std::vector<uint8_t> bytes(1, 0);
+    uint64_t count;
+    if (!readVarint(bytes, count)) {
+      return false;
+    }
+    if (count != blocks.size()) {
+      return fail("xz index does not match the archive");
+    }
+    for (const auto &block : blocks) {
+      uint64_t unpadded, uncompressed;
+      if (!readVarint(bytes, unpadded) || !readVarint(bytes, uncompressed)) {
+        return false;
+      }
+      if (unpadded != block.first || uncompressed != block.second) {
+        return fail("xz index does not match the archive");
+      }
+    }
+    while (bytes.size() % 4 != 0) {
+      uint8_t byte;
+      if (!in.readByte(byte)) {
+        return fail("archive is truncated");
+      }
+      if (byte != 0) {
+        return fail("corrupt xz index");
+      }
+      bytes.push_back(byte);
+    }
+    uint8_t tail[16];
+    if (!in.readExact(tail, sizeof(tail))) {
+      return fail("archive is truncated");
+    }
+    if (Crc32::update(0, bytes.data(), bytes.size()) != readLE32(tail)) {
+      return fail("corrupt xz index");
+    }
+    const uint8_t *footer = tail + 4;
+    if (Crc32::update(0, footer + 4, 6) != readLE32(footer) || footer[10] != 'Y' || footer[11] != 'Z' ||
+        footer[8] != streamFlags[0] || footer[9] != streamFlags[1] ||
+        ((uint64_t)readLE32(footer + 4) + 1) * 4 != bytes.size() + 4) {
+      return fail("corrupt xz stream footer");
+    }
+    return readStreamHeader();
+  }
+
+  void updateCheck(const uint8_t *data, size_t size) {
+    if (checkType == 0x01) {
+      crc32 = Crc32::update(crc32, data, size);
+    } else if (checkType == 0x04) {
+      crc64 = Crc64::update(crc64, data, size);
+    } else if (checkType == 0x0A) {
+      sha256.update(data, size);
+    }
+  }
+
+public:
+  explicit XzSource(InputStream &in) : in(in) {}
+
+  static bool hasMagic(const uint8_t *data, size_t size) {
+    static const uint8_t magic[6] = {0xFD, '7', 'z', 'X', 'Z', 0x00};
+    return size >= sizeof(magic) && std::memcmp(data, magic, sizeof(magic)) == 0;
+  }
+
+  // Peeks at the start of a stream without consuming it.
+  static bool isXz(InputStream &in) {
+    uint8_t header[6];
+    size_t got = in.read(header, sizeof(header));
+    in.unread(header, got);
+    return hasMagic(header, got);
+  }
+
+  size_t read(uint8_t *buffer, size_t size) override {
+    size_t total = 0;
+    while (total < size && !done && errorMessage.empty()) {
+      if (firstStream && !readStreamHeader()) {
+        break;
+      }
+      if (inBlock) {
+        size_t count = lzma.decode(buffer + total, size - total);
+        if (count > 0) {
+          updateCheck(buffer + total, count);
+          blockOut += count;
+          total += count;
+        } else if (!lzma.atEnd()) {
+          fail(lzma.error());
+        } else {
+          finishBlock();
+        }
+        continue;
+      }
+      uint8_t sizeByte;
+      if (!in.readByte(sizeByte)) {
+        fail("archive is truncated");
+      } else if (sizeByte == 0) {
+        readIndex();
+      } else {
+        startBlock(sizeByte);
+      }
+    }
+    return total;
+  }
+
+  const std::string &error() const { return errorMessage; }
+};
+
+struct TarEntry {
+  std::string name;
+  uint64_t size = 0;
+  char type = '0';
+
+  bool isFile() const { return type == '0' || type == '7'; }
+};
+
+// Walks a tar stream front to back. Handles ustar headers, including the
+// name prefix field, pax extended headers and GNU long names.
+class TarStreamReader {
+private:
+  InputStream &in;
+  std::string errorMessage;
+  uint64_t padding = 0;
+
+  bool fail(const std::string &message) {
+    errorMessage = message;
+    return false;
+  }
+
+  // Numeric fields are octal text, or base-256 when the top bit is set.
+  static bool parseNumber(const uint8_t *field, size_t length, uint64_t &value) {
+    value = 0;
+    if (field[0] & 0x80) {
+      for (size_t i = 1; i < length; ++i) {
+        if (value >> 56) {
+          return false;
+        }
+        value = (value << 8) | field[i];
+      }
+      return (field[0] & 0x7F) == 0;
+    }
+    size_t i = 0;
+    while (i < length && field[i] == ' ') {
+      ++i;
+    }
+    bool digits = false;
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; ++i) {
+      value = (value << 3) | (uint64_t)(field[i] - '0');
+      digits = true;
+    }
+    return digits && (i == length || field[i] == ' ' || field[i] == 0);
+  }
+
+  static std::string fieldText(const uint8_t *field, size_t length) {
+    size_t size = 0;
+    while (size < length && field[size] != 0) {
+      ++size;
+    }
+    return std::string(reinterpret_cast<const char *>(field), size);
+  }
+
+  bool readPayload(uint64_t size, std::string &payload) {
+    if (size > (1 << 20)) {
+      return fail("tar extended header is too large");
+    }
+    payload.resize((size_t)size);
+    if (!in.readExact(reinterpret_cast<uint8_t *>(&payload[0]), payload.size()) || !in.skip((512 - size % 512) % 512)) {
+      return fail("archive is truncated");
+    }
+    return true;
+  }
+
+  // pax records are "<length> <key>=<value>\n".
+  static void parsePax(const std::string &payload, std::string &path, uint64_t &size, bool &hasSize) {
+    size_t pos = 0;
+    while (pos < payload.size()) {
+      size_t space = payload.find(' ', pos);
+      if (space == std::string::npos) {
+        return;
+      }
+      uint64_t length = std::strtoull(payload.c_str() + pos, nullptr, 10);
+      if (length <= space - pos || pos + length > payload.size()) {
+        return;
+      }
+      std::string record = payload.substr(space + 1, pos + length - space - 2);
+      size_t equals = record.find('=');
+      if (equals != std::string::npos) {
+        std::string key = record.substr(0, equals);
+        if (key == "path") {
+          path = record.substr(equals + 1);
+        } else if (key == "size") {
+          size = std::strtoull(record.c_str() + equals + 1, nullptr, 10);
+          hasSize = true;
+        }
+      }
+      pos += length;
+    }
+  }
+
+public:
+  explicit TarStreamReader(InputStream &in) : in(in) {}
+
+  const std::string &error() const { return errorMessage; }
+
+  // Returns false at the end-of-archive marker or on error.
+  bool nextEntry(TarEntry &entry) {
+    std::string longName;
+    std::string paxPath;
+    uint64_t paxSize = 0;
+    bool hasPaxSize = false;
+
+    while (true) {
+      uint8_t header[512];
+      size_t got = in.read(header, sizeof(header));
+      if (got == 0) {
+        return false;
+      }
+      if (got != sizeof(header)) {
+        return fail("archive is truncated");
+      }
+      if (std::all_of(header, header + sizeof(header), [](uint8_t byte) { return byte == 0; })) {
+        return false;
+      }
+
+      uint64_t stored;
+      uint32_t sum = 0;
+      for (size_t i = 0; i < sizeof(header); ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+      }
+      if (!parseNumber(header + 148, 8, stored) || stored != sum) {
+        return fail("invalid tar header checksum");
+      }
+
+      uint64_t size;
+      if (!parseNumber(header + 124, 12, size)) {
+        return fail("invalid tar entry size");
+      }
+      char type = header[156] ? (char)header[156] : '0';
+      std::string payload;
+      if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+        if (!readPayload(size, payload)) {
+          return false;
+        }
+        if (type == 'x') {
+          parsePax(payload, paxPath, paxSize, hasPaxSize);
+        } else if (type == 'L') {
+          longName = fieldText(reinterpret_cast<const uint8_t *>(payload.data()), payload.size());
+        }
+        continue;
+      }
+
+      entry = TarEntry();
+      entry.type = type;
+      entry.size = hasPaxSize ? paxSize : size;
+      if (!paxPath.empty()) {
+        entry.name = paxPath;
+      } else if (!longName.empty()) {
+        entry.name = longName;
+      } else {
+        entry.name = fieldText(header, 100);
+        std::string prefix = std::memcmp(header + 257, "ustar", 5) == 0 ? fieldText(header + 345, 155) : "";
+        if (!prefix.empty()) {
+          entry.name = prefix + "/" + entry.name;
+        }
+      }
+      // Links and directories carry no data, whatever the size field says.
+      if (type == '1' || type == '2' || type == '5') {
+        entry.size = 0;
+      }
+      padding = (512 - entry.size % 512) % 512;
+      return true;
+    }
+  }
+
+  bool readEntry(const TarEntry &entry, const Inflater::Sink &sink) {
+    uint8_t buffer[1 << 16];
+    for (uint64_t left = entry.size; left > 0;) {
+      size_t chunk = (size_t)std::min<uint64_t>(left, sizeof(buffer));
+      if (!in.readExact(buffer, chunk)) {
+        return fail("archive is truncated");
+      }
+      if (!sink(buffer, chunk)) {
+        return fail(entry.name + ": failed to write data");
+      }
+      left -= chunk;
+    }
+    return in.skip(padding) || fail("archive is truncated");
+  }
+
+  bool skipEntry(const TarEntry &entry) {
+    return in.skip(entry.size + padding) || fail("archive is truncated");
+  }
+};
+
+struct ParsedUrl {
+  std::string scheme;
+  std::string host;
+  int port = 0;
+  std::string path;
+};
+
+bool parseUrl(const std::string &url, ParsedUrl &parsed) {
+  size_t schemeEnd = url.find("://");
+  if (schemeEnd == std::string::npos) {
+    return false;
+  }
+  parsed.scheme = url.substr(0, schemeEnd);
+  std::transform(parsed.scheme.begin(), parsed.scheme.end(), parsed.scheme.begin(), ::tolower);
+
+  size_t hostStart = schemeEnd + 3;
+  size_t pathStart = url.find('/', hostStart);
+  std::string authority = url.substr(hostStart, pathStart == std::string::npos ? std::string::npos : pathStart - hostStart);
+  parsed.path = pathStart == std::string::npos ? "/" : url.substr(pathStart);
+
+  size_t colon = authority.rfind(':');
+  if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+    try {
+      parsed.port = std::stoi(authority.substr(colon + 1));
+    } catch (...) {
+      return false;
+    }
+    parsed.host = authority.substr(0, colon);
+  } else {
+    parsed.host = authority;
+    parsed.port = parsed.scheme == "https" ? 443 : 80;
+  }
+  return !parsed.host.empty();
+}
+
+// Maps file:// URLs and plain paths (including UNC shares) to a filesystem
+// path. Returns false for anything that has to go over the network.
+bool localSourcePath(const std::string &url, std::string &path) {
+  if (url.compare(0, 7, "file://") != 0) {
+    if (url.empty() || url.find("://") != std::string::npos) {
+      return false;
+    }
+    path = url;
+    return true;
+  }
+
+  std::string encoded = url.substr(7);
+  if (encoded.size() >= 3 && encoded[0] == '/' && encoded[2] == ':') {
+    encoded.erase(0, 1);
+  } else if (!encoded.empty() && encoded[0] != '/') {
+    encoded = "//" + encoded;
+  }
+
+  path.clear();
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    if (encoded[i] == '%' && i + 2 < encoded.size() && std::isxdigit((unsigned char)encoded[i + 1]) &&
+        std::isxdigit((unsigned char)encoded[i + 2])) {
+      path += (char)std::stoi(encoded.substr(i + 1, 2), nullptr, 16);
+      i += 2;
+    } else {
+      path += encoded[i];
+    }
+  }
+  return !path.empty();
+}
+
+// Milliseconds spent in each phase of a request, -1 for phases that did not
+// happen: no DNS lookup or connect on a reused connection, no TLS over http.
+struct HttpTiming {
+  double dnsMs = -1;
+  double connectMs = -1;
+  double tlsMs = -1;
+  // From sending the request until its response headers arrived.
+  double firstByteMs = -1;
+  bool reusedConnection = false;
+};
+
+class HttpResponse : public ByteSource {
+private:
+  HttpTiming phases;
+
+public:
+  const HttpTiming &timing() const { return phases; }
+  void setTiming(const HttpTiming &timing) { phases = timing; }
+
+  virtual int status() const = 0;
+  // Header lookup is case-insensitive; returns "" when the header is absent.
+  virtual std::string header(const std::string &name) const = 0;
+  // True once read() has returned 0 because of a broken connection rather
+  // than the end of the body.
+  virtual bool failed() const = 0;
+};
+
+using HttpHeaders = std::vector<std::pair<std::string, std::string>>;
+
+// Lets another thread abort a request that is still connecting or waiting for
+// its response, e.g. the losing half of a hedged request.
+class HttpCancellation {
+private:
+  std::mutex mutex;
+  std::function<void()> abortRequest;
+  bool cancelled = false;
+
+public:
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!cancelled) {
+      cancelled = true;
+      if (abortRequest) {
+        abortRequest();
+      }
+    }
+  }
+
+  bool isCancelled() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return cancelled;
+  }
+
+  // Registers how to abort the request in flight; false if already cancelled.
+  bool arm(std::function<void()> abort) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cancelled) {
+      return false;
+    }
+    abortRequest = std::move(abort);
+    return true;
+  }
+
+  // Returns true if the request was aborted while armed.
+  bool disarm() {
+    std::lock_guard<std::mutex> lock(mutex);
+    abortRequest = nullptr;
+    return cancelled;
+  }
+};
+
+// One transport is shared by every download in a wta run, so the catalog and
+// all font archives from the same host reuse one keep-alive connection.
+class HttpTransport {
+public:
+  virtual ~HttpTransport() = default;
+  // Returns nullptr when no connection could be made or the request could not be sent.
+  virtual std::unique_ptr<HttpResponse> get(const std::string &url, const HttpHeaders &headers,
+                                            HttpCancellation *cancel = nullptr) = 0;
+};
+
+#ifdef _WIN32
+// When WinINet reported each step of sending a request, from its status
+// callback. The request handle's context points here.
+struct WinInetMarks {
+  std::chrono::steady_clock::time_point resolving, resolved, connecting, connected, sending;
+
+  static double between(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    if (from == std::chrono::steady_clock::time_point() || to == std::chrono::steady_clock::time_point()) {
+      return -1;
+    }
+    return std::chrono::duration<double, std::milli>(to - from).count();
+  }
+};
+
+class WinInetResponse : public HttpResponse {
+private:
+  HINTERNET hRequest;
+  // Closing the handle still reports to the callback, so the marks outlive it.
+  std::unique_ptr<WinInetMarks> marks;
+  bool readFailed = false;
+
+public:
+  WinInetResponse(HINTERNET hRequest, std::unique_ptr<WinInetMarks> marks)
+      : hRequest(hRequest), marks(std::move(marks)) {}
+  ~WinInetResponse() override { InternetCloseHandle(hRequest); }
+
+  int status() const override {
+    DWORD statusCode = 0;
+    DWORD statusLength = sizeof(statusCode);
+    HttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &statusCode, &statusLength, NULL);
+    return (int)statusCode;
+  }
+
+  std::string header(const std::string &name) const override {
+    char buffer[512];
+    std::strncpy(buffer, name.c_str(), sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    DWORD length = sizeof(buffer);
+    if (HttpQueryInfoA(hRequest, HTTP_QUERY_CUSTOM, buffer, &length, NULL)) {
+      return std::string(buffer, length);
+    }
+    return "";
+  }
+
+  bool failed() const override { return readFailed; }
+
+  size_t read(uint8_t *buffer, size_t size) override {
+    DWORD bytesRead = 0;
+    if (!InternetReadFile(hRequest, buffer, (DWORD)size, &bytesRead)) {
+      readFailed = true;
+      return 0;
+    }
+    return bytesRead;
+  }
+};
+
+class WinInetTransport : public HttpTransport {
+private:
+  HINTERNET hSession;
+  std::mutex connectionMutex;
+  std::unordered_map<std::string, HINTERNET> connections;
+
+  HINTERNET connection(const ParsedUrl &url) {
+    std::string key = url.scheme + "://" + url.host + ":" + std::to_string(url.port);
+    std::lock_guard<std::mutex> lock(connectionMutex);
+    auto it = connections.find(key);
+    if (it != connections.end()) {
+      return it->second;
+    }
+    HINTERNET hConnect = InternetConnectA(hSession, url.host.c_str(), (INTERNET_PORT)url.port, NULL, NULL,
+                                          INTERNET_SERVICE_HTTP, 0, 0);
+    if (hConnect) {
+      connections[key] = hConnect;
+    }
+    return hConnect;
+  }
+
+  static void CALLBACK statusCallback(HINTERNET, DWORD_PTR context, DWORD status, LPVOID, DWORD) {
+    if (!context) {
+      return;
+    }
+    WinInetMarks &marks = *reinterpret_cast<WinInetMarks *>(context);
+    auto now = std::chrono::steady_clock::now();
+    switch (status) {
+    case INTERNET_STATUS_RESOLVING_NAME:
+      marks.resolving = now;
+      break;
+    case INTERNET_STATUS_NAME_RESOLVED:
+      marks.resolved = now;
+      break;
+    case INTERNET_STATUS_CONNECTING_TO_SERVER:
+      marks.connecting = now;
+      break;
+    case INTERNET_STATUS_CONNECTED_TO_SERVER:
+      marks.connected = now;
+      break;
+    case INTERNET_STATUS_SENDING_REQUEST:
+      marks.sending = now;
+      break;
+    }
+  }
+
+public:
+  WinInetTransport() {
+    hSession = InternetOpenA("FontDownloader", INTERNET_OPEN_TYPE_DIRECT, NULL, NULL, 0);
+    if (hSession) {
+      InternetSetStatusCallbackA(hSession, statusCallback);
+    }
+  }
+
+  ~WinInetTransport() override {
+    for (auto &entry : connections) {
+      InternetCloseHandle(entry.second);
+    }
+    if (hSession) {
+      InternetCloseHandle(hSession);
+    }
+  }
+
+  std::unique_ptr<HttpResponse> get(const std::string &url, const HttpHeaders &headers,
+                                    HttpCancellation *cancel = nullptr) override {
+    ParsedUrl parsed;
+    if (!hSession || !parseUrl(url, parsed)) {
+      return nullptr;
+    }
+    HINTERNET hConnect = connection(parsed);
+    if (!hConnect) {
+      return nullptr;
+    }
+
+    DWORD flags = INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_KEEP_CONNECTION;
+    if (parsed.scheme == "https") {
+      flags |= INTERNET_FLAG_SECURE;
+    }
+    auto marks = std::make_unique<WinInetMarks>();
+    HINTERNET hRequest =
+        HttpOpenRequestA(hConnect, "GET", parsed.path.c_str(), NULL, NULL, NULL, flags, (DWORD_PTR)marks.get());
+    if (!hRequest) {
+      return nullptr;
+    }
+    // Closing the request handle from another thread aborts a blocked send.
+    if (cancel && !cancel->arm([hRequest] { InternetCloseHandle(hRequest); })) {
+      InternetCloseHandle(hRequest);
+      return nullptr;
+    }
+
+    std::string headerText;
+    for (const auto &header : headers) {
+      headerText += header.first + ": " + header.second + "\r\n";
+    }
+    auto started = std::chrono::steady_clock::now();
+    BOOL sent = HttpSendRequestA(hRequest, headerText.empty() ? NULL : headerText.c_str(),
+                                 (DWORD)headerText.size(), NULL, 0);
+    auto answered = std::chrono::steady_clock::now();
+    if (cancel && cancel->disarm()) {
+      return nullptr;
+    }
+    if (!sent) {
+      InternetCloseHandle(hRequest);
+      return nullptr;
+    }
+
+    // WinINet has no TLS event; the handshake runs between connecting and
+    // sending the request.
+    HttpTiming timing;
+    timing.dnsMs = WinInetMarks::between(marks->resolving, marks->resolved);
+    timing.connectMs = WinInetMarks::between(marks->connecting, marks->connected);
+    timing.reusedConnection = timing.connectMs < 0;
+    if (parsed.scheme == "https" && !timing.reusedConnection) {
+      timing.tlsMs = WinInetMarks::between(marks->connected, marks->sending);
+    }
+    auto sending = marks->sending == std::chrono::steady_clock::time_point() ? started : marks->sending;
+    timing.firstByteMs = WinInetMarks::between(sending, answered);
+    auto response = std::make_unique<WinInetResponse>(hRequest, std::move(marks));
+    response->setTiming(timing);
+    return response;
+  }
+};
+#else
+class SocketHttpTransport;
+
+class SocketResponse : public HttpResponse {
+private:
+  SocketHttpTransport &owner;
+  std::string poolKey;
+  int fd;
+  std::vector<uint8_t> buffer;
+  size_t pos = 0;
+  size_t end = 0;
+  int statusCode = 0;
+  std::vector<std::pair<std::string, std::string>> headers;
+  int64_t remaining = -1;
+  bool chunked = false;
+  bool done = false;
+  bool readFailed = false;
+  bool keepAlive = true;
+
+  bool fill() {
+    pos = 0;
+    end = 0;
+    ssize_t received;
+    do {
+      received = recv(fd, buffer.data(), buffer.size(), 0);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+      return false;
+    }
+    end = (size_t)received;
+    return true;
+  }
+
+  bool readLine(std::string &line) {
+    line.clear();
+    while (true) {
+      if (pos == end && !fill()) {
+        return false;
+      }
+      char c = (char)buffer[pos++];
+      if (c == '\n') {
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        return true;
+      }
+      line += c;
+      if (line.size() > 16384) {
+        return false;
+      }
+    }
+  }
+
+  // A Content-Length (base 10) or chunk size (base 16): at least one digit,
+  // then only whitespace or a chunk extension. Overflow is malformed too.
+  static bool parseSize(const std::string &text, int base, int64_t &value) {
+    size_t i = text.find_first_not_of(" \t");
+    size_t digits = 0;
+    value = 0;
+    for (; i < text.size(); i++, digits++) {
+      char c = text[i];
+      int digit = c >= '0' && c <= '9'   ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                         : base;
+      if (digit >= base) {
+        break;
+      }
+      if (value > (INT64_MAX - digit) / base) {
+        return false;
+      }
+      value = value * base + digit;
+    }
+    if (digits == 0) {
+      return false;
+    }
+    i = text.find_first_not_of(" \t", i);
+    return i == std::string::npos || (base == 16 && text[i] == ';');
+  }
+
+  void fail() {
+    readFailed = true;
+    done = true;
+    keepAlive = false;
+  }
+
+  size_t readRaw(uint8_t *out, size_t size) {
+    if (pos == end && !fill()) {
+      return 0;
+    }
+    size_t chunk = std::min(size, end - pos);
+    std::memcpy(out, buffer.data() + pos, chunk);
+    pos += chunk;
+    return chunk;
+  }
+
+public:
+  SocketResponse(SocketHttpTransport &owner, const std::string &poolKey, int fd, size_t bufferSize)
+      : owner(owner), poolKey(poolKey), fd(fd), buffer(bufferSize) {}
+  ~SocketResponse() override;
+
+  // Parses the status line and headers; false means the connection was unusable.
+  bool readHead(bool headRequest) {
+    std::string line;
+    if (!readLine(line) || line.compare(0, 5, "HTTP/") != 0) {
+      return false;
+    }
+    size_t space = line.find(' ');
+    statusCode = space == std::string::npos ? 0 : std::atoi(line.c_str() + space + 1);
+    if (line.compare(0, 8, "HTTP/1.0") == 0) {
+      keepAlive = false;
+    }
+
+    while (readLine(line) && !line.empty()) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+      headers.emplace_back(name, valueStart == std::string::npos ? "" : line.substr(valueStart));
+    }
+    if (!line.empty()) {
+      return false;
+    }
+
+    std::string connection = header("Connection");
+    std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+    if (connection == "close") {
+      keepAlive = false;
+    } else if (connection == "keep-alive") {
+      keepAlive = true;
+    }
+
+    std::string encoding = header("Transfer-Encoding");
+    std::transform(encoding.begin(), encoding.end(), encoding.begin(), ::tolower);
+    std::string length = header("Content-Length");
+    if (headRequest || statusCode == 204 || statusCode == 304 || (statusCode >= 100 && statusCode < 200)) {
+      remaining = 0;
+    } else if (encoding.find("chunked") != std::string::npos) {
+      chunked = true;
+      remaining = 0;
+    } else if (!length.empty()) {
+      if (!parseSize(length, 10, remaining)) {
+        fail();
+        return true;
+      }
+    } else {
+      keepAlive = false;
+    }
+    done = !chunked && remaining == 0;
+    return true;
+  }
+
+  int status() const override { return statusCode; }
+
+  std::string header(const std::string &name) const override {
+    std::string lower = name;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    for (const auto &entry : headers) {
+      if (entry.first == lower) {
+        return entry.second;
+      }
+    }
+    return "";
+  }
+
+  bool failed() const override { return readFailed; }
+
+  size_t read(uint8_t *out, size_t size) override {
+    if (done || size == 0) {
+      return 0;
+    }
+
+    if (chunked && remaining == 0) {
+      std::string line;
+      if (!readLine(line) || !parseSize(line, 16, remaining)) {
+        fail();
+        return 0;
+      }
+      if (remaining == 0) {
+        while (readLine(line) && !line.empty()) {
+        }
+        done = true;
+        return 0;
+      }
+    }
+
+    if (remaining >= 0) {
+      size = (size_t)std::min<int64_t>((int64_t)size, remaining);
+    }
+    size_t got = readRaw(out, size);
+    if (got == 0) {
+      if (remaining >= 0) {
+        readFailed = true;
+      }
+      done = true;
+      keepAlive = false;
+      return 0;
+    }
+
+    if (remaining >= 0) {
+      remaining -= (int64_t)got;
+      if (remaining == 0) {
+        if (chunked) {
+          std::string crlf;
+          if (!readLine(crlf)) {
+            fail();
+          }
+        } else {
+          done = true;
+        }
+      }
+    }
+    return got;
+  }
+
+  bool reusable() const { return done && !readFailed && keepAlive && pos == end; }
+  int release() {
+    int released = fd;
+    fd = -1;
+    return released;
+  }
+};
+
+// Plain-HTTP/1.1 client over POSIX sockets. Idle connections are pooled per
+// host:port and reused by later requests; HTTPS needs the WinINet backend.
+class SocketHttpTransport : public HttpTransport {
+private:
+  std::mutex poolMutex;
+  std::unordered_map<std::string, std::vector<int>> idle;
+  size_t bufferSize;
+
+  // Connects without blocking so a cancelled request does not have to wait
+  // out the operating system's connect timeout.
+  static bool waitForConnect(int fd, HttpCancellation *cancel) {
+    for (int waited = 0; waited < 30000; waited += 50) {
+      if (cancel && cancel->isCancelled()) {
+        return false;
+      }
+      pollfd entry{fd, POLLOUT, 0};
+      int ready = poll(&entry, 1, 50);
+      if (ready < 0 && errno != EINTR) {
+        return false;
+      }
+      if (ready > 0) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+      }
+    }
+    return false;
+  }
+
+  static double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  static int connectTo(const std::string &host, int port, HttpCancellation *cancel, HttpTiming &timing) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addresses = nullptr;
+    auto started = std::chrono::steady_clock::now();
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+      return -1;
+    }
+    timing.dnsMs = millisecondsSince(started);
+    started = std::chrono::steady_clock::now();
+
+    int fd = -1;
+    for (addrinfo *address = addresses; address; address = address->ai_next) {
+      fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if (fd < 0) {
+        continue;
+      }
+      int flags = fcntl(fd, F_GETFL, 0);
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+      int result = connect(fd, address->ai_addr, address->ai_addrlen);
+      if (result != 0 && errno == EINPROGRESS) {
+        result = waitForConnect(fd, cancel) ? 0 : -1;
+      }
+      if (result == 0) {
+        fcntl(fd, F_SETFL, flags);
+        break;
+      }
+      ::close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(addresses);
+    timing.connectMs = millisecondsSince(started);
+
+    if (fd >= 0) {
+      timeval timeout{60, 0};
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+  }
+
+  static bool sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      ssize_t result = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        return false;
+      }
+      sent += (size_t)result;
+    }
+    return true;
+  }
+
+public:
+  explicit SocketHttpTransport(size_t bufferSize = 1 << 16) : bufferSize(bufferSize) {}
+
+  ~SocketHttpTransport() override {
+    for (auto &entry : idle) {
+      for (int fd : entry.second) {
+        ::close(fd);
+      }
+    }
+  }
+
+  void setBufferSize(size_t size) { bufferSize = size; }
+
+  void release(const std::string &key, int fd) {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    idle[key].push_back(fd);
+  }
+
+  std::unique_ptr<HttpResponse> get(const std::string &url, const HttpHeaders &headers,
+                                    HttpCancellation *cancel = nullptr) override {
+    ParsedUrl parsed;
+    if (!parseUrl(url, parsed)) {
+      return nullptr;
+    }
+    if (parsed.scheme != "http") {
+      std::cerr << "Error: Only plain http:// URLs are supported on this platform: " << url << std::endl;
+      return nullptr;
+    }
+
+    std::string key = parsed.host + ":" + std::to_string(parsed.port);
+    std::string request = "GET " + parsed.path + " HTTP/1.1\r\nHost: " + parsed.host;
+    if (parsed.port != 80) {
+      request += ":" + std::to_string(parsed.port);
+    }
+    request += "\r\nUser-Agent: FontDownloader\r\nConnection: keep-alive\r\n";
+    for (const auto &header : headers) {
+      request += header.first + ": " + header.second + "\r\n";
+    }
+    request += "\r\n";
+
+    // A pooled connection may have been closed by the server while idle, so a
+    // failure on a reused socket is retried once on a fresh connection.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      if (cancel && cancel->isCancelled()) {
+        return nullptr;
+      }
+      int fd = -1;
+      bool reused = false;
+      HttpTiming timing;
+      {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        std::vector<int> &pool = idle[key];
+        if (!pool.empty()) {
+          fd = pool.back();
+          pool.pop_back();
+          reused = true;
+        }
+      }
+      timing.reusedConnection = reused;
+      if (fd < 0) {
+        fd = connectTo(parsed.host, parsed.port, cancel, timing);
+        if (fd < 0) {
+          return nullptr;
+        }
+      }
+      if (cancel && !cancel->arm([fd] { shutdown(fd, SHUT_RDWR); })) {
+        ::close(fd);
+        return nullptr;
+      }
+
+      auto response = std::make_unique<SocketResponse>(*this, key, fd, bufferSize);
+      auto sending = std::chrono::steady_clock::now();
+      bool ok = sendAll(fd, request) && response->readHead(false);
+      timing.firstByteMs = millisecondsSince(sending);
+      response->setTiming(timing);
+      if (cancel && cancel->disarm()) {
+        ::close(response->release());
+        return nullptr;
+      }
+      if (ok) {
+        return response;
+      }
+      if (!reused) {
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+};
+
+SocketResponse::~SocketResponse() {
+  if (fd < 0) {
+    return;
+  }
+  if (reusable()) {
+    owner.release(poolKey, release());
+  } else {
+    ::close(fd);
+  }
+}
+#endif
+
+std::unique_ptr<HttpTransport> createHttpTransport() {
+#ifdef _WIN32
+  return std::make_unique<WinInetTransport>();
+#else
+  return std::make_unique<SocketHttpTransport>();
+#endif
+}
+
+// Recent time-to-first-byte and throughput samples for each configured
+// mirror. The file is shared between runs so the fastest mirror is asked first.
+class MirrorHistory {
+private:
+  static const size_t MAX_SAMPLES = 16;
+
+  std::string path;
+  json data = json::object();
+  bool dirty = false;
+
+  static double percentile(std::vector<double> samples, double fraction) {
+    std::sort(samples.begin(), samples.end());
+    return samples[(size_t)(fraction * (samples.size() - 1) + 0.5)];
+  }
+
+  std::vector<double> samples(const std::string &mirror, const char *kind) const {
+    std::vector<double> values;
+    if (data.contains(mirror) && data[mirror].contains(kind)) {
+      for (const auto &value : data[mirror][kind]) {
+        values.push_back(value.get<double>());
+      }
+    }
+    return values;
+  }
+
+  void record(const std::string &mirror, const char *kind, double value) {
+    json &list = data[mirror][kind];
+    list.push_back(value);
+    if (list.size() > MAX_SAMPLES) {
+      list.erase(list.begin());
+    }
+    dirty = true;
+  }
+
+public:
+  void open(const std::string &historyPath) {
+    path = historyPath;
+    data = json::object();
+    std::ifstream file(path);
+    if (file) {
+      try {
+        file >> data;
+      } catch (...) {
+      }
+    }
+    if (!data.is_object()) {
+      data = json::object();
+    }
+  }
+
+  void recordLatency(const std::string &mirror, double milliseconds) { record(mirror, "ttfbMs", milliseconds); }
+
+  void recordThroughput(const std::string &mirror, double bytesPerSecond) {
+    record(mirror, "bytesPerSec", bytesPerSecond);
+  }
+
+  // Expected milliseconds to fetch the given number of bytes. Mirrors without
+  // history score zero, so a newly added mirror gets tried.
+  double estimate(const std::string &mirror, int64_t bytes) const {
+    std::vector<double> latency = samples(mirror, "ttfbMs");
+    if (latency.empty()) {
+      return 0;
+    }
+    double milliseconds = percentile(latency, 0.5);
+    std::vector<double> throughput = samples(mirror, "bytesPerSec");
+    if (!throughput.empty() && bytes > 0) {
+      milliseconds += bytes / percentile(throughput, 0.5) * 1000;
+    }
+    return milliseconds;
+  }
+
+  // A request is hedged once it has waited longer than 95% of the mirror's
+  // recent responses took to start.
+  std::chrono::milliseconds hedgeDelay(const std::string &mirror) const {
+    std::vector<double> latency = samples(mirror, "ttfbMs");
+    if (latency.size() < 4) {
+      return std::chrono::milliseconds(750);
+    }
+    return std::chrono::milliseconds(std::max<int64_t>(20, (int64_t)percentile(latency, 0.95)));
+  }
+
+  void save() {
+    if (!dirty || path.empty()) {
+      return;
+    }
+    // Parallel upgrade downloads each save their own copy, so the temporary
+    // name must not collide.
+    std::string tempPath = path + ".tmp" + std::to_string(std::random_device()());
+    std::ofstream file(tempPath, std::ios::trunc);
+    file << data.dump();
+    file.close();
+    std::error_code ec;
+    if (file) {
+      std::filesystem::rename(tempPath, path, ec);
+    } else {
+      std::filesystem::remove(tempPath, ec);
+    }
+    dirty = false;
+  }
+};
+
+// One logical transfer, which may take several requests: retries of an
+// interrupted download, or the range requests for part of a zip.
+struct TransferMetrics {
+  std::string url;
+  // Where the bytes actually came from, after mirror rewrites.
+  std::string source;
+  std::string mirror;
+  bool completed = false;
+  int requests = 0;
+  int retries = 0;
+  uint64_t bytes = 0;
+  // Bytes an interrupted earlier run had already saved.
+  uint64_t resumedFrom = 0;
+  HttpTiming firstRequest;
+  double totalMs = 0;
+  double averageBytesPerSecond = 0;
+  double peakBytesPerSecond = 0;
+
+  json toJson() const {
+    auto milliseconds = [](double value) {
+      return value < 0 ? json(nullptr) : json(std::round(value * 10) / 10);
+    };
+    return {{"url", url},
+            {"source", source},
+            {"mirror", mirror},
+            {"completed", completed},
+            {"requests", requests},
+            {"retries", retries},
+            {"bytes", bytes},
+            {"resumedFrom", resumedFrom},
+            {"dnsMs", milliseconds(firstRequest.dnsMs)},
+            {"connectMs", milliseconds(firstRequest.connectMs)},
+            {"tlsMs", milliseconds(firstRequest.tlsMs)},
+            {"firstByteMs", milliseconds(firstRequest.firstByteMs)},
+            {"reusedConnection", firstRequest.reusedConnection},
+            {"totalMs", milliseconds(totalMs)},
+            {"averageBytesPerSecond", (uint64_t)std::round(averageBytesPerSecond)},
+            {"peakBytesPerSecond", (uint64_t)std::round(peakBytesPerSecond)}};
+  }
+};
+
+// Measures a transfer as its bytes arrive and, when enabled, keeps a progress
+// line on the terminal up to date. The peak rate is the best over any
+// half-second window.
+class TransferMeter {
+private:
+  using Clock = std::chrono::steady_clock;
+  static constexpr double WINDOW_SECONDS = 0.5;
+
+  TransferMetrics current;
+  std::string label;
+  int64_t expectedBytes = -1;
+  Clock::time_point started;
+  Clock::time_point windowStarted;
+  Clock::time_point lastDrawn;
+  uint64_t windowBytes = 0;
+  double recentRate = 0;
+  bool progress = false;
+  size_t drawnWidth = 0;
+
+  void draw(Clock::time_point now) {
+    double seconds = std::chrono::duration<double>(now - started).count();
+    uint64_t done = current.resumedFrom + current.bytes;
+    std::ostringstream line;
+    line << "  " << label << "  " << formatSize(done);
+    if (expectedBytes > 0) {
+      line << " of " << formatSize((uint64_t)expectedBytes) << "  " << std::min<uint64_t>(100, done * 100 / expectedBytes)
+           << "%";
+    }
+    double rate = recentRate > 0 ? recentRate : current.bytes / std::max(seconds, 0.001);
+    line << "  " << formatSize((uint64_t)rate) << "/s";
+    if (expectedBytes > 0 && (uint64_t)expectedBytes > done && current.bytes > 0) {
+      line << "  " << (int)std::ceil(((uint64_t)expectedBytes - done) / (current.bytes / seconds)) << "s left";
+    }
+    std::string text = line.str();
+    size_t width = text.size();
+    text.resize(std::max(width, drawnWidth), ' ');
+    std::cout << '\r' << text << std::flush;
+    drawnWidth = width;
+    lastDrawn = now;
+  }
+
+public:
+  static bool terminalOutput() {
+#ifdef _WIN32
+    return _isatty(_fileno(stdout)) != 0;
+#else
+    return isatty(fileno(stdout)) != 0;
+#endif
+  }
+
+  void setProgress(bool enabled) { progress = enabled; }
+
+  void begin(const std::string &url) {
+    current = TransferMetrics();
+    current.url = url;
+    label = url.substr(url.find_last_of("/\\") + 1);
+    expectedBytes = -1;
+    started = windowStarted = lastDrawn = Clock::now();
+    windowBytes = 0;
+    recentRate = 0;
+  }
+
+  // Records which request is serving the transfer; the first one's phase
+  // timings stand for the whole transfer.
+  void request(const HttpResponse &response, const std::string &source, const std::string &mirror) {
+    if (current.requests++ == 0) {
+      current.firstRequest = response.timing();
+    }
+    current.source = source;
+    current.mirror = mirror;
+  }
+
+  void localSource(const std::string &source, const std::string &mirror) {
+    current.source = source;
+    current.mirror = mirror;
+  }
+
+  void retry() { current.retries++; }
+  void resumeAt(uint64_t offset) { current.resumedFrom = offset; }
+  // The size of the whole file, counting any resumed part; -1 when unknown.
+  void expect(int64_t bytes) { expectedBytes = bytes; }
+
+  void add(size_t bytes) {
+    current.bytes += bytes;
+    windowBytes += bytes;
+    Clock::time_point now = Clock::now();
+    double windowSeconds = std::chrono::duration<double>(now - windowStarted).count();
+    if (windowSeconds >= WINDOW_SECONDS) {
+      recentRate = windowBytes / windowSeconds;
+      current.peakBytesPerSecond = std::max(current.peakBytesPerSecond, recentRate);
+      windowStarted = now;
+      windowBytes = 0;
+    }
+    // Short transfers finish before a line would be worth drawing.
+    if (progress && now - lastDrawn >= std::chrono::milliseconds(100) &&
+        now - started >= std::chrono::milliseconds(300)) {
+      draw(now);
+    }
+  }
+
+  void finish(bool completed) {
+    current.completed = completed;
+    current.totalMs = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+    if (current.totalMs > 0) {
+      current.averageBytesPerSecond = current.bytes / (current.totalMs / 1000);
+    }
+    current.peakBytesPerSecond = std::max(current.peakBytesPerSecond, current.averageBytesPerSecond);
+    if (drawnWidth > 0) {
+      std::cout << '\r' << std::string(drawnWidth, ' ') << '\r' << std::flush;
+      drawnWidth = 0;
+    }
+  }
+
+  const TransferMetrics &metrics() const { return current; }
+};
+
+// Caps the combined rate of every download that draws from it. The token
+// bucket is kept as one "paid until" time: each chunk received moves it on
+// by the chunk's transmission time at the limit, and the receiver sleeps
+// until that time has come. Idle time refills the bucket up to BURST_NS.
+// Being a single atomic word, the bucket lives in shared memory, so every
+// wta process on the machine with the same limit takes from the same one;
+// steady_clock is system-wide on both platforms.
+class RateLimiter {
+private:
+  static constexpr int64_t BURST_NS = 125000000;
+  static_assert(std::atomic<int64_t>::is_always_lock_free, "the bucket must work in shared memory");
+
+  uint64_t bytesPerSecond;
+  std::atomic<int64_t> localBucket{0};
+  std::atomic<int64_t> *bucket = &localBucket;
+  void *view = nullptr;
+#ifdef _WIN32
+  HANDLE hMapping = NULL;
+#endif
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+public:
+  explicit RateLimiter(uint64_t bytesPerSecond) : bytesPerSecond(std::max<uint64_t>(bytesPerSecond, 1)) {
+    std::string name = "wta-rate-" + std::to_string(this->bytesPerSecond);
+#ifdef _WIN32
+    // Global\ spans the sessions of all logged-on users, but creating it
+    // needs a privilege that ordinary users lack.
+    for (const char *scope : {"Global\\", "Local\\"}) {
+      hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(int64_t),
+                                    (scope + name).c_str());
+      if (hMapping) {
+        view = MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(int64_t));
+        break;
+      }
+    }
+#else
+    int fd = shm_open(("/" + name).c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd >= 0) {
+      // Other users' processes share the bucket too, whatever the umask.
+      fchmod(fd, 0666);
+      struct stat info;
+      if (fstat(fd, &info) == 0 &&
+          (info.st_size >= (off_t)sizeof(int64_t) || ftruncate(fd, sizeof(int64_t)) == 0)) {
+        void *mapped = mmap(nullptr, sizeof(int64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) {
+          view = mapped;
+        }
+      }
+      ::close(fd);
+    }
+#endif
+    if (view) {
+      bucket = reinterpret_cast<std::atomic<int64_t> *>(view);
+    }
+  }
+
+  RateLimiter(const RateLimiter &) = delete;
+  RateLimiter &operator=(const RateLimiter &) = delete;
+
+  ~RateLimiter() {
+#ifdef _WIN32
+    if (view) {
+      UnmapViewOfFile(view);
+    }
+    if (hMapping) {
+      CloseHandle(hMapping);
+    }
+#else
+    if (view) {
+      munmap(view, sizeof(int64_t));
+    }
+#endif
+  }
+
+  // False when the bucket could not be shared and only limits this process.
+  bool shared() const { return view != nullptr; }
+
+  // Reads are capped to an eighth of a second at the limit, so the line sees
+  // a steady flow rather than buffer-sized bursts.
+  size_t chunkSize(size_t bufferSize) const {
+    return std::min<size_t>(bufferSize, std::max<uint64_t>(bytesPerSecond / 8, 4096));
+  }
+
+  // Takes `bytes` from the bucket, sleeping while it is in debt. Any user can
+  // write the shared bucket, so debt beyond a burst and this read is treated
+  // as corrupt and forgiven, and no single sleep is longer than that either.
+  void acquire(size_t bytes) {
+    int64_t cost = (int64_t)(bytes * 1e9 / bytesPerSecond);
+    int64_t start = now();
+    int64_t maxDebt = BURST_NS + cost;
+    int64_t paid = bucket->load();
+    int64_t next;
+    do {
+      next = (paid > start + maxDebt ? start : std::max(paid, start - BURST_NS)) + cost;
+    } while (!bucket->compare_exchange_weak(paid, next));
+    if (next > start) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(next - start, maxDebt)));
+    }
+  }
+};
+
+class FileDownloader {
+private:
+  static const int MAX_ATTEMPTS = 5;
+  static const uint64_t JOURNAL_INTERVAL = 1 << 20;
+  // The metrics log is rotated once it grows past this.
+  static const uint64_t METRICS_LOG_LIMIT = 8 << 20;
+  // Enough to hold the end of central directory record with the longest
+  // possible comment, plus the zip64 locator and record before it.
+  static const uint64_t ZIP_TAIL_SIZE = 22 + 0xFFFF + 20 + 56;
+  // Entries closer together than this are fetched with one request; a round
+  // trip costs more than the bytes in between.
+  static const uint64_t RANGE_MERGE_GAP = 128 * 1024;
+  // Latency recorded for a mirror that failed, so it sorts behind working ones.
+  static constexpr double FAILED_LATENCY_MS = 30000.0;
+
+  enum class TransferStatus { Complete, Interrupted, Failed };
+
+  struct MirrorChoice {
+    std::string url;
+    std::string mirror;
+  };
+
+  std::unique_ptr<HttpTransport> transport;
+  size_t bufferSize = 256 * 1024;
+  std::vector<std::pair<std::string, std::vector<std::string>>> rewrites;
+  MirrorHistory history;
+  Sha256 hasher;
+  TransferMeter meter;
+  std::string metricsLogPath;
+  RateLimiter *limiter = nullptr;
+
+public:
+  // Where a download actually came from. mirror is the configured mirror
+  // prefix and is empty when no rewrite rule applied.
+  struct SourceReport {
+    std::string mirror;
+    std::string url;
+    std::string hedgedAgainst;
+    // What unchanged() compares against later: the response's ETag or
+    // Last-Modified, or the size and time of a local file. Empty if unknown.
+    std::string validator;
+  };
+
+  struct RangeFetch {
+    uint64_t archiveSize = 0;
+    uint64_t bytesFetched = 0;
+    int requests = 0;
+    // Why the whole archive has to be downloaded instead; empty when the
+    // entries were fetched or ranges were not worth trying.
+    std::string fallbackReason;
+  };
+
+  FileDownloader() : transport(createHttpTransport()) {}
+
+  // Each rule replaces a URL prefix with one or more mirror prefixes, which
+  // may be other servers, file:// URLs or directories. The longest matching
+  // prefix wins.
+  void setUrlRewrites(std::vector<std::pair<std::string, std::vector<std::string>>> rules) {
+    std::stable_sort(rules.begin(), rules.end(), [](const auto &a, const auto &b) {
+      return a.first.size() > b.first.size();
+    });
+    rewrites = std::move(rules);
+  }
+
+  void setMirrorHistoryPath(const std::string &path) { history.open(path); }
+
+  std::string resolve(const std::string &url) const { return candidates(url).front().url; }
+
+  const SourceReport &lastSource() const { return report; }
+
+  // Measurements of the last download, stream or range fetch. A stream's are
+  // final once it has been destroyed.
+  const TransferMetrics &lastMetrics() const { return meter.metrics(); }
+
+  void setProgress(bool enabled) { meter.setProgress(enabled); }
+
+  // Shared by every downloader in the process; nullptr for no limit.
+  void setRateLimiter(RateLimiter *rateLimiter) { limiter = rateLimiter; }
+
+  // Every transfer is appended to this file as one JSON line; empty disables it.
+  void setMetricsLog(const std::string &path) { metricsLogPath = path; }
+
+  // Size of the chunks moved from the connection to disk; larger buffers mean
+  // fewer writes and journal checks per megabyte.
+  void setBufferSize(size_t size) {
+    bufferSize = std::max<size_t>(size, 4096);
+#ifndef _WIN32
+    static_cast<SocketHttpTransport *>(transport.get())->setBufferSize(bufferSize);
+#endif
+  }
+
+  bool downloadFile(const std::string &url, const std::string &filePath,
+                    const ExpectedContent &expected = ExpectedContent()) {
+    meter.begin(url);
+    bool downloaded = fetchFile(url, filePath, expected);
+    finishTransfer(downloaded);
+    return downloaded;
+  }
+
+  std::string lastDigest() const { return hasher.hexDigest(); }
+
+  // headers are sent to whichever mirror is asked; the body is passed on as
+  // received, so a caller that sends Accept-Encoding decodes it itself.
+  std::unique_ptr<ByteSource> openStream(const std::string &url, const HttpHeaders &headers = HttpHeaders()) {
+    meter.begin(url);
+    std::unique_ptr<ByteSource> source = openSource(url, headers);
+    if (!source) {
+      finishTransfer(false);
+      return nullptr;
+    }
+    return std::make_unique<MeteredSource>(*this, std::move(source));
+  }
+
+  // Whether the file a download came from (SourceReport::url) is still the
+  // one described by validator: a conditional request for servers, a size and
+  // time check for local files. Uses only the shared transport, so it is safe
+  // to call from several threads.
+  bool unchanged(const std::string &url, const std::string &validator) {
+    if (validator.empty()) {
+      return false;
+    }
+    std::string sourcePath;
+    if (localSourcePath(url, sourcePath)) {
+      return localValidator(sourcePath) == validator;
+    }
+    HttpHeaders headers;
+    bool etag = validator[0] == '"' || validator.compare(0, 2, "W/") == 0;
+    headers.emplace_back(etag ? "If-None-Match" : "If-Modified-Since", validator);
+    std::unique_ptr<HttpResponse> response = transport->get(url, headers);
+    return response && response->status() == 304;
+  }
+
+  // Size of the archive behind a URL without downloading it: local mirrors
+  // are stat'ed and remote ones asked for a single byte. -1 when unknown.
+  int64_t remoteSize(const std::string &url) {
+    std::vector<MirrorChoice> remote;
+    for (const MirrorChoice &choice : candidates(url)) {
+      std::string sourcePath;
+      if (!localSourcePath(choice.url, sourcePath)) {
+        remote.push_back(choice);
+        continue;
+      }
+      std::error_code ec;
+      uint64_t size = std::filesystem::file_size(sourcePath, ec);
+      if (!ec) {
+        return (int64_t)size;
+      }
+    }
+    if (remote.empty()) {
+      return -1;
+    }
+
+    HttpHeaders headers;
+    headers.emplace_back("Range", "bytes=0-0");
+    std::unique_ptr<HttpResponse> response = fetch(remote, headers, -1);
+    history.save();
+    if (!response) {
+      return -1;
+    }
+    std::string total;
+    if (response->status() == 206) {
+      std::string range = response->header("Content-Range");
+      size_t slash = range.find('/');
+      total = slash == std::string::npos ? "" : range.substr(slash + 1);
+      uint8_t byte;
+      response->read(&byte, 1);
+    } else if (response->status() == 200) {
+      total = response->header("Content-Length");
+    }
+    return parseLength(total);
+  }
+
+  // Fetches the parts of a remote zip that an install needs with HTTP Range
+  // requests: the end of the archive, its central directory, and then the
+  // entries `select` picks from it, which are added to `archive` as
+  // segments. Returns false when the archive should be downloaded whole:
+  // it is on a local mirror, the server ignores Range, the catalog pins a
+  // SHA-256 that only the whole file can be checked against, or the
+  // selected entries make up most of the archive anyway.
+  bool fetchZipEntries(const std::string &url, const ExpectedContent &expected, ZipArchive &archive,
+                       const std::function<std::vector<const ZipEntry *>(const ZipArchive &)> &select,
+                       RangeFetch &result) {
+    meter.begin(url);
+    bool fetched = fetchZipRanges(url, expected, archive, select, result);
+    finishTransfer(fetched);
+    return fetched;
+  }
+
+private:
+  SourceReport report;
+
+  bool fetchZipRanges(const std::string &url, const ExpectedContent &expected, ZipArchive &archive,
+                      const std::function<std::vector<const ZipEntry *>(const ZipArchive &)> &select,
+                      RangeFetch &result) {
+    result = RangeFetch();
+    report = SourceReport();
+    std::vector<MirrorChoice> remote;
+    for (const MirrorChoice &choice : candidates(url)) {
+      std::string sourcePath;
+      if (localSourcePath(choice.url, sourcePath)) {
+        return false;
+      }
+      remote.push_back(choice);
+    }
+    if (!expected.sha256.empty()) {
+      result.fallbackReason = "the catalog pins the archive's SHA-256";
+      return false;
+    }
+
+    HttpHeaders headers;
+    headers.emplace_back("Range", "bytes=-" + std::to_string(ZIP_TAIL_SIZE));
+    std::unique_ptr<HttpResponse> response = fetch(remote, headers, -1);
+    history.save();
+    result.requests++;
+    if (response) {
+      meter.request(*response, report.url, report.mirror);
+    }
+    uint64_t first = 0;
+    uint64_t last = 0;
+    if (!response || response->status() != 206 ||
+        !parseContentRange(response->header("Content-Range"), first, last, result.archiveSize)) {
+      result.fallbackReason = "the server does not support range requests";
+      return false;
+    }
+    if (expected.size >= 0 && result.archiveSize != (uint64_t)expected.size) {
+      result.fallbackReason = "the archive size does not match the catalog";
+      return false;
+    }
+    // Later requests must hit the same mirror and the same version of the
+    // archive; If-Range turns a changed archive into a plain 200 response.
+    std::string validator = response->header("ETag");
+    if (validator.empty()) {
+      validator = response->header("Last-Modified");
+    }
+    std::vector<uint8_t> tail;
+    if (!readBody(*response, last - first + 1, tail, result)) {
+      result.fallbackReason = "the connection failed";
+      return false;
+    }
+    response.reset();
+
+    ZipArchive::DirectoryLocation location;
+    std::string error;
+    if (!ZipArchive::locateDirectory(tail.data(), tail.size(), result.archiveSize, location, error)) {
+      result.fallbackReason = "its central directory could not be read (" + error + ")";
+      return false;
+    }
+    if (location.offset >= first || location.size == 0) {
+      const uint8_t *directory = location.size == 0 ? tail.data() : tail.data() + (location.offset - first);
+      if (!archive.readDirectory(directory, (size_t)location.size, location.entryCount)) {
+        result.fallbackReason = "its central directory could not be read (" + archive.error() + ")";
+        return false;
+      }
+    } else {
+      // Only the part of the directory before the tail is still missing.
+      std::vector<uint8_t> directory;
+      uint64_t missing = std::min(location.size, first - location.offset);
+      bool fetched = fetchRange(validator, location.offset, missing, directory, result);
+      directory.insert(directory.end(), tail.begin(), tail.begin() + (size_t)(location.size - missing));
+      if (!fetched ||
+          !archive.readDirectory(directory.data(), directory.size(), location.entryCount)) {
+        result.fallbackReason = "its central directory could not be read" +
+                                (archive.error().empty() ? std::string() : " (" + archive.error() + ")");
+        return false;
+      }
+    }
+
+    // An entry runs from its local header to the next one, which also covers
+    // its data descriptor.
+    std::vector<uint64_t> boundaries;
+    for (const ZipEntry &entry : archive.entries()) {
+      boundaries.push_back(entry.localHeaderOffset);
+    }
+    boundaries.push_back(location.offset);
+    std::sort(boundaries.begin(), boundaries.end());
+
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (const ZipEntry *entry : select(archive)) {
+      auto next = std::upper_bound(boundaries.begin(), boundaries.end(), entry->localHeaderOffset);
+      if (next == boundaries.end()) {
+        result.fallbackReason = entry->name + ": invalid local header offset";
+        return false;
+      }
+      ranges.emplace_back(entry->localHeaderOffset, *next);
+    }
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<std::pair<uint64_t, uint64_t>> merged;
+    uint64_t needed = 0;
+    for (const auto &range : ranges) {
+      if (!merged.empty() && range.first <= merged.back().second + RANGE_MERGE_GAP) {
+        merged.back().second = std::max(merged.back().second, range.second);
+      } else {
+        merged.push_back(range);
+      }
+    }
+    for (const auto &range : merged) {
+      needed += range.second - range.first;
+    }
+    if (needed > result.archiveSize / 2) {
+      result.fallbackReason = "the selected files make up most of the archive";
+      return false;
+    }
+    meter.expect((int64_t)(result.bytesFetched + needed));
+
+    for (const auto &range : merged) {
+      std::vector<uint8_t> data;
+      if (!fetchRange(validator, range.first, range.second - range.first, data, result)) {
+        result.fallbackReason = "a range request failed";
+        return false;
+      }
+      archive.addSegment(range.first, std::move(data));
+    }
+    return true;
+  }
+
+  // The archive is hashed as it is received; a resumed transfer picks the hash
+  // state up from the journal, so the file is never read back for verification.
+  bool fetchFile(const std::string &url, const std::string &filePath, const ExpectedContent &expected) {
+    report = SourceReport();
+    std::vector<MirrorChoice> remote;
+    for (const MirrorChoice &choice : candidates(url)) {
+      std::string sourcePath;
+      if (!localSourcePath(choice.url, sourcePath)) {
+        remote.push_back(choice);
+      } else if (copyLocalFile(sourcePath, filePath, expected)) {
+        report.mirror = choice.mirror;
+        report.url = choice.url;
+        report.validator = localValidator(sourcePath);
+        meter.localSource(choice.url, choice.mirror);
+        return true;
+      }
+    }
+    if (remote.empty()) {
+      return false;
+    }
+
+    std::string partPath = filePath + ".part";
+    std::string journalPath = filePath + ".journal";
+    json journal = loadJournal(journalPath, partPath, url);
+
+    TransferStatus status = TransferStatus::Interrupted;
+    for (int attempt = 0; attempt < MAX_ATTEMPTS && status == TransferStatus::Interrupted; ++attempt) {
+      if (attempt > 0) {
+        meter.retry();
+      }
+      if (attempt > 0 || completedBytes(journal) > 0) {
+        std::cout << "Resuming download at byte " << completedBytes(journal) << "..." << std::endl;
+      }
+      status = transfer(remote, expected.size, partPath, journalPath, journal);
+    }
+    history.save();
+
+    if (status != TransferStatus::Complete) {
+      if (status == TransferStatus::Interrupted) {
+        std::cerr << "Error: Download interrupted. Run the command again to resume." << std::endl;
+      }
+      return false;
+    }
+
+    std::error_code ec;
+    uint64_t actualSize = std::filesystem::file_size(partPath, ec);
+    int64_t expectedSize = journal.value("totalSize", (int64_t)-1);
+    if (ec || (expectedSize >= 0 && actualSize != (uint64_t)expectedSize)) {
+      std::cerr << "Error: Downloaded file size does not match the size reported by the server." << std::endl;
+      std::filesystem::remove(partPath, ec);
+      std::filesystem::remove(journalPath, ec);
+      return false;
+    }
+
+    if (hasher.bytesHashed() != actualSize || !verifyContent(expected, hasher)) {
+      std::filesystem::remove(partPath, ec);
+      std::filesystem::remove(journalPath, ec);
+      return false;
+    }
+
+    std::filesystem::rename(partPath, filePath, ec);
+    if (ec) {
+      std::cerr << "Error: Could not move completed download to " << filePath << std::endl;
+      return false;
+    }
+    std::filesystem::remove(journalPath, ec);
+    report.validator = journal.value("validator", "");
+    return true;
+  }
+
+  std::unique_ptr<ByteSource> openSource(const std::string &url, const HttpHeaders &headers) {
+    report = SourceReport();
+    std::vector<MirrorChoice> remote;
+    for (const MirrorChoice &choice : candidates(url)) {
+      std::string sourcePath;
+      if (!localSourcePath(choice.url, sourcePath)) {
+        remote.push_back(choice);
+        continue;
+      }
+      auto source = std::make_unique<MappedFileSource>();
+      if (source->open(sourcePath)) {
+        report.mirror = choice.mirror;
+        report.url = choice.url;
+        report.validator = localValidator(sourcePath);
+        meter.localSource(choice.url, choice.mirror);
+        std::error_code ec;
+        meter.expect((int64_t)std::filesystem::file_size(sourcePath, ec));
+        return source;
+      }
+      std::cerr << "Error: Could not open " << sourcePath << std::endl;
+    }
+    if (remote.empty()) {
+      return nullptr;
+    }
+
+    std::unique_ptr<HttpResponse> response = fetch(remote, headers, -1);
+    history.save();
+    if (!response) {
+      return nullptr;
+    }
+    meter.request(*response, report.url, report.mirror);
+    if (response->status() != 200) {
+      std::cerr << "Error: Server responded with HTTP status " << response->status() << "." << std::endl;
+      return nullptr;
+    }
+    report.validator = response->header("ETag");
+    if (report.validator.empty()) {
+      report.validator = response->header("Last-Modified");
+    }
+    std::string length = response->header("Content-Length");
+    meter.expect(parseLength(length));
+    return response;
+  }
+
+  // Feeds a stream's bytes to the meter; the transfer is logged when the
+  // caller is done with the stream.
+  class MeteredSource : public ByteSource {
+  private:
+    FileDownloader &owner;
+    std::unique_ptr<ByteSource> inner;
+    bool ended = false;
+
+  public:
+    MeteredSource(FileDownloader &owner, std::unique_ptr<ByteSource> inner) : owner(owner), inner(std::move(inner)) {}
+
+    ~MeteredSource() override {
+      HttpResponse *response = dynamic_cast<HttpResponse *>(inner.get());
+      owner.finishTransfer(ended && !(response && response->failed()));
+    }
+
+    size_t read(uint8_t *buffer, size_t size) override {
+      size_t bytesRead = inner->read(buffer, owner.chunkSize(size));
+      if (bytesRead == 0 && size > 0) {
+        ended = true;
+      }
+      owner.received(bytesRead);
+      return bytesRead;
+    }
+  };
+
+  size_t chunkSize(size_t size) const { return limiter ? limiter->chunkSize(size) : size; }
+
+  // Every byte from the network passes through here.
+  void received(size_t bytes) {
+    meter.add(bytes);
+    if (limiter && bytes > 0) {
+      limiter->acquire(bytes);
+    }
+  }
+
+  void finishTransfer(bool completed) {
+    meter.finish(completed);
+    const TransferMetrics &metrics = meter.metrics();
+    if (metricsLogPath.empty() || (metrics.requests == 0 && metrics.bytes == 0)) {
+      return;
+    }
+    json entry = metrics.toJson();
+    entry["time"] =
+        std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    entry["host"] = machineName();
+    // Rotated rather than trimmed, so concurrent writers only ever append.
+    std::error_code ec;
+    if (std::filesystem::file_size(metricsLogPath, ec) > METRICS_LOG_LIMIT && !ec) {
+      std::filesystem::rename(metricsLogPath, metricsLogPath + ".1", ec);
+    }
+    std::filesystem::create_directories(std::filesystem::path(metricsLogPath).parent_path(), ec);
+    std::ofstream log(metricsLogPath, std::ios::app);
+    log << entry.dump() + "\n" << std::flush;
+  }
+
+  static std::string machineName() {
+#ifdef _WIN32
+    const char *name = std::getenv("COMPUTERNAME");
+    return name ? name : "";
+#else
+    char name[256] = {};
+    return gethostname(name, sizeof(name) - 1) == 0 ? name : "";
+#endif
+  }
+
+  static std::string localValidator(const std::string &path) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec) {
+      return "";
+    }
+    auto modified = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+      return "";
+    }
+    return "local " + std::to_string(size) + " " + std::to_string(modified.time_since_epoch().count());
+  }
+
+  // A Content-Length or Content-Range total from the server; -1 when it is
+  // missing or malformed.
+  static int64_t parseLength(const std::string &text) {
+    try {
+      long long value = text.empty() || text == "*" ? -1 : std::stoll(text);
+      return value < 0 ? -1 : (int64_t)value;
+    } catch (...) {
+      return -1;
+    }
+  }
+
+  // Parses "bytes first-last/total".
+  static bool parseContentRange(const std::string &header, uint64_t &first, uint64_t &last, uint64_t &total) {
+    unsigned long long a = 0, b = 0, c = 0;
+    if (std::sscanf(header.c_str(), "bytes %llu-%llu/%llu", &a, &b, &c) != 3 || a > b || b >= c) {
+      return false;
+    }
+    first = a;
+    last = b;
+    total = c;
+    return true;
+  }
+
+  bool readBody(HttpResponse &response, uint64_t size, std::vector<uint8_t> &body, RangeFetch &result) {
+    body.resize((size_t)size);
+    size_t filled = 0;
+    while (filled < body.size()) {
+      size_t got = response.read(body.data() + filled, chunkSize(body.size() - filled));
+      if (got == 0) {
+        return false;
+      }
+      filled += got;
+      received(got);
+    }
+    result.bytesFetched += size;
+    return true;
+  }
+
+  // Requests one byte range from the mirror the tail came from.
+  bool fetchRange(const std::string &validator, uint64_t offset, uint64_t size, std::vector<uint8_t> &data,
+                  RangeFetch &result) {
+    HttpHeaders headers;
+    headers.emplace_back("Range", "bytes=" + std::to_string(offset) + "-" + std::to_string(offset + size - 1));
+    if (!validator.empty()) {
+      headers.emplace_back("If-Range", validator);
+    }
+    result.requests++;
+    std::unique_ptr<HttpResponse> response = transport->get(report.url, headers);
+    if (response) {
+      meter.request(*response, report.url, report.mirror);
+    }
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t total = 0;
+    return response && response->status() == 206 &&
+           parseContentRange(response->header("Content-Range"), first, last, total) && first == offset &&
+           last == offset + size - 1 && total == result.archiveSize && readBody(*response, size, data, result);
+  }
+
+  std::vector<MirrorChoice> candidates(const std::string &url) const {
+    for (const auto &rule : rewrites) {
+      if (url.compare(0, rule.first.size(), rule.first) != 0) {
+        continue;
+      }
+      std::vector<MirrorChoice> choices;
+      for (const std::string &mirror : rule.second) {
+        choices.push_back({mirror + url.substr(rule.first.size()), mirror});
+      }
+      if (!choices.empty()) {
+        return choices;
+      }
+    }
+    return {{url, ""}};
+  }
+
+  static bool usable(const std::unique_ptr<HttpResponse> &response) {
+    return response && (response->status() == 200 || response->status() == 206 || response->status() == 416);
+  }
+
+  // Asks the mirror with the best history first. If its response has not
+  // started by the hedge deadline, the runner-up is asked too and whichever
+  // answers first wins; the other request is cancelled. A mirror that fails
+  // outright is replaced by the next one straight away.
+  std::unique_ptr<HttpResponse> fetch(std::vector<MirrorChoice> choices, const HttpHeaders &headers,
+                                      int64_t expectedBytes) {
+    if (choices.size() == 1) {
+      report.mirror = choices[0].mirror;
+      report.url = choices[0].url;
+      auto started = std::chrono::steady_clock::now();
+      std::unique_ptr<HttpResponse> response = transport->get(choices[0].url, headers);
+      if (!report.mirror.empty()) {
+        double milliseconds =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        history.recordLatency(report.mirror, usable(response) ? milliseconds : FAILED_LATENCY_MS);
+      }
+      return response;
+    }
+
+    std::stable_sort(choices.begin(), choices.end(), [&](const MirrorChoice &a, const MirrorChoice &b) {
+      return history.estimate(a.mirror, expectedBytes) < history.estimate(b.mirror, expectedBytes);
+    });
+
+    struct Attempt {
+      MirrorChoice choice;
+      HttpCancellation cancel;
+      std::unique_ptr<HttpResponse> response;
+      std::chrono::steady_clock::time_point started;
+      std::chrono::steady_clock::time_point finishedAt;
+      bool finished = false;
+      std::thread worker;
+    };
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<std::unique_ptr<Attempt>> attempts;
+    size_t next = 0;
+
+    auto launch = [&] {
+      attempts.push_back(std::make_unique<Attempt>());
+      Attempt *attempt = attempts.back().get();
+      attempt->choice = choices[next++];
+      attempt->started = std::chrono::steady_clock::now();
+      attempt->worker = std::thread([&, attempt] {
+        std::unique_ptr<HttpResponse> response = transport->get(attempt->choice.url, headers, &attempt->cancel);
+        std::lock_guard<std::mutex> lock(mutex);
+        attempt->response = std::move(response);
+        attempt->finishedAt = std::chrono::steady_clock::now();
+        attempt->finished = true;
+        finished.notify_all();
+      });
+    };
+
+    Attempt *winner = nullptr;
+    bool hedged = false;
+    std::vector<double> latencies;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      launch();
+      auto deadline = attempts[0]->started + history.hedgeDelay(attempts[0]->choice.mirror);
+      while (true) {
+        bool running = false;
+        for (const auto &attempt : attempts) {
+          if (!attempt->finished) {
+            running = true;
+          } else if (usable(attempt->response)) {
+            winner = attempt.get();
+            break;
+          }
+        }
+        if (winner) {
+          break;
+        }
+        if (!running) {
+          if (next == choices.size()) {
+            break;
+          }
+          launch();
+        } else if (!hedged && next < choices.size()) {
+          if (finished.wait_until(lock, deadline) == std::cv_status::timeout) {
+            hedged = true;
+            launch();
+          }
+        } else {
+          finished.wait(lock);
+        }
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      for (const auto &attempt : attempts) {
+        if (!attempt->finished) {
+          // Lost the race: it took at least this long, which is all we know.
+          latencies.push_back(std::chrono::duration<double, std::milli>(now - attempt->started).count());
+        } else if (usable(attempt->response)) {
+          latencies.push_back(
+              std::chrono::duration<double, std::milli>(attempt->finishedAt - attempt->started).count());
+        } else {
+          latencies.push_back(FAILED_LATENCY_MS);
+        }
+      }
+    }
+
+    for (const auto &attempt : attempts) {
+      if (attempt.get() != winner) {
+        attempt->cancel.cancel();
+      }
+    }
+    for (size_t i = 0; i < attempts.size(); ++i) {
+      attempts[i]->worker.join();
+      history.recordLatency(attempts[i]->choice.mirror, latencies[i]);
+      if (hedged && attempts[i].get() != winner) {
+        report.hedgedAgainst = attempts[i]->choice.mirror;
+      }
+    }
+
+    if (!winner) {
+      // Report the last mirror's answer so the caller can show its status.
+      for (auto it = attempts.rbegin(); it != attempts.rend(); ++it) {
+        if ((*it)->response) {
+          report.mirror = (*it)->choice.mirror;
+          report.url = (*it)->choice.url;
+          return std::move((*it)->response);
+        }
+      }
+      return nullptr;
+    }
+    report.mirror = winner->choice.mirror;
+    report.url = winner->choice.url;
+    return std::move(winner->response);
+  }
+
+  // Mirrors on local disks or LAN shares are mapped rather than streamed; the
+  // digest is checked before anything is written.
+  bool copyLocalFile(const std::string &sourcePath, const std::string &filePath, const ExpectedContent &expected) {
+    MappedFile source;
+    if (!source.open(sourcePath)) {
+      std::cerr << "Error: Could not open " << sourcePath << std::endl;
+      return false;
+    }
+
+    hasher.reset();
+    if (source.size() > 0) {
+      hasher.update(source.data(), source.size());
+    }
+    if (!verifyContent(expected, hasher)) {
+      return false;
+    }
+
+    std::string partPath = filePath + ".part";
+    std::ofstream outFile(partPath, std::ios::binary | std::ios::trunc);
+    outFile.write(reinterpret_cast<const char *>(source.data()), (std::streamsize)source.size());
+    meter.add(source.size());
+    outFile.close();
+    std::error_code ec;
+    if (!outFile) {
+      std::cerr << "Error: Failed writing to " << partPath << std::endl;
+      std::filesystem::remove(partPath, ec);
+      return false;
+    }
+    std::filesystem::rename(partPath, filePath, ec);
+    if (ec) {
+      std::cerr << "Error: Could not move completed download to " << filePath << std::endl;
+      std::filesystem::remove(partPath, ec);
+      return false;
+    }
+    return true;
+  }
+
+  json loadJournal(const std::string &journalPath, const std::string &partPath, const std::string &url) {
+    json journal = {{"url", url}, {"validator", ""}, {"totalSize", -1}, {"ranges", json::array()}};
+    std::error_code ec;
+
+    std::ifstream file(journalPath);
+    if (file) {
+      try {
+        json stored;
+        file >> stored;
+        if (stored.is_object() && stored.value("url", "") == url && wellFormedJournal(stored)) {
+          journal = stored;
+        }
+      } catch (...) {
+      }
+    }
+
+    uint64_t partSize = std::filesystem::exists(partPath, ec) ? std::filesystem::file_size(partPath, ec) : 0;
+    uint64_t completed = std::min(completedBytes(journal), partSize);
+    if (partSize > completed) {
+      std::filesystem::resize_file(partPath, completed, ec);
+    }
+
+    hasher.reset();
+    if (completed > 0 && !(journal.contains("sha256State") && hasher.importState(journal["sha256State"]) &&
+                           hasher.bytesHashed() == completed)) {
+      hasher.reset();
+      std::ifstream partFile(partPath, std::ios::binary);
+      char buffer[1 << 16];
+      for (uint64_t left = completed; left > 0 && partFile;) {
+        partFile.read(buffer, (std::streamsize)std::min<uint64_t>(left, sizeof(buffer)));
+        hasher.update(reinterpret_cast<const uint8_t *>(buffer), (size_t)partFile.gcount());
+        left -= (uint64_t)partFile.gcount();
+      }
+    }
+    setCompleted(journal, completed);
+    return journal;
+  }
+
+  // Every field resumption reads must have the type it expects; a journal that
+  // does not is discarded like one for another URL.
+  static bool wellFormedJournal(const json &journal) {
+    if (!journal.contains("ranges") || !journal["ranges"].is_array()) {
+      return false;
+    }
+    for (const auto &range : journal["ranges"]) {
+      if (!range.is_array() || range.size() != 2 || !range[0].is_number_unsigned() || !range[1].is_number_unsigned()) {
+        return false;
+      }
+    }
+    return (!journal.contains("validator") || journal["validator"].is_string()) &&
+           (!journal.contains("totalSize") || journal["totalSize"].is_number_integer());
+  }
+
+  void saveJournal(const std::string &journalPath, const json &journal) {
+    std::ofstream file(journalPath, std::ios::trunc);
+    if (file) {
+      file << journal.dump();
+    }
+  }
+
+  // Completed ranges are kept as a list so out-of-order transfers can share the
+  // journal format; resumption only trusts the contiguous prefix from byte zero.
+  uint64_t completedBytes(const json &journal) {
+    uint64_t completed = 0;
+    for (const auto &range : journal["ranges"]) {
+      if (range.size() == 2 && range[0].get<uint64_t>() <= completed) {
+        completed = std::max(completed, range[1].get<uint64_t>());
+      }
+    }
+    return completed;
+  }
+
+  void setCompleted(json &journal, uint64_t completed) {
+    journal["ranges"] = json::array();
+    if (completed > 0) {
+      journal["ranges"].push_back({0, completed});
+    }
+    if (hasher.bytesHashed() == completed) {
+      journal["sha256State"] = hasher.exportState();
+    } else {
+      journal.erase("sha256State");
+    }
+  }
+
+  TransferStatus transfer(const std::vector<MirrorChoice> &choices, int64_t expectedBytes,
+                          const std::string &partPath, const std::string &journalPath, json &journal) {
+    uint64_t offset = completedBytes(journal);
+    HttpHeaders headers;
+    if (offset > 0) {
+      headers.emplace_back("Range", "bytes=" + std::to_string(offset) + "-");
+      std::string validator = journal.value("validator", "");
+      if (!validator.empty()) {
+        headers.emplace_back("If-Range", validator);
+      }
+    }
+
+    std::unique_ptr<HttpResponse> response = fetch(choices, headers, expectedBytes);
+    if (!response) {
+      return TransferStatus::Interrupted;
+    }
+    meter.request(*response, report.url, report.mirror);
+
+    int statusCode = response->status();
+    if (statusCode == 416 && journal.value("totalSize", (int64_t)-1) == (int64_t)offset) {
+      return TransferStatus::Complete;
+    }
+    if (statusCode == 416) {
+      hasher.reset();
+      setCompleted(journal, 0);
+      saveJournal(journalPath, journal);
+      return TransferStatus::Interrupted;
+    }
+    if (statusCode != 200 && statusCode != 206) {
+      std::cerr << "Error: Server responded with HTTP status " << statusCode << "." << std::endl;
+      return TransferStatus::Failed;
+    }
+
+    if (statusCode == 200) {
+      offset = 0;
+      hasher.reset();
+      std::string length = response->header("Content-Length");
+      journal["totalSize"] = parseLength(length);
+    } else {
+      // Bytes from anywhere but the end of the part file cannot be appended,
+      // so a range that starts elsewhere restarts the download from zero.
+      std::string range = response->header("Content-Range");
+      size_t slash = range.find('/');
+      unsigned long long first = 0, last = 0;
+      if (slash == std::string::npos || std::sscanf(range.c_str(), "bytes %llu-%llu/", &first, &last) != 2 ||
+          first > last || first != offset) {
+        hasher.reset();
+        setCompleted(journal, 0);
+        saveJournal(journalPath, journal);
+        return TransferStatus::Interrupted;
+      }
+      if (range.compare(slash + 1, std::string::npos, "*") != 0) {
+        journal["totalSize"] = parseLength(range.substr(slash + 1));
+      }
+    }
+
+    std::string validator = response->header("ETag");
+    if (validator.empty()) {
+      validator = response->header("Last-Modified");
+    }
+    journal["validator"] = validator;
+    setCompleted(journal, offset);
+    saveJournal(journalPath, journal);
+    if (meter.metrics().bytes == 0) {
+      meter.resumeAt(offset);
+    }
+    meter.expect(journal.value("totalSize", (int64_t)-1));
+
+    auto started = std::chrono::steady_clock::now();
+    TransferStatus status = receive(*response, partPath, journalPath, journal, offset);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    uint64_t received = completedBytes(journal) - offset;
+    if (!report.mirror.empty() && received >= (64 << 10) && seconds > 0) {
+      history.recordThroughput(report.mirror, received / seconds);
+    }
+    return status;
+  }
+
+  TransferStatus receive(HttpResponse &response, const std::string &partPath,
+                         const std::string &journalPath, json &journal, uint64_t offset) {
+    std::ofstream outFile(partPath, std::ios::binary | (offset > 0 ? std::ios::app : std::ios::trunc));
+    if (!outFile) {
+      std::cerr << "Error: Could not open " << partPath << " for writing." << std::endl;
+      return TransferStatus::Failed;
+    }
+
+    uint64_t completed = offset;
+    uint64_t lastSaved = offset;
+    std::vector<uint8_t> buffer(bufferSize);
+    size_t bytesRead;
+    while ((bytesRead = response.read(buffer.data(), chunkSize(buffer.size()))) > 0) {
+      if (!outFile.write(reinterpret_cast<const char *>(buffer.data()), (std::streamsize)bytesRead)) {
+        break;
+      }
+      hasher.update(buffer.data(), bytesRead);
+      received(bytesRead);
+      completed += bytesRead;
+      if (completed - lastSaved >= JOURNAL_INTERVAL) {
+        outFile.flush();
+        setCompleted(journal, completed);
+        saveJournal(journalPath, journal);
+        lastSaved = completed;
+      }
+    }
+
+    outFile.close();
+    setCompleted(journal, completed);
+    saveJournal(journalPath, journal);
+
+    if (!outFile) {
+      std::cerr << "Error: Failed writing to " << partPath << std::endl;
+      return TransferStatus::Failed;
+    }
+
+    int64_t totalSize = journal.value("totalSize", (int64_t)-1);
+    if (response.failed() || (totalSize >= 0 && completed < (uint64_t)totalSize)) {
+      return TransferStatus::Interrupted;
+    }
+    return TransferStatus::Complete;
+  }
+};
+
+// Parses sizes such as "500000", "512K", "2M" or "1.5G" (binary multiples).
+bool parseSize(const std::string &text, uint64_t &bytes) {
+  try {
+    size_t used = 0;
+    double value = std::stod(text, &used);
+    std::string suffix = text.substr(used);
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::toupper);
+    if (!suffix.empty() && suffix.back() == 'B') {
+      suffix.pop_back();
+    }
+    double multiplier = 1;
+    if (suffix == "K") {
+      multiplier = 1024.0;
+    } else if (suffix == "M") {
+      multiplier = 1024.0 * 1024;
+    } else if (suffix == "G") {
+      multiplier = 1024.0 * 1024 * 1024;
+    } else if (!suffix.empty()) {
+      return false;
+    }
+    if (value < 0) {
+      return false;
+    }
+    bytes = (uint64_t)(value * multiplier);
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
+// Machine-wide settings for WTA itself (not Windows Terminal). Read from
+// %ProgramData%\wta\config.json, /etc/wta/config.json, or $WTA_CONFIG.
+class WTAConfig {
+private:
+  json data = json::object();
+
+public:
+  WTAConfig() {
+    std::ifstream file(configPath());
+    if (file) {
+      try {
+        file >> data;
+      } catch (...) {
+        std::cerr << "Warning: Ignoring invalid WTA config file " << configPath() << std::endl;
+        data = json::object();
+      }
+    }
+  }
+
+  static std::string configPath() {
+    if (const char *path = std::getenv("WTA_CONFIG")) {
+      return path;
+    }
+#ifdef _WIN32
+    const char *programData = std::getenv("ProgramData");
+    return (std::filesystem::path(programData ? programData : "C:\\ProgramData") / "wta" / "config.json").string();
+#else
+    return "/etc/wta/config.json";
+#endif
+  }
+
+  std::string cacheDirectory() const {
+    if (data.contains("cacheDir") && data["cacheDir"].is_string()) {
+      return data["cacheDir"].get<std::string>();
+    }
+#ifdef _WIN32
+    const char *programData = std::getenv("ProgramData");
+    return (std::filesystem::path(programData ? programData : "C:\\ProgramData") / "wta" / "cache").string();
+#else
+    const char *cacheHome = std::getenv("XDG_CACHE_HOME");
+    const char *home = std::getenv("HOME");
+    if (cacheHome && *cacheHome) {
+      return (std::filesystem::path(cacheHome) / "wta").string();
+    }
+    return home ? (std::filesystem::path(home) / ".cache" / "wta").string() : "";
+#endif
+  }
+
+  uint64_t cacheMaxBytes() const {
+    uint64_t bytes = 2ull << 30;
+    if (data.contains("cacheMaxBytes")) {
+      const json &value = data["cacheMaxBytes"];
+      if (value.is_number_unsigned()) {
+        bytes = value.get<uint64_t>();
+      } else if (value.is_string() && !parseSize(value.get<std::string>(), bytes)) {
+        std::cerr << "Warning: Invalid cacheMaxBytes in WTA config, using 2G." << std::endl;
+        bytes = 2ull << 30;
+      }
+    }
+    return bytes;
+  }
+
+  uint64_t downloadBufferSize() const {
+    uint64_t bytes = 256 * 1024;
+    if (data.contains("downloadBufferSize")) {
+      const json &value = data["downloadBufferSize"];
+      if (value.is_number_unsigned()) {
+        bytes = value.get<uint64_t>();
+      } else if (value.is_string() && !parseSize(value.get<std::string>(), bytes)) {
+        std::cerr << "Warning: Invalid downloadBufferSize in WTA config, using 256K." << std::endl;
+        bytes = 256 * 1024;
+      }
+    }
+    return bytes;
+  }
+
+  // Seconds to wait for another process that is downloading the same archive.
+  int downloadWaitTimeout() const {
+    if (data.contains("downloadWaitTimeout") && data["downloadWaitTimeout"].is_number_unsigned()) {
+      return (int)std::min<uint64_t>(data["downloadWaitTimeout"].get<uint64_t>(), 24 * 3600);
+    }
+    return 600;
+  }
+
+  // Every download is appended to this file as a JSON line; "" turns it off.
+  std::string metricsLog() const {
+    if (data.contains("metricsLog") && data["metricsLog"].is_string()) {
+      return data["metricsLog"].get<std::string>();
+    }
+    std::string directory = cacheDirectory();
+    return directory.empty() ? "" : (std::filesystem::path(directory) / "transfer-metrics.jsonl").string();
+  }
+
+  // Catalog locations tried in order: URLs, file:// URLs or mirror directories.
+  std::vector<std::string> catalogSources() const {
+    std::vector<std::string> sources;
+    if (data.contains("catalogSources")) {
+      const json &value = data["catalogSources"];
+      if (value.is_string()) {
+        sources.push_back(value.get<std::string>());
+      } else if (value.is_array()) {
+        for (const auto &source : value) {
+          if (source.is_string()) {
+            sources.push_back(source.get<std::string>());
+          }
+        }
+      }
+    }
+    return sources;
+  }
+
+  // "mirrors" maps a URL prefix to one mirror prefix or a list of them.
+  std::vector<std::pair<std::string, std::vector<std::string>>> urlRewrites() const {
+    std::vector<std::pair<std::string, std::vector<std::string>>> rules;
+    if (data.contains("mirrors") && data["mirrors"].is_object()) {
+      for (const auto &rule : data["mirrors"].items()) {
+        std::vector<std::string> mirrors;
+        if (rule.value().is_string()) {
+          mirrors.push_back(rule.value().get<std::string>());
+        } else if (rule.value().is_array()) {
+          for (const auto &mirror : rule.value()) {
+            if (mirror.is_string()) {
+              mirrors.push_back(mirror.get<std::string>());
+            }
+          }
+        }
+        if (!mirrors.empty()) {
+          rules.emplace_back(rule.key(), mirrors);
+        }
+      }
+    }
+    return rules;
+  }
+
+  // Glyph set "wta font" requires by default: "nerd", "powerline" or a file.
+  std::string requiredGlyphs() const {
+    if (data.contains("requireGlyphs") && data["requireGlyphs"].is_string()) {
+      return data["requireGlyphs"].get<std::string>();
+    }
+    return "";
+  }
+
+  const json &raw() const { return data; }
+};
+
+class FileLock {
+private:
+#ifdef _WIN32
+  HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+  int fd = -1;
+#endif
+  bool busy = false;
+
+public:
+  // Without wait, gives up at once when another process holds the lock;
+  // contended() then tells that apart from a lock file that cannot be opened.
+  explicit FileLock(const std::string &path, bool wait = true) {
+#ifdef _WIN32
+    for (int attempt = 0; attempt < (wait ? 1200 : 1); ++attempt) {
+      handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+      if (handle == INVALID_HANDLE_VALUE && GetLastError() == ERROR_ACCESS_DENIED) {
+        // Created by another user; an unshared read-only handle locks it too.
+        handle = CreateFileA(path.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      }
+      if (handle != INVALID_HANDLE_VALUE) {
+        break;
+      }
+      // Only another holder is worth waiting for.
+      busy = GetLastError() == ERROR_SHARING_VIOLATION;
+      if (!busy) {
+        break;
+      }
+      if (wait) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+    }
+#else
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0 && errno == EACCES) {
+      // Created by another user; flock() works on a read-only descriptor too.
+      fd = ::open(path.c_str(), O_RDONLY);
+    }
+    if (fd >= 0 && flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+      busy = errno == EWOULDBLOCK;
+      ::close(fd);
+      fd = -1;
+    }
+#endif
+  }
+
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+  ~FileLock() {
+#ifdef _WIN32
+    if (handle != INVALID_HANDLE_VALUE) {
+      CloseHandle(handle);
+    }
+#else
+    if (fd >= 0) {
+      flock(fd, LOCK_UN);
+      ::close(fd);
+    }
+#endif
+  }
+
+  bool locked() const {
+#ifdef _WIN32
+    return handle != INVALID_HANDLE_VALUE;
+#else
+    return fd >= 0;
+#endif
+  }
+
+  bool contended() const { return busy; }
+};
+
+// Lets one process download an archive while every other process that wants
+// the same URL waits, then takes the result from the archive cache. The
+// leader holds locks/<hash>.lock, which the OS releases if it dies, and
+// rewrites a heartbeat file next to it every few seconds. A waiting process
+// takes over when the heartbeat goes stale, as with a leader hung on a dead
+// connection, or when it has waited longer than the configured timeout.
+class SingleFlight {
+private:
+  static const int HEARTBEAT_SECONDS = 2;
+  static const int STALE_SECONDS = 30;
+
+  std::unique_ptr<FileLock> lock;
+  std::string heartbeatPath;
+  bool waitedForOther = false;
+  std::thread heartbeat;
+  std::mutex mutex;
+  std::condition_variable stopped;
+  bool stopping = false;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Written to a private file and renamed into place, so readers never see a
+  // partial write and a file left by another user can still be replaced.
+  void beat() {
+    std::string tempPath = heartbeatPath + "." + std::to_string(std::random_device()());
+    {
+      std::ofstream file(tempPath, std::ios::trunc);
+      file << now() << std::endl;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tempPath, heartbeatPath, ec);
+    if (ec) {
+      std::filesystem::remove(tempPath, ec);
+    }
+  }
+
+  // 0 when there is no heartbeat yet, which counts as fresh.
+  int64_t lastBeat() const {
+    std::ifstream file(heartbeatPath);
+    int64_t seconds = 0;
+    file >> seconds;
+    return file ? seconds : 0;
+  }
+
+public:
+  // Blocks until this process may download `key`: as the leader, or because
+  // the leader stopped responding. onWait runs once if the caller has to wait.
+  SingleFlight(const std::filesystem::path &directory, const std::string &key, int timeoutSeconds,
+               const std::function<void(const std::string &)> &onWait) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    Sha256 hasher;
+    hasher.update(reinterpret_cast<const uint8_t *>(key.data()), key.size());
+    std::string name = hasher.hexDigest().substr(0, 16);
+    std::string lockPath = (directory / (name + ".lock")).string();
+    heartbeatPath = (directory / (name + ".heartbeat")).string();
+
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+      lock = std::make_unique<FileLock>(lockPath, false);
+      if (lock->locked() || !lock->contended()) {
+        break;
+      }
+      lock.reset();
+      if (!waitedForOther) {
+        onWait("Another wta process is downloading this archive; waiting for it to finish...");
+        waitedForOther = true;
+      }
+      int64_t last = lastBeat();
+      if (last > 0 && now() - last > STALE_SECONDS) {
+        onWait("The other download stopped responding; downloading here instead.");
+        return;
+      }
+      if (std::chrono::steady_clock::now() - start > std::chrono::seconds(timeoutSeconds)) {
+        onWait("Timed out waiting for the other download; downloading here instead.");
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    }
+    if (!leader()) {
+      return;
+    }
+
+    beat();
+    heartbeat = std::thread([this] {
+      std::unique_lock<std::mutex> guard(mutex);
+      while (!stopped.wait_for(guard, std::chrono::seconds(HEARTBEAT_SECONDS), [this] { return stopping; })) {
+        beat();
+      }
+    });
+  }
+
+  SingleFlight(const SingleFlight &) = delete;
+  SingleFlight &operator=(const SingleFlight &) = delete;
+
+  ~SingleFlight() {
+    if (heartbeat.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        stopping = true;
+      }
+      stopped.notify_all();
+      heartbeat.join();
+      std::error_code ec;
+      std::filesystem::remove(heartbeatPath, ec);
+    }
+  }
+
+  // False when this process took over from a leader that stopped responding,
+  // or the lock file could not be used at all; its temporary files must then
+  // not collide with the leader's.
+  bool leader() const { return lock && lock->locked(); }
+  // True when another process held the lock first, so its result may now be
+  // in the cache.
+  bool waited() const { return waitedForOther; }
+};
+
+// Font archives shared by every user of the machine, stored under their SHA-256
+// in <cacheDir>/objects. index.json maps download URLs to digests and tracks
+// sizes and last use for LRU eviction; every index update, and every file
+// added to objects or staging, holds cache.lock.
+class ArchiveCache {
+public:
+  // Whether the source an archive was downloaded from still matches the
+  // validator recorded with it; see FileDownloader::unchanged.
+  using Revalidator = std::function<bool(const std::string &source, const std::string &validator)>;
+
+private:
+  std::filesystem::path root;
+  uint64_t maxBytes;
+  Revalidator revalidate;
+
+  static int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+#ifdef _WIN32
+  // The cache is shared by every user of the machine, so files one user
+  // creates in it, cache.lock included, must stay writable for the others.
+  // Only the directory's owner may change its DACL; for anyone else this is a
+  // no-op.
+  static void shareWithUsers(const std::filesystem::path &directory) {
+    PSECURITY_DESCRIPTOR descriptor = NULL;
+    // Modify rights for Builtin\Users, inherited by subdirectories and files.
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA("D:(A;OICI;0x1301bf;;;BU)", SDDL_REVISION_1,
+                                                              &descriptor, NULL)) {
+      return;
+    }
+    BOOL present = FALSE;
+    BOOL defaulted = FALSE;
+    PACL dacl = NULL;
+    if (GetSecurityDescriptorDacl(descriptor, &present, &dacl, &defaulted) && present) {
+      std::string path = directory.string();
+      SetNamedSecurityInfoA(&path[0], SE_FILE_OBJECT, DACL_SECURITY_INFORMATION, NULL, NULL, dacl, NULL);
+    }
+    LocalFree(descriptor);
+  }
+#endif
+
+  std::filesystem::path objectPath(const std::string &digest) const { return root / "objects" / digest; }
+
+  // Every user can write to the cache, index.json included, so a name from the
+  // index is only used as a path once it looks like a digest, and an object is
+  // only used while its contents still hash to that digest.
+  static bool validDigest(const std::string &digest) {
+    return digest.size() == 64 && digest.find_first_not_of("0123456789abcdef") == std::string::npos;
+  }
+
+  bool intact(const std::string &digest) const {
+    MappedFile file;
+    if (!validDigest(digest) || !file.open(objectPath(digest).string())) {
+      return false;
+    }
+    Sha256 hasher;
+    hasher.update(file.data(), file.size());
+    return hasher.hexDigest() == digest;
+  }
+
+  json readIndex() const {
+    json index;
+    std::ifstream file((root / "index.json").string());
+    if (file) {
+      try {
+        file >> index;
+      } catch (...) {
+        index = json();
+      }
+    }
+    if (!index.is_object()) {
+      index = json::object();
+    }
+    for (const char *key : {"objects", "urls"}) {
+      if (!index.contains(key) || !index[key].is_object()) {
+        index[key] = json::object();
+      }
+    }
+    return index;
+  }
+
+  void writeIndex(const json &index) const {
+    std::filesystem::path tempPath = root / "index.json.tmp";
+    {
+      std::ofstream file(tempPath.string(), std::ios::trunc);
+      if (!file) {
+        return;
+      }
+      file << std::setw(2) << index << std::endl;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tempPath, root / "index.json", ec);
+  }
+
+  // Objects looked up or stored this recently may still be opened by the
+  // install that asked for them, so eviction leaves them alone.
+  static const int64_t IN_USE_SECONDS = 600;
+
+  uint64_t evict(json &index, uint64_t budget, const std::string &keep, bool spareRecent) const {
+    std::vector<std::pair<int64_t, std::string>> byAge;
+    uint64_t total = 0;
+    for (auto it = index["objects"].begin(); it != index["objects"].end(); ++it) {
+      total += it.value().value("size", (uint64_t)0);
+      byAge.emplace_back(it.value().value("lastAccess", (int64_t)0), it.key());
+    }
+    std::sort(byAge.begin(), byAge.end());
+
+    uint64_t freed = 0;
+    int64_t recent = now() - IN_USE_SECONDS;
+    for (const auto &candidate : byAge) {
+      if (total <= budget) {
+        break;
+      }
+      if (candidate.second == keep || (spareRecent && candidate.first > recent)) {
+        continue;
+      }
+      removeObject(index, candidate.second, total, freed);
+    }
+    return freed;
+  }
+
+  // The index entry is only dropped once the file is gone; on Windows a file
+  // another process has open cannot be removed yet.
+  bool removeObject(json &index, const std::string &digest, uint64_t &total, uint64_t &freed) const {
+    uint64_t size = index["objects"][digest].value("size", (uint64_t)0);
+    std::error_code ec;
+    if (validDigest(digest)) {
+      std::filesystem::remove(objectPath(digest), ec);
+      if (ec) {
+        return false;
+      }
+    }
+    index["objects"].erase(digest);
+    for (auto it = index["urls"].begin(); it != index["urls"].end();) {
+      if (it.value() == digest || (it.value().is_object() && it.value().value("digest", "") == digest)) {
+        it = index["urls"].erase(it);
+      } else {
+        ++it;
+      }
+    }
+    total -= std::min(total, size);
+    freed += size;
+    return true;
+  }
+
+public:
+  ArchiveCache(const std::string &directory, uint64_t maxBytes) : maxBytes(maxBytes) {
+    std::error_code ec;
+    if (!directory.empty()) {
+      std::filesystem::create_directories(std::filesystem::path(directory) / "objects", ec);
+      std::filesystem::create_directories(std::filesystem::path(directory) / "staging", ec);
+      if (!ec) {
+        root = directory;
+#ifdef _WIN32
+        shareWithUsers(root);
+#endif
+      }
+    }
+  }
+
+  bool enabled() const { return !root.empty(); }
+  std::string directory() const { return root.string(); }
+
+  void setRevalidator(Revalidator check) { revalidate = std::move(check); }
+
+  // Looks an archive up by its catalog digest. When the catalog has none, the
+  // archive last downloaded from the URL is used only while its source still
+  // matches the validator recorded with it; that check runs without holding
+  // cache.lock. A hit is re-hashed, and an object that no longer matches its
+  // digest is removed and counted as a miss. On a hit, foundDigest is set to
+  // the archive's SHA-256.
+  std::string lookup(const std::string &url, const ExpectedContent &expected, std::string *foundDigest = nullptr) {
+    if (!enabled()) {
+      return "";
+    }
+    std::string digest = expected.sha256;
+    std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+    if (digest.empty()) {
+      json entry;
+      {
+        FileLock lock((root / "cache.lock").string());
+        if (!lock.locked()) {
+          return "";
+        }
+        json index = readIndex();
+        if (index["urls"].contains(url)) {
+          entry = index["urls"][url];
+        }
+      }
+      if (entry.is_object() && revalidate && revalidate(entry.value("source", ""), entry.value("validator", ""))) {
+        digest = entry.value("digest", "");
+      }
+    }
+
+    FileLock lock((root / "cache.lock").string());
+    if (!lock.locked()) {
+      return "";
+    }
+    json index = readIndex();
+    bool hit = !digest.empty() && index["objects"].contains(digest) && intact(digest);
+    if (hit) {
+      index["objects"][digest]["lastAccess"] = now();
+      index["hits"] = index.value("hits", (uint64_t)0) + 1;
+    } else {
+      if (!digest.empty() && index["objects"].contains(digest)) {
+        uint64_t total = 0, freed = 0;
+        removeObject(index, digest, total, freed);
+      }
+      index["misses"] = index.value("misses", (uint64_t)0) + 1;
+    }
+    writeIndex(index);
+    if (hit && foundDigest) {
+      *foundDigest = digest;
+    }
+    return hit ? objectPath(digest).string() : "";
+  }
+
+  // Moves a verified download into the cache and returns its cached path. On
+  // failure the result is empty and filePath is left where it was. origin
+  // records where the download came from, for URL lookups.
+  std::string store(const std::string &filePath, const std::string &digest, const std::string &url,
+                    const FileDownloader::SourceReport &origin) {
+    if (!enabled() || digest.empty()) {
+      return "";
+    }
+    FileLock lock((root / "cache.lock").string());
+    if (!lock.locked()) {
+      return "";
+    }
+
+    std::error_code ec;
+    std::filesystem::path target = objectPath(digest);
+    std::filesystem::rename(filePath, target, ec);
+    if (ec) {
+      // On another volume: copy under a staging name so the object only
+      // appears once it is complete.
+      std::filesystem::path staging = root / "staging" / (digest + "." + std::to_string(std::random_device()()));
+      ec.clear();
+      std::filesystem::copy_file(filePath, staging, std::filesystem::copy_options::overwrite_existing, ec);
+      if (!ec) {
+        std::filesystem::rename(staging, target, ec);
+      }
+      if (ec) {
+        std::filesystem::remove(staging, ec);
+        return "";
+      }
+      std::filesystem::remove(filePath, ec);
+    }
+
+    json index = readIndex();
+    index["objects"][digest] = {{"size", std::filesystem::file_size(target, ec)},
+                                {"lastAccess", now()},
+                                {"url", url}};
+    index["urls"][url] = {{"digest", digest}, {"source", origin.url}, {"validator", origin.validator}};
+    evict(index, maxBytes, digest, true);
+    writeIndex(index);
+    return target.string();
+  }
+
+  json stats() {
+    json result = {{"directory", root.string()}, {"maxBytes", maxBytes}, {"entries", 0}, {"bytes", 0},
+                   {"hits", 0}, {"misses", 0}};
+    if (!enabled()) {
+      return result;
+    }
+    FileLock lock((root / "cache.lock").string());
+    if (!lock.locked()) {
+      return result;
+    }
+    json index = readIndex();
+    uint64_t total = 0;
+    for (const auto &object : index["objects"]) {
+      total += object.value("size", (uint64_t)0);
+    }
+    result["entries"] = index["objects"].size();
+    result["bytes"] = total;
+    result["hits"] = index.value("hits", (uint64_t)0);
+    result["misses"] = index.value("misses", (uint64_t)0);
+    return result;
+  }
+
+  // Trims the cache to its byte budget (or empties it) and removes files the
+  // index does not know about, such as staging files left by killed processes.
+  // Files are only added to either directory under cache.lock, so none of
+  // them can still be in use. A trim to the budget spares recently used
+  // objects like store does.
+  uint64_t prune(bool all) {
+    if (!enabled()) {
+      return 0;
+    }
+    FileLock lock((root / "cache.lock").string());
+    if (!lock.locked()) {
+      return 0;
+    }
+    json index = readIndex();
+    uint64_t freed = evict(index, all ? 0 : maxBytes, "", !all);
+
+    std::error_code ec;
+    for (const char *directory : {"objects", "staging"}) {
+      for (const auto &entry : std::filesystem::directory_iterator(root / directory, ec)) {
+        std::string name = entry.path().filename().string();
+        if (directory == std::string("staging") || !index["objects"].contains(name)) {
+          freed += entry.is_regular_file(ec) ? entry.file_size(ec) : 0;
+          std::filesystem::remove(entry.path(), ec);
+        }
+      }
+    }
+    writeIndex(index);
+    return freed;
+  }
+};
+
+struct FontFaceInfo {
+  // Offset of the face's table directory; non-zero only inside collections.
+  uint32_t offset = 0;
+  std::string family;
+  std::string subfamily;
+  std::string fullName;
+  uint16_t weight = 400;
+  bool bold = false;
+  bool italic = false;
+  bool monospace = false;
+  // PostScript (CFF) outlines rather than TrueType glyphs.
+  bool cff = false;
+};
+
+// One bit per Unicode code point. Checking a font against a set of required
+// glyphs is then a pass of 64-bit AND-NOTs and popcounts over 17K words,
+// which the compiler vectorizes.
+class GlyphCoverage {
+private:
+  std::vector<uint64_t> words;
+
+public:
+  static constexpr uint32_t CODE_POINTS = 0x110000;
+
+  GlyphCoverage() : words(CODE_POINTS / 64, 0) {}
+
+  void add(uint32_t code) {
+    if (code < CODE_POINTS) {
+      words[code >> 6] |= 1ull << (code & 63);
+    }
+  }
+
+  void remove(uint32_t code) {
+    if (code < CODE_POINTS) {
+      words[code >> 6] &= ~(1ull << (code & 63));
+    }
+  }
+
+  void addRange(uint32_t first, uint32_t last) {
+    if (first > last || first >= CODE_POINTS) {
+      return;
+    }
+    last = std::min(last, CODE_POINTS - 1);
+    size_t firstWord = first >> 6;
+    size_t lastWord = last >> 6;
+    uint64_t firstMask = ~0ull << (first & 63);
+    uint64_t lastMask = ~0ull >> (63 - (last & 63));
+    if (firstWord == lastWord) {
+      words[firstWord] |= firstMask & lastMask;
+      return;
+    }
+    words[firstWord] |= firstMask;
+    std::fill(words.begin() + firstWord + 1, words.begin() + lastWord, ~0ull);
+    words[lastWord] |= lastMask;
+  }
+
+  bool contains(uint32_t code) const {
+    return code < CODE_POINTS && (words[code >> 6] >> (code & 63)) & 1;
+  }
+
+  void intersect(const GlyphCoverage &other) {
+    for (size_t i = 0; i < words.size(); ++i) {
+      words[i] &= other.words[i];
+    }
+  }
+
+  size_t count() const {
+    size_t total = 0;
+    for (uint64_t word : words) {
+      total += __builtin_popcountll(word);
+    }
+    return total;
+  }
+
+  size_t missingCount(const GlyphCoverage &required) const {
+    size_t total = 0;
+    for (size_t i = 0; i < words.size(); ++i) {
+      total += __builtin_popcountll(required.words[i] & ~words[i]);
+    }
+    return total;
+  }
+
+  std::vector<uint32_t> missing(const GlyphCoverage &required) const {
+    std::vector<uint32_t> codes;
+    for (size_t i = 0; i < words.size(); ++i) {
+      uint64_t gaps = required.words[i] & ~words[i];
+      while (gaps) {
+        codes.push_back((uint32_t)(i * 64 + __builtin_ctzll(gaps)));
+        gaps &= gaps - 1;
+      }
+    }
+    return codes;
+  }
+};
+
+// The OpenType table checksum: the sum of a table's big-endian uint32 words,
+// with a short last word padded with zeros. Whole words go through an AVX2 or
+// NEON kernel when the CPU has one.
+class SfntChecksum {
+private:
+  using Kernel = uint32_t (*)(const uint8_t *data, size_t words);
+
+  static uint32_t sumWords(const uint8_t *data, size_t words) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < words; ++i, data += 4) {
+      sum += ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+    }
+    return sum;
+  }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __attribute__((target("avx2"))) static uint32_t accelerated(const uint8_t *data, size_t words) {
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i a = _mm256_setzero_si256();
+    __m256i b = _mm256_setzero_si256();
+    for (; words >= 16; words -= 16, data += 64) {
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+      __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+      a = _mm256_add_epi32(a, _mm256_shuffle_epi8(x, swap));
+      b = _mm256_add_epi32(b, _mm256_shuffle_epi8(y, swap));
+    }
+    a = _mm256_add_epi32(a, b);
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return (uint32_t)_mm_cvtsi128_si32(sum) + sumWords(data, words);
+  }
+
+  static bool hasAcceleration() { return __builtin_cpu_supports("avx2"); }
+#elif defined(__GNUC__) && defined(__aarch64__)
+  static uint32_t accelerated(const uint8_t *data, size_t words) {
+    uint32x4_t a = vdupq_n_u32(0);
+    uint32x4_t b = vdupq_n_u32(0);
+    for (; words >= 8; words -= 8, data += 32) {
+      a = vaddq_u32(a, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data))));
+      b = vaddq_u32(b, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16))));
+    }
+    return vaddvq_u32(vaddq_u32(a, b)) + sumWords(data, words);
+  }
+
+  static bool hasAcceleration() { return true; }
+#else
+  static uint32_t accelerated(const uint8_t *data, size_t words) { return sumWords(data, words); }
+
+  static bool hasAcceleration() { return false; }
+#endif
+
+  static Kernel kernel() {
+    static const Kernel selected = hasAcceleration() ? &accelerated : &sumWords;
+    return selected;
+  }
+
+  static uint32_t finish(uint32_t sum, const uint8_t *data, size_t size) {
+    uint8_t last[4] = {};
+    if (size % 4 != 0) {
+      memcpy(last, data + size / 4 * 4, size % 4);
+      sum += sumWords(last, 1);
+    }
+    return sum;
+  }
+
+public:
+  static uint32_t compute(const uint8_t *data, size_t size) {
+    return finish(kernel()(data, size / 4), data, size);
+  }
+
+  static uint32_t computePortable(const uint8_t *data, size_t size) {
+    return finish(sumWords(data, size / 4), data, size);
+  }
+
+  static bool accelerationAvailable() { return hasAcceleration(); }
+};
+
+// Reads the name, OS/2, head, post and cmap tables of one sfnt face in place. Every
+// offset is checked against the buffer, so truncated or corrupt files are
+// rejected with an error instead of being read out of bounds.
+class SfntParser {
+public:
+  static bool parse(const uint8_t *data, size_t size, size_t faceOffset, FontFaceInfo &info, std::string &error) {
+    info = FontFaceInfo();
+    info.offset = (uint32_t)faceOffset;
+    if (faceOffset > size || size - faceOffset < 12) {
+      error = "file is too small to be a font";
+      return false;
+    }
+    uint32_t version = readBE32(data + faceOffset);
+    if (version != 0x00010000 && version != 0x4F54544F && version != 0x74727565) {
+      error = "not a TrueType or OpenType font";
+      return false;
+    }
+    info.cff = version == 0x4F54544F;
+
+    Table name;
+    Table head;
+    Table os2;
+    Table post;
+    uint16_t numTables = readBE16(data + faceOffset + 4);
+    if ((size - faceOffset - 12) / 16 < numTables) {
+      error = "table directory is truncated";
+      return false;
+    }
+    for (uint16_t i = 0; i < numTables; ++i) {
+      const uint8_t *record = data + faceOffset + 12 + 16 * i;
+      uint32_t offset = readBE32(record + 8);
+      uint32_t length = readBE32(record + 12);
+      if (offset > size || length > size - offset) {
+        error = "table extends past the end of the file";
+        return false;
+      }
+      Table table{data + offset, length};
+      switch (readBE32(record)) {
+      case 0x6E616D65: name = table; break;
+      case 0x68656164: head = table; break;
+      case 0x4F532F32: os2 = table; break;
+      case 0x706F7374: post = table; break;
+      }
+    }
+
+    if (!head.data || head.length < 54 || readBE32(head.data + 12) != 0x5F0F3CF5) {
+      error = "missing or invalid head table";
+      return false;
+    }
+    uint16_t macStyle = readBE16(head.data + 44);
+    info.bold = (macStyle & 1) != 0;
+    info.italic = (macStyle & 2) != 0;
+    info.weight = info.bold ? 700 : 400;
+
+    if (os2.data && os2.length >= 64) {
+      uint16_t weight = readBE16(os2.data + 4);
+      if (weight >= 1 && weight <= 1000) {
+        info.weight = weight;
+      }
+      uint16_t selection = readBE16(os2.data + 62);
+      info.italic = (selection & 1) != 0;
+      info.bold = (selection & 0x20) != 0;
+      // PANOSE family "Latin text" with proportion "monospaced".
+      info.monospace = os2.data[32] == 2 && os2.data[35] == 9;
+    }
+    if (post.data && post.length >= 16 && readBE32(post.data + 12) != 0) {
+      info.monospace = true;
+    }
+
+    if (!name.data || !readNames(name, info)) {
+      error = "missing or invalid name table";
+      return false;
+    }
+    return true;
+  }
+
+  // Adds every code point the face maps to a real glyph. All Unicode cmap
+  // subtables are merged; formats 0, 4, 6, 12 and 13 cover fonts in the wild.
+  static bool parseCoverage(const uint8_t *data, size_t size, size_t faceOffset, GlyphCoverage &coverage,
+                            std::string &error) {
+    Table cmap;
+    if (!findTable(data, size, faceOffset, 0x636D6170, cmap, error)) {
+      return false;
+    }
+    if (!cmap.data || cmap.length < 4) {
+      error = "missing or invalid cmap table";
+      return false;
+    }
+    uint16_t count = readBE16(cmap.data + 2);
+    if ((cmap.length - 4) / 8 < count) {
+      error = "cmap table is truncated";
+      return false;
+    }
+    bool found = false;
+    for (uint16_t i = 0; i < count; ++i) {
+      const uint8_t *record = cmap.data + 4 + 8 * i;
+      uint16_t platform = readBE16(record);
+      uint16_t encoding = readBE16(record + 2);
+      uint32_t offset = readBE32(record + 4);
+      bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+      if (unicode && offset < cmap.length && readCmapSubtable(cmap.data + offset, cmap.length - offset, coverage)) {
+        found = true;
+      }
+    }
+    if (!found) {
+      error = "no Unicode cmap subtable";
+    }
+    return found;
+  }
+
+  // A plain font has one face at offset zero; a TrueType/OpenType collection
+  // ("ttcf") lists the offset of each face's table directory.
+  static bool faceOffsets(const uint8_t *data, size_t size, std::vector<uint32_t> &offsets, std::string &error) {
+    offsets.clear();
+    if (size < 12 || readBE32(data) != 0x74746366) {
+      offsets.push_back(0);
+      return true;
+    }
+    uint32_t numFonts = readBE32(data + 8);
+    if (numFonts == 0 || (size - 12) / 4 < numFonts) {
+      error = "collection header is truncated";
+      return false;
+    }
+    for (uint32_t i = 0; i < numFonts; ++i) {
+      offsets.push_back(readBE32(data + 12 + 4 * i));
+    }
+    return true;
+  }
+
+  // Parses every face in a font file or collection.
+  static bool parseFaces(const std::string &path, std::vector<FontFaceInfo> &faces, std::string &error) {
+    faces.clear();
+    MappedFile file;
+    if (!file.open(path)) {
+      error = "could not open " + path;
+      return false;
+    }
+    std::vector<uint32_t> offsets;
+    if (!faceOffsets(file.data(), file.size(), offsets, error)) {
+      return false;
+    }
+    for (uint32_t offset : offsets) {
+      FontFaceInfo info;
+      if (!parse(file.data(), file.size(), offset, info, error)) {
+        faces.clear();
+        return false;
+      }
+      faces.push_back(info);
+    }
+    return true;
+  }
+
+  // Checks what a font loader takes on trust: every table directory and table
+  // lies inside the file, each table matches its directory checksum, and
+  // head.checkSumAdjustment balances the whole file. Faces in a collection
+  // share one file, so the adjustment is only checked for single fonts.
+  static bool validate(const uint8_t *data, size_t size, std::string &error) {
+    std::vector<uint32_t> offsets;
+    if (!faceOffsets(data, size, offsets, error)) {
+      return false;
+    }
+    bool collection = size >= 12 && readBE32(data) == 0x74746366;
+    for (uint32_t faceOffset : offsets) {
+      if (faceOffset > size || size - faceOffset < 12) {
+        error = "file is too small to be a font";
+        return false;
+      }
+      uint32_t version = readBE32(data + faceOffset);
+      if (version != 0x00010000 && version != 0x4F54544F && version != 0x74727565) {
+        error = "not a TrueType or OpenType font";
+        return false;
+      }
+      uint16_t numTables = readBE16(data + faceOffset + 4);
+      if (numTables == 0 || (size - faceOffset - 12) / 16 < numTables) {
+        error = "table directory is truncated";
+        return false;
+      }
+      bool haveHead = false;
+      uint32_t adjustment = 0;
+      for (uint16_t i = 0; i < numTables; ++i) {
+        const uint8_t *record = data + faceOffset + 12 + 16 * i;
+        uint32_t tag = readBE32(record);
+        uint32_t offset = readBE32(record + 8);
+        uint32_t length = readBE32(record + 12);
+        if (offset > size || length > size - offset) {
+          error = "table extends past the end of the file";
+          return false;
+        }
+        uint32_t sum = SfntChecksum::compute(data + offset, length);
+        if (tag == 0x68656164) {
+          if (length < 54 || readBE32(data + offset + 12) != 0x5F0F3CF5) {
+            error = "missing or invalid head table";
+            return false;
+          }
+          haveHead = true;
+          adjustment = readBE32(data + offset + 8);
+          sum -= adjustment;
+        }
+        if (sum != readBE32(record + 4)) {
+          error = "checksum mismatch in the '" + std::string(reinterpret_cast<const char *>(record), 4) + "' table";
+          return false;
+        }
+      }
+      if (!haveHead) {
+        error = "missing or invalid head table";
+        return false;
+      }
+      if (!collection && 0xB1B0AFBA - (SfntChecksum::compute(data, size) - adjustment) != adjustment) {
+        error = "head.checkSumAdjustment does not match the file";
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  struct Table {
+    const uint8_t *data = nullptr;
+    uint32_t length = 0;
+  };
+
+  static uint16_t readBE16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+  static uint32_t readBE32(const uint8_t *p) { return ((uint32_t)readBE16(p) << 16) | readBE16(p + 2); }
+
+  // Looks up one table in a face's directory. A missing table is not an
+  // error; table.data stays null.
+  static bool findTable(const uint8_t *data, size_t size, size_t faceOffset, uint32_t tag, Table &table,
+                        std::string &error) {
+    if (faceOffset > size || size - faceOffset < 12) {
+      error = "file is too small to be a font";
+      return false;
+    }
+    uint16_t numTables = readBE16(data + faceOffset + 4);
+    if ((size - faceOffset - 12) / 16 < numTables) {
+      error = "table directory is truncated";
+      return false;
+    }
+    for (uint16_t i = 0; i < numTables; ++i) {
+      const uint8_t *record = data + faceOffset + 12 + 16 * i;
+      if (readBE32(record) != tag) {
+        continue;
+      }
+      uint32_t offset = readBE32(record + 8);
+      uint32_t length = readBE32(record + 12);
+      if (offset > size || length > size - offset) {
+        error = "table extends past the end of the file";
+        return false;
+      }
+      table = Table{data + offset, length};
+      return true;
+    }
+    return true;
+  }
+
+  static bool readCmapSubtable(const uint8_t *p, size_t length, GlyphCoverage &coverage) {
+    if (length < 2) {
+      return false;
+    }
+    switch (readBE16(p)) {
+    case 0:
+      if (length < 262) {
+        return false;
+      }
+      for (uint32_t code = 0; code < 256; ++code) {
+        if (p[6 + code]) {
+          coverage.add(code);
+        }
+      }
+      return true;
+
+    case 4: {
+      if (length < 14) {
+        return false;
+      }
+      size_t segCount = readBE16(p + 6) / 2;
+      size_t starts = 16 + 2 * segCount;
+      size_t deltas = starts + 2 * segCount;
+      size_t rangeOffsets = deltas + 2 * segCount;
+      if (rangeOffsets + 2 * segCount > length) {
+        return false;
+      }
+      for (size_t i = 0; i < segCount; ++i) {
+        uint32_t end = readBE16(p + 14 + 2 * i);
+        uint32_t start = readBE16(p + starts + 2 * i);
+        uint16_t delta = readBE16(p + deltas + 2 * i);
+        uint16_t rangeOffset = readBE16(p + rangeOffsets + 2 * i);
+        if (start > end) {
+          continue;
+        }
+        if (rangeOffset == 0) {
+          // The glyph is code + delta, so at most one code point lands on
+          // .notdef; this also drops the 0xFFFF terminator segment.
+          coverage.addRange(start, end);
+          uint32_t notdef = (uint16_t)(0x10000 - delta);
+          if (notdef >= start && notdef <= end) {
+            coverage.remove(notdef);
+          }
+          continue;
+        }
+        for (uint32_t code = start; code <= end; ++code) {
+          size_t at = rangeOffsets + 2 * i + rangeOffset + 2 * (code - start);
+          if (at + 2 > length) {
+            break;
+          }
+          uint16_t glyph = readBE16(p + at);
+          if (glyph != 0 && (uint16_t)(glyph + delta) != 0) {
+            coverage.add(code);
+          }
+        }
+      }
+      return true;
+    }
+
+    case 6: {
+      if (length < 10) {
+        return false;
+      }
+      uint32_t first = readBE16(p + 6);
+      uint32_t entries = readBE16(p + 8);
+      if ((length - 10) / 2 < entries) {
+        return false;
+      }
+      for (uint32_t i = 0; i < entries; ++i) {
+        if (readBE16(p + 10 + 2 * i) != 0) {
+          coverage.add(first + i);
+        }
+      }
+      return true;
+    }
+
+    case 12:
+    case 13: {
+      if (length < 16) {
+        return false;
+      }
+      bool manyToOne = readBE16(p) == 13;
+      uint32_t groups = readBE32(p + 12);
+      if ((length - 16) / 12 < groups) {
+        return false;
+      }
+      for (uint32_t i = 0; i < groups; ++i) {
+        const uint8_t *group = p + 16 + 12 * i;
+        uint32_t start = readBE32(group);
+        uint32_t end = readBE32(group + 4);
+        uint32_t glyph = readBE32(group + 8);
+        if (glyph == 0) {
+          // Format 12 maps the first code to .notdef; format 13 maps all.
+          if (manyToOne || start == UINT32_MAX) {
+            continue;
+          }
+          start++;
+        }
+        coverage.addRange(start, end);
+      }
+      return true;
+    }
+
+    default:
+      return false;
+    }
+  }
+
+  // Windows English names are preferred, then any Windows or Unicode name,
+  // then Mac Roman.
+  static int nameScore(uint16_t platform, uint16_t encoding, uint16_t language) {
+    if (platform == 3 && (encoding == 1 || encoding == 10)) {
+      return language == 0x0409 ? 4 : 3;
+    }
+    if (platform == 0) {
+      return 2;
+    }
+    if (platform == 1 && encoding == 0) {
+      return 1;
+    }
+    return 0;
+  }
+
+  static std::string decodeName(uint16_t platform, const uint8_t *text, size_t length) {
+    std::string result;
+    if (platform == 1) {
+      for (size_t i = 0; i < length; ++i) {
+        result += text[i] < 0x80 ? (char)text[i] : '?';
+      }
+      return result;
+    }
+
+    for (size_t i = 0; i + 1 < length; i += 2) {
+      uint32_t code = readBE16(text + i);
+      if (code >= 0xD800 && code < 0xDC00 && i + 3 < length) {
+        uint32_t low = readBE16(text + i + 2);
+        if (low >= 0xDC00 && low < 0xE000) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          i += 2;
+        }
+      }
+      if (code < 0x80) {
+        result += (char)code;
+      } else if (code < 0x800) {
+        result += (char)(0xC0 | (code >> 6));
+        result += (char)(0x80 | (code & 0x3F));
+      } else if (code < 0x10000) {
+        result += (char)(0xE0 | (code >> 12));
+        result += (char)(0x80 | ((code >> 6) & 0x3F));
+        result += (char)(0x80 | (code & 0x3F));
+      } else {
+        result += (char)(0xF0 | (code >> 18));
+        result += (char)(0x80 | ((code >> 12) & 0x3F));
+        result += (char)(0x80 | ((code >> 6) & 0x3F));
+        result += (char)(0x80 | (code & 0x3F));
+      }
+    }
+    return result;
+  }
+
+  static bool readNames(const Table &table, FontFaceInfo &info) {
+    if (table.length < 6) {
+      return false;
+    }
+    uint16_t count = readBE16(table.data + 2);
+    uint16_t stringOffset = readBE16(table.data + 4);
+    if ((table.length - 6) / 12 < count || stringOffset > table.length) {
+      return false;
+    }
+
+    // Name IDs 1, 2, 4, 16 and 17: family, subfamily, full name and the
+    // typographic family and subfamily.
+    std::string names[18];
+    int scores[18] = {0};
+    for (uint16_t i = 0; i < count; ++i) {
+      const uint8_t *record = table.data + 6 + 12 * i;
+      uint16_t nameId = readBE16(record + 6);
+      if (nameId >= 18 || (nameId != 1 && nameId != 2 && nameId != 4 && nameId != 16 && nameId != 17)) {
+        continue;
+      }
+      uint16_t platform = readBE16(record);
+      int score = nameScore(platform, readBE16(record + 2), readBE16(record + 4));
+      uint16_t length = readBE16(record + 8);
+      uint32_t offset = (uint32_t)stringOffset + readBE16(record + 10);
+      if (score <= scores[nameId] || offset > table.length || length > table.length - offset) {
+        continue;
+      }
+      names[nameId] = decodeName(platform, table.data + offset, length);
+      scores[nameId] = score;
+    }
+
+    info.family = !names[16].empty() ? names[16] : names[1];
+    info.subfamily = !names[17].empty() ? names[17] : names[2];
+    info.fullName = !names[4].empty() ? names[4] : (info.family + " " + info.subfamily);
+    return !info.family.empty();
+  }
+};
+
+// Case-folded name with only letters and digits kept, so "JetBrains Mono",
+// "jetbrains-mono" and "JetBrainsMono" compare equal.
+std::string normalizeFontName(const std::string &name) {
+  std::string normalized;
+  normalized.reserve(name.size());
+  for (unsigned char c : name) {
+    if (std::isalnum(c)) {
+      normalized += (char)std::tolower(c);
+    }
+  }
+  return normalized;
+}
+
+bool isFontFileName(const std::string &fileName) {
+  std::string ext = std::filesystem::path(fileName).extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == ".ttf" || ext == ".otf" || ext == ".ttc" || ext == ".otc";
+}
+
+bool isFontCollectionName(const std::string &fileName) {
+  std::string ext = std::filesystem::path(fileName).extension().string();
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == ".ttc" || ext == ".otc";
+}
+
+// Identifies a face across files, so a single-face file can be recognised as
+// a copy of one already contained in a collection.
+std::string fontFaceKey(const FontFaceInfo &face) {
+  return normalizeFontName(face.family) + "/" + normalizeFontName(face.subfamily);
+}
+
+// Suffixes patched Nerd Fonts add to their family names, in normalized form,
+// so the catalog name "JetBrainsMono" finds "JetBrainsMono Nerd Font Mono".
+const char *const NERD_FONT_SUFFIXES[] = {"nerdfont", "nerdfontmono", "nerdfontpropo", "nf", "nfm", "nfp"};
+
+// Narrows an install to some of the files in an archive: Nerd Font variants
+// (the default double-width icons, Mono or Propo), weights and italics. Most
+// archives name files "<Family>NerdFont[Mono|Propo]-<Weight>[Italic].ttf", so
+// files are usually judged by name before anything is inflated; the rest are
+// judged by their OS/2 and name tables once extracted.
+struct FontFilter {
+  enum class Decision { Keep, Skip, Unknown };
+
+  std::vector<std::string> variants;
+  std::vector<int> weights;
+  bool italic = true;
+
+  bool empty() const { return variants.empty() && weights.empty() && italic; }
+
+  static int weightFromName(const std::string &name) {
+    static const std::pair<const char *, int> names[] = {
+        {"thin", 100},     {"hairline", 100},  {"extralight", 200}, {"ultralight", 200}, {"light", 300},
+        {"regular", 400},  {"normal", 400},    {"book", 400},       {"", 400},           {"medium", 500},
+        {"semibold", 600}, {"demibold", 600},  {"bold", 700},       {"extrabold", 800},  {"ultrabold", 800},
+        {"black", 900},    {"heavy", 900}};
+    std::string key = normalizeFontName(name);
+    for (const auto &entry : names) {
+      if (key == entry.first) {
+        return entry.second;
+      }
+    }
+    return 0;
+  }
+
+  // Accepts a comma-separated list of weight names or numeric weights.
+  bool parseWeights(const std::string &list) {
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+      int weight = 0;
+      if (!item.empty() && std::all_of(item.begin(), item.end(), ::isdigit)) {
+        weight = std::atoi(item.c_str());
+        weight = weight >= 100 && weight <= 900 && weight % 100 == 0 ? weight : 0;
+      } else if (!item.empty()) {
+        weight = weightFromName(item);
+      }
+      if (weight == 0) {
+        return false;
+      }
+      weights.push_back(weight);
+    }
+    return !weights.empty();
+  }
+
+  bool parseVariants(const std::string &list) {
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+      std::transform(item.begin(), item.end(), item.begin(), ::tolower);
+      if (item != "default" && item != "mono" && item != "propo") {
+        return false;
+      }
+      variants.push_back(item);
+    }
+    return !variants.empty();
+  }
+
+  // The variant a family or file name belongs to, from its Nerd Font suffix.
+  static std::string variantOf(const std::string &name) {
+    std::string key = normalizeFontName(name);
+    auto endsWith = [&](const char *suffix) {
+      size_t length = std::strlen(suffix);
+      return key.size() >= length && key.compare(key.size() - length, length, suffix) == 0;
+    };
+    if (endsWith("nerdfontmono") || endsWith("nfm")) {
+      return "mono";
+    }
+    if (endsWith("nerdfontpropo") || endsWith("nfp")) {
+      return "propo";
+    }
+    return endsWith("nerdfont") || endsWith("nf") ? "default" : "";
+  }
+
+  Decision fromFileName(const std::string &fileName) const {
+    if (empty()) {
+      return Decision::Keep;
+    }
+    if (isFontCollectionName(fileName)) {
+      return Decision::Unknown;
+    }
+    std::string stem = std::filesystem::path(fileName).stem().string();
+    size_t dash = stem.find_last_of('-');
+    std::string family = stem.substr(0, dash == std::string::npos ? stem.size() : dash);
+    std::string style = dash == std::string::npos ? "" : normalizeFontName(stem.substr(dash + 1));
+
+    bool known = true;
+    if (!variants.empty()) {
+      std::string variant = variantOf(family);
+      if (variant.empty()) {
+        known = false;
+      } else if (std::find(variants.begin(), variants.end(), variant) == variants.end()) {
+        return Decision::Skip;
+      }
+    }
+    if (weights.empty() && italic) {
+      return known ? Decision::Keep : Decision::Unknown;
+    }
+    if (dash == std::string::npos) {
+      return Decision::Unknown;
+    }
+
+    bool isItalic = false;
+    for (const char *slant : {"italic", "oblique"}) {
+      size_t length = std::strlen(slant);
+      if (style.size() >= length && style.compare(style.size() - length, length, slant) == 0) {
+        style.erase(style.size() - length);
+        isItalic = true;
+        break;
+      }
+    }
+    int weight = weightFromName(style);
+    if (weight == 0) {
+      return Decision::Unknown;
+    }
+    if ((!italic && isItalic) ||
+        (!weights.empty() && std::find(weights.begin(), weights.end(), weight) == weights.end())) {
+      return Decision::Skip;
+    }
+    return known ? Decision::Keep : Decision::Unknown;
+  }
+
+  // A collection is kept when any of its faces matches.
+  bool matches(const std::vector<FontFaceInfo> &faces) const {
+    return std::any_of(faces.begin(), faces.end(), [&](const FontFaceInfo &face) {
+      std::string variant = variantOf(face.family);
+      int weight = std::min(900, std::max(100, (face.weight + 50) / 100 * 100));
+      return (variants.empty() || std::find(variants.begin(), variants.end(),
+                                            variant.empty() ? "default" : variant) != variants.end()) &&
+             (weights.empty() || std::find(weights.begin(), weights.end(), weight) != weights.end()) &&
+             (italic || !face.italic);
+    });
+  }
+
+  json toJson() const {
+    json filter = json::object();
+    if (!variants.empty()) {
+      filter["variants"] = variants;
+    }
+    if (!weights.empty()) {
+      filter["weights"] = weights;
+    }
+    if (!italic) {
+      filter["italic"] = false;
+    }
+    return filter;
+  }
+
+  static FontFilter fromJson(const json &filter) {
+    FontFilter result;
+    if (filter.is_object()) {
+      result.variants = filter.value("variants", std::vector<std::string>());
+      result.weights = filter.value("weights", std::vector<int>());
+      result.italic = filter.value("italic", true);
+    }
+    return result;
+  }
+};
+
+struct GlyphRange {
+  uint32_t first;
+  uint32_t last;
+};
+
+// The Powerline separators and branch symbols prompts draw with.
+const GlyphRange POWERLINE_GLYPHS[] = {{0xE0A0, 0xE0A2}, {0xE0B0, 0xE0B3}};
+
+// The Nerd Fonts private-use blocks every 2.x and 3.x release patches in
+// full: Pomicons, Powerline and Powerline Extra, Weather Icons, Devicons and
+// Font Logos.
+const GlyphRange NERD_FONT_GLYPHS[] = {{0xE000, 0xE00A}, {0xE0A0, 0xE0A3}, {0xE0B0, 0xE0C8}, {0xE0CA, 0xE0CA},
+                                       {0xE0CC, 0xE0D4}, {0xE300, 0xE3E3}, {0xE700, 0xE7C5}, {0xF300, 0xF313}};
+
+bool parseCodePoint(std::string text, uint32_t &code) {
+  if (text.size() > 2 && (text[0] == 'U' || text[0] == 'u') && text[1] == '+') {
+    text = text.substr(2);
+  }
+  if (text.empty() || text.size() > 6 || text.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+    return false;
+  }
+  code = (uint32_t)std::stoul(text, nullptr, 16);
+  return code < GlyphCoverage::CODE_POINTS;
+}
+
+// Loads the code points a font must cover: "nerd", "powerline", or a file
+// listing code points and ranges such as "U+E0A0", "E0B0-E0B3" or
+// "E0B0..E0B3", with # comments.
+bool loadGlyphRanges(const std::string &spec, GlyphCoverage &required, std::string &error) {
+  if (spec == "nerd") {
+    for (const GlyphRange &range : NERD_FONT_GLYPHS) {
+      required.addRange(range.first, range.last);
+    }
+    return true;
+  }
+  if (spec == "powerline") {
+    for (const GlyphRange &range : POWERLINE_GLYPHS) {
+      required.addRange(range.first, range.last);
+    }
+    return true;
+  }
+
+  std::ifstream file(spec);
+  if (!file) {
+    error = "unknown glyph set or unreadable file: " + spec;
+    return false;
+  }
+  std::string line;
+  for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+    line = line.substr(0, line.find('#'));
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::istringstream tokens(line);
+    std::string token;
+    while (tokens >> token) {
+      size_t separator = token.find("..");
+      size_t separatorLength = 2;
+      if (separator == std::string::npos) {
+        separator = token.find('-');
+        separatorLength = 1;
+      }
+      uint32_t first;
+      uint32_t last;
+      bool ok = separator == std::string::npos
+                    ? parseCodePoint(token, first) && parseCodePoint(token, last)
+                    : parseCodePoint(token.substr(0, separator), first) &&
+                          parseCodePoint(token.substr(separator + separatorLength), last) && first <= last;
+      if (!ok) {
+        error = spec + ":" + std::to_string(lineNumber) + ": invalid code point or range '" + token + "'";
+        return false;
+      }
+      required.addRange(first, last);
+    }
+  }
+  if (required.count() == 0) {
+    error = spec + " lists no code points";
+    return false;
+  }
+  return true;
+}
+
+// Collapses sorted code points into "U+E0A0-U+E0A3, U+E0B0" form, listing at
+// most maxRanges ranges.
+std::string formatCodePoints(const std::vector<uint32_t> &codes, size_t maxRanges) {
+  auto hex = [](uint32_t code) {
+    std::ostringstream out;
+    out << "U+" << std::uppercase << std::hex << std::setw(4) << std::setfill('0') << code;
+    return out.str();
+  };
+  std::string result;
+  size_t ranges = 0;
+  for (size_t i = 0; i < codes.size();) {
+    size_t j = i;
+    while (j + 1 < codes.size() && codes[j + 1] == codes[j] + 1) {
+      ++j;
+    }
+    if (ranges == maxRanges) {
+      size_t remaining = 0;
+      for (size_t k = i; k < codes.size(); ++k) {
+        remaining += k == i || codes[k] != codes[k - 1] + 1;
+      }
+      result += ", and " + std::to_string(remaining) + " more ranges";
+      break;
+    }
+    result += (result.empty() ? "" : ", ") + hex(codes[i]);
+    if (j > i) {
+      result += "-" + hex(codes[j]);
+    }
+    ranges++;
+    i = j + 1;
+  }
+  return result;
+}
+
+// On-disk index of the font families installed in the system and user font
+// directories, keyed by normalized family name. A refresh only stats the
+// directories; a directory is listed again only when its modification time
+// changed, and only new or changed files in it are parsed.
+class FontIndex {
+private:
+  // Version 2 added collections; older indexes never listed .ttc files.
+  static constexpr int INDEX_VERSION = 2;
+
+  std::string path;
+  json directories = json::object();
+  json files = json::object();
+  std::unordered_map<std::string, std::vector<std::string>> families;
+  bool loaded = false;
+  bool dirty = false;
+
+  // Raw file clock ticks; only ever compared with earlier readings.
+  static bool modificationTime(const std::string &target, int64_t &ticks) {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(target, ec);
+    ticks = ec ? 0 : (int64_t)time.time_since_epoch().count();
+    return !ec;
+  }
+
+  static json describe(const std::string &file) {
+    std::error_code ec;
+    int64_t mtime;
+    modificationTime(file, mtime);
+    json entry = {{"mtime", mtime},
+                  {"size", (uint64_t)std::filesystem::file_size(file, ec)},
+                  {"faces", json::array()}};
+    std::vector<FontFaceInfo> faces;
+    std::string error;
+    SfntParser::parseFaces(file, faces, error);
+    for (const FontFaceInfo &info : faces) {
+      entry["faces"].push_back({{"offset", info.offset},
+                                {"family", info.family},
+                                {"subfamily", info.subfamily},
+                                {"fullName", info.fullName},
+                                {"weight", info.weight},
+                                {"italic", info.italic},
+                                {"monospace", info.monospace}});
+    }
+    return entry;
+  }
+
+  void rebuildFamilies() {
+    families.clear();
+    for (const auto &file : files.items()) {
+      for (const auto &face : file.value()["faces"]) {
+        std::string family = face.value("family", "");
+        std::vector<std::string> &names = families[normalizeFontName(family)];
+        if (std::find(names.begin(), names.end(), family) == names.end()) {
+          names.push_back(family);
+        }
+      }
+    }
+  }
+
+  void load() {
+    if (loaded) {
+      return;
+    }
+    loaded = true;
+    std::ifstream file(path);
+    if (file) {
+      try {
+        json data;
+        file >> data;
+        if (data.value("version", 0) == INDEX_VERSION) {
+          directories = data["directories"];
+          files = data["files"];
+        }
+      } catch (...) {
+      }
+    }
+    if (!directories.is_object() || !files.is_object()) {
+      directories = json::object();
+      files = json::object();
+    }
+    rebuildFamilies();
+  }
+
+  // Lists one directory whose modification time changed: new or changed font
+  // files are parsed and files that disappeared are dropped.
+  void scanDirectory(const std::string &dir, json &entry, std::vector<std::string> &pending) {
+    std::vector<std::string> previous;
+    if (entry.contains("files")) {
+      previous = entry["files"].get<std::vector<std::string>>();
+    }
+    std::vector<std::string> current;
+    std::unordered_set<std::string> currentSet;
+    std::vector<std::string> subdirs;
+
+    std::error_code ec;
+    for (auto it = std::filesystem::directory_iterator(dir, ec); !ec && it != std::filesystem::directory_iterator();
+         it.increment(ec)) {
+      std::string child = it->path().string();
+      std::error_code typeError;
+      if (it->is_directory(typeError)) {
+        subdirs.push_back(child);
+        pending.push_back(child);
+      } else if (isFontFileName(child)) {
+        current.push_back(child);
+        currentSet.insert(child);
+        int64_t mtime;
+        modificationTime(child, mtime);
+        uint64_t size = it->file_size(typeError);
+        if (!files.contains(child) || files[child].value("mtime", (int64_t)0) != mtime ||
+            files[child].value("size", (uint64_t)0) != size) {
+          files[child] = describe(child);
+        }
+      }
+    }
+
+    for (const std::string &file : previous) {
+      if (!currentSet.count(file)) {
+        files.erase(file);
+      }
+    }
+    entry["files"] = current;
+    entry["subdirs"] = subdirs;
+  }
+
+public:
+  explicit FontIndex(const std::string &path) : path(path) {}
+
+  static std::string defaultPath() {
+#ifdef _WIN32
+    const char *localAppData = std::getenv("LOCALAPPDATA");
+    return localAppData ? (std::filesystem::path(localAppData) / "wta" / "font-index.json").string() : "";
+#else
+    const char *cacheHome = std::getenv("XDG_CACHE_HOME");
+    const char *home = std::getenv("HOME");
+    if (cacheHome && *cacheHome) {
+      return (std::filesystem::path(cacheHome) / "wta" / "font-index.json").string();
+    }
+    return home ? (std::filesystem::path(home) / ".cache" / "wta" / "font-index.json").string() : "";
+#endif
+  }
+
+  static std::vector<std::string> fontDirectories() {
+    std::vector<std::string> dirs;
+#ifdef _WIN32
+    char windowsPath[MAX_PATH];
+    if (GetWindowsDirectoryA(windowsPath, MAX_PATH) != 0) {
+      dirs.push_back(std::string(windowsPath) + "\\Fonts");
+    }
+    if (const char *localAppData = std::getenv("LOCALAPPDATA")) {
+      dirs.push_back((std::filesystem::path(localAppData) / "Microsoft" / "Windows" / "Fonts").string());
+    }
+#else
+    if (const char *home = std::getenv("HOME")) {
+      dirs.push_back((std::filesystem::path(home) / ".local" / "share" / "fonts").string());
+      dirs.push_back((std::filesystem::path(home) / ".fonts").string());
+    }
+    dirs.push_back("/usr/local/share/fonts");
+    dirs.push_back("/usr/share/fonts");
+#endif
+    return dirs;
+  }
+
+  void refresh() {
+    load();
+    std::vector<std::string> pending = fontDirectories();
+    std::unordered_set<std::string> seen;
+
+    while (!pending.empty()) {
+      std::string dir = pending.back();
+      pending.pop_back();
+      int64_t mtime;
+      if (!modificationTime(dir, mtime)) {
+        continue;
+      }
+      seen.insert(dir);
+
+      json &entry = directories[dir];
+      if (!entry.is_object()) {
+        entry = json::object();
+      }
+      if (entry.contains("mtime") && entry["mtime"].get<int64_t>() == mtime) {
+        for (const auto &subdir : entry["subdirs"]) {
+          pending.push_back(subdir.get<std::string>());
+        }
+        continue;
+      }
+      scanDirectory(dir, entry, pending);
+      entry["mtime"] = mtime;
+      dirty = true;
+    }
+
+    std::vector<std::string> removed;
+    for (const auto &dir : directories.items()) {
+      if (!seen.count(dir.key())) {
+        removed.push_back(dir.key());
+      }
+    }
+    for (const std::string &dir : removed) {
+      for (const auto &file : directories[dir]["files"]) {
+        files.erase(file.get<std::string>());
+      }
+      directories.erase(dir);
+      dirty = true;
+    }
+
+    if (dirty) {
+      rebuildFamilies();
+      save();
+    }
+  }
+
+  // Re-reads files just written or removed by the installer. Overwriting a
+  // font in place does not touch its directory's modification time, so a
+  // refresh alone would miss it.
+  void update(const std::vector<std::string> &paths) {
+    load();
+    for (const std::string &file : paths) {
+      std::error_code ec;
+      bool exists = std::filesystem::is_regular_file(file, ec);
+      if (exists) {
+        files[file] = describe(file);
+      } else {
+        files.erase(file);
+      }
+      std::string dir = std::filesystem::path(file).parent_path().string();
+      if (directories.contains(dir)) {
+        json &list = directories[dir]["files"];
+        auto it = std::find(list.begin(), list.end(), file);
+        if (exists && it == list.end()) {
+          list.push_back(file);
+        } else if (!exists && it != list.end()) {
+          list.erase(it);
+        }
+      }
+      dirty = true;
+    }
+    if (dirty) {
+      rebuildFamilies();
+      save();
+    }
+  }
+
+  // Exact family names win over Nerd Font suffixed ones, then shorter names,
+  // so "JetBrainsMono" picks "JetBrainsMono Nerd Font" over its Mono variant.
+  bool findFamily(const std::string &name, std::string &family) const {
+    std::string key = normalizeFontName(name);
+    family.clear();
+    auto exact = families.find(key);
+    if (exact != families.end()) {
+      family = exact->second.front();
+      return true;
+    }
+    for (const char *suffix : NERD_FONT_SUFFIXES) {
+      auto it = families.find(key + suffix);
+      if (it == families.end()) {
+        continue;
+      }
+      for (const std::string &candidate : it->second) {
+        if (family.empty() || candidate.size() < family.size()) {
+          family = candidate;
+        }
+      }
+    }
+    return !family.empty();
+  }
+
+  size_t familyCount() const { return families.size(); }
+
+  std::vector<std::string> familyNames() const {
+    std::vector<std::string> names;
+    for (const auto &family : families) {
+      names.insert(names.end(), family.second.begin(), family.second.end());
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+  }
+
+  // The faces of one family as (file, face offset) pairs.
+  std::vector<std::pair<std::string, uint32_t>> facesOf(const std::string &family) const {
+    std::vector<std::pair<std::string, uint32_t>> faces;
+    for (const auto &file : files.items()) {
+      for (const auto &face : file.value()["faces"]) {
+        if (face.value("family", "") == family) {
+          faces.emplace_back(file.key(), face.value("offset", 0u));
+        }
+      }
+    }
+    return faces;
+  }
+
+  void save() {
+    dirty = false;
+    if (path.empty()) {
+      return;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    // Several wta processes may save at once, e.g. at logon; each writes its
+    // own temporary file and the last rename wins.
+    std::string tempPath = path + ".tmp" + std::to_string(std::random_device()());
+    std::ofstream file(tempPath, std::ios::trunc);
+    file << json({{"version", INDEX_VERSION}, {"directories", directories}, {"files", files}}).dump();
+    file.close();
+    if (file) {
+      std::filesystem::rename(tempPath, path, ec);
+    }
+    if (!file || ec) {
+      std::filesystem::remove(tempPath, ec);
+    }
+  }
+};
+
+// The release a catalog URL points at, such as "v3.4.0" in
+// ".../releases/download/v3.4.0/JetBrainsMono.zip", or "" if it names none.
+std::string releaseVersion(const std::string &url) {
+  for (size_t at = url.find("/v"); at != std::string::npos; at = url.find("/v", at + 1)) {
+    if (at + 2 < url.size() && std::isdigit((unsigned char)url[at + 2])) {
+      size_t end = url.find('/', at + 1);
+      return url.substr(at + 1, end == std::string::npos ? std::string::npos : end - at - 1);
+    }
+  }
+  return "";
+}
+
+// "tar.xz" for .tar.xz and .txz archive URLs, "zip" for anything else.
+std::string archiveFormat(const std::string &url) {
+  std::string path = url.substr(0, url.find_first_of("?#"));
+  std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+  auto endsWith = [&](const std::string &suffix) {
+    return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+  };
+  return endsWith(".tar.xz") || endsWith(".txz") ? "tar.xz" : "zip";
+}
+
+// What wta installed, by catalog name: the archive each font came from and
+// every file written, with its SHA-256 and registry value. Upgrades diff it
+// against the catalog and uninstall removes exactly what it lists. Fonts are
+// installed for the whole machine on Windows, so the manifest sits next to
+// the WTA config rather than in a user profile.
+class FontManifest {
+private:
+  std::string path;
+
+  json read() const {
+    json data;
+    std::ifstream file(path);
+    if (file) {
+      try {
+        file >> data;
+      } catch (...) {
+        data = json();
+      }
+    }
+    if (!data.is_object() || data.value("version", 0) != 1 || !data["fonts"].is_object()) {
+      return json::object();
+    }
+    return data["fonts"];
+  }
+
+public:
+  explicit FontManifest(const std::string &path) : path(path) {}
+
+  static std::string defaultPath() {
+#ifdef _WIN32
+    const char *programData = std::getenv("ProgramData");
+    return (std::filesystem::path(programData ? programData : "C:\\ProgramData") / "wta" / "installed-fonts.json")
+        .string();
+#else
+    const char *dataHome = std::getenv("XDG_DATA_HOME");
+    const char *home = std::getenv("HOME");
+    if (dataHome && *dataHome) {
+      return (std::filesystem::path(dataHome) / "wta" / "installed-fonts.json").string();
+    }
+    return home ? (std::filesystem::path(home) / ".local" / "share" / "wta" / "installed-fonts.json").string() : "";
+#endif
+  }
+
+  json fonts() const { return path.empty() ? json::object() : read(); }
+
+  // Re-reads the manifest under a lock before applying the change, so
+  // concurrent installs do not drop each other's entries.
+  bool update(const std::function<void(json &fonts)> &change) {
+    if (path.empty()) {
+      return false;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    FileLock lock(path + ".lock");
+    if (!lock.locked()) {
+      return false;
+    }
+    json fonts = read();
+    change(fonts);
+
+    std::string tempPath = path + ".tmp";
+    std::ofstream file(tempPath, std::ios::trunc);
+    file << std::setw(2) << json({{"version", 1}, {"fonts", fonts}}) << std::endl;
+    file.close();
+    if (!file) {
+      std::filesystem::remove(tempPath, ec);
+      return false;
+    }
+    std::filesystem::rename(tempPath, path, ec);
+    return !ec;
+  }
+
+  static json makeEntry(const std::string &url, const std::string &archiveDigest,
+                        const std::vector<std::string> &files,
+                        const std::unordered_map<std::string, std::string> &digests,
+                        const std::unordered_map<std::string, std::string> &registryValues) {
+    json entry = {{"url", url},
+                  {"version", releaseVersion(url)},
+                  {"archiveSha256", archiveDigest},
+                  {"installedAt", std::chrono::duration_cast<std::chrono::seconds>(
+                                      std::chrono::system_clock::now().time_since_epoch())
+                                      .count()},
+                  {"files", json::object()}};
+    for (const std::string &file : files) {
+      std::error_code ec;
+      auto digest = digests.find(file);
+      entry["files"][file] = {{"sha256", digest == digests.end() ? "" : digest->second},
+                              {"size", (uint64_t)std::filesystem::file_size(file, ec)}};
+      auto value = registryValues.find(file);
+      if (value != registryValues.end()) {
+        entry["files"][file]["registryValue"] = value->second;
+      }
+    }
+    return entry;
+  }
+};
+
+class FontInstaller {
+public:
+  struct InstallStats {
+    uint64_t bytesWritten = 0;
+    int filesInstalled = 0;
+    // Single-face files skipped because a collection in the archive already
+    // holds the same faces.
+    int duplicatesSkipped = 0;
+    // Files left in place because the installed copy matched the archive.
+    int unchangedSkipped = 0;
+    // Files left out by the install filter.
+    int filteredOut = 0;
+    // Files refused because their tables or checksums are broken.
+    int invalidSkipped = 0;
+    std::vector<std::string> files;
+    // SHA-256 of each installed file, keyed by its path in the Fonts directory.
+    std::unordered_map<std::string, std::string> digests;
+    // Registry value written for each file; Windows only.
+    std::unordered_map<std::string, std::string> registryValues;
+  };
+
+  // Font entries are inflated straight into the Fonts directory under a
+  // temporary name and renamed over the installed file, so each font byte is
+  // written once and the rest of the archive never touches the disk.
+  bool extractAndInstallFonts(const std::string &archivePath) {
+    MappedFile file;
+    if (file.open(archivePath) && XzSource::hasMagic(file.data(), file.size())) {
+      MemorySource source(file.data(), file.size());
+      return streamAndInstallFonts(source, [] { return true; });
+    }
+    file.close();
+
+    stats = InstallStats();
+    std::string fontsDir = getFontsDirectory();
+    if (fontsDir.empty()) {
+      return false;
+    }
+
+    ZipArchive archive;
+    if (!archive.open(archivePath)) {
+      std::cerr << "Error: Failed to extract font archive: " << archive.error() << std::endl;
+      return false;
+    }
+
+    std::cout << "Note: Font installation may require administrator privileges." << std::endl;
+
+    bool fontsInstalled = installFontsFromArchive(archive, fontsDir);
+    archive.close();
+    return fontsInstalled;
+  }
+
+  // The entries an install from `archive` would extract: font files the
+  // filter does not rule out by name and whose installed copy differs. Used
+  // to fetch only those parts of a remote archive.
+  std::vector<const ZipEntry *> entriesToExtract(const ZipArchive &archive) {
+    std::vector<const ZipEntry *> wanted;
+    std::string fontsDir = getFontsDirectory();
+    if (fontsDir.empty()) {
+      return wanted;
+    }
+    for (const ZipEntry &entry : archive.entries()) {
+      std::string fileName = std::filesystem::path(entry.name).filename().string();
+      std::string digest;
+      if (isFontFileName(fileName) && filter.fromFileName(fileName) != FontFilter::Decision::Skip &&
+          !installedCopyMatches((std::filesystem::path(fontsDir) / fileName).string(), entry, digest)) {
+        wanted.push_back(&entry);
+      }
+    }
+    return wanted;
+  }
+
+  // Installs from an archive whose central directory has been read and whose
+  // wanted entries have been fetched, see entriesToExtract.
+  bool installFromPartialArchive(const ZipArchive &archive) {
+    stats = InstallStats();
+    std::string fontsDir = getFontsDirectory();
+    if (fontsDir.empty()) {
+      return false;
+    }
+    std::cout << "Note: Font installation may require administrator privileges." << std::endl;
+    return installFontsFromArchive(archive, fontsDir);
+  }
+
+  // Installs fonts as the archive arrives: zip archives entry by entry, and
+  // .tar.xz archives through XzSource and a tar reader. Fonts are written
+  // into the Fonts directory under temporary names and only replace installed
+  // fonts once the whole archive has been read and verifyArchive accepts it.
+  bool streamAndInstallFonts(ByteSource &source, const std::function<bool()> &verifyArchive) {
+    stats = InstallStats();
+    std::string fontsDir = getFontsDirectory();
+    if (fontsDir.empty()) {
+      return false;
+    }
+
+    std::cout << "Note: Font installation may require administrator privileges." << std::endl;
+
+    InputStream in(source);
+    std::vector<StagedFont> stagedFonts;
+    std::string error = XzSource::isXz(in) ? stageTarXzStream(in, fontsDir, stagedFonts)
+                                           : stageZipStream(in, fontsDir, stagedFonts);
+    bool valid = error.empty();
+    if (!valid) {
+      std::cerr << "Error: Failed to extract font archive: " << error << std::endl;
+    } else {
+      in.skipToEnd();
+      valid = verifyArchive();
+    }
+
+    std::vector<char> rejected(stagedFonts.size(), 0);
+    if (valid) {
+      forEachParallel(stagedFonts.size(), [&](size_t i) { rejected[i] = !validateFont(stagedFonts[i]); });
+    }
+
+    std::vector<bool> filtered(stagedFonts.size(), false);
+    std::unordered_set<std::string> coveredFaces;
+    if (valid) {
+      for (size_t i = 0; i < stagedFonts.size(); ++i) {
+        const StagedFont &font = stagedFonts[i];
+        if (rejected[i]) {
+          continue;
+        }
+        if (font.filterPending && !matchesFilter(font.contentPath)) {
+          filtered[i] = true;
+        } else if (isFontCollectionName(font.destPath)) {
+          addFaceKeys(font.contentPath, coveredFaces);
+        }
+      }
+    }
+
+    bool fontsInstalled = false;
+    for (size_t i = 0; i < stagedFonts.size(); ++i) {
+      const StagedFont &font = stagedFonts[i];
+      if (!valid || rejected[i]) {
+        discardFont(font);
+      } else if (filtered[i]) {
+        discardFont(font);
+        stats.filteredOut++;
+      } else if (!isFontCollectionName(font.destPath) && isCoveredByCollection(font.contentPath, coveredFaces)) {
+        discardFont(font);
+        stats.duplicatesSkipped++;
+      } else if (commitFont(font)) {
+        fontsInstalled = true;
+      }
+    }
+    if (valid) {
+      reportFilteredOut();
+    }
+    return valid && fontsInstalled;
+  }
+
+  const InstallStats &lastStats() const { return stats; }
+
+  // The manifest names the files to delete, and on Windows it sits in a
+  // directory a non-admin could have created first. Only a file directly in
+  // the Fonts directory, after resolving links and "..", is ever removed.
+  bool inFontsDirectory(const std::string &file) {
+    std::error_code ec;
+    std::filesystem::path fontsDir = std::filesystem::weakly_canonical(getFontsDirectory(), ec);
+    if (ec || fontsDir.empty()) {
+      return false;
+    }
+    std::filesystem::path path = std::filesystem::weakly_canonical(file, ec);
+    return !ec && path.has_filename() && path.parent_path() == fontsDir;
+  }
+
+  // Deletes installed fonts and their registry values in one pass. A file
+  // still loaded by a running application is deleted when Windows restarts.
+  void removeFonts(const std::vector<std::string> &files, const std::vector<std::string> &registryValues,
+                   std::vector<std::string> &removed) {
+#ifdef _WIN32
+    if (!registryValues.empty()) {
+      HKEY hKey;
+      if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, "SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Fonts", 0,
+                        KEY_SET_VALUE, &hKey) == ERROR_SUCCESS) {
+        for (const std::string &value : registryValues) {
+          RegDeleteValueA(hKey, value.c_str());
+        }
+        RegCloseKey(hKey);
+      } else {
+        std::cout << "Warning: Could not remove fonts from the registry (requires admin rights)" << std::endl;
+      }
+    }
+#else
+    (void)registryValues;
+#endif
+    for (const std::string &file : files) {
+      if (!inFontsDirectory(file)) {
+        std::cerr << "Error: Refusing to remove " << file << ", which is not in the Fonts directory." << std::endl;
+        continue;
+      }
+      std::error_code ec;
+      if (std::filesystem::remove(file, ec) || !std::filesystem::exists(file, ec)) {
+        removed.push_back(file);
+        continue;
+      }
+#ifdef _WIN32
+      if (MoveFileExA(file.c_str(), NULL, MOVEFILE_DELAY_UNTIL_REBOOT)) {
+        std::cout << "Note: " << file << " is in use and will be removed when Windows restarts." << std::endl;
+        removed.push_back(file);
+        continue;
+      }
+#endif
+      std::cerr << "Error: Could not remove " << file << std::endl;
+    }
+  }
+
+  void setThreadCount(unsigned count) { threadCount = count; }
+  void setFilter(const FontFilter &newFilter) { filter = newFilter; }
+
+private:
+  InstallStats stats;
+  unsigned threadCount = 0;
+  FontFilter filter;
+  std::mutex installMutex;
+
+  // A font staged for installation. contentPath holds the new contents: a
+  // .part file next to destPath, or destPath itself when the installed copy
+  // already matches the archive.
+  struct StagedFont {
+    std::string destPath;
+    std::string contentPath;
+    std::string digest;
+    bool unchanged = false;
+    // Set when the file name did not say whether the filter keeps it.
+    bool filterPending = false;
+  };
+
+  // Zip entries only carry a CRC-32, so an installed file counts as current
+  // when its size and CRC-32 match; the SHA-256 recorded in the manifest is
+  // then taken from the installed copy.
+  static bool installedCopyMatches(const std::string &path, const ZipEntry &entry, std::string &digest) {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec || size != entry.uncompressedSize || size == 0) {
+      return false;
+    }
+    MappedFile file;
+    if (!file.open(path) || Crc32::update(0, file.data(), file.size()) != entry.crc32) {
+      return false;
+    }
+    Sha256 hasher;
+    hasher.update(file.data(), file.size());
+    digest = hasher.hexDigest();
+    return true;
+  }
+
+  // Deals entries out largest-first to the least loaded worker so a handful of
+  // big files does not leave the other cores idle at the end.
+  std::vector<std::vector<const ZipEntry *>> partitionEntries(std::vector<const ZipEntry *> entries,
+                                                              size_t workerCount) {
+    std::sort(entries.begin(), entries.end(), [](const ZipEntry *a, const ZipEntry *b) {
+      return a->compressedSize > b->compressedSize;
+    });
+
+    std::vector<std::vector<const ZipEntry *>> batches(workerCount);
+    std::vector<uint64_t> loads(workerCount, 0);
+    for (const ZipEntry *entry : entries) {
+      size_t target = std::min_element(loads.begin(), loads.end()) - loads.begin();
+      batches[target].push_back(entry);
+      loads[target] += entry->compressedSize + 1;
+    }
+    return batches;
+  }
+
+  // Files that cannot be parsed are kept, as they were before filtering.
+  bool matchesFilter(const std::string &fontFile) {
+    std::vector<FontFaceInfo> faces;
+    std::string error;
+    return !SfntParser::parseFaces(fontFile, faces, error) || filter.matches(faces);
+  }
+
+  void reportFilteredOut() {
+    if (stats.filteredOut > 0 && stats.filesInstalled == 0) {
+      std::cerr << "Error: No font files in the archive match the requested variants, weights and styles."
+                << std::endl;
+    }
+  }
+
+  void addFaceKeys(const std::string &fontFile, std::unordered_set<std::string> &keys) {
+    std::vector<FontFaceInfo> faces;
+    std::string error;
+    if (SfntParser::parseFaces(fontFile, faces, error)) {
+      for (const FontFaceInfo &face : faces) {
+        keys.insert(fontFaceKey(face));
+      }
+    }
+  }
+
+  bool isCoveredByCollection(const std::string &fontFile, const std::unordered_set<std::string> &keys) {
+    if (keys.empty()) {
+      return false;
+    }
+    std::vector<FontFaceInfo> faces;
+    std::string error;
+    if (!SfntParser::parseFaces(fontFile, faces, error)) {
+      return false;
+    }
+    for (const FontFaceInfo &face : faces) {
+      if (!keys.count(fontFaceKey(face))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Runs work(0) .. work(count - 1) on the install threads, handing out
+  // indices one at a time.
+  void forEachParallel(size_t count, const std::function<void(size_t)> &work) {
+    unsigned threads = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min<size_t>(threads, count); ++t) {
+      workers.emplace_back([&] {
+        for (size_t i = next++; i < count; i = next++) {
+          work(i);
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  void forEachEntryParallel(const std::vector<const ZipEntry *> &entries,
+                            const std::function<void(const ZipEntry &)> &work) {
+    if (entries.empty()) {
+      return;
+    }
+    unsigned threads = threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::vector<const ZipEntry *>> batches =
+        partitionEntries(entries, std::min<size_t>(threads, entries.size()));
+
+    std::vector<std::thread> workers;
+    for (const auto &batch : batches) {
+      workers.emplace_back([&, batch] {
+        for (const ZipEntry *entry : batch) {
+          work(*entry);
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Collections are installed first so that the single-face files they
+  // already contain can be skipped in the second pass.
+  bool installFontsFromArchive(const ZipArchive &archive, const std::string &fontsDir) {
+    std::vector<const ZipEntry *> collections;
+    std::vector<const ZipEntry *> singles;
+    std::unordered_set<const ZipEntry *> undecided;
+    for (const ZipEntry &entry : archive.entries()) {
+      std::string fileName = std::filesystem::path(entry.name).filename().string();
+      if (!isFontFileName(fileName)) {
+        continue;
+      }
+      FontFilter::Decision decision = filter.fromFileName(fileName);
+      if (decision == FontFilter::Decision::Skip) {
+        stats.filteredOut++;
+        continue;
+      }
+      if (decision == FontFilter::Decision::Unknown) {
+        undecided.insert(&entry);
+      }
+      (isFontCollectionName(fileName) ? collections : singles).push_back(&entry);
+    }
+    if (collections.empty() && singles.empty()) {
+      reportFilteredOut();
+      return false;
+    }
+
+    std::atomic<bool> fontsInstalled(false);
+    std::atomic<bool> extractFailed(false);
+    std::atomic<int> filtered(0);
+    std::unordered_set<std::string> coveredFaces;
+
+    forEachEntryParallel(collections, [&](const ZipEntry &entry) {
+      StagedFont font;
+      if (!stageEntry(archive, entry, fontsDir, font)) {
+        extractFailed = true;
+        return;
+      }
+      if (!validateFont(font)) {
+        discardFont(font);
+        return;
+      }
+      if (undecided.count(&entry) && !matchesFilter(font.contentPath)) {
+        discardFont(font);
+        filtered++;
+        return;
+      }
+      std::unordered_set<std::string> keys;
+      addFaceKeys(font.contentPath, keys);
+      {
+        std::lock_guard<std::mutex> lock(installMutex);
+        coveredFaces.insert(keys.begin(), keys.end());
+      }
+      if (commitFont(font)) {
+        fontsInstalled = true;
+      }
+    });
+
+    std::atomic<int> duplicates(0);
+    forEachEntryParallel(singles, [&](const ZipEntry &entry) {
+      StagedFont font;
+      if (!stageEntry(archive, entry, fontsDir, font)) {
+        extractFailed = true;
+      } else if (!validateFont(font)) {
+        discardFont(font);
+      } else if (undecided.count(&entry) && !matchesFilter(font.contentPath)) {
+        discardFont(font);
+        filtered++;
+      } else if (isCoveredByCollection(font.contentPath, coveredFaces)) {
+        discardFont(font);
+        duplicates++;
+      } else if (commitFont(font)) {
+        fontsInstalled = true;
+      }
+    });
+    stats.duplicatesSkipped = duplicates;
+    stats.filteredOut += filtered;
+    if (!extractFailed) {
+      reportFilteredOut();
+    }
+
+    return fontsInstalled && !extractFailed;
+  }
+
+  // Inflates one entry next to its destination. The temporary name includes
+  // the entry's offset, since archives may hold the same file name twice.
+  bool stageEntry(const ZipArchive &archive, const ZipEntry &entry, const std::string &fontsDir, StagedFont &font) {
+    std::string fileName = std::filesystem::path(entry.name).filename().string();
+    font.destPath = (std::filesystem::path(fontsDir) / fileName).string();
+    if (installedCopyMatches(font.destPath, entry, font.digest)) {
+      font.contentPath = font.destPath;
+      font.unchanged = true;
+      return true;
+    }
+
+    font.contentPath = font.destPath + "." + std::to_string(entry.localHeaderOffset) + ".part";
+    std::ofstream outFile(font.contentPath, std::ios::binary);
+    if (!outFile) {
+      std::lock_guard<std::mutex> lock(installMutex);
+      std::cerr << "Error: Could not write font file to " << font.destPath << std::endl;
+      return false;
+    }
+
+    uint64_t written = 0;
+    std::string error;
+    Sha256 hasher;
+    bool ok = archive.extract(entry, [&](const uint8_t *data, size_t size) {
+      outFile.write(reinterpret_cast<const char *>(data), size);
+      hasher.update(data, size);
+      written += size;
+      return (bool)outFile;
+    }, error);
+    outFile.close();
+    font.digest = hasher.hexDigest();
+
+    std::lock_guard<std::mutex> lock(installMutex);
+    stats.bytesWritten += written;
+    if (!ok) {
+      std::cerr << "Error: Failed to extract font archive: " << error << std::endl;
+      std::error_code ec;
+      std::filesystem::remove(font.contentPath, ec);
+    }
+    return ok;
+  }
+
+  // Returns the error that stopped reading, or an empty string.
+  std::string stageZipStream(InputStream &in, const std::string &fontsDir, std::vector<StagedFont> &stagedFonts) {
+    ZipStreamReader reader(in);
+    ZipEntry entry;
+    while (reader.nextEntry(entry)) {
+      std::string fileName = std::filesystem::path(entry.name).filename().string();
+      FontFilter::Decision decision =
+          isFontFileName(fileName) ? filter.fromFileName(fileName) : FontFilter::Decision::Skip;
+      if (decision == FontFilter::Decision::Skip) {
+        if (isFontFileName(fileName)) {
+          stats.filteredOut++;
+        }
+        if (!reader.skipEntry(entry)) {
+          break;
+        }
+        continue;
+      }
+
+      StagedFont font;
+      font.destPath = (std::filesystem::path(fontsDir) / fileName).string();
+      font.filterPending = decision == FontFilter::Decision::Unknown;
+      if (!(entry.flags & 0x08) && installedCopyMatches(font.destPath, entry, font.digest)) {
+        if (!reader.skipEntry(entry)) {
+          break;
+        }
+        font.contentPath = font.destPath;
+        font.unchanged = true;
+        stagedFonts.push_back(font);
+        continue;
+      }
+
+      // Numbered by position, since archives may hold the same file name twice.
+      font.contentPath = font.destPath + "." + std::to_string(stagedFonts.size()) + ".part";
+      std::ofstream outFile(font.contentPath, std::ios::binary);
+      if (!outFile) {
+        std::cerr << "Error: Could not write font file to " << font.destPath << std::endl;
+        if (!reader.skipEntry(entry)) {
+          break;
+        }
+        continue;
+      }
+
+      Sha256 hasher;
+      bool ok = reader.readEntry(entry, [&](const uint8_t *data, size_t size) {
+        outFile.write(reinterpret_cast<const char *>(data), size);
+        hasher.update(data, size);
+        stats.bytesWritten += size;
+        return (bool)outFile;
+      });
+      outFile.close();
+      font.digest = hasher.hexDigest();
+      stagedFonts.push_back(font);
+      if (!ok) {
+        break;
+      }
+    }
+    return reader.error();
+  }
+
+  // Tar entries carry no checksum, so an installed file of the same size is
+  // compared with the entry as it decodes; the .part file is only written
+  // once the contents differ.
+  std::string stageTarXzStream(InputStream &in, const std::string &fontsDir, std::vector<StagedFont> &stagedFonts) {
+    XzSource xz(in);
+    InputStream tarIn(xz);
+    TarStreamReader reader(tarIn);
+    TarEntry entry;
+    while (reader.nextEntry(entry)) {
+      std::string fileName = std::filesystem::path(entry.name).filename().string();
+      bool isFont = entry.isFile() && isFontFileName(fileName);
+      FontFilter::Decision decision = isFont ? filter.fromFileName(fileName) : FontFilter::Decision::Skip;
+      if (decision == FontFilter::Decision::Skip) {
+        if (isFont) {
+          stats.filteredOut++;
+        }
+        if (!reader.skipEntry(entry)) {
+          break;
+        }
+        continue;
+      }
+
+      StagedFont font;
+      font.destPath = (std::filesystem::path(fontsDir) / fileName).string();
+      font.contentPath = font.destPath + "." + std::to_string(stagedFonts.size()) + ".part";
+      font.filterPending = decision == FontFilter::Decision::Unknown;
+      std::error_code ec;
+      MappedFile installed;
+      bool comparing = entry.size > 0 && std::filesystem::file_size(font.destPath, ec) == entry.size && !ec &&
+                       installed.open(font.destPath);
+      std::ofstream outFile;
+      if (!comparing) {
+        outFile.open(font.contentPath, std::ios::binary);
+        if (!outFile) {
+          std::cerr << "Error: Could not write font file to " << font.destPath << std::endl;
+          if (!reader.skipEntry(entry)) {
+            break;
+          }
+          continue;
+        }
+      }
+
+      Sha256 hasher;
+      uint64_t matched = 0;
+      bool ok = reader.readEntry(entry, [&](const uint8_t *data, size_t size) {
+        hasher.update(data, size);
+        if (comparing) {
+          if (std::memcmp(installed.data() + matched, data, size) == 0) {
+            matched += size;
+            return true;
+          }
+          comparing = false;
+          outFile.open(font.contentPath, std::ios::binary);
+          outFile.write(reinterpret_cast<const char *>(installed.data()), matched);
+          stats.bytesWritten += matched;
+        }
+        outFile.write(reinterpret_cast<const char *>(data), size);
+        stats.bytesWritten += size;
+        return (bool)outFile;
+      });
+      outFile.close();
+      font.digest = hasher.hexDigest();
+      if (comparing) {
+        font.contentPath = font.destPath;
+        font.unchanged = true;
+      }
+      stagedFonts.push_back(font);
+      if (!ok) {
+        break;
+      }
+    }
+    if (reader.error().empty()) {
+      // Decode what follows the end-of-archive marker so the xz index and
+      // block checks are verified too.
+      tarIn.skipToEnd();
+    }
+    return xz.error().empty() ? reader.error() : xz.error();
+  }
+
+  // Checks a staged font's table directory and checksums before it can
+  // replace anything. Files already installed unchanged are not rechecked.
+  bool validateFont(const StagedFont &font) {
+    if (font.unchanged) {
+      return true;
+    }
+    MappedFile file;
+    std::string error;
+    if (!file.open(font.contentPath)) {
+      error = "could not be read back";
+    } else if (SfntParser::validate(file.data(), file.size(), error)) {
+      return true;
+    }
+    std::lock_guard<std::mutex> lock(installMutex);
+    stats.invalidSkipped++;
+    std::cerr << "Error: " << std::filesystem::path(font.destPath).filename().string()
+              << " is not a valid font (" << error << ") and was not installed." << std::endl;
+    return false;
+  }
+
+  void discardFont(const StagedFont &font) {
+    if (!font.unchanged) {
+      std::error_code ec;
+      std::filesystem::remove(font.contentPath, ec);
+    }
+  }
+
+  bool commitFont(const StagedFont &font) {
+    std::error_code ec;
+    if (!font.unchanged) {
+      std::filesystem::rename(font.contentPath, font.destPath, ec);
+    }
+    std::lock_guard<std::mutex> lock(installMutex);
+    if (ec) {
+      std::cerr << "Error: Could not replace font file " << font.destPath << std::endl;
+      std::filesystem::remove(font.contentPath, ec);
+      return false;
+    }
+    stats.filesInstalled++;
+    stats.unchangedSkipped += font.unchanged;
+    stats.files.push_back(font.destPath);
+    stats.digests[font.destPath] = font.digest;
+    std::string valueName = registerFontInRegistry(font.destPath);
+    if (!valueName.empty()) {
+      stats.registryValues[font.destPath] = valueName;
+    }
+    return true;
+  }
+
+  std::string getFontsDirectory() {
+#ifdef _WIN32
+    char fontsPath[MAX_PATH];
+    if (GetWindowsDirectoryA(fontsPath, MAX_PATH) == 0) {
+      std::cerr << "Error: Could not get Windows directory." << std::endl;
+      return "";
+    }
+    return std::string(fontsPath) + "\\Fonts";
+#else
+    const char *home = std::getenv("HOME");
+    if (!home) {
+      std::cerr << "Error: Could not get HOME directory." << std::endl;
+      return "";
+    }
+    std::filesystem::path fontsPath = std::filesystem::path(home) / ".local" / "share" / "fonts";
+    std::error_code ec;
+    std::filesystem::create_directories(fontsPath, ec);
+    return fontsPath.string();
+#endif
+  }
+
+  // Fonts are registered under their full name from the name table, the way
+  // the Fonts control panel does, falling back to the file name. A collection
+  // gets one value naming all its faces, e.g. "Cascadia Code & Cascadia Mono
+  // (TrueType)". Returns the value name, or "" if nothing was written.
+  std::string registerFontInRegistry(const std::string &fontFile) {
+    std::string fileName = std::filesystem::path(fontFile).filename().string();
+    std::string fontName = std::filesystem::path(fontFile).stem().string();
+    std::string valueName = fontName;
+    std::vector<FontFaceInfo> faces;
+    std::string error;
+    if (SfntParser::parseFaces(fontFile, faces, error)) {
+      std::vector<std::string> names;
+      for (const FontFaceInfo &face : faces) {
+        if (std::find(names.begin(), names.end(), face.fullName) == names.end()) {
+          names.push_back(face.fullName);
+        }
+      }
+      fontName.clear();
+      for (const std::string &name : names) {
+        fontName += (fontName.empty() ? "" : " & ") + name;
+      }
+      bool cff = faces.size() == 1 && faces.front().cff;
+      valueName = fontName + (cff ? " (OpenType)" : " (TrueType)");
+    }
+
+#ifdef _WIN32
+    HKEY hKey;
+    if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, 
+                     "SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\Fonts",
+                     0, KEY_WRITE, &hKey) == ERROR_SUCCESS) {
+      LONG result = RegSetValueExA(hKey, valueName.c_str(), 0, REG_SZ,
+                                   (const BYTE*)fileName.c_str(), fileName.length() + 1);
+      RegCloseKey(hKey);
+      std::cout << "Installed font: " << fontName << std::endl;
+      return result == ERROR_SUCCESS ? valueName : "";
+    }
+    std::cout << "Warning: Could not register font in registry (requires admin rights)" << std::endl;
+    return "";
+#else
+    // Fontconfig picks up files in the user fonts directory on its own.
+    std::cout << "Installed font: " << fontName << " (" << fileName << ")" << std::endl;
+    return "";
+#endif
+  }
+};
+
+class FontManager {
+private:
+  const std::string FONT_DATA_URL = "https://raw.githubusercontent.com/k0src/Windows-Terminal-CLI-Actions/992ac7b89305645fe6c972cbffde7592c8f32b73/font_data.json";
+  FileDownloader &downloader;
+  std::vector<std::string> catalogSources;
+  FontIndex fontIndex;
+
+public:
+  // Shares the command manager's downloader so the catalog fetch and the font
+  // download go over the same pooled connection.
+  explicit FontManager(FileDownloader &downloader) : downloader(downloader), fontIndex(FontIndex::defaultPath()) {}
+
+  void setCatalogSources(const std::vector<std::string> &sources) { catalogSources = sources; }
+
+  const std::string &defaultCatalogUrl() const { return FONT_DATA_URL; }
+
+  bool fontExists(const std::string &fontName) {
+    std::string family;
+    return findInstalledFamily(fontName, family);
+  }
+
+  // Looks up the installed family a name refers to, e.g. "JetBrainsMono"
+  // finds "JetBrainsMono Nerd Font".
+  bool findInstalledFamily(const std::string &fontName, std::string &family) {
+    fontIndex.refresh();
+    return fontIndex.findFamily(fontName, family);
+  }
+
+  void indexInstalledFonts(const std::vector<std::string> &files) { fontIndex.update(files); }
+
+  std::vector<std::string> installedFamilies() {
+    fontIndex.refresh();
+    return fontIndex.familyNames();
+  }
+
+  // The code points every style of a family maps, so a glyph only the
+  // regular face has still counts as missing for bold prompt segments. Safe
+  // to call from several threads once the index is refreshed.
+  bool familyCoverage(const std::string &family, GlyphCoverage &coverage, std::string &error) const {
+    std::vector<std::pair<std::string, uint32_t>> faces = fontIndex.facesOf(family);
+    if (faces.empty()) {
+      error = "no font files found for " + family;
+      return false;
+    }
+    for (size_t i = 0; i < faces.size(); ++i) {
+      MappedFile file;
+      if (!file.open(faces[i].first)) {
+        error = "could not open " + faces[i].first;
+        return false;
+      }
+      GlyphCoverage face;
+      if (!SfntParser::parseCoverage(file.data(), file.size(), faces[i].second, face, error)) {
+        error = faces[i].first + ": " + error;
+        return false;
+      }
+      if (i == 0) {
+        coverage = std::move(face);
+      } else {
+        coverage.intersect(face);
+      }
+    }
+    return true;
+  }
+
+  // Tries each configured catalog source in order, falling back to the
+  // upstream catalog only when none are configured.
+  json readFontData() {
+    std::vector<std::string> sources = catalogSources;
+    if (sources.empty()) {
+      sources.push_back(FONT_DATA_URL);
+    }
+
+    for (const std::string &source : sources) {
+      json data;
+      if (loadCatalog(source, data)) {
+        return data;
+      }
+      std::cerr << "Warning: Could not read font catalog from " << source << std::endl;
+    }
+    return json::array();
+  }
+
+  // Relative archive URLs in a catalog are resolved against the catalog's own
+  // location, so a mirror directory can be moved or served as-is.
+  bool loadCatalog(const std::string &source, json &data) {
+    std::string url = downloader.resolve(source);
+    std::string localPath;
+    std::string base;
+
+    if (localSourcePath(url, localPath)) {
+      std::error_code ec;
+      if (std::filesystem::is_directory(localPath, ec)) {
+        std::filesystem::path directory(localPath);
+        localPath = (directory / "font_data.json").string();
+        if (!std::filesystem::exists(localPath, ec) && std::filesystem::exists(directory / "font_data.json.gz", ec)) {
+          localPath = (directory / "font_data.json.gz").string();
+        }
+      }
+      MappedFile file;
+      if (!file.open(localPath) || file.size() == 0) {
+        return false;
+      }
+      MemorySource contents(file.data(), file.size());
+      if (!parseCatalog(contents, data)) {
+        return false;
+      }
+      base = std::filesystem::path(localPath).parent_path().string();
+    } else {
+      std::string catalogUrl = source;
+      if (!catalogUrl.empty() && catalogUrl.back() == '/') {
+        catalogUrl += "font_data.json";
+      }
+      std::unique_ptr<ByteSource> stream = downloader.openStream(catalogUrl, {{"Accept-Encoding", "gzip"}});
+      if (!stream) {
+        return false;
+      }
+      url = downloader.lastSource().url;
+      bool parsed = parseCatalog(*stream, data);
+      stream.reset();
+      if (!parsed) {
+        return false;
+      }
+      base = url.substr(0, url.rfind('/'));
+    }
+
+    if (!data.is_array()) {
+      return false;
+    }
+    auto resolveUrl = [&](json &archive) {
+      if (!archive.is_object() || !archive.contains("URL") || !archive["URL"].is_string()) {
+        return;
+      }
+      std::string fontUrl = archive["URL"].get<std::string>();
+      if (fontUrl.find("://") != std::string::npos || std::filesystem::path(fontUrl).is_absolute() ||
+          fontUrl.compare(0, 2, "\\\\") == 0) {
+        return;
+      }
+      archive["URL"] = localPath.empty() ? base + "/" + fontUrl : (std::filesystem::path(base) / fontUrl).string();
+    };
+    for (auto &font : data) {
+      resolveUrl(font);
+      if (font.is_object() && font.contains("archives") && font["archives"].is_array()) {
+        for (auto &archive : font["archives"]) {
+          resolveUrl(archive);
+        }
+      }
+    }
+    return true;
+  }
+
+  // A catalog may arrive gzip-compressed, as Content-Encoding or as a
+  // .json.gz file. Both are told apart from JSON text by the gzip magic and
+  // inflated as they are read, without a temporary file.
+  static bool parseCatalog(ByteSource &source, json &data) {
+    InputStream in(source);
+    std::string text;
+    Inflater::Sink append = [&](const uint8_t *bytes, size_t size) {
+      text.append(reinterpret_cast<const char *>(bytes), size);
+      return true;
+    };
+    if (GzipReader::isGzip(in)) {
+      GzipReader reader(in);
+      if (!reader.read(append)) {
+        std::cerr << "Error: Failed to decompress font data: " << reader.error() << std::endl;
+        return false;
+      }
+    } else {
+      uint8_t buffer[1 << 14];
+      for (size_t got; (got = in.read(buffer, sizeof(buffer))) > 0;) {
+        append(buffer, got);
+      }
+    }
+    try {
+      data = json::parse(text);
+    } catch (...) {
+      std::cerr << "Error: Failed to parse font data." << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool findFontInData(const json &fontData, const std::string &fontName, std::string &fontUrl) {
+    ExpectedContent expected;
+    return findFontInData(fontData, fontName, fontUrl, expected, "zip");
+  }
+
+  // Catalog entries may carry an optional "sha256" and "size" for the archive,
+  // and an "archives" list of the same font in other formats, each with its
+  // own "URL", "sha256" and "size". The first archive in the preferred format
+  // is chosen, falling back to the entry's own URL.
+  bool findFontInData(const json &fontData, const std::string &fontName, std::string &fontUrl,
+                      ExpectedContent &expected, const std::string &format) {
+    for (const auto &font : fontData) {
+      if (font["Name"].get<std::string>() != fontName) {
+        continue;
+      }
+      std::vector<json> archives = fontArchives(font);
+      auto chosen = std::find_if(archives.begin(), archives.end(), [&](const json &archive) {
+        return archiveFormat(archive["URL"].get<std::string>()) == format;
+      });
+      const json &archive = chosen != archives.end() ? *chosen : font;
+      fontUrl = archive["URL"].get<std::string>();
+      expected.sha256 = archive.value("sha256", "");
+      expected.size = archive.value("size", (int64_t)-1);
+      return true;
+    }
+    return false;
+  }
+
+  // The entry itself followed by its alternative archives.
+  static std::vector<json> fontArchives(const json &font) {
+    std::vector<json> archives;
+    if (font.contains("URL") && font["URL"].is_string()) {
+      archives.push_back(font);
+    }
+    if (font.contains("archives") && font["archives"].is_array()) {
+      for (const json &archive : font["archives"]) {
+        if (archive.is_object() && archive.contains("URL") && archive["URL"].is_string()) {
+          archives.push_back(archive);
+        }
+      }
+    }
+    return archives;
+  }
+
+  // True when a manifest entry was installed from any of the font's catalog
+  // archives, whatever its format.
+  bool installedFromCatalog(const json &fontData, const std::string &fontName, const json &installed) {
+    std::string installedDigest = installed.value("archiveSha256", "");
+    for (const auto &font : fontData) {
+      if (font["Name"].get<std::string>() != fontName) {
+        continue;
+      }
+      for (const json &archive : fontArchives(font)) {
+        std::string digest = archive.value("sha256", "");
+        std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+        if (digest.empty() ? installed.value("url", "") == archive["URL"].get<std::string>()
+                           : installedDigest == digest) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+};
+
+class WTAFileManager {
+private:
+  json settings;
+  std::string settingsPath;
+
+public:
+  WTAFileManager() {
+    settingsPath = getSettingsPath();
+    settings = readSettings(settingsPath);
+  }
+
+  std::string getSettingsPath() {
+    const char *localAppData = std::getenv("LOCALAPPDATA");
+    if (!localAppData) {
+      std::cerr << "Could not get LOCALAPPDATA environment variable." << std::endl;
+      std::exit(1);
+    }
+
+    std::filesystem::path path =
+        std::filesystem::path(localAppData) /
+        "Packages/Microsoft.WindowsTerminal_8wekyb3d8bbwe/LocalState/settings.json";
+
+    if (!std::filesystem::exists(path)) {
+      std::cerr << "settings.json does not exist. Make sure Windows Terminal is installed."
+                << std::endl;
+      std::exit(1);
+    }
+
+    return path.string();
+  }
+
+  json readSettings(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+      std::cerr << "Failed to open settings.json." << std::endl;
+      std::exit(1);
+    }
+
+    try {
+      json data;
+      file >> data;
+      return data;
+    } catch (...) {
+      std::cerr << "Failed to parse settings.json." << std::endl;
+      std::exit(1);
+    }
+  }
+
+  void writeSettings() {
+    std::ofstream file(settingsPath);
+    if (!file) {
+      std::cerr << "Failed to write to settings.json." << std::endl;
+      std::exit(1);
+    }
+
+    try {
+      file << std::setw(4) << settings << std::endl;
+    } catch (...) {
+      std::cerr << "Failed to write settings to settings.json." << std::endl;
+      std::exit(1);
+    }
+  }
+
+  json &getSettings() { return settings; }
+
+  bool profileExists(const std::string &profileName) {
+    return settings["profiles"].contains(profileName);
+  }
+
+  bool colorSchemeExists(const std::string &schemeName) {
+    for (const auto &scheme : settings["schemes"]) {
+      if (scheme["name"] == schemeName) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool themeExists(const std::string &themeName) {
+    if (!settings.contains("themes")) {
+      return false;
+    }
+    for (const auto &theme : settings["themes"]) {
+      if (theme["name"] == themeName) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Every font face set in a profile, including each entry of a fallback
+  // list such as "Cascadia Code, Symbols Nerd Font".
+  std::vector<std::string> referencedFontFaces() {
+    std::vector<std::string> faces;
+    auto collect = [&](const json &profile) {
+      std::string value;
+      if (profile.contains("font") && profile["font"].is_object() && profile["font"].contains("face") &&
+          profile["font"]["face"].is_string()) {
+        value = profile["font"]["face"].get<std::string>();
+      } else if (profile.contains("fontFace") && profile["fontFace"].is_string()) {
+        value = profile["fontFace"].get<std::string>();
+      }
+      std::istringstream list(value);
+      std::string face;
+      while (std::getline(list, face, ',')) {
+        face.erase(0, face.find_first_not_of(' '));
+        face.erase(face.find_last_not_of(' ') + 1);
+        if (!face.empty()) {
+          faces.push_back(face);
+        }
+      }
+    };
+    if (!settings.contains("profiles") || !settings["profiles"].is_object()) {
+      return faces;
+    }
+    for (const auto &entry : settings["profiles"].items()) {
+      if (entry.key() == "list" && entry.value().is_array()) {
+        for (const auto &profile : entry.value()) {
+          collect(profile);
+        }
+      } else if (entry.value().is_object()) {
+        collect(entry.value());
+      }
+    }
+    return faces;
+  }
+
+  bool profileNameExists(const std::string &profileName) {
+    for (const auto &profile : settings["profiles"]["list"]) {
+      if (profile["name"] == profileName) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool actionIdExists(const std::string &actionId) {
+    if (!settings.contains("actions")) {
+      return false;
+    }
+    
+    for (const auto &action : settings["actions"]) {
+      if (action.contains("id") && action["id"] == actionId) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void addAction(const json &newAction) {
+    if (!settings.contains("actions")) {
+      settings["actions"] = json::array();
+    }
+    settings["actions"].push_back(newAction);
+  }
+
+  void addKeybinding(const json &newKeybinding) {
+    if (!settings.contains("keybindings")) {
+      settings["keybindings"] = json::array();
+    }
+    settings["keybindings"].push_back(newKeybinding);
+  }
+
+  bool removeAction(const std::string &actionId) {
+    if (!settings.contains("actions")) {
+      return false;
+    }
+    
+    auto &actions = settings["actions"];
+    bool removed = false;
+    
+    for (auto it = actions.begin(); it != actions.end(); ++it) {
+      if (it->contains("id") && (*it)["id"] == actionId) {
+        actions.erase(it);
+        removed = true;
+        break;
+      }
+    }
+    
+    return removed;
+  }
+
+  int removeKeybindingsForAction(const std::string &actionId) {
     if (!settings.contains("keybindings")) {
       return 0;
     }
@@ -401,21 +7848,90 @@ public:
         ++it;
       }
     }
-    
-    return removedCount;
+    
+    return removedCount;
+  }
+};
+
+class WTACommandManager {
+private:
+  WTAFileManager fileManager;
+  FileDownloader downloader;
+  FontManager fontManager;
+  FontInstaller installer;
+  WTAConfig config;
+  ArchiveCache cache;
+  FontManifest manifest;
+  std::unordered_map<std::string, std::function<void(const std::vector<std::string> &args)>> commands;
+  bool showProgress = TransferMeter::terminalOutput();
+  // Set by --max-rate; every download in the process draws from it.
+  std::unique_ptr<RateLimiter> rateLimiter;
+  // Collects the per-font results while install-font runs with --json.
+  json *fontReports = nullptr;
+
+  // Upgrades download on several FileDownloaders at once, each set up like
+  // the main one.
+  void configureDownloader(FileDownloader &target) {
+    target.setBufferSize((size_t)std::min<uint64_t>(config.downloadBufferSize(), 64 << 20));
+    target.setUrlRewrites(config.urlRewrites());
+    target.setProgress(showProgress);
+    target.setMetricsLog(config.metricsLog());
+    target.setRateLimiter(rateLimiter.get());
+    if (!config.cacheDirectory().empty()) {
+      std::filesystem::path historyPath = std::filesystem::path(config.cacheDirectory()) / "mirror-history.json";
+      target.setMirrorHistoryPath(historyPath.string());
+    }
+  }
+
+  // With --json, each font installed or upgraded adds an entry here.
+  void reportFont(const std::string &name, bool installed, const std::string &source, const json &transfer) {
+    if (!fontReports) {
+      return;
+    }
+    json entry = {{"name", name}, {"installed", installed}, {"source", source}, {"transfer", transfer}};
+    if (installed) {
+      const FontInstaller::InstallStats &stats = installer.lastStats();
+      entry["filesInstalled"] = stats.filesInstalled;
+      entry["bytesWritten"] = stats.bytesWritten;
+    }
+    fontReports->push_back(entry);
+  }
+
+  // " in 1.9s at 3.9 MB/s (peak 4.2 MB/s)", for the download summary lines.
+  static std::string describeTransfer(const TransferMetrics &metrics) {
+    std::ostringstream out;
+    out << " in " << std::fixed << std::setprecision(1) << metrics.totalMs / 1000 << "s at "
+        << formatSize((uint64_t)metrics.averageBytesPerSecond) << "/s (peak "
+        << formatSize((uint64_t)metrics.peakBytesPerSecond) << "/s)";
+    if (metrics.retries > 0) {
+      out << " after " << metrics.retries << (metrics.retries == 1 ? " retry" : " retries");
+    }
+    return out.str();
   }
-};
 
-class WTACommandManager {
-private:
-  WTAFileManager fileManager;
-  FontManager fontManager;
-  FileDownloader downloader;
-  FontInstaller installer;
-  std::unordered_map<std::string, std::function<void(const std::vector<std::string> &args)>> commands;
+  // Coordinates a download with other wta processes fetching the same URL,
+  // through lock files in the shared cache.
+  std::unique_ptr<SingleFlight> joinDownload(const std::string &url, const std::function<void(const std::string &)> &say) {
+    std::filesystem::path directory =
+        cache.enabled() ? std::filesystem::path(cache.directory()) / "locks" : tempDirectory() / "wta-locks";
+    return std::make_unique<SingleFlight>(directory, url, config.downloadWaitTimeout(), say);
+  }
+
+  // A unique name for a download this process does not coordinate, so it
+  // cannot clobber the file another process is writing.
+  static std::string privateSuffix(const SingleFlight &flight) {
+    return flight.leader() ? "" : "." + std::to_string(std::random_device()());
+  }
 
 public:
-  WTACommandManager() {
+  WTACommandManager()
+      : fontManager(downloader), cache(config.cacheDirectory(), config.cacheMaxBytes()),
+        manifest(FontManifest::defaultPath()) {
+    configureDownloader(downloader);
+    cache.setRevalidator([this](const std::string &source, const std::string &validator) {
+      return downloader.unchanged(source, validator);
+    });
+    fontManager.setCatalogSources(config.catalogSources());
     registerCommands();
   }
 
@@ -445,6 +7961,10 @@ private:
     commands["create-profile"] = [this](const std::vector<std::string> &args) { createProfileCommand(args); };
     commands["elevate"] = [this](const std::vector<std::string> &args) { elevateCommand(args); };
     commands["install-font"] = [this](const std::vector<std::string> &args) { fontInstallCommand(args); };
+    commands["uninstall-font"] = [this](const std::vector<std::string> &args) { fontUninstallCommand(args); };
+    commands["font-coverage"] = [this](const std::vector<std::string> &args) { fontCoverageCommand(args); };
+    commands["cache"] = [this](const std::vector<std::string> &args) { cacheCommand(args); };
+    commands["mirror"] = [this](const std::vector<std::string> &args) { mirrorCommand(args); };
     commands["add-action"] = [this](const std::vector<std::string> &args) { addActionCommand(args); };
     commands["remove-action"] = [this](const std::vector<std::string> &args) { removeActionCommand(args); };
     commands["launch-mode"] = [this](const std::vector<std::string> &args) { launchModeCommand(args); };
@@ -576,7 +8096,8 @@ private:
 
       // Group commands by category for better organization
       std::cout << "Font Management:" << std::endl;
-      std::cout << "  font, font-size, font-weight, install-font" << std::endl;
+      std::cout << "  font, font-size, font-weight, font-coverage, install-font, uninstall-font" << std::endl;
+      std::cout << "  cache, mirror" << std::endl;
       std::cout << std::endl;
 
       std::cout << "Color & Themes:" << std::endl;
@@ -635,7 +8156,7 @@ private:
     std::cout << std::endl;
 
     if (commandName == "font") {
-      std::cout << "Usage: wta font <fontName> [fontSize] [weight] [profileName]" << std::endl;
+      std::cout << "Usage: wta font <fontName> [fontSize] [weight] [profileName] [--require <glyphs>]" << std::endl;
       std::cout << std::endl;
       std::cout << "Sets the font face, size, and weight for a terminal profile." << std::endl;
       std::cout << std::endl;
@@ -645,9 +8166,30 @@ private:
       std::cout << "  weight      - Font weight (optional, see font-weight command)" << std::endl;
       std::cout << "  profileName - Target profile (optional, defaults to 'defaults')" << std::endl;
       std::cout << std::endl;
+      std::cout << "Options:" << std::endl;
+      std::cout << "  --require <glyphs> - Refuse fonts missing any of these glyphs: nerd, powerline" << std::endl;
+      std::cout << "                       or a file of code points (see font-coverage)" << std::endl;
+      std::cout << std::endl;
       std::cout << "Examples:" << std::endl;
       std::cout << "  wta font \"Cascadia Code\"" << std::endl;
       std::cout << "  wta font \"Fira Code\" 14 bold PowerShell" << std::endl;
+      std::cout << "  wta font JetBrainsMono --require nerd" << std::endl;
+    }
+    else if (commandName == "font-coverage") {
+      std::cout << "Usage: wta font-coverage <fontName|--all> [--ranges nerd|powerline|<file>]" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Checks that an installed font has the glyphs prompts draw with and lists" << std::endl;
+      std::cout << "the code points it is missing. A glyph counts only if every style of the" << std::endl;
+      std::cout << "family has it." << std::endl;
+      std::cout << std::endl;
+      std::cout << "Options:" << std::endl;
+      std::cout << "  --all             - Rank every installed font family by missing glyphs" << std::endl;
+      std::cout << "  --ranges <glyphs> - nerd (default), powerline, or a file listing code points" << std::endl;
+      std::cout << "                      and ranges such as U+E0A0 or E0B0-E0B3, one or more per line" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Examples:" << std::endl;
+      std::cout << "  wta font-coverage \"Cascadia Code\"" << std::endl;
+      std::cout << "  wta font-coverage --all --ranges powerline" << std::endl;
     }
     else if (commandName == "font-size") {
       std::cout << "Usage: wta font-size <fontSize> [profileName]" << std::endl;
@@ -681,7 +8223,14 @@ private:
       std::cout << "  wta font-weight 600 PowerShell" << std::endl;
     }
     else if (commandName == "install-font") {
-      std::cout << "Usage: wta install-font <fontName|help>" << std::endl;
+      std::cout << "Usage: wta install-font <fontName|help> [--stream] [--format <tar.xz|zip>] [--threads <n>] [--json]"
+                << std::endl;
+      std::cout << "                        [--variant <default|mono|propo>] [--weights <list>] [--no-italic]"
+                << std::endl;
+      std::cout << "                        [--max-rate <rate>]" << std::endl;
+      std::cout << "       wta install-font --upgrade [fontName...] [--dry-run] [--format <tar.xz|zip>] [--threads <n>] [--json]"
+                << std::endl;
+      std::cout << "                        [--max-rate <rate>]" << std::endl;
       std::cout << std::endl;
       std::cout << "Downloads and installs Nerd Fonts from the internet." << std::endl;
       std::cout << std::endl;
@@ -689,11 +8238,78 @@ private:
       std::cout << "  fontName - Name of the Nerd Font to install" << std::endl;
       std::cout << "  help     - Shows list of available fonts" << std::endl;
       std::cout << std::endl;
+      std::cout << "Options:" << std::endl;
+      std::cout << "  --stream - Extract fonts while downloading instead of saving the archive first" << std::endl;
+      std::cout << "             (faster and writes less to disk, but cannot resume a dropped download)" << std::endl;
+      std::cout << "  --format <tar.xz|zip> - Archive format to download when the catalog offers both" << std::endl;
+      std::cout << "                  (defaults to tar.xz, which is smaller and always streamed)" << std::endl;
+      std::cout << "  --threads <n> - Number of font files to extract and install in parallel" << std::endl;
+      std::cout << "                  (defaults to the number of CPU cores)" << std::endl;
+      std::cout << "  --variant <list> - Only install these Nerd Font variants: default, mono, propo" << std::endl;
+      std::cout << "  --weights <list> - Only install these weights, by name or number (regular,bold or 400,700)"
+                << std::endl;
+      std::cout << "  --no-italic   - Leave out italic and oblique styles" << std::endl;
+      std::cout << "  --upgrade     - Reinstall installed fonts whose archive changed in the catalog" << std::endl;
+      std::cout << "                  (all fonts wta installed, or only the ones named)" << std::endl;
+      std::cout << "  --dry-run     - With --upgrade, list the fonts and bytes that would be downloaded" << std::endl;
+      std::cout << "  --json        - Print a JSON report of each font and its transfer on stdout" << std::endl;
+      std::cout << "                  (other messages go to stderr and no progress line is drawn)" << std::endl;
+      std::cout << "  --max-rate <rate> - Limit downloads to this many bytes per second, e.g. 500K or 2M" << std::endl;
+      std::cout << "                  (shared with other wta processes using the same limit)" << std::endl;
+      std::cout << std::endl;
       std::cout << "Note: Font installation may require administrator privileges." << std::endl;
       std::cout << std::endl;
       std::cout << "Examples:" << std::endl;
       std::cout << "  wta install-font help" << std::endl;
       std::cout << "  wta install-font \"Fira Code\"" << std::endl;
+      std::cout << "  wta install-font JetBrainsMono --stream" << std::endl;
+      std::cout << "  wta install-font JetBrainsMono --variant mono --weights regular,bold --no-italic" << std::endl;
+      std::cout << "  wta install-font --upgrade --dry-run" << std::endl;
+    }
+    else if (commandName == "uninstall-font") {
+      std::cout << "Usage: wta uninstall-font <fontName...|--unused> [--dry-run]" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Removes fonts installed with install-font: exactly the files and registry" << std::endl;
+      std::cout << "values recorded when they were installed." << std::endl;
+      std::cout << std::endl;
+      std::cout << "Parameters:" << std::endl;
+      std::cout << "  fontName - Catalog name or family name of an installed font" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Options:" << std::endl;
+      std::cout << "  --unused  - Remove every installed font no profile uses" << std::endl;
+      std::cout << "  --dry-run - List what would be removed" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Examples:" << std::endl;
+      std::cout << "  wta uninstall-font JetBrainsMono" << std::endl;
+      std::cout << "  wta uninstall-font --unused --dry-run" << std::endl;
+    }
+    else if (commandName == "cache") {
+      std::cout << "Usage: wta cache <stats | prune [--all]>" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Manages the shared cache of downloaded font archives." << std::endl;
+      std::cout << std::endl;
+      std::cout << "Subcommands:" << std::endl;
+      std::cout << "  stats        - Show cache location, size, and hit rate" << std::endl;
+      std::cout << "  prune        - Evict least recently used archives until the cache fits its size limit" << std::endl;
+      std::cout << "  prune --all  - Remove every cached archive" << std::endl;
+      std::cout << std::endl;
+      std::cout << "The cache directory and size limit are set with \"cacheDir\" and \"cacheMaxBytes\"" << std::endl;
+      std::cout << "in the WTA config file (" << WTAConfig::configPath() << ")." << std::endl;
+    }
+    else if (commandName == "mirror") {
+      std::cout << "Usage: wta mirror sync <directory> [--catalog <source>]" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Copies the font catalog and its archives into a directory that can be used as an" << std::endl;
+      std::cout << "offline mirror. Only archives that are missing or changed are downloaded." << std::endl;
+      std::cout << std::endl;
+      std::cout << "Parameters:" << std::endl;
+      std::cout << "  directory          - Mirror directory, created if needed" << std::endl;
+      std::cout << "  --catalog <source> - Catalog to mirror (defaults to the upstream catalog)" << std::endl;
+      std::cout << std::endl;
+      std::cout << "Point \"catalogSources\" in the WTA config file at the directory to install from it." << std::endl;
+      std::cout << std::endl;
+      std::cout << "Examples:" << std::endl;
+      std::cout << "  wta mirror sync \\\\fileserver\\fonts\\wta" << std::endl;
     }
     else if (commandName == "color-scheme") {
       std::cout << "Usage: wta color-scheme <schemeName> [profileName]" << std::endl;
@@ -841,372 +8457,1405 @@ private:
       std::cout << "Example: wta " << commandName << std::endl;
     }
     
-    std::cout << std::endl;
-    std::cout << "Use 'wta help' to see all available commands." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Use 'wta help' to see all available commands." << std::endl;
+  }
+
+  void colorSchemeCommand(const std::vector<std::string> &args) {
+    if (args.size() < 1 || args.size() > 2) {
+      std::cerr << "Usage: wta color-scheme <schemeName> [profileName]" << std::endl;
+      return;
+    }
+
+    std::string schemeName = args[0];
+    std::string profileName = (args.size() == 2) ? args[1] : "defaults";
+
+    if (!fileManager.colorSchemeExists(schemeName)) {
+      std::cerr << "Color scheme not found: " << schemeName << std::endl;
+      return;
+    }
+
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
+      return;
+    }
+
+    json &settings = fileManager.getSettings();
+    settings["profiles"][profileName]["colorScheme"] = schemeName;
+    fileManager.writeSettings();
+    std::cout << "Color scheme updated successfully." << std::endl;
+  }
+
+  void createSchemeCommand(const std::vector<std::string> &args) {
+    if (args.size() > 0) {
+      std::cerr << "Usage: wta create-scheme" << std::endl;
+      return;
+    }
+
+    std::cout << "Creating a new color scheme..." << std::endl;
+
+    std::string schemeName;
+    std::cout << "Enter scheme name: ";
+    std::getline(std::cin, schemeName);
+    
+    if (schemeName.empty()) {
+      std::cerr << "Error: Scheme name cannot be empty." << std::endl;
+      return;
+    }
+
+    if (fileManager.colorSchemeExists(schemeName)) {
+      std::cerr << "Error: Color scheme '" << schemeName << "' already exists." << std::endl;
+      return;
+    }
+
+    json newScheme;
+    newScheme["name"] = schemeName;
+
+    std::vector<std::string> colorFields = {
+      "background", "foreground", "cursorColor", "selectionBackground",
+      "black", "red", "green", "yellow", "blue", "purple", "cyan", "white",
+      "brightBlack", "brightRed", "brightGreen", "brightYellow", 
+      "brightBlue", "brightPurple", "brightCyan", "brightWhite"
+    };
+
+    std::cout << "Enter hex colors in format #FFFFFF or FFFFFF." << std::endl;
+    std::cout << std::endl;
+
+    for (const std::string &field : colorFields) {
+      std::string color = promptForHexColor(field);
+      newScheme[field] = color;
+    }
+
+    json &settings = fileManager.getSettings();
+    
+    if (!settings.contains("schemes")) {
+      settings["schemes"] = json::array();
+    }
+    
+    settings["schemes"].push_back(newScheme);
+    fileManager.writeSettings();
+    
+    std::cout << std::endl;
+    std::cout << "Color scheme '" << schemeName << "' created successfully." << std::endl;
+    std::cout << "You can now use it with: wta color-scheme " << schemeName << " [profileName]" << std::endl;
+  }
+
+  void fontCommand(const std::vector<std::string> &allArgs) {
+    std::vector<std::string> args;
+    std::string requiredGlyphs = config.requiredGlyphs();
+    for (size_t i = 0; i < allArgs.size(); ++i) {
+      if (allArgs[i] == "--require" && i + 1 < allArgs.size()) {
+        requiredGlyphs = allArgs[++i];
+      } else {
+        args.push_back(allArgs[i]);
+      }
+    }
+    if (args.empty() || args.size() > 4) {
+      std::cerr << "Usage: wta font <fontName> [fontSize] [weight] [profileName] [--require <glyphs>]" << std::endl;
+      return;
+    }
+
+    std::string fontName = args[0];
+    std::string fontSize = args.size() >= 2 ? args[1] : "";
+    std::string weight = args.size() >= 3 ? args[2] : "";
+    std::string profileName = args.size() == 4 ? args[3] : "defaults";
+
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
+      return;
+    }
+
+    std::string family;
+    if (!fontManager.findInstalledFamily(fontName, family)) {
+      std::cerr << "Font not found on system: " << fontName << std::endl;
+      std::cout << "Use: wta install-font <fontName> to install a font." << std::endl;
+      return;
+    }
+
+    if (!requiredGlyphs.empty()) {
+      GlyphCoverage required;
+      GlyphCoverage coverage;
+      std::string error;
+      if (!loadGlyphRanges(requiredGlyphs, required, error) ||
+          !fontManager.familyCoverage(family, coverage, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return;
+      }
+      size_t missing = coverage.missingCount(required);
+      if (missing > 0) {
+        std::cerr << "Error: Font family '" << family << "' is missing " << missing << " of " << required.count()
+                  << " required glyphs (" << requiredGlyphs << ")." << std::endl;
+        std::cout << "Use: wta font-coverage \"" << family << "\" --ranges " << requiredGlyphs << " to list them."
+                  << std::endl;
+        return;
+      }
+    }
+
+    json &settings = fileManager.getSettings();
+    settings["profiles"][profileName]["font"]["face"] = family;
+    
+    if (!fontSize.empty()) {
+      try {
+        settings["profiles"][profileName]["font"]["size"] = std::stoi(fontSize);
+      } catch (...) {
+        std::cerr << "Invalid font size: " << fontSize << std::endl;
+        return;
+      }
+    }
+
+    if (!weight.empty()) {
+      if (!validateAndSetFontWeight(weight, settings, profileName)) {
+        return;
+      }
+    }
+
+    fileManager.writeSettings();
+    if (family != fontName) {
+      std::cout << "Using installed font family '" << family << "'." << std::endl;
+    }
+    std::cout << "Font updated successfully." << std::endl;
+  }
+
+  void fontSizeCommand(const std::vector<std::string> &args) {
+    if (args.size() < 1 || args.size() > 2) {
+      std::cerr << "Usage: wta font-size <fontSize> [profileName]" << std::endl;
+      return;
+    }
+
+    std::string fontSize = args[0];
+    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
+      return;
+    }
+
+    try {
+      int fontSizeValue = std::stoi(fontSize);
+      if (fontSizeValue < 1) {
+        std::cerr << "Invalid font size: " << fontSize << ". Must be a positive integer." << std::endl;
+        return;
+      }
+
+      json &settings = fileManager.getSettings();
+      settings["profiles"][profileName]["font"]["size"] = fontSizeValue;
+      fileManager.writeSettings();
+      std::cout << "Font size updated successfully." << std::endl;
+    } catch (...) {
+      std::cerr << "Invalid font size: " << fontSize << ". Must be a positive integer." << std::endl;
+    }
+  }
+
+  void fontWeightCommand(const std::vector<std::string> &args) {
+    if (args.size() < 1 || args.size() > 2) {
+      std::cerr << "Usage: wta font-weight <weight> [profileName]" << std::endl;
+      std::cout << "Valid weights: normal, thin, extra-light, light, semi-light, medium, semi-bold, bold, extra-bold, black, extra-black, or integer 1-1000" << std::endl;
+      return;
+    }
+
+    std::string weight = args[0];
+    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
+      return;
+    }
+
+    json &settings = fileManager.getSettings();
+    
+    if (validateAndSetFontWeight(weight, settings, profileName)) {
+      fileManager.writeSettings();
+      std::cout << "Font weight updated successfully." << std::endl;
+    }
+  }
+
+  void cursorShapeCommand(const std::vector<std::string> &args) {
+    if (args.size() < 1 || args.size() > 2) {
+      std::cerr << "Usage: wta cursor-shape <cursorShape> [profileName]" << std::endl;
+      std::cout << "Valid cursor shapes: bar, vintage, underscore, filledBox, emptyBox, doubleUnderscore" << std::endl;
+      return;
+    }
+
+    std::string cursorShape = args[0];
+    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
+      return;
+    }
+
+    std::vector<std::string> validCursorShapes = {
+      "bar", "vintage", "underscore", "filledBox", "emptyBox", "doubleUnderscore"
+    };
+    
+    bool isValidShape = false;
+    for (const auto& validShape : validCursorShapes) {
+      if (cursorShape == validShape) {
+        isValidShape = true;
+        break;
+      }
+    }
+    
+    if (!isValidShape) {
+      std::cerr << "Invalid cursor shape: " << cursorShape << std::endl;
+      std::cout << "Valid cursor shapes: bar, vintage, underscore, filledBox, emptyBox, doubleUnderscore" << std::endl;
+      return;
+    }
+
+    json &settings = fileManager.getSettings();
+    settings["profiles"][profileName]["cursorShape"] = cursorShape;
+    fileManager.writeSettings();
+    std::cout << "Cursor shape updated successfully." << std::endl;
   }
 
-  void colorSchemeCommand(const std::vector<std::string> &args) {
+  void cursorHeightCommand(const std::vector<std::string> &args) {
     if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta color-scheme <schemeName> [profileName]" << std::endl;
+      std::cerr << "Usage: wta cursor-height <height> [profileName]" << std::endl;
+      std::cout << "Height must be an integer from 1-100 (only works with vintage cursor shape)" << std::endl;
       return;
     }
 
-    std::string schemeName = args[0];
-    std::string profileName = (args.size() == 2) ? args[1] : "defaults";
+    std::string heightStr = args[0];
+    std::string profileName = args.size() == 2 ? args[1] : "defaults";
 
-    if (!fileManager.colorSchemeExists(schemeName)) {
-      std::cerr << "Color scheme not found: " << schemeName << std::endl;
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
+      return;
+    }
+
+    try {
+      int height = std::stoi(heightStr);
+      if (height < 1 || height > 100) {
+        std::cerr << "Invalid cursor height: " << heightStr << ". Must be between 1 and 100." << std::endl;
+        return;
+      }
+
+      json &settings = fileManager.getSettings();
+      settings["profiles"][profileName]["cursorHeight"] = height;
+      fileManager.writeSettings();
+      std::cout << "Cursor height updated successfully." << std::endl;
+      
+      if (settings["profiles"][profileName].contains("cursorShape") && 
+          settings["profiles"][profileName]["cursorShape"] != "vintage") {
+        std::cout << "Note: Cursor height only affects the 'vintage' cursor shape." << std::endl;
+      }
+    } catch (...) {
+      std::cerr << "Invalid cursor height: " << heightStr << ". Must be an integer between 1 and 100." << std::endl;
+    }
+  }
+
+  void forceFullRepaintCommand(const std::vector<std::string> &args) {
+    if (args.size() < 1 || args.size() > 2) {
+      std::cerr << "Usage: wta force-full-repaint <true|false> [profileName]" << std::endl;
+      std::cout << "Controls whether the terminal redraws the entire screen each frame." << std::endl;
       return;
     }
 
+    std::string option = args[0];
+    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+
     if (!fileManager.profileExists(profileName)) {
       std::cerr << "Profile not found: " << profileName << std::endl;
       return;
     }
 
+    if (option != "true" && option != "false") {
+      std::cerr << "Invalid option: " << option << ". Use 'true' or 'false'." << std::endl;
+      return;
+    }
+
     json &settings = fileManager.getSettings();
-    settings["profiles"][profileName]["colorScheme"] = schemeName;
+    settings["profiles"][profileName]["experimental.rendering.forceFullRepaint"] = (option == "true");
     fileManager.writeSettings();
-    std::cout << "Color scheme updated successfully." << std::endl;
+    std::cout << "Force full repaint set to " << option << " successfully." << std::endl;
   }
 
-  void createSchemeCommand(const std::vector<std::string> &args) {
-    if (args.size() > 0) {
-      std::cerr << "Usage: wta create-scheme" << std::endl;
+  void softwareRenderingCommand(const std::vector<std::string> &args) {
+    if (args.size() < 1 || args.size() > 2) {
+      std::cerr << "Usage: wta software-rendering <true|false> [profileName]" << std::endl;
+      std::cout << "Controls whether the terminal uses software rendering (WARP) instead of hardware rendering." << std::endl;
       return;
     }
 
-    std::cout << "Creating a new color scheme..." << std::endl;
+    std::string option = args[0];
+    std::string profileName = args.size() == 2 ? args[1] : "defaults";
 
-    std::string schemeName;
-    std::cout << "Enter scheme name: ";
-    std::getline(std::cin, schemeName);
-    
-    if (schemeName.empty()) {
-      std::cerr << "Error: Scheme name cannot be empty." << std::endl;
+    if (!fileManager.profileExists(profileName)) {
+      std::cerr << "Profile not found: " << profileName << std::endl;
       return;
     }
 
-    if (fileManager.colorSchemeExists(schemeName)) {
-      std::cerr << "Error: Color scheme '" << schemeName << "' already exists." << std::endl;
+    if (option != "true" && option != "false") {
+      std::cerr << "Invalid option: " << option << ". Use 'true' or 'false'." << std::endl;
       return;
     }
 
-    json newScheme;
-    newScheme["name"] = schemeName;
+    json &settings = fileManager.getSettings();
+    settings["profiles"][profileName]["experimental.rendering.software"] = (option == "true");
+    fileManager.writeSettings();
+    std::cout << "Software rendering set to " << option << " successfully." << std::endl;
+  }
 
-    std::vector<std::string> colorFields = {
-      "background", "foreground", "cursorColor", "selectionBackground",
-      "black", "red", "green", "yellow", "blue", "purple", "cyan", "white",
-      "brightBlack", "brightRed", "brightGreen", "brightYellow", 
-      "brightBlue", "brightPurple", "brightCyan", "brightWhite"
-    };
+  void fontCoverageCommand(const std::vector<std::string> &args) {
+    std::string fontName;
+    std::string ranges = "nerd";
+    bool all = false;
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (args[i] == "--ranges" && i + 1 < args.size()) {
+        ranges = args[++i];
+      } else if (args[i] == "--all") {
+        all = true;
+      } else if (fontName.empty() && args[i].rfind("--", 0) != 0) {
+        fontName = args[i];
+      } else {
+        std::cerr << "Unknown option: " << args[i] << std::endl;
+        return;
+      }
+    }
+    if (all == !fontName.empty()) {
+      std::cerr << "Usage: wta font-coverage <fontName|--all> [--ranges nerd|powerline|<file>]" << std::endl;
+      return;
+    }
 
-    std::cout << "Enter hex colors in format #FFFFFF or FFFFFF." << std::endl;
-    std::cout << std::endl;
+    GlyphCoverage required;
+    std::string error;
+    if (!loadGlyphRanges(ranges, required, error)) {
+      std::cerr << "Error: " << error << std::endl;
+      return;
+    }
+    size_t requiredCount = required.count();
 
-    for (const std::string &field : colorFields) {
-      std::string color = promptForHexColor(field);
-      newScheme[field] = color;
+    if (all) {
+      rankFontCoverage(required, ranges);
+      return;
     }
 
-    json &settings = fileManager.getSettings();
-    
-    if (!settings.contains("schemes")) {
-      settings["schemes"] = json::array();
+    std::string family;
+    if (!fontManager.findInstalledFamily(fontName, family)) {
+      std::cerr << "Font not found on system: " << fontName << std::endl;
+      return;
     }
-    
-    settings["schemes"].push_back(newScheme);
-    fileManager.writeSettings();
-    
-    std::cout << std::endl;
-    std::cout << "Color scheme '" << schemeName << "' created successfully." << std::endl;
-    std::cout << "You can now use it with: wta color-scheme " << schemeName << " [profileName]" << std::endl;
+    GlyphCoverage coverage;
+    if (!fontManager.familyCoverage(family, coverage, error)) {
+      std::cerr << "Error: " << error << std::endl;
+      return;
+    }
+    std::vector<uint32_t> missing = coverage.missing(required);
+    if (missing.empty()) {
+      std::cout << family << " covers all " << requiredCount << " required code points (" << ranges << ")."
+                << std::endl;
+      return;
+    }
+    std::cout << family << " is missing " << missing.size() << " of " << requiredCount << " required code points ("
+              << ranges << "):" << std::endl;
+    std::cout << "  " << formatCodePoints(missing, 32) << std::endl;
   }
 
-  void fontCommand(const std::vector<std::string> &args) {
-    if (args.empty() || args.size() > 4) {
-      std::cerr << "Usage: wta font <fontName> [fontSize] [weight] [profileName]" << std::endl;
+  // Scores every installed family in parallel; each worker maps and parses
+  // its own fonts, the index is only read.
+  void rankFontCoverage(const GlyphCoverage &required, const std::string &ranges) {
+    std::vector<std::string> families = fontManager.installedFamilies();
+    std::vector<long long> missing(families.size(), -1);
+    std::atomic<size_t> next(0);
+    unsigned threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), families.size());
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+      workers.emplace_back([&] {
+        for (size_t i = next++; i < families.size(); i = next++) {
+          GlyphCoverage coverage;
+          std::string error;
+          if (fontManager.familyCoverage(families[i], coverage, error)) {
+            missing[i] = (long long)coverage.missingCount(required);
+          }
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < families.size(); ++i) {
+      if (missing[i] >= 0) {
+        order.push_back(i);
+      }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return missing[a] < missing[b]; });
+
+    std::cout << "Missing  Family" << std::endl;
+    for (size_t i : order) {
+      std::cout << std::setw(7) << missing[i] << "  " << families[i] << std::endl;
+    }
+    std::cout << "Ranked " << order.size() << " font families against " << required.count()
+              << " required code points (" << ranges << ")." << std::endl;
+    if (order.size() < families.size()) {
+      std::cout << "Skipped " << families.size() - order.size() << " families whose fonts could not be read."
+                << std::endl;
+    }
+  }
+
+  void fontInstallCommand(const std::vector<std::string> &args) {
+    if (std::find(args.begin(), args.end(), "--json") == args.end()) {
+      runFontInstall(args);
       return;
     }
+    // stdout then carries nothing but the report; the usual messages go to stderr.
+    json reports = json::array();
+    std::streambuf *stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+    showProgress = false;
+    downloader.setProgress(false);
+    fontReports = &reports;
+    runFontInstall(args);
+    fontReports = nullptr;
+    std::cout.rdbuf(stdoutBuffer);
+    std::cout << json({{"fonts", reports}}).dump(2) << std::endl;
+  }
 
-    std::string fontName = args[0];
-    std::string fontSize = args.size() >= 2 ? args[1] : "";
-    std::string weight = args.size() >= 3 ? args[2] : "";
-    std::string profileName = args.size() == 4 ? args[3] : "defaults";
+  void runFontInstall(const std::vector<std::string> &args) {
+    bool stream = false;
+    bool upgrade = false;
+    bool dryRun = false;
+    std::string format = "tar.xz";
+    FontFilter filter;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < args.size(); ++i) {
+      if (args[i] == "--stream") {
+        stream = true;
+      } else if (args[i] == "--variant" && i + 1 < args.size()) {
+        if (!filter.parseVariants(args[++i])) {
+          std::cerr << "Invalid variant: " << args[i] << ". Must be default, mono or propo." << std::endl;
+          return;
+        }
+      } else if (args[i] == "--weights" && i + 1 < args.size()) {
+        if (!filter.parseWeights(args[++i])) {
+          std::cerr << "Invalid weights: " << args[i] << ". Use names such as regular,bold or numbers such as 400,700."
+                    << std::endl;
+          return;
+        }
+      } else if (args[i] == "--no-italic") {
+        filter.italic = false;
+      } else if (args[i] == "--format" && i + 1 < args.size()) {
+        format = args[++i];
+        if (format != "tar.xz" && format != "zip") {
+          std::cerr << "Invalid archive format: " << format << ". Must be tar.xz or zip." << std::endl;
+          return;
+        }
+      } else if (args[i] == "--upgrade") {
+        upgrade = true;
+      } else if (args[i] == "--dry-run") {
+        dryRun = true;
+      } else if (args[i] == "--max-rate" && i + 1 < args.size()) {
+        uint64_t rate = 0;
+        if (!parseSize(args[++i], rate) || rate == 0) {
+          std::cerr << "Invalid rate: " << args[i] << ". Use bytes per second, such as 500K or 2M." << std::endl;
+          return;
+        }
+        rateLimiter = std::make_unique<RateLimiter>(rate);
+        if (!rateLimiter->shared()) {
+          std::cerr << "Warning: Could not share the rate limit with other wta processes; it applies to this one only."
+                    << std::endl;
+        }
+        downloader.setRateLimiter(rateLimiter.get());
+      } else if (args[i] == "--json") {
+        // Handled by fontInstallCommand.
+      } else if (args[i].rfind("--", 0) != 0) {
+        names.push_back(args[i]);
+      } else if (args[i] == "--threads" && i + 1 < args.size()) {
+        try {
+          int threads = std::stoi(args[++i]);
+          if (threads < 1) {
+            throw std::out_of_range("threads");
+          }
+          installer.setThreadCount((unsigned)threads);
+        } catch (...) {
+          std::cerr << "Invalid thread count: " << args[i] << ". Must be a positive integer." << std::endl;
+          return;
+        }
+      } else {
+        std::cerr << "Unknown option: " << args[i] << std::endl;
+        return;
+      }
+    }
 
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
+    if (upgrade && !stream) {
+      upgradeFonts(names, dryRun, format, filter);
+      return;
+    }
+    if (upgrade || dryRun || names.size() != 1) {
+      std::cerr << "Usage: wta install-font <fontName|help> [--stream] [--format <tar.xz|zip>] [--threads <n>] [--json]"
+                << std::endl;
+      std::cerr << "                        [--variant <default|mono|propo>] [--weights <list>] [--no-italic]"
+                << std::endl;
+      std::cerr << "                        [--max-rate <rate>]" << std::endl;
+      std::cerr << "       wta install-font --upgrade [fontName...] [--dry-run] [--format <tar.xz|zip>] [--threads <n>] [--json]"
+                << std::endl;
+      std::cerr << "                        [--max-rate <rate>]" << std::endl;
+      std::cout << "Use: wta install-font help to see a list of available Nerd Fonts." << std::endl;
       return;
     }
 
-    if (!fontManager.fontExists(fontName)) {
-      std::cerr << "Font not found on system: " << fontName << std::endl;
-      std::cout << "Use: wta install-font <fontName> to install a font." << std::endl;
+    std::string fontArg = names[0];
+
+    if (fontArg == "help") {
+      displayAvailableFonts();
       return;
     }
 
-    json &settings = fileManager.getSettings();
-    settings["profiles"][profileName]["font"]["face"] = fontName;
+    if (fontManager.fontExists(fontArg)) {
+      std::cerr << "Font '" << fontArg << "' is already installed on the system." << std::endl;
+      std::cout << "Use: wta font <fontName> to set it for a profile, or" << std::endl;
+      std::cout << "     wta install-font --upgrade " << fontArg << " to install the catalog's version." << std::endl;
+      return;
+    }
+
+    installFont(fontArg, stream, format, filter);
+  }
+
+  void displayAvailableFonts() {
+    json fontData = fontManager.readFontData();
+    std::cout << "Available Nerd Fonts:" << std::endl;
+    for (const auto &font : fontData) {
+      std::cout << font["Name"].get<std::string>() << std::endl;
+    }
+  }
+
+  // A .tar.xz archive is always streamed, since it needs no random access;
+  // zip archives are saved first unless `stream` is set.
+  void installFont(const std::string &fontName, bool stream, const std::string &format, const FontFilter &filter) {
+    json fontData = fontManager.readFontData();
+    std::string fontUrl;
+    ExpectedContent expected;
     
-    if (!fontSize.empty()) {
-      try {
-        settings["profiles"][profileName]["font"]["size"] = std::stoi(fontSize);
-      } catch (...) {
-        std::cerr << "Invalid font size: " << fontSize << std::endl;
+    if (!fontManager.findFontInData(fontData, fontName, fontUrl, expected, format)) {
+      std::cerr << "Error: Font '" << fontName << "' not found in available fonts." << std::endl;
+      std::cout << "Use: wta font-install help to see available fonts." << std::endl;
+      reportFont(fontName, false, "", nullptr);
+      return;
+    }
+
+    installer.setFilter(filter);
+    auto start = std::chrono::steady_clock::now();
+    bool installed;
+    bool downloaded = false;
+    // Bytes saved to disk before installing, and bytes received overall.
+    uint64_t downloadedBytes = 0;
+    uint64_t fetchedBytes = 0;
+    std::string archiveDigest;
+    std::string archivePath = cache.lookup(fontUrl, expected, &archiveDigest);
+    ZipArchive partialArchive;
+    FileDownloader::RangeFetch ranges;
+    bool ranged = archivePath.empty() && !filter.empty() &&
+                  fetchSelectedEntries(fontData, fontName, fontUrl, partialArchive, ranges);
+
+    // Every full download ends up in the archive cache, except a streamed
+    // zip, so processes installing the same font at once share one download.
+    std::unique_ptr<SingleFlight> flight;
+    if (!ranged && archivePath.empty() && !(stream && archiveFormat(fontUrl) == "zip")) {
+      flight = joinDownload(fontUrl, [](const std::string &message) { std::cout << message << std::endl; });
+      if (flight->waited()) {
+        archivePath = cache.lookup(fontUrl, expected, &archiveDigest);
+      }
+    }
+
+    if (ranged) {
+      std::cout << "Installing " << fontName << " font..." << std::endl;
+      installed = installer.installFromPartialArchive(partialArchive);
+      downloaded = true;
+      fetchedBytes = ranges.bytesFetched;
+    } else if (!archivePath.empty()) {
+      std::cout << "Installing " << fontName << " font from the archive cache..." << std::endl;
+      installed = installer.extractAndInstallFonts(archivePath);
+    } else if (stream || archiveFormat(fontUrl) == "tar.xz") {
+      std::cout << "Downloading and installing " << fontName << " font..." << std::endl;
+
+      std::unique_ptr<ByteSource> source = downloader.openStream(fontUrl);
+      if (!source) {
+        std::cerr << "Error: Failed to download font from " << fontUrl << std::endl;
+        reportFont(fontName, false, "stream", downloader.lastMetrics().toJson());
+        return;
+      }
+      downloaded = true;
+      HashingSource hashingSource(*source);
+      // A .tar.xz archive is small enough to keep for the cache as it streams by.
+      std::string keptPath;
+      std::ofstream kept;
+      if (cache.enabled() && archiveFormat(fontUrl) == "tar.xz") {
+        keptPath = (tempDirectory() / (fontName + ".tar.xz." + std::to_string(std::random_device()()))).string();
+        kept.open(keptPath, std::ios::binary);
+        if (kept) {
+          hashingSource.copyTo(&kept);
+        }
+      }
+      installed = installer.streamAndInstallFonts(hashingSource, [&] {
+        return verifyContent(expected, hashingSource.digest());
+      });
+      archiveDigest = hashingSource.digest().hexDigest();
+      fetchedBytes = hashingSource.digest().bytesHashed();
+      if (!keptPath.empty()) {
+        kept.close();
+        if (installed && kept) {
+          cache.store(keptPath, archiveDigest, fontUrl, downloader.lastSource());
+        }
+        std::error_code ec;
+        std::filesystem::remove(keptPath, ec);
+      }
+    } else {
+      std::cout << "Downloading " << fontName << " font..." << std::endl;
+
+      std::string zipPath = (tempDirectory() / (fontName + ".zip" + privateSuffix(*flight))).string();
+
+      if (!downloader.downloadFile(fontUrl, zipPath, expected)) {
+        std::cerr << "Error: Failed to download font from " << fontUrl << std::endl;
+        reportFont(fontName, false, "download", downloader.lastMetrics().toJson());
         return;
       }
+
+      downloaded = true;
+      std::error_code ec;
+      downloadedBytes = std::filesystem::file_size(zipPath, ec);
+      fetchedBytes = downloadedBytes;
+      archiveDigest = downloader.lastDigest();
+      archivePath = cache.store(zipPath, archiveDigest, fontUrl, downloader.lastSource());
+      if (archivePath.empty()) {
+        archivePath = zipPath;
+      }
+
+      std::cout << "Installing " << fontName << " font..." << std::endl;
+      installed = installer.extractAndInstallFonts(archivePath);
+      if (archivePath == zipPath) {
+        std::filesystem::remove(zipPath, ec);
+      }
+    }
+
+    std::string source = "download";
+    if (ranged) {
+      source = "ranges";
+    } else if (!downloaded) {
+      source = "cache";
+    } else if (stream || archiveFormat(fontUrl) == "tar.xz") {
+      source = "stream";
+    }
+    reportFont(fontName, installed, source, downloaded ? downloader.lastMetrics().toJson() : json(nullptr));
+    if (installed) {
+      fontManager.indexInstalledFonts(installer.lastStats().files);
+      recordInstall(fontName, fontUrl, archiveDigest, filter);
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      const FontInstaller::InstallStats &stats = installer.lastStats();
+      std::cout << "Font '" << fontName << "' installed successfully!" << std::endl;
+      std::cout << "Installed " << stats.filesInstalled << " font files, wrote "
+                << formatSize(stats.bytesWritten + downloadedBytes)
+                << " to disk in " << std::fixed << std::setprecision(1) << seconds << "s." << std::endl;
+      if (stats.duplicatesSkipped > 0) {
+        std::cout << "Skipped " << stats.duplicatesSkipped
+                  << " font files already contained in a font collection." << std::endl;
+      }
+      if (stats.unchangedSkipped > 0) {
+        std::cout << stats.unchangedSkipped << " font files were already installed and left unchanged." << std::endl;
+      }
+      if (stats.filteredOut > 0) {
+        std::cout << "Left out " << stats.filteredOut << " font files that do not match the filters." << std::endl;
+      }
+      if (stats.invalidSkipped > 0) {
+        std::cout << "Refused " << stats.invalidSkipped << " font files that failed validation." << std::endl;
+      }
+      const FileDownloader::SourceReport &origin = downloader.lastSource();
+      if (ranged) {
+        std::cout << "Downloaded " << formatSize(fetchedBytes) << " of the " << formatSize(ranges.archiveSize)
+                  << " zip archive with " << ranges.requests << " range requests";
+      } else if (downloaded) {
+        std::cout << "Downloaded " << formatSize(fetchedBytes) << " " << archiveFormat(fontUrl) << " archive";
+      }
+      if (downloaded) {
+        std::cout << describeTransfer(downloader.lastMetrics());
+        if (!origin.mirror.empty()) {
+          std::cout << " from mirror " << origin.mirror;
+        }
+        if (!origin.hedgedAgainst.empty()) {
+          std::cout << " (won a hedged request against " << origin.hedgedAgainst << ")";
+        }
+        std::cout << "." << std::endl;
+      }
+      std::cout << "You may need to restart applications to see the new font." << std::endl;
+    } else {
+      std::cerr << "Error: Failed to install font." << std::endl;
+    }
+  }
+
+  // The filter is recorded so that upgrades install the same subset.
+  // With filters, only the selected files are fetched from the font's zip
+  // archive using Range requests; fontUrl then becomes the zip's URL. Returns
+  // false when the whole archive should be downloaded instead.
+  bool fetchSelectedEntries(const json &fontData, const std::string &fontName, std::string &fontUrl,
+                            ZipArchive &archive, FileDownloader::RangeFetch &ranges) {
+    std::string zipUrl;
+    ExpectedContent zipExpected;
+    if (!fontManager.findFontInData(fontData, fontName, zipUrl, zipExpected, "zip") ||
+        archiveFormat(zipUrl) != "zip") {
+      return false;
+    }
+    std::cout << "Reading the contents of the " << fontName << " archive..." << std::endl;
+    bool fetched = downloader.fetchZipEntries(zipUrl, zipExpected, archive, [&](const ZipArchive &contents) {
+      return installer.entriesToExtract(contents);
+    }, ranges);
+    if (!fetched) {
+      if (!ranges.fallbackReason.empty()) {
+        std::cout << "Downloading the whole archive, as " << ranges.fallbackReason << "." << std::endl;
+      }
+      archive.close();
+      return false;
+    }
+    fontUrl = zipUrl;
+    return true;
+  }
+
+  void recordInstall(const std::string &fontName, const std::string &url, const std::string &archiveDigest,
+                     const FontFilter &filter) {
+    const FontInstaller::InstallStats &stats = installer.lastStats();
+    json entry = FontManifest::makeEntry(url, archiveDigest, stats.files, stats.digests, stats.registryValues);
+    if (!filter.empty()) {
+      entry["filter"] = filter.toJson();
+    }
+    if (!manifest.update([&](json &fonts) { fonts[fontName] = entry; })) {
+      std::cerr << "Warning: Could not record " << fontName << " in the installed-font manifest." << std::endl;
+    }
+  }
+
+  struct FontUpgrade {
+    std::string name;
+    std::string url;
+    ExpectedContent expected;
+    std::string fromVersion;
+    json previousFiles = json::object();
+    FontFilter filter;
+    std::string archivePath;
+    std::string archiveDigest;
+    // Set when the cache could not take the download.
+    bool temporaryArchive = false;
+    // Bytes still to download: 0 when the archive is cached, -1 if unknown.
+    int64_t fetchBytes = -1;
+    uint64_t downloadedBytes = 0;
+    json transfer;
+  };
+
+  // Diffs the manifest against the catalog and reinstalls only the fonts
+  // whose archive changed. Archives download in parallel, each worker on its
+  // own connection; installs then run one font at a time, since each already
+  // spreads its files across cores. Each font keeps the filter it was
+  // installed with unless a new one is given, which also forces a reinstall.
+  void upgradeFonts(const std::vector<std::string> &names, bool dryRun, const std::string &format,
+                    const FontFilter &filter) {
+    json catalog = fontManager.readFontData();
+    if (!catalog.is_array() || catalog.empty()) {
+      std::cerr << "Error: Could not read the font catalog." << std::endl;
+      return;
     }
+    json installed = manifest.fonts();
 
-    if (!weight.empty()) {
-      if (!validateAndSetFontWeight(weight, settings, profileName)) {
-        return;
+    std::vector<std::string> wanted = names;
+    if (wanted.empty()) {
+      for (const auto &font : installed.items()) {
+        wanted.push_back(font.key());
       }
     }
 
-    fileManager.writeSettings();
-    std::cout << "Font updated successfully." << std::endl;
-  }
+    std::vector<FontUpgrade> upgrades;
+    int current = 0;
+    for (const std::string &name : wanted) {
+      FontUpgrade upgrade;
+      upgrade.name = name;
+      if (!fontManager.findFontInData(catalog, name, upgrade.url, upgrade.expected, format)) {
+        std::cerr << "Warning: " << name << " is not in the font catalog; skipping." << std::endl;
+        continue;
+      }
+      std::transform(upgrade.expected.sha256.begin(), upgrade.expected.sha256.end(), upgrade.expected.sha256.begin(),
+                     ::tolower);
+      upgrade.filter = filter;
+      if (installed.contains(name)) {
+        const json &entry = installed[name];
+        FontFilter recorded = FontFilter::fromJson(entry.value("filter", json::object()));
+        if (filter.empty()) {
+          upgrade.filter = recorded;
+        }
+        if (fontManager.installedFromCatalog(catalog, name, entry) &&
+            upgrade.filter.toJson() == recorded.toJson()) {
+          current++;
+          continue;
+        }
+        upgrade.fromVersion = entry.value("version", "");
+        upgrade.previousFiles = entry.value("files", json::object());
+      } else if (!fontManager.fontExists(name)) {
+        std::cerr << "Warning: " << name << " is not installed; use wta install-font " << name << "." << std::endl;
+        continue;
+      }
+      // Fonts installed before the manifest existed have no recorded version
+      // and are always reinstalled when named.
+      upgrades.push_back(upgrade);
+    }
 
-  void fontSizeCommand(const std::vector<std::string> &args) {
-    if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta font-size <fontSize> [profileName]" << std::endl;
+    if (upgrades.empty()) {
+      std::cout << "All " << current << " installed fonts are up to date." << std::endl;
       return;
     }
 
-    std::string fontSize = args[0];
-    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+    for (FontUpgrade &upgrade : upgrades) {
+      upgrade.archivePath = cache.lookup(upgrade.url, upgrade.expected, &upgrade.archiveDigest);
+      if (!upgrade.archivePath.empty()) {
+        upgrade.fetchBytes = 0;
+      } else if (upgrade.expected.size >= 0) {
+        upgrade.fetchBytes = upgrade.expected.size;
+      } else if (dryRun) {
+        upgrade.fetchBytes = downloader.remoteSize(upgrade.url);
+      }
+    }
 
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
+    if (dryRun) {
+      uint64_t total = 0;
+      int unknown = 0;
+      std::cout << std::left << std::setw(24) << "Font" << std::setw(12) << "Installed" << std::setw(12) << "Catalog"
+                << "Download" << std::endl;
+      for (const FontUpgrade &upgrade : upgrades) {
+        std::string to = releaseVersion(upgrade.url);
+        std::cout << std::setw(24) << upgrade.name << std::setw(12)
+                  << (upgrade.fromVersion.empty() ? "unknown" : upgrade.fromVersion) << std::setw(12)
+                  << (to.empty() ? "unknown" : to);
+        if (upgrade.fetchBytes == 0) {
+          std::cout << "cached";
+        } else if (upgrade.fetchBytes < 0) {
+          std::cout << "unknown size";
+          unknown++;
+        } else {
+          std::cout << formatSize((uint64_t)upgrade.fetchBytes);
+          total += upgrade.fetchBytes;
+        }
+        std::cout << std::endl;
+      }
+      std::cout << std::right << upgrades.size() << " fonts to upgrade, " << formatSize(total) << " to download";
+      if (unknown > 0) {
+        std::cout << " (plus " << unknown << " of unknown size)";
+      }
+      std::cout << "." << std::endl;
       return;
     }
 
-    try {
-      int fontSizeValue = std::stoi(fontSize);
-      if (fontSizeValue < 1) {
-        std::cerr << "Invalid font size: " << fontSize << ". Must be a positive integer." << std::endl;
-        return;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<FontUpgrade *> pending;
+    for (FontUpgrade &upgrade : upgrades) {
+      if (upgrade.archivePath.empty()) {
+        pending.push_back(&upgrade);
       }
-
-      json &settings = fileManager.getSettings();
-      settings["profiles"][profileName]["font"]["size"] = fontSizeValue;
-      fileManager.writeSettings();
-      std::cout << "Font size updated successfully." << std::endl;
-    } catch (...) {
-      std::cerr << "Invalid font size: " << fontSize << ". Must be a positive integer." << std::endl;
     }
-  }
-
-  void fontWeightCommand(const std::vector<std::string> &args) {
-    if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta font-weight <weight> [profileName]" << std::endl;
-      std::cout << "Valid weights: normal, thin, extra-light, light, semi-light, medium, semi-bold, bold, extra-bold, black, extra-black, or integer 1-1000" << std::endl;
-      return;
+    std::mutex outputMutex;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    size_t workerCount = std::min<size_t>(pending.size(), 4);
+    for (size_t w = 0; w < workerCount; ++w) {
+      workers.emplace_back([&] {
+        FileDownloader worker;
+        configureDownloader(worker);
+        // Progress lines from parallel downloads would overwrite each other.
+        if (workerCount > 1) {
+          worker.setProgress(false);
+        }
+        for (size_t i = next++; i < pending.size(); i = next++) {
+          FontUpgrade &upgrade = *pending[i];
+          std::unique_ptr<SingleFlight> flight = joinDownload(upgrade.url, [&](const std::string &message) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cout << upgrade.name << ": " << message << std::endl;
+          });
+          if (flight->waited()) {
+            upgrade.archivePath = cache.lookup(upgrade.url, upgrade.expected, &upgrade.archiveDigest);
+            if (!upgrade.archivePath.empty()) {
+              continue;
+            }
+          }
+          std::string zipPath = (tempDirectory() / (upgrade.name + "." + archiveFormat(upgrade.url) +
+                                                    privateSuffix(*flight))).string();
+          bool fetched = worker.downloadFile(upgrade.url, zipPath, upgrade.expected);
+          upgrade.transfer = worker.lastMetrics().toJson();
+          if (!fetched) {
+            std::lock_guard<std::mutex> lock(outputMutex);
+            std::cerr << "Error: Failed to download font from " << upgrade.url << std::endl;
+            continue;
+          }
+          std::error_code ec;
+          upgrade.downloadedBytes = std::filesystem::file_size(zipPath, ec);
+          upgrade.archiveDigest = worker.lastDigest();
+          upgrade.archivePath = cache.store(zipPath, upgrade.archiveDigest, upgrade.url, worker.lastSource());
+          if (upgrade.archivePath.empty()) {
+            upgrade.archivePath = zipPath;
+            upgrade.temporaryArchive = true;
+          }
+          std::lock_guard<std::mutex> lock(outputMutex);
+          std::cout << "Downloaded " << upgrade.name << " (" << formatSize(upgrade.downloadedBytes) << ")"
+                    << describeTransfer(worker.lastMetrics()) << "." << std::endl;
+        }
+      });
+    }
+    for (std::thread &worker : workers) {
+      worker.join();
     }
 
-    std::string weight = args[0];
-    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+    std::vector<std::string> changedFiles;
+    uint64_t downloadedBytes = 0;
+    int upgraded = 0;
+    for (FontUpgrade &upgrade : upgrades) {
+      if (upgrade.archivePath.empty()) {
+        reportFont(upgrade.name, false, "download", upgrade.transfer);
+        continue;
+      }
+      downloadedBytes += upgrade.downloadedBytes;
+      std::cout << "Installing " << upgrade.name << " font..." << std::endl;
+      installer.setFilter(upgrade.filter);
+      bool installed = installer.extractAndInstallFonts(upgrade.archivePath);
+      if (upgrade.temporaryArchive) {
+        std::error_code ec;
+        std::filesystem::remove(upgrade.archivePath, ec);
+      }
+      reportFont(upgrade.name, installed, upgrade.transfer.is_null() ? "cache" : "download", upgrade.transfer);
+      if (!installed) {
+        std::cerr << "Error: Failed to install " << upgrade.name << "." << std::endl;
+        continue;
+      }
 
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
-      return;
+      // Files the new release no longer ships are removed, unless another
+      // installed font also lists them, as uninstall-font does.
+      const FontInstaller::InstallStats &stats = installer.lastStats();
+      changedFiles.insert(changedFiles.end(), stats.files.begin(), stats.files.end());
+      json others = manifest.fonts();
+      others.erase(upgrade.name);
+      std::unordered_set<std::string> kept;
+      for (const auto &font : others) {
+        json files = font.value("files", json::object());
+        for (const auto &file : files.items()) {
+          kept.insert(file.key());
+        }
+      }
+      std::vector<std::string> staleFiles;
+      std::vector<std::string> staleValues;
+      for (const auto &file : upgrade.previousFiles.items()) {
+        if (std::find(stats.files.begin(), stats.files.end(), file.key()) == stats.files.end() &&
+            !kept.count(file.key())) {
+          staleFiles.push_back(file.key());
+          std::string value = file.value().value("registryValue", "");
+          bool reused = std::any_of(stats.registryValues.begin(), stats.registryValues.end(),
+                                    [&](const auto &written) { return written.second == value; });
+          if (!value.empty() && !reused && installer.inFontsDirectory(file.key())) {
+            staleValues.push_back(value);
+          }
+        }
+      }
+      installer.removeFonts(staleFiles, staleValues, changedFiles);
+      recordInstall(upgrade.name, upgrade.url, upgrade.archiveDigest, upgrade.filter);
+      std::string to = releaseVersion(upgrade.url);
+      std::cout << "Upgraded " << upgrade.name;
+      if (!upgrade.fromVersion.empty() && !to.empty()) {
+        std::cout << " from " << upgrade.fromVersion << " to " << to;
+      }
+      std::cout << "." << std::endl;
+      upgraded++;
     }
+    fontManager.indexInstalledFonts(changedFiles);
 
-    json &settings = fileManager.getSettings();
-    
-    if (validateAndSetFontWeight(weight, settings, profileName)) {
-      fileManager.writeSettings();
-      std::cout << "Font weight updated successfully." << std::endl;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Upgraded " << upgraded << " of " << upgrades.size() << " fonts, downloaded "
+              << formatSize(downloadedBytes) << " in " << std::fixed << std::setprecision(1) << seconds << "s";
+    if (current > 0) {
+      std::cout << "; " << current << " already up to date";
+    }
+    std::cout << "." << std::endl;
+    if (upgraded > 0) {
+      std::cout << "You may need to restart applications to see the new fonts." << std::endl;
     }
   }
 
-  void cursorShapeCommand(const std::vector<std::string> &args) {
-    if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta cursor-shape <cursorShape> [profileName]" << std::endl;
-      std::cout << "Valid cursor shapes: bar, vintage, underscore, filledBox, emptyBox, doubleUnderscore" << std::endl;
-      return;
+  static std::vector<std::string> familiesInFiles(const json &files) {
+    std::vector<std::string> families;
+    for (const auto &file : files.items()) {
+      std::vector<FontFaceInfo> faces;
+      std::string error;
+      SfntParser::parseFaces(file.key(), faces, error);
+      for (const FontFaceInfo &face : faces) {
+        families.push_back(face.family);
+      }
     }
+    return families;
+  }
 
-    std::string cursorShape = args[0];
-    std::string profileName = args.size() == 2 ? args[1] : "defaults";
-
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
-      return;
+  // Finds the manifest entry a name refers to: the catalog name, ignoring
+  // case and spacing, or the family name of one of its fonts.
+  std::string findManifestFont(const json &installed, const std::string &name) {
+    std::string key = normalizeFontName(name);
+    for (const auto &font : installed.items()) {
+      if (normalizeFontName(font.key()) == key) {
+        return font.key();
+      }
+    }
+    std::string family;
+    if (!fontManager.findInstalledFamily(name, family)) {
+      return "";
+    }
+    for (const auto &font : installed.items()) {
+      std::vector<std::string> families = familiesInFiles(font.value()["files"]);
+      if (std::find(families.begin(), families.end(), family) != families.end()) {
+        return font.key();
+      }
     }
+    return "";
+  }
 
-    std::vector<std::string> validCursorShapes = {
-      "bar", "vintage", "underscore", "filledBox", "emptyBox", "doubleUnderscore"
-    };
-    
-    bool isValidShape = false;
-    for (const auto& validShape : validCursorShapes) {
-      if (cursorShape == validShape) {
-        isValidShape = true;
-        break;
+  // Fonts none of whose families is set as a profile's font face.
+  std::vector<std::string> unusedFonts(const json &installed) {
+    std::unordered_set<std::string> used;
+    for (const std::string &face : fileManager.referencedFontFaces()) {
+      used.insert(normalizeFontName(face));
+      std::string family;
+      if (fontManager.findInstalledFamily(face, family)) {
+        used.insert(normalizeFontName(family));
       }
     }
-    
-    if (!isValidShape) {
-      std::cerr << "Invalid cursor shape: " << cursorShape << std::endl;
-      std::cout << "Valid cursor shapes: bar, vintage, underscore, filledBox, emptyBox, doubleUnderscore" << std::endl;
-      return;
+    std::vector<std::string> unused;
+    for (const auto &font : installed.items()) {
+      std::vector<std::string> families = familiesInFiles(font.value()["files"]);
+      bool referenced = std::any_of(families.begin(), families.end(), [&](const std::string &family) {
+        return used.count(normalizeFontName(family)) > 0;
+      });
+      if (!referenced) {
+        unused.push_back(font.key());
+      }
     }
-
-    json &settings = fileManager.getSettings();
-    settings["profiles"][profileName]["cursorShape"] = cursorShape;
-    fileManager.writeSettings();
-    std::cout << "Cursor shape updated successfully." << std::endl;
+    return unused;
   }
 
-  void cursorHeightCommand(const std::vector<std::string> &args) {
-    if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta cursor-height <height> [profileName]" << std::endl;
-      std::cout << "Height must be an integer from 1-100 (only works with vintage cursor shape)" << std::endl;
-      return;
+  void fontUninstallCommand(const std::vector<std::string> &args) {
+    bool unused = false;
+    bool dryRun = false;
+    std::vector<std::string> names;
+    for (const std::string &arg : args) {
+      if (arg == "--unused") {
+        unused = true;
+      } else if (arg == "--dry-run") {
+        dryRun = true;
+      } else if (arg.rfind("--", 0) != 0) {
+        names.push_back(arg);
+      } else {
+        std::cerr << "Unknown option: " << arg << std::endl;
+        return;
+      }
     }
-
-    std::string heightStr = args[0];
-    std::string profileName = args.size() == 2 ? args[1] : "defaults";
-
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
+    if (unused == !names.empty()) {
+      std::cerr << "Usage: wta uninstall-font <fontName...|--unused> [--dry-run]" << std::endl;
       return;
     }
 
-    try {
-      int height = std::stoi(heightStr);
-      if (height < 1 || height > 100) {
-        std::cerr << "Invalid cursor height: " << heightStr << ". Must be between 1 and 100." << std::endl;
+    json installed = manifest.fonts();
+    std::vector<std::string> targets;
+    if (unused) {
+      targets = unusedFonts(installed);
+      if (targets.empty()) {
+        std::cout << "Every font installed by wta is used by a profile." << std::endl;
         return;
       }
-
-      json &settings = fileManager.getSettings();
-      settings["profiles"][profileName]["cursorHeight"] = height;
-      fileManager.writeSettings();
-      std::cout << "Cursor height updated successfully." << std::endl;
-      
-      if (settings["profiles"][profileName].contains("cursorShape") && 
-          settings["profiles"][profileName]["cursorShape"] != "vintage") {
-        std::cout << "Note: Cursor height only affects the 'vintage' cursor shape." << std::endl;
+    } else {
+      for (const std::string &name : names) {
+        std::string key = findManifestFont(installed, name);
+        if (key.empty()) {
+          std::cerr << "Error: '" << name << "' was not installed by wta." << std::endl;
+          return;
+        }
+        if (std::find(targets.begin(), targets.end(), key) == targets.end()) {
+          targets.push_back(key);
+        }
       }
-    } catch (...) {
-      std::cerr << "Invalid cursor height: " << heightStr << ". Must be an integer between 1 and 100." << std::endl;
     }
-  }
 
-  void forceFullRepaintCommand(const std::vector<std::string> &args) {
-    if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta force-full-repaint <true|false> [profileName]" << std::endl;
-      std::cout << "Controls whether the terminal redraws the entire screen each frame." << std::endl;
+    // A file another installed font also lists stays, along with its
+    // registry value.
+    std::unordered_set<std::string> kept;
+    for (const auto &font : installed.items()) {
+      if (std::find(targets.begin(), targets.end(), font.key()) == targets.end()) {
+        for (const auto &file : font.value()["files"].items()) {
+          kept.insert(file.key());
+        }
+      }
+    }
+    std::vector<std::string> files;
+    std::vector<std::string> registryValues;
+    uint64_t bytes = 0;
+    for (const std::string &target : targets) {
+      int count = 0;
+      for (const auto &file : installed[target]["files"].items()) {
+        if (kept.count(file.key())) {
+          continue;
+        }
+        files.push_back(file.key());
+        std::string value = file.value().value("registryValue", "");
+        if (!value.empty() && installer.inFontsDirectory(file.key())) {
+          registryValues.push_back(value);
+        }
+        bytes += file.value().value("size", (uint64_t)0);
+        count++;
+      }
+      std::cout << (dryRun ? "Would uninstall " : "Uninstalling ") << target << " (" << count << " files)."
+                << std::endl;
+    }
+    if (dryRun) {
+      std::cout << "Would remove " << files.size() << " font files, " << formatSize(bytes) << "." << std::endl;
       return;
     }
 
-    std::string option = args[0];
-    std::string profileName = args.size() == 2 ? args[1] : "defaults";
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> removed;
+    installer.removeFonts(files, registryValues, removed);
+    fontManager.indexInstalledFonts(removed);
 
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
-      return;
+    std::unordered_set<std::string> removedSet(removed.begin(), removed.end());
+    bool recorded = manifest.update([&](json &fonts) {
+      for (const std::string &target : targets) {
+        if (!fonts.contains(target)) {
+          continue;
+        }
+        json &entryFiles = fonts[target]["files"];
+        for (const std::string &file : removed) {
+          entryFiles.erase(file);
+        }
+        bool remaining = false;
+        for (const auto &file : entryFiles.items()) {
+          remaining = remaining || !kept.count(file.key());
+        }
+        if (!remaining) {
+          fonts.erase(target);
+        }
+      }
+    });
+    if (!recorded) {
+      std::cerr << "Warning: Could not update the installed-font manifest." << std::endl;
     }
 
-    if (option != "true" && option != "false") {
-      std::cerr << "Invalid option: " << option << ". Use 'true' or 'false'." << std::endl;
-      return;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Removed " << removed.size() << " of " << files.size() << " font files in " << std::fixed
+              << std::setprecision(1) << seconds << "s." << std::endl;
+    if (removed.size() < files.size()) {
+      std::cerr << "Error: Some font files could not be removed; run the command again as administrator." << std::endl;
     }
-
-    json &settings = fileManager.getSettings();
-    settings["profiles"][profileName]["experimental.rendering.forceFullRepaint"] = (option == "true");
-    fileManager.writeSettings();
-    std::cout << "Force full repaint set to " << option << " successfully." << std::endl;
   }
 
-  void softwareRenderingCommand(const std::vector<std::string> &args) {
-    if (args.size() < 1 || args.size() > 2) {
-      std::cerr << "Usage: wta software-rendering <true|false> [profileName]" << std::endl;
-      std::cout << "Controls whether the terminal uses software rendering (WARP) instead of hardware rendering." << std::endl;
+  void cacheCommand(const std::vector<std::string> &args) {
+    if (args.empty() || (args[0] != "stats" && args[0] != "prune") ||
+        (args[0] == "stats" && args.size() != 1) ||
+        (args[0] == "prune" && args.size() > 2) || (args.size() == 2 && args[1] != "--all")) {
+      std::cerr << "Usage: wta cache <stats | prune [--all]>" << std::endl;
       return;
     }
 
-    std::string option = args[0];
-    std::string profileName = args.size() == 2 ? args[1] : "defaults";
-
-    if (!fileManager.profileExists(profileName)) {
-      std::cerr << "Profile not found: " << profileName << std::endl;
+    if (!cache.enabled()) {
+      std::cerr << "Archive cache is unavailable: could not create " << config.cacheDirectory() << std::endl;
       return;
     }
 
-    if (option != "true" && option != "false") {
-      std::cerr << "Invalid option: " << option << ". Use 'true' or 'false'." << std::endl;
-      return;
+    if (args[0] == "stats") {
+      json stats = cache.stats();
+      uint64_t hits = stats["hits"].get<uint64_t>();
+      uint64_t misses = stats["misses"].get<uint64_t>();
+      std::cout << "Cache directory: " << stats["directory"].get<std::string>() << std::endl;
+      std::cout << "Archives:        " << stats["entries"].get<uint64_t>() << std::endl;
+      std::cout << "Size:            " << formatSize(stats["bytes"].get<uint64_t>()) << " of "
+                << formatSize(stats["maxBytes"].get<uint64_t>()) << std::endl;
+      std::cout << "Hits / misses:   " << hits << " / " << misses;
+      if (hits + misses > 0) {
+        std::cout << " (" << (100 * hits / (hits + misses)) << "% hit rate)";
+      }
+      std::cout << std::endl;
+    } else {
+      uint64_t freed = cache.prune(args.size() == 2);
+      std::cout << "Freed " << formatSize(freed) << " from the archive cache." << std::endl;
     }
-
-    json &settings = fileManager.getSettings();
-    settings["profiles"][profileName]["experimental.rendering.software"] = (option == "true");
-    fileManager.writeSettings();
-    std::cout << "Software rendering set to " << option << " successfully." << std::endl;
   }
 
-  void fontInstallCommand(const std::vector<std::string> &args) {
-    if (args.empty()) {
-      std::cerr << "Usage: wta install-font <fontName|help>" << std::endl;
-      std::cout << "Use: wta install-font help to see a list of available Nerd Fonts." << std::endl;
+  // The mirror keeps its own font_data.json with relative URLs, digests and the
+  // upstream URL of each archive. An archive is fetched again only when its
+  // upstream URL or digest changes, or the mirrored file is missing or resized.
+  void mirrorCommand(const std::vector<std::string> &args) {
+    if (args.size() < 2 || args[0] != "sync") {
+      std::cerr << "Usage: wta mirror sync <directory> [--catalog <source>]" << std::endl;
       return;
     }
 
-    std::string fontArg = args[0];
+    std::filesystem::path mirrorDir = args[1];
+    std::string catalogSource = fontManager.defaultCatalogUrl();
+    for (size_t i = 2; i < args.size(); ++i) {
+      if (args[i] == "--catalog" && i + 1 < args.size()) {
+        catalogSource = args[++i];
+      } else {
+        std::cerr << "Unknown option: " << args[i] << std::endl;
+        return;
+      }
+    }
 
-    if (fontArg == "help") {
-      displayAvailableFonts();
+    std::error_code ec;
+    std::filesystem::create_directories(mirrorDir, ec);
+    if (!std::filesystem::is_directory(mirrorDir, ec)) {
+      std::cerr << "Error: Could not create mirror directory " << mirrorDir.string() << std::endl;
       return;
     }
 
-    if (fontManager.fontExists(fontArg)) {
-      std::cerr << "Font '" << fontArg << "' is already installed on the system." << std::endl;
-      std::cout << "Use: wta font <fontName> to set it for a profile." << std::endl;
+    json upstream;
+    if (!fontManager.loadCatalog(catalogSource, upstream)) {
+      std::cerr << "Error: Could not read font catalog from " << catalogSource << std::endl;
       return;
     }
 
-    installFont(fontArg);
-  }
-
-  void displayAvailableFonts() {
-    json fontData = fontManager.readFontData();
-    std::cout << "Available Nerd Fonts:" << std::endl;
-    for (const auto &font : fontData) {
-      std::cout << font["Name"].get<std::string>() << std::endl;
+    std::unordered_map<std::string, json> mirrored;
+    json current;
+    if (fontManager.loadCatalog(mirrorDir.string(), current)) {
+      for (const auto &font : current) {
+        if (font.contains("Name") && font["Name"].is_string()) {
+          mirrored[font["Name"].get<std::string>()] = font;
+        }
+      }
     }
-  }
 
-  void installFont(const std::string &fontName) {
-    json fontData = fontManager.readFontData();
-    std::string fontUrl;
-    
-    if (!fontManager.findFontInData(fontData, fontName, fontUrl)) {
-      std::cerr << "Error: Font '" << fontName << "' not found in available fonts." << std::endl;
-      std::cout << "Use: wta font-install help to see available fonts." << std::endl;
-      return;
-    }
+    json catalog = json::array();
+    int fetched = 0;
+    int unchanged = 0;
+    int failed = 0;
+    uint64_t fetchedBytes = 0;
+
+    // Mirrors one archive of a font into the directory, reusing the copy from
+    // the previous sync when it still matches. Returns false when it could not
+    // be fetched; "out" is left empty unless an older copy can still be served.
+    auto syncArchive = [&](const json &archive, const json *previous, const std::string &label,
+                           const std::string &defaultName, json &out, bool &wasFetched) {
+      std::string url = archive["URL"].get<std::string>();
+      ExpectedContent expected;
+      expected.sha256 = archive.value("sha256", "");
+      expected.size = archive.value("size", (int64_t)-1);
+
+      std::string fileName = url.substr(url.find_last_of("/\\") + 1);
+      if (fileName.empty()) {
+        fileName = defaultName;
+      }
+      std::filesystem::path archivePath = mirrorDir / fileName;
+
+      wasFetched = false;
+      if (previous) {
+        uint64_t size = std::filesystem::file_size(archivePath, ec);
+        if (!ec && previous->value("source", "") == url && previous->value("size", (int64_t)-1) == (int64_t)size &&
+            (expected.sha256.empty() || previous->value("sha256", "") == expected.sha256)) {
+          out = *previous;
+          out["URL"] = fileName;
+          return true;
+        }
+      }
 
-    std::cout << "Downloading " << fontName << " font..." << std::endl;
+      std::cout << "Fetching " << label << "..." << std::endl;
+      if (!downloader.downloadFile(url, archivePath.string(), expected)) {
+        std::cerr << "Error: Failed to download font from " << url << std::endl;
+        if (previous && std::filesystem::exists(archivePath, ec)) {
+          out = *previous;
+          out["URL"] = fileName;
+        }
+        return false;
+      }
 
-    std::string tempPath = std::getenv("TEMP");
-    std::string zipPath = tempPath + "\\" + fontName + ".zip";
+      uint64_t size = std::filesystem::file_size(archivePath, ec);
+      out = archive;
+      out["URL"] = fileName;
+      out["sha256"] = downloader.lastDigest();
+      out["size"] = size;
+      out["source"] = url;
+      wasFetched = true;
+      fetchedBytes += size;
+      return true;
+    };
 
-    if (!downloader.downloadFile(fontUrl, zipPath)) {
-      std::cerr << "Error: Failed to download font from " << fontUrl << std::endl;
-      return;
+    for (const auto &font : upstream) {
+      if (!font.contains("Name") || !font.contains("URL") || !font["URL"].is_string()) {
+        continue;
+      }
+      std::string name = font["Name"].get<std::string>();
+      auto existing = mirrored.find(name);
+      const json *previous = existing != mirrored.end() ? &existing->second : nullptr;
+
+      bool anyFetched = false;
+      bool anyFailed = false;
+      bool wasFetched = false;
+
+      json entry;
+      if (!syncArchive(font, previous, name, name + ".zip", entry, wasFetched)) {
+        anyFailed = true;
+      }
+      anyFetched |= wasFetched;
+      if (entry.is_null()) {
+        failed++;
+        continue;
+      }
+
+      // Alternative formats are mirrored alongside the primary archive, so an
+      // offline machine can install whichever format it prefers.
+      entry.erase("archives");
+      if (font.contains("archives") && font["archives"].is_array()) {
+        json archives = json::array();
+        for (const json &archive : font["archives"]) {
+          if (!archive.is_object() || !archive.contains("URL") || !archive["URL"].is_string()) {
+            continue;
+          }
+          const json *previousArchive = nullptr;
+          if (previous && previous->contains("archives") && (*previous)["archives"].is_array()) {
+            for (const json &candidate : (*previous)["archives"]) {
+              if (candidate.value("source", "") == archive["URL"].get<std::string>()) {
+                previousArchive = &candidate;
+                break;
+              }
+            }
+          }
+          std::string format = archiveFormat(archive["URL"].get<std::string>());
+          json mirroredArchive;
+          if (!syncArchive(archive, previousArchive, name + " (" + format + ")", name + "." + format, mirroredArchive,
+                           wasFetched)) {
+            anyFailed = true;
+          }
+          anyFetched |= wasFetched;
+          if (!mirroredArchive.is_null()) {
+            archives.push_back(mirroredArchive);
+          }
+        }
+        if (!archives.empty()) {
+          entry["archives"] = archives;
+        }
+      }
+
+      catalog.push_back(entry);
+      if (anyFailed) {
+        failed++;
+      } else if (anyFetched) {
+        fetched++;
+      } else {
+        unchanged++;
+      }
     }
 
-    std::cout << "Installing " << fontName << " font..." << std::endl;
+    std::filesystem::path catalogPath = mirrorDir / "font_data.json";
+    std::string tempPath = catalogPath.string() + ".tmp";
+    std::ofstream file(tempPath, std::ios::trunc);
+    file << std::setw(2) << catalog << std::endl;
+    file.close();
+    if (!file) {
+      std::cerr << "Error: Could not write " << catalogPath.string() << std::endl;
+      std::filesystem::remove(tempPath, ec);
+      return;
+    }
+    std::filesystem::rename(tempPath, catalogPath, ec);
+    if (ec) {
+      std::cerr << "Error: Could not write " << catalogPath.string() << std::endl;
+      return;
+    }
 
-    if (installer.extractAndInstallFonts(zipPath, fontName)) {
-      std::cout << "Font '" << fontName << "' installed successfully!" << std::endl;
-      std::cout << "You may need to restart applications to see the new font." << std::endl;
-    } else {
-      std::cerr << "Error: Failed to install font." << std::endl;
+    std::cout << "Mirror synced: " << fetched << " fetched (" << formatSize(fetchedBytes) << "), " << unchanged
+              << " unchanged";
+    if (failed > 0) {
+      std::cout << ", " << failed << " failed";
     }
+    std::cout << "." << std::endl;
   }
 
   void createProfileCommand(const std::vector<std::string> &args) {
@@ -2267,6 +10916,8 @@ private:
   }
 };
 
+// The test programs include this file for its classes and bring their own main.
+#ifndef WTA_NO_MAIN
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     std::cerr << "Usage: wta [command] [arguments]" << std::endl;
@@ -2286,3 +10937,4 @@ int main(int argc, char *argv[]) {
   
   return 0;
 }
+#endif
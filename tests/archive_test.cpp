@@ -0,0 +1,184 @@
+// ZipArchive and the install paths built on it, run against the fixture
+// archives: every font entry must come out byte for byte, everything else
+// must be left out, and damaged archives must fail cleanly.
+#include "test.h"
+
+namespace {
+
+const char *const FONT_NAMES[] = {"Fixture-Bold.ttf", "Fixture-Regular.ttf", "FixtureMono-Regular.ttf"};
+
+std::vector<uint8_t> extractEntry(const ZipArchive &archive, const std::string &name, std::string &error) {
+  std::vector<uint8_t> out;
+  for (const ZipEntry &entry : archive.entries()) {
+    if (entry.name == name) {
+      archive.extract(
+          entry,
+          [&](const uint8_t *data, size_t size) {
+            out.insert(out.end(), data, data + size);
+            return true;
+          },
+          error);
+    }
+  }
+  return out;
+}
+
+// Where the compressed data of an entry starts in the archive bytes.
+size_t dataOffset(const std::vector<uint8_t> &zip, const ZipEntry &entry) {
+  const uint8_t *header = zip.data() + entry.localHeaderOffset;
+  return (size_t)entry.localHeaderOffset + 30 + (header[26] | header[27] << 8) + (header[28] | header[29] << 8);
+}
+
+// The offset of the first central directory record.
+size_t directoryOffset(const std::vector<uint8_t> &zip) {
+  const uint8_t *end = zip.data() + zip.size() - 22;
+  return (size_t)end[16] | (size_t)end[17] << 8 | (size_t)end[18] << 16 | (size_t)end[19] << 24;
+}
+
+void checkInstalledFixtures(const TempHome &home) {
+  std::vector<std::string> expected(std::begin(FONT_NAMES), std::end(FONT_NAMES));
+  CHECK(listFiles(home.fontsDirectory()) == expected);
+  for (const char *name : FONT_NAMES) {
+    CHECK(readBytes((home.fontsDirectory() / name).string()) == readBytes(fixturePath(name)));
+  }
+}
+
+} // namespace
+
+TEST(zipListsEveryEntry) {
+  ZipArchive archive;
+  CHECK(archive.open(fixturePath("fonts.zip")));
+  std::vector<std::string> names;
+  for (const ZipEntry &entry : archive.entries()) {
+    names.push_back(entry.name);
+  }
+  std::sort(names.begin(), names.end());
+  CHECK(names == std::vector<std::string>({"Fixture/Fixture-Bold.ttf", "Fixture/Fixture-Regular.ttf",
+                                           "Fixture/FixtureMono-Regular.ttf", "LICENSE.txt", "README.md"}));
+}
+
+TEST(zipExtractsDeflatedAndStoredEntries) {
+  ZipArchive archive;
+  CHECK(archive.open(fixturePath("fonts.zip")));
+  std::string error;
+  for (const char *name : FONT_NAMES) {
+    CHECK(extractEntry(archive, std::string("Fixture/") + name, error) == readBytes(fixturePath(name)));
+  }
+  std::vector<uint8_t> license = extractEntry(archive, "LICENSE.txt", error);
+  CHECK(std::string(license.begin(), license.end()) == "Public domain.\n");
+  CHECK(error.empty());
+}
+
+TEST(zipRejectsCorruptEntryData) {
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  ZipArchive original;
+  CHECK(original.open(fixturePath("fonts.zip")));
+  const ZipEntry &entry = original.entries()[0];
+  CHECK(entry.method == 8);
+  zip[dataOffset(zip, entry) + (size_t)entry.compressedSize / 2] ^= 0x55;
+  CHECK(writeBytes(dir / "corrupt.zip", zip));
+
+  ZipArchive archive;
+  CHECK(archive.open(dir / "corrupt.zip"));
+  std::string error;
+  extractEntry(archive, entry.name, error);
+  CHECK(!error.empty());
+}
+
+TEST(zipRejectsTruncatedArchive) {
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  zip.resize(zip.size() / 2);
+  CHECK(writeBytes(dir / "truncated.zip", zip));
+  ZipArchive archive;
+  CHECK(!archive.open(dir / "truncated.zip"));
+  CHECK(!archive.error().empty());
+}
+
+TEST(zipRejectsOffsetsPastTheEnd) {
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  // The first entry's local header offset, then its compressed size, set
+  // just short of 4 GB; the bounds checks must not wrap around.
+  size_t record = directoryOffset(zip);
+  std::string name(zip.begin() + record + 46, zip.begin() + record + 46 + (zip[record + 28] | zip[record + 29] << 8));
+  for (size_t field : {42, 20}) {
+    std::vector<uint8_t> patched = zip;
+    const uint8_t huge[] = {0xF0, 0xFF, 0xFF, 0xFF};
+    std::copy(huge, huge + 4, patched.begin() + record + field);
+    CHECK(writeBytes(dir / "patched.zip", patched));
+
+    ZipArchive archive;
+    CHECK(archive.open(dir / "patched.zip"));
+    std::string error;
+    extractEntry(archive, name, error);
+    CHECK(!error.empty());
+  }
+}
+
+TEST(installFromZipWritesOnlyFonts) {
+  TempHome home;
+  FontInstaller installer;
+  CHECK(installer.extractAndInstallFonts(fixturePath("fonts.zip")));
+  checkInstalledFixtures(home);
+  CHECK(installer.lastStats().filesInstalled == 3);
+}
+
+TEST(installFromTarXzWritesOnlyFonts) {
+  TempHome home;
+  FontInstaller installer;
+  CHECK(installer.extractAndInstallFonts(fixturePath("fonts.tar.xz")));
+  checkInstalledFixtures(home);
+}
+
+TEST(installStreamsZipWithoutTheArchiveOnDisk) {
+  TempHome home;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  MemorySource source(zip.data(), zip.size());
+  FontInstaller installer;
+  CHECK(installer.streamAndInstallFonts(source, [] { return true; }));
+  checkInstalledFixtures(home);
+}
+
+TEST(installWithOneThreadMatchesParallel) {
+  TempHome home;
+  FontInstaller installer;
+  installer.setThreadCount(1);
+  CHECK(installer.extractAndInstallFonts(fixturePath("fonts.zip")));
+  checkInstalledFixtures(home);
+}
+
+TEST(reinstallSkipsUnchangedFiles) {
+  TempHome home;
+  FontInstaller installer;
+  CHECK(installer.extractAndInstallFonts(fixturePath("fonts.zip")));
+  installer.extractAndInstallFonts(fixturePath("fonts.zip"));
+  CHECK(installer.lastStats().unchangedSkipped == 3);
+  CHECK(installer.lastStats().bytesWritten == 0);
+  checkInstalledFixtures(home);
+}
+
+TEST(installSkipsFontsWithBadChecksums) {
+  TempHome home;
+  TempDir dir;
+  std::vector<uint8_t> good = readBytes(fixturePath("Fixture-Regular.ttf"));
+  std::vector<uint8_t> bad = readBytes(fixturePath("Fixture-Bold.ttf"));
+  bad[bad.size() - 8] ^= 0x01;
+  CHECK(writeBytes(dir / "mixed.zip", storedZip({{"Good.ttf", good}, {"Bad.ttf", bad}})));
+
+  FontInstaller installer;
+  CHECK(installer.extractAndInstallFonts(dir / "mixed.zip"));
+  CHECK(listFiles(home.fontsDirectory()) == std::vector<std::string>({"Good.ttf"}));
+  CHECK(installer.lastStats().invalidSkipped == 1);
+}
+
+TEST(filterKeepsOnlyRequestedWeights) {
+  TempHome home;
+  FontFilter filter;
+  filter.weights = {700};
+  FontInstaller installer;
+  installer.setFilter(filter);
+  CHECK(installer.extractAndInstallFonts(fixturePath("fonts.zip")));
+  CHECK(listFiles(home.fontsDirectory()) == std::vector<std::string>({"Fixture-Bold.ttf"}));
+}
@@ -0,0 +1,67 @@
+// Helpers for the benchmark programs that `make bench` runs. Each program
+// takes archive paths on the command line, such as Nerd Font releases, and
+// falls back to the fixture archive, which keeps it working offline but is
+// too small to time meaningfully.
+#define WTA_BENCHMARK
+#include "http_stub.h"
+
+struct Measurement {
+  double milliseconds = 0;
+  // Bytes handed to write() by every thread of this process.
+  uint64_t bytesWritten = 0;
+};
+
+// The wchar counter in /proc/self/io.
+uint64_t bytesWrittenSoFar() {
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  uint64_t value = 0;
+  while (io >> key >> value) {
+    if (key == "wchar:") {
+      return value;
+    }
+  }
+  return 0;
+}
+
+// Runs `work` with std::cout and std::cerr silenced, so their output does not
+// count as written bytes.
+Measurement measure(const std::function<void()> &work) {
+  std::ostringstream discarded;
+  std::streambuf *out = std::cout.rdbuf(discarded.rdbuf());
+  std::streambuf *err = std::cerr.rdbuf(discarded.rdbuf());
+  uint64_t before = bytesWrittenSoFar();
+  auto start = std::chrono::steady_clock::now();
+  work();
+  Measurement result;
+  result.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  result.bytesWritten = bytesWrittenSoFar() - before;
+  std::cout.rdbuf(out);
+  std::cerr.rdbuf(err);
+  return result;
+}
+
+// The fastest of `runs` measurements; `work` sets up whatever it needs fresh.
+Measurement fastest(int runs, const std::function<void()> &work) {
+  Measurement best;
+  for (int i = 0; i < runs; ++i) {
+    Measurement next = measure(work);
+    if (i == 0 || next.milliseconds < best.milliseconds) {
+      best = next;
+    }
+  }
+  return best;
+}
+
+std::vector<std::string> archiveArguments(int argc, char *argv[]) {
+  std::vector<std::string> archives(argv + 1, argv + argc);
+  if (archives.empty()) {
+    archives.push_back(fixturePath("fonts.zip"));
+  }
+  return archives;
+}
+
+void printMeasurement(const std::string &label, const Measurement &measurement) {
+  std::printf("  %-28s %10.2f ms %14llu bytes written\n", label.c_str(), measurement.milliseconds,
+              (unsigned long long)measurement.bytesWritten);
+}
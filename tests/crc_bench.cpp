@@ -0,0 +1,45 @@
+// Crc32 throughput, the runtime-selected kernel against the portable
+// slicing-by-8 one, over each archive's bytes repeated to at least 64 MB.
+#include "bench.h"
+
+namespace {
+
+using Kernel = uint32_t (*)(uint32_t, const uint8_t *, size_t);
+
+// GB per second over `passes` runs through the data.
+double throughput(const std::vector<uint8_t> &data, size_t passes, Kernel kernel, uint32_t &crc) {
+  Measurement measurement = fastest(3, [&] {
+    crc = 0;
+    for (size_t i = 0; i < passes; ++i) {
+      crc = kernel(crc, data.data(), data.size());
+    }
+  });
+  return (double)data.size() * passes / (measurement.milliseconds / 1000) / (1 << 30);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const size_t MINIMUM = 64 << 20;
+  std::printf("Accelerated kernel available: %s\n", Crc32::accelerationAvailable() ? "yes" : "no");
+  for (const std::string &archive : archiveArguments(argc, argv)) {
+    std::vector<uint8_t> data = readBytes(archive);
+    if (data.empty()) {
+      std::fprintf(stderr, "could not read %s\n", archive.c_str());
+      return 1;
+    }
+    size_t passes = (MINIMUM + data.size() - 1) / data.size();
+    uint32_t selected = 0;
+    uint32_t portable = 0;
+    double fast = throughput(data, passes, &Crc32::update, selected);
+    double slow = throughput(data, passes, &Crc32::updatePortable, portable);
+    std::printf("%s (%zu bytes x %zu)\n", archive.c_str(), data.size(), passes);
+    std::printf("  selected kernel  %8.2f GB/s\n", fast);
+    std::printf("  slicing-by-8     %8.2f GB/s\n", slow);
+    if (selected != portable) {
+      std::fprintf(stderr, "the kernels disagree: %08x against %08x\n", selected, portable);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+// Extracting fonts straight into the Fonts directory against the round trip
+// installs used to make: every entry expanded into a temporary directory, the
+// fonts copied from there, and the directory removed. Zip archives only.
+#include "bench.h"
+
+namespace {
+
+bool roundTrip(const std::string &archivePath, const std::filesystem::path &fontsDirectory) {
+  ZipArchive archive;
+  if (!archive.open(archivePath)) {
+    return false;
+  }
+  TempDir temp;
+  std::vector<std::filesystem::path> fonts;
+  for (const ZipEntry &entry : archive.entries()) {
+    if (entry.name.empty() || entry.name.back() == '/') {
+      continue;
+    }
+    std::filesystem::path target = temp.path() / std::filesystem::path(entry.name).lexically_normal();
+    std::filesystem::create_directories(target.parent_path());
+    std::ofstream out(target, std::ios::binary | std::ios::trunc);
+    std::string error;
+    archive.extract(
+        entry,
+        [&](const uint8_t *data, size_t size) {
+          out.write(reinterpret_cast<const char *>(data), (std::streamsize)size);
+          return (bool)out;
+        },
+        error);
+    if (!error.empty()) {
+      return false;
+    }
+    if (isFontFileName(target.filename().string())) {
+      fonts.push_back(target);
+    }
+  }
+  std::filesystem::create_directories(fontsDirectory);
+  for (const std::filesystem::path &font : fonts) {
+    std::filesystem::copy_file(font, fontsDirectory / font.filename(),
+                               std::filesystem::copy_options::overwrite_existing);
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const int RUNS = 5;
+  for (const std::string &archive : archiveArguments(argc, argv)) {
+    std::printf("%s\n", archive.c_str());
+    Measurement baseline = fastest(RUNS, [&] {
+      TempHome home;
+      if (!roundTrip(archive, home.fontsDirectory())) {
+        std::fprintf(stderr, "temporary directory round trip failed for %s\n", archive.c_str());
+      }
+    });
+    Measurement direct = fastest(RUNS, [&] {
+      TempHome home;
+      FontInstaller installer;
+      if (!installer.extractAndInstallFonts(archive)) {
+        std::fprintf(stderr, "install failed for %s\n", archive.c_str());
+      }
+    });
+    // Installed files whose digest matches the archive are left alone.
+    TempHome home;
+    FontInstaller installer;
+    measure([&] { installer.extractAndInstallFonts(archive); });
+    Measurement unchanged = fastest(RUNS, [&] { installer.extractAndInstallFonts(archive); });
+
+    printMeasurement("temporary directory", baseline);
+    printMeasurement("direct", direct);
+    printMeasurement("direct, already installed", unchanged);
+  }
+  return 0;
+}
@@ -0,0 +1,183 @@
+// FileDownloader and install-font against the loopback stand-in: catalog
+// digests are checked while the bytes arrive, a mismatch stops the install
+// before anything is extracted, and broken transfers resume or fail cleanly.
+#include "http_stub.h"
+
+namespace {
+
+json catalogEntry(const std::string &name, const std::string &url, const std::vector<uint8_t> &archive) {
+  return {{"Name", name}, {"URL", url}, {"sha256", sha256Hex(archive)}, {"size", archive.size()}};
+}
+
+bool hasPartialFiles(const std::filesystem::path &directory) {
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::recursive_directory_iterator(directory, ec)) {
+    std::string extension = entry.path().extension().string();
+    if (extension == ".part" || extension == ".journal") {
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace
+
+TEST(sha256MatchesKnownAnswers) {
+  std::string abc = "abc";
+  CHECK(sha256Hex(std::vector<uint8_t>(abc.begin(), abc.end())) ==
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  CHECK(sha256Hex(std::vector<uint8_t>(1000000, 'a')) ==
+        "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST(downloadAcceptsMatchingDigest) {
+  LoopbackServer server;
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  server.serve("/fonts.zip", zip);
+
+  FileDownloader downloader;
+  ExpectedContent expected{sha256Hex(zip), (int64_t)zip.size()};
+  CHECK(downloader.downloadFile(server.url("/fonts.zip"), dir / "fonts.zip", expected));
+  CHECK(readBytes(dir / "fonts.zip") == zip);
+  CHECK(downloader.lastDigest() == expected.sha256);
+}
+
+TEST(downloadRejectsDigestMismatch) {
+  LoopbackServer server;
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  server.serve("/fonts.zip", zip);
+
+  FileDownloader downloader;
+  ExpectedContent expected{std::string(64, '0'), -1};
+  CHECK(!downloader.downloadFile(server.url("/fonts.zip"), dir / "fonts.zip", expected));
+  CHECK(!std::filesystem::exists(dir / "fonts.zip"));
+  CHECK(!hasPartialFiles(dir.path()));
+}
+
+TEST(downloadRejectsSizeMismatch) {
+  LoopbackServer server;
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  server.serve("/fonts.zip", zip);
+
+  FileDownloader downloader;
+  ExpectedContent expected{"", (int64_t)zip.size() + 1};
+  CHECK(!downloader.downloadFile(server.url("/fonts.zip"), dir / "fonts.zip", expected));
+  CHECK(!std::filesystem::exists(dir / "fonts.zip"));
+}
+
+TEST(downloadResumesAfterDroppedConnection) {
+  LoopbackServer server;
+  TempDir dir;
+  LoopbackServer::Resource resource;
+  resource.body = readBytes(fixturePath("fonts.zip"));
+  resource.cutAfter = resource.body.size() / 2;
+  resource.cuts = 1;
+  server.serve("/fonts.zip", resource);
+
+  FileDownloader downloader;
+  ExpectedContent expected{sha256Hex(resource.body), (int64_t)resource.body.size()};
+  CHECK(downloader.downloadFile(server.url("/fonts.zip"), dir / "fonts.zip", expected));
+  CHECK(readBytes(dir / "fonts.zip") == resource.body);
+  CHECK(server.ranges("/fonts.zip") == std::vector<std::string>({"bytes=" + std::to_string(resource.cutAfter) + "-"}));
+}
+
+TEST(downloadRestartsWhenServerSendsAnotherRange) {
+  LoopbackServer server;
+  TempDir dir;
+  LoopbackServer::Resource resource;
+  resource.body = readBytes(fixturePath("fonts.zip"));
+  resource.cutAfter = resource.body.size() / 2;
+  resource.cuts = 1;
+  resource.rangeFromZero = true;
+  server.serve("/fonts.zip", resource);
+
+  FileDownloader downloader;
+  ExpectedContent expected{sha256Hex(resource.body), (int64_t)resource.body.size()};
+  CHECK(downloader.downloadFile(server.url("/fonts.zip"), dir / "fonts.zip", expected));
+  CHECK(readBytes(dir / "fonts.zip") == resource.body);
+}
+
+TEST(downloadIgnoresMalformedJournal) {
+  LoopbackServer server;
+  TempDir dir;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  server.serve("/fonts.zip", zip);
+  std::vector<uint8_t> part(zip.begin(), zip.begin() + 100);
+
+  std::string url = server.url("/fonts.zip");
+  for (const json &journal : {json{{"url", url}}, json{{"url", url}, {"ranges", json::array({json::array({"a", 1})})}},
+                              json{{"url", url}, {"ranges", {{0, 100}}}, {"totalSize", "big"}}, json::array({1, 2})}) {
+    CHECK(writeBytes(dir / "fonts.zip.part", part));
+    std::ofstream(dir / "fonts.zip.journal") << journal;
+    FileDownloader downloader;
+    CHECK(downloader.downloadFile(url, dir / "fonts.zip"));
+    CHECK(readBytes(dir / "fonts.zip") == zip);
+    std::filesystem::remove(dir / "fonts.zip");
+  }
+}
+
+TEST(chunkedBodiesNeedWellFormedSizes) {
+  LoopbackServer server;
+  TempDir dir;
+  LoopbackServer::Resource good;
+  good.raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+             "5;name=value\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+  LoopbackServer::Resource bad;
+  bad.raw = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n5\r\nhello\r\nzz\r\n";
+  LoopbackServer::Resource negative;
+  negative.raw = "HTTP/1.1 200 OK\r\nContent-Length: -5\r\nConnection: close\r\n\r\nhello";
+  server.serve("/good", good);
+  server.serve("/bad", bad);
+  server.serve("/negative", negative);
+
+  FileDownloader downloader;
+  CHECK(downloader.downloadFile(server.url("/good"), dir / "good"));
+  std::vector<uint8_t> body = readBytes(dir / "good");
+  CHECK(std::string(body.begin(), body.end()) == "hello world");
+  CHECK(!downloader.downloadFile(server.url("/bad"), dir / "bad"));
+  CHECK(!downloader.downloadFile(server.url("/negative"), dir / "negative"));
+}
+
+TEST(installVerifiesCatalogDigest) {
+  LoopbackServer server;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  server.serve("/fonts.zip", zip);
+  TestEnvironment env(server, json::array({catalogEntry("Fixture", server.url("/fonts.zip"), zip)}));
+
+  runWta("install-font", {"Fixture"});
+  CHECK(listFiles(env.fontsDirectory()) ==
+        std::vector<std::string>({"Fixture-Bold.ttf", "Fixture-Regular.ttf", "FixtureMono-Regular.ttf"}));
+}
+
+TEST(installStopsBeforeExtractionOnDigestMismatch) {
+  LoopbackServer server;
+  std::vector<uint8_t> zip = readBytes(fixturePath("fonts.zip"));
+  server.serve("/fonts.zip", zip);
+  json entry = catalogEntry("Fixture", server.url("/fonts.zip"), zip);
+  entry["sha256"] = std::string(64, 'f');
+
+  for (bool stream : {false, true}) {
+    TestEnvironment env(server, json::array({entry}));
+    runWta("install-font", stream ? std::vector<std::string>({"Fixture", "--stream"}) : std::vector<std::string>({"Fixture"}));
+    CHECK(listFiles(env.fontsDirectory()).empty());
+    CHECK(!hasPartialFiles(env.fontsDirectory()));
+  }
+}
+
+TEST(streamedDuplicateNamesKeepTheLastEntry) {
+  LoopbackServer server;
+  TempHome home;
+  server.serve("/duplicates.zip", readBytes(fixturePath("duplicates.zip")));
+
+  FileDownloader downloader;
+  std::unique_ptr<ByteSource> source = downloader.openStream(server.url("/duplicates.zip"));
+  CHECK(source != nullptr);
+  FontInstaller installer;
+  CHECK(source && installer.streamAndInstallFonts(*source, [] { return true; }));
+  CHECK(listFiles(home.fontsDirectory()) == std::vector<std::string>({"Fixture-Regular.ttf"}));
+  CHECK(readBytes((home.fontsDirectory() / "Fixture-Regular.ttf").string()) ==
+        readBytes(fixturePath("Fixture-Bold.ttf")));
+}
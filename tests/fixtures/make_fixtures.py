@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# Regenerates the test fixtures: three tiny but valid sfnt fonts and the
+# archives the tests install them from. The output is deterministic, so a
+# rerun only changes files when this script does.
+
+import io
+import lzma
+import os
+import struct
+import tarfile
+import zipfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+DATE = (2024, 1, 1, 0, 0, 0)
+
+
+def checksum(data):
+    data += b"\0" * (-len(data) % 4)
+    return sum(struct.unpack(">%dI" % (len(data) // 4), data)) & 0xFFFFFFFF
+
+
+def name_table(family, subfamily):
+    names = [(1, family), (2, subfamily), (4, family + " " + subfamily), (6, (family + "-" + subfamily).replace(" ", ""))]
+    records = b""
+    strings = b""
+    for name_id, text in names:
+        encoded = text.encode("utf-16-be")
+        records += struct.pack(">HHHHHH", 3, 1, 0x409, name_id, len(encoded), len(strings))
+        strings += encoded
+    return struct.pack(">HHH", 0, len(names), 6 + len(records)) + records + strings
+
+
+def head_table(bold):
+    return struct.pack(">IIIIHHqqhhhhHHhhh", 0x00010000, 0x00010000, 0, 0x5F0F3CF5, 0x000B, 1000, 0, 0,
+                       0, -200, 600, 800, 1 if bold else 0, 8, 2, 0, 0)
+
+
+def os2_table(weight, bold, mono):
+    panose = bytes([2, 0, 0, 9 if mono else 0, 0, 0, 0, 0, 0, 0])
+    return (struct.pack(">HhHHH", 4, 600, weight, 5, 0) + struct.pack(">10h", *([0] * 10)) + struct.pack(">h", 0) +
+            panose + struct.pack(">IIII", 1, 0, 0, 0) + b"WTA " +
+            struct.pack(">HHHhhhHHIIhhHHH", 0x20 if bold else 0x40, 0x41, 0x5A, 800, -200, 0, 800, 200, 1, 0,
+                        500, 700, 0, 0x20, 1))
+
+
+def cmap_table():
+    # Format 4 mapping A-Z to glyphs 1-26, plus the 0xFFFF terminator.
+    ends, starts, deltas = [0x5A, 0xFFFF], [0x41, 0xFFFF], [(1 - 0x41) & 0xFFFF, 1]
+    seg_count = len(ends)
+    body = (struct.pack(">%dH" % seg_count, *ends) + b"\0\0" + struct.pack(">%dH" % seg_count, *starts) +
+            struct.pack(">%dH" % seg_count, *deltas) + struct.pack(">%dH" % seg_count, *([0] * seg_count)))
+    subtable = struct.pack(">HHHHHHH", 4, 14 + len(body), 0, seg_count * 2, 4, 1, 0) + body
+    return struct.pack(">HHHHI", 0, 1, 3, 1, 12) + subtable
+
+
+def post_table(mono):
+    return struct.pack(">IIhhIIIII", 0x00030000, 0, -100, 50, 1 if mono else 0, 0, 0, 0, 0)
+
+
+def font(family, subfamily, weight, bold=False, mono=False):
+    tables = {
+        b"OS/2": os2_table(weight, bold, mono),
+        b"cmap": cmap_table(),
+        b"head": head_table(bold),
+        b"name": name_table(family, subfamily),
+        b"post": post_table(mono),
+    }
+    tags = sorted(tables)
+    offset = 12 + 16 * len(tags)
+    directory = struct.pack(">IHHHH", 0x00010000, len(tags), 64, 2, len(tags) * 16 - 64)
+    body = b""
+    for tag in tags:
+        data = tables[tag]
+        directory += struct.pack(">4sIII", tag, checksum(data), offset + len(body), len(data))
+        body += data + b"\0" * (-len(data) % 4)
+    data = bytearray(directory + body)
+    head_offset = struct.unpack(">I", directory[12 + 16 * tags.index(b"head") + 8:][:4])[0]
+    struct.pack_into(">I", data, head_offset + 8, (0xB1B0AFBA - checksum(bytes(data))) & 0xFFFFFFFF)
+    return bytes(data)
+
+
+FONTS = {
+    "Fixture-Regular.ttf": font("Fixture", "Regular", 400),
+    "Fixture-Bold.ttf": font("Fixture", "Bold", 700, bold=True),
+    "FixtureMono-Regular.ttf": font("Fixture Mono", "Regular", 400, mono=True),
+}
+EXTRAS = {"README.md": b"# Fixture fonts\n" * 40, "LICENSE.txt": b"Public domain.\n"}
+
+
+def write_zip(path, members):
+    with zipfile.ZipFile(path, "w") as archive:
+        for name, data in members:
+            info = zipfile.ZipInfo(name, DATE)
+            info.compress_type = zipfile.ZIP_STORED if name.endswith(".txt") else zipfile.ZIP_DEFLATED
+            info.external_attr = 0o644 << 16
+            archive.writestr(info, data)
+
+
+def write_tar_xz(path, members):
+    buffer = io.BytesIO()
+    with tarfile.open(fileobj=buffer, mode="w", format=tarfile.USTAR_FORMAT) as archive:
+        for name, data in members:
+            info = tarfile.TarInfo(name)
+            info.size = len(data)
+            info.mtime = 1704067200
+            info.mode = 0o644
+            archive.addfile(info, io.BytesIO(data))
+    with open(path, "wb") as out:
+        out.write(lzma.compress(buffer.getvalue(), format=lzma.FORMAT_XZ, check=lzma.CHECK_CRC64))
+
+
+def main():
+    for name, data in FONTS.items():
+        with open(os.path.join(HERE, name), "wb") as out:
+            out.write(data)
+    members = [("Fixture/" + name, data) for name, data in FONTS.items()] + list(EXTRAS.items())
+    write_zip(os.path.join(HERE, "fonts.zip"), members)
+    write_tar_xz(os.path.join(HERE, "fonts.tar.xz"), members)
+    # Two entries share a file name in different folders; the later one wins.
+    write_zip(os.path.join(HERE, "duplicates.zip"), [("a/Fixture-Regular.ttf", FONTS["Fixture-Regular.ttf"]),
+                                                     ("b/Fixture-Regular.ttf", FONTS["Fixture-Bold.ttf"])])
+
+
+if __name__ == "__main__":
+    main()
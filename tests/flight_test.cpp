@@ -0,0 +1,211 @@
+// SingleFlight across real processes: children forked on the same key must
+// take turns, only the first may download, and the others must reuse what
+// it left behind. A leader that hangs or dies must not block the rest.
+#include "http_stub.h"
+
+#include <sys/wait.h>
+
+namespace {
+
+const int CHILDREN = 4;
+
+// Holds every forked child until release(), so they all contend at once.
+class StartingGate {
+private:
+  int fds[2] = {-1, -1};
+
+public:
+  StartingGate() {
+    if (pipe(fds) != 0) {
+      std::perror("pipe");
+    }
+  }
+
+  ~StartingGate() {
+    for (int fd : fds) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  void wait() {
+    ::close(fds[1]);
+    fds[1] = -1;
+    char byte;
+    while (::read(fds[0], &byte, 1) > 0) {
+    }
+  }
+
+  void release() {
+    ::close(fds[1]);
+    fds[1] = -1;
+  }
+};
+
+// Forks CHILDREN processes that run `body` once the gate opens and returns
+// how many of them exited with status 0.
+int runChildren(const std::function<bool(int)> &body) {
+  StartingGate gate;
+  std::vector<pid_t> children;
+  for (int i = 0; i < CHILDREN; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      gate.wait();
+      bool ok = body(i);
+      std::cout.flush();
+      _exit(ok ? 0 : 1);
+    }
+    children.push_back(pid);
+  }
+  gate.release();
+  int succeeded = 0;
+  for (pid_t pid : children) {
+    int status = 0;
+    if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+      succeeded++;
+    }
+  }
+  return succeeded;
+}
+
+void appendLine(const std::string &path, const std::string &line) {
+  std::ofstream(path, std::ios::app) << line << std::endl;
+}
+
+std::vector<std::string> readLines(const std::string &path) {
+  std::ifstream file(path);
+  std::vector<std::string> lines;
+  for (std::string line; std::getline(file, line);) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+std::string lockName(const std::string &key) {
+  Sha256 hasher;
+  hasher.update(reinterpret_cast<const uint8_t *>(key.data()), key.size());
+  return hasher.hexDigest().substr(0, 16);
+}
+
+void ignore(const std::string &) {}
+
+} // namespace
+
+// Each child follows the install path: use the result if it is already
+// there, otherwise join the flight and download only if nobody else did.
+TEST(oneProcessDownloadsAndTheOthersReuse) {
+  TempDir dir;
+  std::string result = dir / "result";
+  std::string log = dir / "log";
+  int succeeded = runChildren([&](int) {
+    if (std::filesystem::exists(result)) {
+      appendLine(log, "cached");
+      return true;
+    }
+    SingleFlight flight(dir.path() / "locks", "https://example.com/font.zip", 30, ignore);
+    if (flight.waited() && std::filesystem::exists(result)) {
+      appendLine(log, "reused");
+      return true;
+    }
+    appendLine(log, "begin");
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    std::ofstream(result) << "archive";
+    appendLine(log, "end");
+    return flight.leader();
+  });
+  CHECK(succeeded == CHILDREN);
+
+  std::vector<std::string> lines = readLines(log);
+  CHECK(std::count(lines.begin(), lines.end(), "begin") == 1);
+  CHECK(std::count(lines.begin(), lines.end(), "reused") + std::count(lines.begin(), lines.end(), "cached") ==
+        CHILDREN - 1);
+  // Nobody reused the result before it was written.
+  auto end = std::find(lines.begin(), lines.end(), "end");
+  CHECK(end != lines.end() && std::find(lines.begin(), end, "reused") == end);
+}
+
+TEST(differentKeysDoNotWait) {
+  TempDir dir;
+  std::string log = dir / "log";
+  int succeeded = runChildren([&](int child) {
+    SingleFlight flight(dir.path(), "key " + std::to_string(child), 30, ignore);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    appendLine(log, flight.waited() ? "waited" : "led");
+    return flight.leader();
+  });
+  CHECK(succeeded == CHILDREN);
+  CHECK(readLines(log) == std::vector<std::string>(CHILDREN, "led"));
+}
+
+TEST(waiterTakesOverAfterTimeout) {
+  TempDir dir;
+  SingleFlight leader(dir.path(), "key", 30, ignore);
+  CHECK(leader.leader());
+
+  std::vector<std::string> messages;
+  auto start = std::chrono::steady_clock::now();
+  SingleFlight waiter(dir.path(), "key", 1, [&](const std::string &message) { messages.push_back(message); });
+  auto waited = std::chrono::steady_clock::now() - start;
+  CHECK(!waiter.leader());
+  CHECK(waiter.waited());
+  CHECK(waited >= std::chrono::seconds(1) && waited < std::chrono::seconds(5));
+  CHECK(messages.size() == 2 && messages.back().find("Timed out") != std::string::npos);
+}
+
+// A leader that was killed keeps no lock; one that hangs with the lock held
+// stops updating its heartbeat.
+TEST(waiterTakesOverFromStalledLeader) {
+  TempDir dir;
+  std::string name = lockName("key");
+  FileLock hung(dir / (name + ".lock"), false);
+  CHECK(hung.locked());
+  std::ofstream(dir / (name + ".heartbeat")) << std::time(nullptr) - 60 << std::endl;
+
+  std::vector<std::string> messages;
+  auto start = std::chrono::steady_clock::now();
+  SingleFlight waiter(dir.path(), "key", 30, [&](const std::string &message) { messages.push_back(message); });
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+  CHECK(!waiter.leader());
+  CHECK(messages.size() == 2 && messages.back().find("stopped responding") != std::string::npos);
+}
+
+TEST(leaderThatExitsReleasesTheLock) {
+  TempDir dir;
+  pid_t pid = fork();
+  if (pid == 0) {
+    SingleFlight flight(dir.path(), "key", 30, ignore);
+    _exit(flight.leader() ? 0 : 1);
+  }
+  int status = 0;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  SingleFlight next(dir.path(), "key", 30, ignore);
+  CHECK(next.leader());
+  CHECK(!next.waited());
+}
+
+// The whole install command, with the children sharing only the archive
+// cache: the server must see one request for the archive.
+TEST(concurrentInstallsFetchTheArchiveOnce) {
+  LoopbackServer server;
+  LoopbackServer::Resource archive;
+  archive.body = readBytes(fixturePath("fonts.zip"));
+  archive.delayMs = 500;
+  server.serve("/fonts.zip", archive);
+  json entry = {{"Name", "Fixture"},
+                {"URL", server.url("/fonts.zip")},
+                {"sha256", sha256Hex(archive.body)},
+                {"size", archive.body.size()}};
+  TestEnvironment env(server, json::array({entry}));
+  TempDir homes;
+
+  int succeeded = runChildren([&](int child) {
+    std::filesystem::path home = homes.path() / std::to_string(child);
+    setenv("HOME", home.c_str(), 1);
+    setenv("XDG_DATA_HOME", (home / "data").c_str(), 1);
+    runWta("install-font", {"Fixture"});
+    return listFiles(home / ".local" / "share" / "fonts").size() == 3;
+  });
+  CHECK(succeeded == CHILDREN);
+  CHECK(server.requests("/fonts.zip") == 1);
+}
@@ -0,0 +1,292 @@
+// A stand-in web server on 127.0.0.1 for the download tests. It serves byte
+// buffers from memory with ETags and Range support, counts the requests for
+// each path, and can be told to misbehave the ways real servers do.
+#include "test.h"
+
+class LoopbackServer {
+public:
+  struct Resource {
+    std::vector<uint8_t> body;
+    std::string etag = "\"fixture\"";
+    bool ranges = true;
+    // Ignores the requested start and always answers a Range request with
+    // the whole body as "bytes 0-...".
+    bool rangeFromZero = false;
+    // The first `cuts` responses send only this many body bytes and then
+    // close the connection.
+    size_t cutAfter = 0;
+    int cuts = 0;
+    // Sent verbatim instead of a generated response when not empty.
+    std::string raw;
+    // Waits this long before answering, so that concurrent clients overlap.
+    int delayMs = 0;
+  };
+
+private:
+  int listener = -1;
+  int boundPort = 0;
+  std::atomic<bool> stopping{false};
+  std::thread acceptor;
+  std::mutex mutex;
+  std::vector<std::thread> workers;
+  std::map<std::string, Resource> resources;
+  std::map<std::string, int> counts;
+  std::map<std::string, std::vector<std::string>> rangeHeaders;
+
+  static bool sendAll(int fd, const void *data, size_t size) {
+    const char *p = static_cast<const char *>(data);
+    while (size > 0) {
+      ssize_t sent = ::send(fd, p, size, MSG_NOSIGNAL);
+      if (sent <= 0) {
+        return false;
+      }
+      p += sent;
+      size -= (size_t)sent;
+    }
+    return true;
+  }
+
+  static std::string headerValue(const std::string &request, const std::string &name) {
+    std::string lower = request;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    std::string key = "\r\n" + name + ":";
+    size_t at = lower.find(key);
+    if (at == std::string::npos) {
+      return "";
+    }
+    size_t start = request.find_first_not_of(' ', at + key.size());
+    return request.substr(start, request.find("\r\n", start) - start);
+  }
+
+  void handle(int fd) {
+    std::string request;
+    char buffer[4096];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t got = ::recv(fd, buffer, sizeof(buffer), 0);
+      if (got <= 0) {
+        ::close(fd);
+        return;
+      }
+      request.append(buffer, (size_t)got);
+    }
+    size_t space = request.find(' ');
+    std::string target = request.substr(space + 1, request.find(' ', space + 1) - space - 1);
+    std::string path = target.substr(0, target.find('?'));
+    std::string range = headerValue(request, "range");
+
+    Resource resource;
+    bool found;
+    size_t limit = SIZE_MAX;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      found = resources.count(path) > 0;
+      counts[path]++;
+      if (!range.empty()) {
+        rangeHeaders[path].push_back(range);
+      }
+      if (found) {
+        Resource &stored = resources[path];
+        if (stored.cuts > 0) {
+          stored.cuts--;
+          limit = stored.cutAfter;
+        }
+        resource = stored;
+      }
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(resource.delayMs));
+    if (!resource.raw.empty()) {
+      sendAll(fd, resource.raw.data(), resource.raw.size());
+      ::close(fd);
+      return;
+    }
+
+    std::ostringstream head;
+    const std::vector<uint8_t> &body = resource.body;
+    size_t first = 0;
+    size_t last = body.empty() ? 0 : body.size() - 1;
+    int status = found ? 200 : 404;
+    std::string ifRange = headerValue(request, "if-range");
+    if (found && headerValue(request, "if-none-match") == resource.etag) {
+      status = 304;
+    } else if (found && resource.ranges && range.compare(0, 6, "bytes=") == 0 &&
+               (ifRange.empty() || ifRange == resource.etag)) {
+      std::string spec = range.substr(6);
+      size_t dash = spec.find('-');
+      if (dash == 0) {
+        size_t suffix = std::min<size_t>(std::stoull(spec.substr(1)), body.size());
+        first = body.size() - suffix;
+      } else {
+        first = std::stoull(spec.substr(0, dash));
+        if (dash + 1 < spec.size()) {
+          last = std::min<size_t>(std::stoull(spec.substr(dash + 1)), last);
+        }
+      }
+      if (first >= body.size()) {
+        status = 416;
+      } else {
+        status = 206;
+        if (resource.rangeFromZero) {
+          first = 0;
+          last = body.size() - 1;
+        }
+      }
+    }
+
+    size_t length = status == 200 ? body.size() : status == 206 ? last - first + 1 : 0;
+    if (status == 200) {
+      first = 0;
+    }
+    head << "HTTP/1.1 " << status << " Stub\r\n";
+    head << "Content-Length: " << length << "\r\n";
+    head << "ETag: " << resource.etag << "\r\n";
+    if (status == 206) {
+      head << "Content-Range: bytes " << first << "-" << last << "/" << body.size() << "\r\n";
+    } else if (status == 416) {
+      head << "Content-Range: bytes */" << body.size() << "\r\n";
+    }
+    head << "Connection: close\r\n\r\n";
+    std::string headText = head.str();
+    if (sendAll(fd, headText.data(), headText.size()) && length > 0) {
+      sendAll(fd, body.data() + first, std::min(length, limit));
+    }
+    ::close(fd);
+  }
+
+public:
+  LoopbackServer() {
+    listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if (::bind(listener, reinterpret_cast<sockaddr *>(&address), size) != 0 || ::listen(listener, 64) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr *>(&address), &size) != 0) {
+      std::fprintf(stderr, "LoopbackServer: could not listen on 127.0.0.1\n");
+      std::exit(1);
+    }
+    boundPort = ntohs(address.sin_port);
+    acceptor = std::thread([this] {
+      while (!stopping) {
+        pollfd entry{listener, POLLIN, 0};
+        if (poll(&entry, 1, 50) <= 0) {
+          continue;
+        }
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd >= 0) {
+          std::lock_guard<std::mutex> lock(mutex);
+          workers.emplace_back([this, fd] { handle(fd); });
+        }
+      }
+    });
+  }
+
+  LoopbackServer(const LoopbackServer &) = delete;
+  LoopbackServer &operator=(const LoopbackServer &) = delete;
+
+  ~LoopbackServer() {
+    stopping = true;
+    acceptor.join();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+    ::close(listener);
+  }
+
+  void serve(const std::string &path, const Resource &resource) {
+    std::lock_guard<std::mutex> lock(mutex);
+    resources[path] = resource;
+  }
+
+  void serve(const std::string &path, const std::vector<uint8_t> &body) {
+    Resource resource;
+    resource.body = body;
+    serve(path, resource);
+  }
+
+  std::string url(const std::string &path) const { return "http://127.0.0.1:" + std::to_string(boundPort) + path; }
+
+  int requests(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return counts[path];
+  }
+
+  std::vector<std::string> ranges(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return rangeHeaders[path];
+  }
+};
+
+std::string sha256Hex(const std::vector<uint8_t> &data) {
+  Sha256 hasher;
+  hasher.update(data.data(), data.size());
+  return hasher.hexDigest();
+}
+
+// Everything wta reads from the environment, pointed into one temporary
+// directory: HOME (and with it the fonts directory), the XDG cache and data
+// directories, a minimal Windows Terminal settings.json and a WTA config
+// whose font catalog is served by `server`.
+class TestEnvironment {
+private:
+  struct SavedVariable {
+    std::string name;
+    bool wasSet;
+    std::string value;
+  };
+
+  TempHome home;
+  std::vector<SavedVariable> saved;
+
+  void set(const std::string &name, const std::string &value) {
+    const char *previous = std::getenv(name.c_str());
+    saved.push_back({name, previous != nullptr, previous ? previous : ""});
+    setenv(name.c_str(), value.c_str(), 1);
+  }
+
+public:
+  TestEnvironment(LoopbackServer &server, const json &catalog, const json &config = json::object()) {
+    const std::filesystem::path &root = home.path();
+    std::filesystem::path localState = root / "appdata" / "Packages" / "Microsoft.WindowsTerminal_8wekyb3d8bbwe" /
+                                       "LocalState";
+    std::filesystem::create_directories(localState);
+    std::ofstream(localState / "settings.json") << json{{"profiles", {{"defaults", json::object()}, {"list", json::array()}}},
+                                                        {"schemes", json::array()}};
+    server.serve("/font_data.json", [&] {
+      std::string text = catalog.dump();
+      return std::vector<uint8_t>(text.begin(), text.end());
+    }());
+    json wtaConfig = config;
+    wtaConfig["catalogSources"] = server.url("/font_data.json");
+    std::ofstream(root / "wta.json") << wtaConfig;
+
+    set("LOCALAPPDATA", (root / "appdata").string());
+    set("XDG_CACHE_HOME", (root / "cache").string());
+    set("XDG_DATA_HOME", (root / "data").string());
+    set("WTA_CONFIG", (root / "wta.json").string());
+  }
+
+  TestEnvironment(const TestEnvironment &) = delete;
+  TestEnvironment &operator=(const TestEnvironment &) = delete;
+
+  ~TestEnvironment() {
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+      if (it->wasSet) {
+        setenv(it->name.c_str(), it->value.c_str(), 1);
+      } else {
+        unsetenv(it->name.c_str());
+      }
+    }
+  }
+
+  std::filesystem::path fontsDirectory() const { return home.fontsDirectory(); }
+  std::filesystem::path cacheDirectory() const { return home.path() / "cache" / "wta"; }
+};
+
+// Runs one wta command the way main() does.
+void runWta(const std::string &command, const std::vector<std::string> &args) {
+  WTACommandManager commandManager;
+  commandManager.executeCommand(command, args);
+}
@@ -0,0 +1,26 @@
+// A libFuzzer target for SfntParser and SfntChecksum. `make fuzz` builds it
+// with clang and AddressSanitizer; start it from the fixture fonts with
+// ./tests/sfnt_fuzz tests/fixtures. sfnt_test includes this file and feeds it
+// seeded mutations of the fixtures, so `make test` runs the same code paths.
+#ifndef WTA_NO_MAIN
+#define WTA_NO_MAIN
+#include "../main.cpp"
+#endif
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  std::string error;
+  std::vector<uint32_t> offsets;
+  if (SfntParser::faceOffsets(data, size, offsets, error)) {
+    for (uint32_t offset : offsets) {
+      FontFaceInfo info;
+      SfntParser::parse(data, size, offset, info, error);
+      GlyphCoverage coverage;
+      SfntParser::parseCoverage(data, size, offset, coverage, error);
+    }
+  }
+  SfntParser::validate(data, size, error);
+  if (SfntChecksum::compute(data, size) != SfntChecksum::computePortable(data, size)) {
+    std::abort();
+  }
+  return 0;
+}
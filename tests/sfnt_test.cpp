@@ -0,0 +1,172 @@
+// SfntParser and SfntChecksum against the fixture fonts, and the fuzz target
+// in sfnt_fuzz.cpp run over seeded mutations of them. This program is built
+// with AddressSanitizer, so a read past the end of a buffer fails the run.
+#include "test.h"
+#include "sfnt_fuzz.cpp"
+
+namespace {
+
+// xorshift64*, so every run mutates the same bytes.
+class Mutator {
+private:
+  uint64_t state;
+
+public:
+  explicit Mutator(uint64_t seed) : state(seed) {}
+
+  uint32_t next(uint32_t bound) {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (uint32_t)((state * 0x2545F4914F6CDD1Dull) >> 32) % bound;
+  }
+
+  // Overwrites bytes, 32-bit fields with boundary values, or the length.
+  // Half of the edits land in the table directory, where the offsets are.
+  void mutate(std::vector<uint8_t> &data) {
+    static const uint32_t BOUNDARIES[] = {0, 1, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF, 0xFFFF, 0x10000};
+    for (uint32_t edits = 1 + next(4); edits > 0 && !data.empty(); --edits) {
+      size_t limit = next(2) ? std::min<size_t>(data.size(), 12 + 16 * 8) : data.size();
+      size_t at = next((uint32_t)limit);
+      switch (next(4)) {
+      case 0:
+        data[at] = (uint8_t)next(256);
+        break;
+      case 1:
+        data[at] ^= (uint8_t)(1 << next(8));
+        break;
+      case 2: {
+        uint32_t value = next(2) ? BOUNDARIES[next(7)] : (uint32_t)data.size() - next(8);
+        for (size_t i = 0; i < 4 && at + i < data.size(); ++i) {
+          data[at + i] = (uint8_t)(value >> (24 - 8 * i));
+        }
+        break;
+      }
+      default:
+        data.resize(at);
+        break;
+      }
+    }
+  }
+};
+
+// A collection ("ttcf") holding the given fonts, with each face's table
+// offsets moved to where the face lands in the collection.
+std::vector<uint8_t> collection(const std::vector<std::vector<uint8_t>> &fonts) {
+  std::vector<uint8_t> out = {'t', 't', 'c', 'f', 0, 1, 0, 0, 0, 0, 0, (uint8_t)fonts.size()};
+  out.resize(12 + 4 * fonts.size());
+  for (size_t i = 0; i < fonts.size(); ++i) {
+    uint32_t base = (uint32_t)out.size();
+    for (size_t b = 0; b < 4; ++b) {
+      out[12 + 4 * i + b] = (uint8_t)(base >> (24 - 8 * b));
+    }
+    std::vector<uint8_t> font = fonts[i];
+    uint16_t tables = (uint16_t)(font[4] << 8 | font[5]);
+    for (uint16_t t = 0; t < tables; ++t) {
+      uint8_t *field = font.data() + 12 + 16 * t + 8;
+      uint32_t offset = ((uint32_t)field[0] << 24 | field[1] << 16 | field[2] << 8 | field[3]) + base;
+      for (size_t b = 0; b < 4; ++b) {
+        field[b] = (uint8_t)(offset >> (24 - 8 * b));
+      }
+    }
+    out.insert(out.end(), font.begin(), font.end());
+  }
+  return out;
+}
+
+FontFaceInfo parseFixture(const std::string &name) {
+  std::vector<uint8_t> font = readBytes(fixturePath(name));
+  FontFaceInfo info;
+  std::string error;
+  CHECK(SfntParser::parse(font.data(), font.size(), 0, info, error));
+  return info;
+}
+
+} // namespace
+
+TEST(parseReadsNamesAndStyle) {
+  FontFaceInfo regular = parseFixture("Fixture-Regular.ttf");
+  CHECK(regular.family == "Fixture");
+  CHECK(regular.subfamily == "Regular");
+  CHECK(regular.fullName == "Fixture Regular");
+  CHECK(regular.weight == 400);
+  CHECK(!regular.bold && !regular.italic && !regular.monospace);
+
+  FontFaceInfo bold = parseFixture("Fixture-Bold.ttf");
+  CHECK(bold.subfamily == "Bold");
+  CHECK(bold.weight == 700);
+  CHECK(bold.bold);
+
+  FontFaceInfo mono = parseFixture("FixtureMono-Regular.ttf");
+  CHECK(mono.family == "Fixture Mono");
+  CHECK(mono.monospace);
+}
+
+TEST(parseCoverageReadsCmap) {
+  std::vector<uint8_t> font = readBytes(fixturePath("Fixture-Regular.ttf"));
+  GlyphCoverage coverage;
+  std::string error;
+  CHECK(SfntParser::parseCoverage(font.data(), font.size(), 0, coverage, error));
+  GlyphCoverage required;
+  required.addRange('A', 'Z');
+  CHECK(coverage.missingCount(required) == 0);
+  required.add('a');
+  CHECK(coverage.missing(required) == std::vector<uint32_t>({'a'}));
+}
+
+TEST(validateAcceptsFixturesAndRejectsDamage) {
+  for (const char *name : {"Fixture-Regular.ttf", "Fixture-Bold.ttf", "FixtureMono-Regular.ttf"}) {
+    std::vector<uint8_t> font = readBytes(fixturePath(name));
+    std::string error;
+    CHECK(SfntParser::validate(font.data(), font.size(), error));
+
+    std::vector<uint8_t> flipped = font;
+    flipped[flipped.size() - 3] ^= 0x10;
+    CHECK(!SfntParser::validate(flipped.data(), flipped.size(), error));
+    std::vector<uint8_t> truncated(font.begin(), font.end() - 4);
+    CHECK(!SfntParser::validate(truncated.data(), truncated.size(), error));
+  }
+}
+
+TEST(collectionsListEveryFace) {
+  std::vector<uint8_t> ttc = collection({readBytes(fixturePath("Fixture-Regular.ttf")),
+                                         readBytes(fixturePath("FixtureMono-Regular.ttf"))});
+  std::vector<uint32_t> offsets;
+  std::string error;
+  CHECK(SfntParser::faceOffsets(ttc.data(), ttc.size(), offsets, error));
+  CHECK(offsets.size() == 2);
+  CHECK(SfntParser::validate(ttc.data(), ttc.size(), error));
+  FontFaceInfo info;
+  CHECK(offsets.size() == 2 && SfntParser::parse(ttc.data(), ttc.size(), offsets[1], info, error));
+  CHECK(info.family == "Fixture Mono");
+}
+
+TEST(checksumKernelsAgree) {
+  Mutator random(1);
+  std::vector<uint8_t> data(4096 + 3);
+  for (uint8_t &byte : data) {
+    byte = (uint8_t)random.next(256);
+  }
+  for (size_t size = 0; size <= data.size(); size += 1 + size / 16) {
+    CHECK(SfntChecksum::compute(data.data(), size) == SfntChecksum::computePortable(data.data(), size));
+  }
+}
+
+// Each input is copied into a buffer of exactly its size, so AddressSanitizer
+// sees any read past the end.
+TEST(fuzzMutatedFixtures) {
+  std::vector<std::vector<uint8_t>> seeds;
+  for (const char *name : {"Fixture-Regular.ttf", "Fixture-Bold.ttf", "FixtureMono-Regular.ttf"}) {
+    seeds.push_back(readBytes(fixturePath(name)));
+  }
+  seeds.push_back(collection({seeds[0], seeds[2]}));
+
+  Mutator random(0x5EED);
+  for (int round = 0; round < 20000; ++round) {
+    std::vector<uint8_t> input = seeds[random.next((uint32_t)seeds.size())];
+    random.mutate(input);
+    std::unique_ptr<uint8_t[]> exact(new uint8_t[input.size()]);
+    std::copy(input.begin(), input.end(), exact.get());
+    LLVMFuzzerTestOneInput(exact.get(), input.size());
+  }
+}
@@ -0,0 +1,38 @@
+// Streaming install against downloading the archive first: both fetch from
+// the loopback server, and the download path saves the archive to disk and
+// extracts it from there, as installs did before streaming.
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+  const int RUNS = 5;
+  LoopbackServer server;
+  for (const std::string &archive : archiveArguments(argc, argv)) {
+    std::vector<uint8_t> bytes = readBytes(archive);
+    std::string name = "/" + std::filesystem::path(archive).filename().string();
+    server.serve(name, bytes);
+    std::printf("%s (%zu bytes)\n", archive.c_str(), bytes.size());
+
+    Measurement downloaded = fastest(RUNS, [&] {
+      TempHome home;
+      TempDir dir;
+      FileDownloader downloader;
+      FontInstaller installer;
+      if (!downloader.downloadFile(server.url(name), dir / name.substr(1)) ||
+          !installer.extractAndInstallFonts(dir / name.substr(1))) {
+        std::fprintf(stderr, "download then extract failed for %s\n", archive.c_str());
+      }
+    });
+    Measurement streamed = fastest(RUNS, [&] {
+      TempHome home;
+      FileDownloader downloader;
+      FontInstaller installer;
+      std::unique_ptr<ByteSource> source = downloader.openStream(server.url(name));
+      if (!source || !installer.streamAndInstallFonts(*source, [] { return true; })) {
+        std::fprintf(stderr, "streaming install failed for %s\n", archive.c_str());
+      }
+    });
+    printMeasurement("download, then extract", downloaded);
+    printMeasurement("stream", streamed);
+  }
+  return 0;
+}
@@ -0,0 +1,219 @@
+// A minimal harness for the test programs. Each program includes main.cpp
+// directly, so the classes under test need no header of their own, and
+// registers its cases with TEST(). Fixtures are generated by
+// tests/fixtures/make_fixtures.py.
+#define WTA_NO_MAIN
+#include "../main.cpp"
+
+#include <cstdlib>
+
+#ifndef WTA_FIXTURES
+#define WTA_FIXTURES "tests/fixtures"
+#endif
+
+struct TestCase {
+  const char *name;
+  void (*run)();
+};
+
+std::vector<TestCase> &testCases() {
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+int testFailures = 0;
+
+#define TEST(name)                                                                                                   \
+  static void name();                                                                                                \
+  static const bool name##Registered = (testCases().push_back({#name, name}), true);                                 \
+  static void name()
+
+// Failures go to stderr directly, since test output on std::cout and std::cerr
+// is swallowed unless the program runs with -v.
+#define CHECK(condition)                                                                                             \
+  do {                                                                                                               \
+    if (!(condition)) {                                                                                              \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);                             \
+      testFailures++;                                                                                                \
+    }                                                                                                                \
+  } while (0)
+
+std::string fixturePath(const std::string &name) { return std::string(WTA_FIXTURES) + "/" + name; }
+
+std::vector<uint8_t> readBytes(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+bool writeBytes(const std::string &path, const std::vector<uint8_t> &data) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(data.data()), (std::streamsize)data.size());
+  return (bool)file;
+}
+
+// A fresh directory under $TMPDIR, removed with everything in it.
+class TempDir {
+private:
+  std::filesystem::path root;
+
+public:
+  TempDir() {
+    const char *tmp = std::getenv("TMPDIR");
+    std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/wta-test-XXXXXX";
+    std::vector<char> buffer(pattern.begin(), pattern.end());
+    buffer.push_back('\0');
+    if (mkdtemp(buffer.data())) {
+      root = buffer.data();
+    }
+  }
+
+  TempDir(const TempDir &) = delete;
+  TempDir &operator=(const TempDir &) = delete;
+
+  ~TempDir() {
+    std::error_code ec;
+    std::filesystem::remove_all(root, ec);
+  }
+
+  const std::filesystem::path &path() const { return root; }
+  std::string operator/(const std::string &name) const { return (root / name).string(); }
+};
+
+// Points HOME, and with it FontInstaller's fonts directory, at a temporary
+// directory for the lifetime of the object.
+class TempHome {
+private:
+  TempDir dir;
+  std::string previous;
+  bool hadPrevious;
+
+public:
+  TempHome() {
+    const char *home = std::getenv("HOME");
+    hadPrevious = home != nullptr;
+    previous = home ? home : "";
+    setenv("HOME", dir.path().c_str(), 1);
+  }
+
+  ~TempHome() {
+    if (hadPrevious) {
+      setenv("HOME", previous.c_str(), 1);
+    } else {
+      unsetenv("HOME");
+    }
+  }
+
+  const std::filesystem::path &path() const { return dir.path(); }
+  std::filesystem::path fontsDirectory() const { return dir.path() / ".local" / "share" / "fonts"; }
+  std::string operator/(const std::string &name) const { return dir / name; }
+};
+
+// The names of the regular files in a directory, sorted.
+std::vector<std::string> listFiles(const std::filesystem::path &directory) {
+  std::vector<std::string> names;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(directory, ec)) {
+    if (entry.is_regular_file(ec)) {
+      names.push_back(entry.path().filename().string());
+    }
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+// Builds a zip with stored (uncompressed) entries, for archives whose content
+// a test needs to control byte by byte.
+std::vector<uint8_t> storedZip(const std::vector<std::pair<std::string, std::vector<uint8_t>>> &files) {
+  std::vector<uint8_t> out;
+  std::vector<uint8_t> directory;
+  auto put16 = [](std::vector<uint8_t> &to, uint32_t value) {
+    to.push_back((uint8_t)value);
+    to.push_back((uint8_t)(value >> 8));
+  };
+  auto put32 = [&](std::vector<uint8_t> &to, uint32_t value) {
+    put16(to, value & 0xFFFF);
+    put16(to, value >> 16);
+  };
+  for (const auto &file : files) {
+    uint32_t offset = (uint32_t)out.size();
+    uint32_t crc = Crc32::update(0, file.second.data(), file.second.size());
+    uint32_t size = (uint32_t)file.second.size();
+    put32(out, 0x04034b50);
+    for (uint32_t value : {20u, 0u, 0u, 0u, 0u}) {
+      put16(out, value);
+    }
+    put32(out, crc);
+    put32(out, size);
+    put32(out, size);
+    put16(out, (uint32_t)file.first.size());
+    put16(out, 0);
+    out.insert(out.end(), file.first.begin(), file.first.end());
+    out.insert(out.end(), file.second.begin(), file.second.end());
+
+    put32(directory, 0x02014b50);
+    for (uint32_t value : {20u, 20u, 0u, 0u, 0u, 0u}) {
+      put16(directory, value);
+    }
+    put32(directory, crc);
+    put32(directory, size);
+    put32(directory, size);
+    put16(directory, (uint32_t)file.first.size());
+    for (uint32_t value : {0u, 0u, 0u, 0u}) {
+      put16(directory, value);
+    }
+    put32(directory, 0);
+    put32(directory, offset);
+    directory.insert(directory.end(), file.first.begin(), file.first.end());
+  }
+  uint32_t directoryOffset = (uint32_t)out.size();
+  out.insert(out.end(), directory.begin(), directory.end());
+  put32(out, 0x06054b50);
+  put16(out, 0);
+  put16(out, 0);
+  put16(out, (uint32_t)files.size());
+  put16(out, (uint32_t)files.size());
+  put32(out, (uint32_t)directory.size());
+  put32(out, directoryOffset);
+  put16(out, 0);
+  return out;
+}
+
+// The benchmark programs use the helpers above with a main of their own.
+#ifndef WTA_BENCHMARK
+int main(int argc, char *argv[]) {
+  bool verbose = false;
+  std::string only;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string(argv[i]) == "-v") {
+      verbose = true;
+    } else {
+      only = argv[i];
+    }
+  }
+
+  std::ostringstream discarded;
+  std::streambuf *out = std::cout.rdbuf();
+  std::streambuf *err = std::cerr.rdbuf();
+  int passed = 0;
+  int failed = 0;
+  for (const TestCase &test : testCases()) {
+    if (!only.empty() && std::string(test.name).find(only) == std::string::npos) {
+      continue;
+    }
+    int before = testFailures;
+    if (!verbose) {
+      std::cout.rdbuf(discarded.rdbuf());
+      std::cerr.rdbuf(discarded.rdbuf());
+    }
+    test.run();
+    std::cout.rdbuf(out);
+    std::cerr.rdbuf(err);
+    discarded.str("");
+    bool ok = testFailures == before;
+    std::printf("%s %s\n", ok ? "PASS" : "FAIL", test.name);
+    (ok ? passed : failed)++;
+  }
+  std::printf("%d passed, %d failed\n", passed, failed);
+  return failed == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,34 @@
+// How installing from an archive scales with FontInstaller's thread count,
+// from one thread up to one per core.
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+  const int RUNS = 3;
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<unsigned> counts;
+  for (unsigned count = 1; count < cores; count *= 2) {
+    counts.push_back(count);
+  }
+  counts.push_back(cores);
+
+  for (const std::string &archive : archiveArguments(argc, argv)) {
+    std::printf("%s (%u cores)\n", archive.c_str(), cores);
+    double single = 0;
+    for (unsigned count : counts) {
+      Measurement measurement = fastest(RUNS, [&] {
+        TempHome home;
+        FontInstaller installer;
+        installer.setThreadCount(count);
+        if (!installer.extractAndInstallFonts(archive)) {
+          std::fprintf(stderr, "install failed for %s\n", archive.c_str());
+        }
+      });
+      if (count == 1) {
+        single = measurement.milliseconds;
+      }
+      std::printf("  %2u thread%s %10.2f ms %6.2fx\n", count, count == 1 ? " " : "s", measurement.milliseconds,
+                  single / measurement.milliseconds);
+    }
+  }
+  return 0;
+}
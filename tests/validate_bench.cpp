@@ -0,0 +1,64 @@
+// What SfntParser::validate adds to an install: the fonts an archive installs
+// are validated again one after another, which the installer spreads across
+// its threads, and the time is set against the whole install. The checksum
+// kernels are timed separately over the same files.
+#include "bench.h"
+
+int main(int argc, char *argv[]) {
+  const int RUNS = 5;
+  for (const std::string &archive : archiveArguments(argc, argv)) {
+    Measurement install = fastest(RUNS, [&] {
+      TempHome home;
+      FontInstaller installer;
+      if (!installer.extractAndInstallFonts(archive)) {
+        std::fprintf(stderr, "install failed for %s\n", archive.c_str());
+      }
+    });
+
+    TempHome home;
+    FontInstaller installer;
+    measure([&] { installer.extractAndInstallFonts(archive); });
+    std::vector<std::vector<uint8_t>> fonts;
+    size_t bytes = 0;
+    for (const std::string &name : listFiles(home.fontsDirectory())) {
+      fonts.push_back(readBytes((home.fontsDirectory() / name).string()));
+      bytes += fonts.back().size();
+    }
+
+    int invalid = 0;
+    Measurement validate = fastest(RUNS, [&] {
+      invalid = 0;
+      for (const std::vector<uint8_t> &font : fonts) {
+        std::string error;
+        invalid += !SfntParser::validate(font.data(), font.size(), error);
+      }
+    });
+    uint32_t sink = 0;
+    Measurement selected = fastest(RUNS, [&] {
+      for (const std::vector<uint8_t> &font : fonts) {
+        sink += SfntChecksum::compute(font.data(), font.size());
+      }
+    });
+    Measurement portable = fastest(RUNS, [&] {
+      for (const std::vector<uint8_t> &font : fonts) {
+        sink -= SfntChecksum::computePortable(font.data(), font.size());
+      }
+    });
+
+    std::printf("%s (%zu fonts, %zu bytes)\n", archive.c_str(), fonts.size(), bytes);
+    std::printf("  install                 %10.3f ms\n", install.milliseconds);
+    std::printf("  validate, one thread    %10.3f ms  %5.2f%% of the install\n", validate.milliseconds,
+                100 * validate.milliseconds / install.milliseconds);
+    std::printf("  checksums, selected     %10.3f ms\n", selected.milliseconds);
+    std::printf("  checksums, portable     %10.3f ms\n", portable.milliseconds);
+    if (invalid > 0) {
+      std::fprintf(stderr, "%d installed fonts failed validation\n", invalid);
+      return 1;
+    }
+    if (sink != 0) {
+      std::fprintf(stderr, "the checksum kernels disagree\n");
+      return 1;
+    }
+  }
+  return 0;
+}